@@ -84,8 +84,16 @@
 #  endif
 # endif
 
+/* OpenSSL 1.0.1 and later pick an AES implementation at runtime (including
+ *    AES-NI where the CPU supports it), but only behind the EVP interface.
+ *    Since we hand EVP many counter blocks at once, it wins there. */
+# if OPENSSL_VERSION_NUMBER >= 0x1000100fL
+#  undef USE_OPENSSL_AES
+#  define USE_OPENSSL_EVP
+# endif
+
 /* Otherwise, use the built-in implementation below. */
-# ifndef USE_OPENSSL_AES
+# if !defined(USE_OPENSSL_AES) && !defined(USE_OPENSSL_EVP)
 #  define USE_BUILTIN_AES
 # endif
 #endif /* endif need to pick a method */
@@ -137,7 +145,7 @@ static void rijndaelEncrypt(const u32 rk[/*4*(Nr + 1)*/], int Nr,
 struct aes_cnt_cipher {
 /** This next element (however it's defined) is the AES key. */
 #if defined(USE_OPENSSL_EVP)
-  EVP_CIPHER_CTX key;
+  EVP_CIPHER_CTX *key;
 #elif defined(USE_OPENSSL_AES)
   AES_KEY key;
 #else
@@ -200,7 +208,7 @@ _aes_fill_buf(aes_cnt_cipher_t *cipher)
 #if defined(USE_OPENSSL_EVP)
   {
     int outl=16, inl=16;
-    EVP_EncryptUpdate(&cipher->key, cipher->buf, &outl,
+    EVP_EncryptUpdate(cipher->key, cipher->buf, &outl,
                       cipher->ctr_buf.buf, inl);
   }
 #elif defined(USE_OPENSSL_AES)
@@ -218,6 +226,10 @@ aes_cnt_cipher_t*
 aes_new_cipher(void)
 {
   aes_cnt_cipher_t* result = tor_malloc_zero(sizeof(aes_cnt_cipher_t));
+#ifdef USE_OPENSSL_EVP
+  result->key = EVP_CIPHER_CTX_new();
+  tor_assert(result->key);
+#endif
 
   return result;
 }
@@ -237,7 +249,8 @@ aes_set_key(aes_cnt_cipher_t *cipher, const char *key, int key_bits)
     case 256: c = EVP_aes_256_ecb(); break;
     default: tor_assert(0);
   }
-  EVP_EncryptInit(&cipher->key, c, (const unsigned char*)key, NULL);
+  EVP_EncryptInit(cipher->key, c, (const unsigned char*)key, NULL);
+  EVP_CIPHER_CTX_set_padding(cipher->key, 0);
 #elif defined(USE_OPENSSL_AES)
   AES_set_encrypt_key((const unsigned char *)key, key_bits, &(cipher->key));
 #else
@@ -265,7 +278,7 @@ aes_free_cipher(aes_cnt_cipher_t *cipher)
 {
   tor_assert(cipher);
 #ifdef USE_OPENSSL_EVP
-  EVP_CIPHER_CTX_cleanup(&cipher->key);
+  EVP_CIPHER_CTX_free(cipher->key);
 #endif
   memset(cipher, 0, sizeof(cipher));
   tor_free(cipher);
@@ -279,6 +292,119 @@ aes_free_cipher(aes_cnt_cipher_t *cipher)
 #define UPDATE_CTR_BUF(c, n)
 #endif
 
+/** How many counter blocks' worth of keystream do we generate at once when
+ * we're crypting a long run of data? (32 blocks cover a whole cell.) */
+#define AES_KEYSTREAM_BLOCKS 32
+
+/** Advance the 128-bit counter of <b>cipher</b> by <b>n</b>. */
+static INLINE void
+_aes_advance_counter(aes_cnt_cipher_t *cipher, u32 n)
+{
+  u32 old = COUNTER(cipher, 0);
+  COUNTER(cipher, 0) += n;
+  if (PREDICT_UNLIKELY(COUNTER(cipher, 0) < old)) {
+    if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 1))) {
+      if (PREDICT_UNLIKELY(! ++COUNTER(cipher, 2))) {
+        ++COUNTER(cipher, 3);
+        UPDATE_CTR_BUF(cipher, 3);
+      }
+      UPDATE_CTR_BUF(cipher, 2);
+    }
+    UPDATE_CTR_BUF(cipher, 1);
+  }
+  UPDATE_CTR_BUF(cipher, 0);
+}
+
+/** Write the keystream for the <b>n_blocks</b> counter values starting at
+ * the current counter of <b>cipher</b> into <b>out</b>, and advance the
+ * counter past them.  Don't touch cipher-\>buf or cipher-\>pos. */
+static void
+_aes_fill_keystream(aes_cnt_cipher_t *cipher, u8 *out, int n_blocks)
+{
+  int i;
+  tor_assert(n_blocks <= AES_KEYSTREAM_BLOCKS);
+#if defined(USE_BUILTIN_AES) && defined(USE_RIJNDAEL_COUNTER_OPTIMIZATION)
+  for (i = 0; i < n_blocks; ++i) {
+    rijndaelEncrypt(cipher->rk, cipher->nr,
+                    cipher->counter3, cipher->counter2,
+                    cipher->counter1, cipher->counter0, out + 16*i);
+    _aes_advance_counter(cipher, 1);
+  }
+#else
+  {
+    /* Lay out all the counter blocks, then encrypt them in one go. */
+    u8 ctrs[16*AES_KEYSTREAM_BLOCKS];
+    for (i = 0; i < n_blocks; ++i) {
+      u32 c0 = COUNTER(cipher, 0) + (u32)i;
+      u32 c1 = COUNTER(cipher, 1), c2 = COUNTER(cipher, 2);
+      u32 c3 = COUNTER(cipher, 3);
+      if (PREDICT_UNLIKELY(c0 < COUNTER(cipher, 0))) {
+        if (! ++c1)
+          if (! ++c2)
+            ++c3;
+      }
+      set_uint32((char*)ctrs+16*i,    htonl(c3));
+      set_uint32((char*)ctrs+16*i+4,  htonl(c2));
+      set_uint32((char*)ctrs+16*i+8,  htonl(c1));
+      set_uint32((char*)ctrs+16*i+12, htonl(c0));
+    }
+#if defined(USE_OPENSSL_EVP)
+    {
+      int outl = 16*n_blocks;
+      EVP_EncryptUpdate(cipher->key, out, &outl, ctrs, 16*n_blocks);
+    }
+#elif defined(USE_OPENSSL_AES)
+    for (i = 0; i < n_blocks; ++i)
+      AES_encrypt(ctrs+16*i, out+16*i, &cipher->key);
+#else
+    for (i = 0; i < n_blocks; ++i)
+      rijndaelEncrypt(cipher->rk, cipher->nr, ctrs+16*i, out+16*i);
+#endif
+    _aes_advance_counter(cipher, (u32)n_blocks);
+  }
+#endif
+}
+
+/** Helper for aes_crypt() and aes_crypt_inplace(): XOR <b>len</b> bytes
+ * from <b>input</b> with keystream from <b>cipher</b>, storing the result in
+ * <b>output</b> (which may be the same as <b>input</b>).  Whole blocks in
+ * the middle of the run are handled AES_KEYSTREAM_BLOCKS at a time. */
+static void
+_aes_crypt_bulk(aes_cnt_cipher_t *cipher, const char *input, size_t len,
+                char *output)
+{
+  u8 ks[16*AES_KEYSTREAM_BLOCKS];
+  int c = cipher->pos;
+
+  /* Use up whatever is left of the current block. */
+  if (c) {
+    while (c != 16) {
+      *(output++) = *(input++) ^ cipher->buf[c++];
+      --len;
+    }
+    _aes_advance_counter(cipher, 1);
+  }
+
+  while (len >= 16) {
+    size_t n_blocks = len / 16, i;
+    if (n_blocks > AES_KEYSTREAM_BLOCKS)
+      n_blocks = AES_KEYSTREAM_BLOCKS;
+    _aes_fill_keystream(cipher, ks, (int)n_blocks);
+    for (i = 0; i < 16*n_blocks; ++i)
+      output[i] = input[i] ^ ks[i];
+    input += 16*n_blocks;
+    output += 16*n_blocks;
+    len -= 16*n_blocks;
+  }
+
+  /* Leave cipher->buf holding the keystream for the current counter, as
+   * everything else expects. */
+  _aes_fill_buf(cipher);
+  for (c = 0; c < (int)len; ++c)
+    output[c] = input[c] ^ cipher->buf[c];
+  cipher->pos = c;
+}
+
 /** Encrypt <b>len</b> bytes from <b>input</b>, storing the result in
  * <b>output</b>.  Uses the key in <b>cipher</b>, and advances the counter
  * by <b>len</b> bytes as it encrypts.
@@ -288,13 +414,16 @@ aes_crypt(aes_cnt_cipher_t *cipher, const char *input, size_t len,
           char *output)
 {
 
-  /* XXXX This function is up to 5% of our runtime in some profiles;
-   * we should look into unrolling some of the loops; taking advantage
-   * of alignment, using a bigger buffer, and so on. Not till after 0.1.2.x,
-   * though. */
+  /* Long runs (like cell payloads) go through _aes_crypt_bulk(), which
+   * generates keystream many blocks at a time; short ones stay here. */
   int c = cipher->pos;
   if (PREDICT_UNLIKELY(!len)) return;
 
+  if (len >= 32 + 16 - (size_t)c) {
+    _aes_crypt_bulk(cipher, input, len, output);
+    return;
+  }
+
   while (1) {
     do {
       if (len-- == 0) { cipher->pos = c; return; }
@@ -324,13 +453,16 @@ void
 aes_crypt_inplace(aes_cnt_cipher_t *cipher, char *data, size_t len)
 {
 
-  /* XXXX This function is up to 5% of our runtime in some profiles;
-   * we should look into unrolling some of the loops; taking advantage
-   * of alignment, using a bigger buffer, and so on. Not till after 0.1.2.x,
-   * though. */
+  /* Long runs (like cell payloads) go through _aes_crypt_bulk(), which
+   * generates keystream many blocks at a time; short ones stay here. */
   int c = cipher->pos;
   if (PREDICT_UNLIKELY(!len)) return;
 
+  if (len >= 32 + 16 - (size_t)c) {
+    _aes_crypt_bulk(cipher, data, len, data);
+    return;
+  }
+
   while (1) {
     do {
       if (len-- == 0) { cipher->pos = c; return; }
@@ -87,6 +87,9 @@
 /* Only use the linux prctl;  the IRIX prctl is totally different */
 #include <sys/prctl.h>
 #endif
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
 
 #include "log.h"
 #include "util.h"
@@ -853,6 +856,72 @@ set_socket_nonblocking(int socket)
 #endif
 }
 
+/** Set *<b>size_out</b> to the number of bytes of data that the kernel's
+ * send buffer for <b>socket</b> can hold.  Return 0 on success, or -1 if
+ * we can't tell on this platform. */
+int
+tor_socket_get_send_buffer_size(int socket, size_t *size_out)
+{
+#if defined(SO_SNDBUF) && defined(TIOCOUTQ)
+  int sndbuf = 0;
+  socklen_t len = (socklen_t)sizeof(sndbuf);
+  if (getsockopt(socket, SOL_SOCKET, SO_SNDBUF, (void*)&sndbuf, &len) < 0)
+    return -1;
+#ifdef __linux__
+  /* Linux doubles the value it reports for SO_SNDBUF, to leave room for its
+   * own bookkeeping; only about half of it is for data. */
+  sndbuf /= 2;
+#endif
+  *size_out = sndbuf > 0 ? (size_t)sndbuf : 0;
+  return 0;
+#else
+  (void)socket;
+  (void)size_out;
+  return -1;
+#endif
+}
+
+/** Set *<b>space_out</b> to an estimate of how many more bytes the kernel
+ * will accept for sending on <b>socket</b> right now: <b>sndbuf</b>, the
+ * size of its send buffer as reported by tor_socket_get_send_buffer_size(),
+ * minus the bytes already queued there.  Return 0 on success, or -1 if we
+ * can't tell on this platform. */
+int
+tor_socket_get_send_space(int socket, size_t sndbuf, size_t *space_out)
+{
+#if defined(SO_SNDBUF) && defined(TIOCOUTQ)
+  int queued = 0;
+  if (ioctl(socket, TIOCOUTQ, &queued) < 0)
+    return -1;
+  *space_out = ((size_t)queued < sndbuf) ? sndbuf - queued : 0;
+  return 0;
+#else
+  (void)socket;
+  (void)sndbuf;
+  (void)space_out;
+  return -1;
+#endif
+}
+
+/** Set *<b>pending_out</b> to the number of bytes that are waiting to be
+ * read on <b>socket</b>.  Return 0 on success, or -1 if we can't tell on
+ * this platform. */
+int
+tor_socket_get_recv_pending(int socket, size_t *pending_out)
+{
+#if defined(FIONREAD) && !defined(MS_WINDOWS)
+  int pending = 0;
+  if (ioctl(socket, FIONREAD, &pending) < 0)
+    return -1;
+  *pending_out = pending > 0 ? (size_t)pending : 0;
+  return 0;
+#else
+  (void)socket;
+  (void)pending_out;
+  return -1;
+#endif
+}
+
 /**
  * Allocate a pair of connected sockets.  (Like socketpair(family,
  * type,protocol,fd), but works on systems that don't have
@@ -1870,6 +1939,32 @@ tor_gettimeofday(struct timeval *timeval)
   return;
 }
 
+/** Return a count of microseconds that never decreases, from some arbitrary
+ * starting point.  Use this for measuring short intervals: unlike
+ * tor_gettimeofday(), it doesn't jump when someone sets the clock.  Where the
+ * OS has no monotonic clock, we fall back to the time of day, but never
+ * return a smaller value than we returned before. */
+uint64_t
+tor_gettime_monotonic_usec(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return ((uint64_t)ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+#endif
+  {
+    static uint64_t last_usec = 0;
+    struct timeval tv;
+    uint64_t usec;
+    tor_gettimeofday(&tv);
+    usec = ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+    if (usec < last_usec)
+      usec = last_usec;
+    last_usec = usec;
+    return usec;
+  }
+}
+
 #if defined(TOR_IS_MULTITHREADED) && !defined(MS_WINDOWS)
 /** Defined iff we need to add locks when defining fake versions of reentrant
  * versions of time-related functions. */
@@ -2051,7 +2146,6 @@ tor_mutex_free(tor_mutex_t *m)
 
 /* Conditions. */
 #ifdef USE_PTHREADS
-#if 0
 /** Cross-platform condition implementation. */
 struct tor_cond_t {
   pthread_cond_t cond;
@@ -2098,7 +2192,6 @@ tor_cond_signal_all(tor_cond_t *cond)
 {
   pthread_cond_broadcast(&cond->cond);
 }
-#endif
 /** Set up common structures for use by threading. */
 void
 tor_threads_init(void)
@@ -2111,7 +2204,6 @@ tor_threads_init(void)
   }
 }
 #elif defined(USE_WIN32_THREADS)
-#if 0
 static DWORD cond_event_tls_index;
 struct tor_cond_t {
   CRITICAL_SECTION mutex;
@@ -2193,17 +2285,28 @@ tor_cond_signal_all(tor_cond_t *cond)
   smartlist_clear(cond->events);
   LeaveCriticalSection(&cond->mutex);
 }
-#endif
 void
 tor_threads_init(void)
 {
-#if 0
   cond_event_tls_index = TlsAlloc();
-#endif
   set_main_thread();
 }
 #endif
 
+#ifdef TOR_MEMORY_BARRIER_USES_MUTEX
+/** Lock that tor_memory_barrier() takes and releases, on platforms where we
+ * don't know how to ask for a barrier directly. Locking a mutex is a barrier
+ * too, if a slow one. */
+static pthread_mutex_t memory_barrier_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Act as a full memory barrier; see compat.h. */
+void
+tor_memory_barrier(void)
+{
+  pthread_mutex_lock(&memory_barrier_lock);
+  pthread_mutex_unlock(&memory_barrier_lock);
+}
+#endif
+
 /** Identity of the "main" thread */
 static unsigned long main_thread_id = -1;
 
@@ -2221,6 +2324,30 @@ in_main_thread(void)
   return main_thread_id == tor_get_thread_id();
 }
 
+/** Return the number of CPUs the current process can use, or -1 if we
+ * can't tell.  Don't believe absurdly large answers. */
+int
+compute_num_cpus(void)
+{
+#if defined(MS_WINDOWS)
+  SYSTEM_INFO info;
+  memset(&info, 0, sizeof(info));
+  GetSystemInfo(&info);
+  if (info.dwNumberOfProcessors >= 1 && info.dwNumberOfProcessors < INT_MAX)
+    return (int)info.dwNumberOfProcessors;
+  else
+    return -1;
+#elif defined(HAVE_SYSCONF) && defined(_SC_NPROCESSORS_ONLN)
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus >= 1 && cpus < INT_MAX)
+    return (int)cpus;
+  else
+    return -1;
+#else
+  return -1;
+#endif
+}
+
 /**
  * On Windows, WSAEWOULDBLOCK is not always correct: when you see it,
  * you need to ask the socket for its actual errno.  Also, you need to
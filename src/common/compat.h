@@ -291,6 +291,7 @@ struct timeval {
 #endif
 
 void tor_gettimeofday(struct timeval *timeval);
+uint64_t tor_gettime_monotonic_usec(void);
 
 #ifdef HAVE_LOCALTIME_R
 #define tor_localtime_r localtime_r
@@ -398,6 +399,9 @@ const char *tor_inet_ntop(int af, const void *src, char *dst, size_t len);
 int tor_inet_pton(int af, const char *src, void *dst);
 int tor_lookup_hostname(const char *name, uint32_t *addr) ATTR_NONNULL((1,2));
 void set_socket_nonblocking(int socket);
+int tor_socket_get_send_buffer_size(int socket, size_t *size_out);
+int tor_socket_get_send_space(int socket, size_t sndbuf, size_t *space_out);
+int tor_socket_get_recv_pending(int socket, size_t *pending_out);
 int tor_socketpair(int family, int type, int protocol, int fd[2]);
 int network_init(void);
 
@@ -533,7 +537,6 @@ void set_main_thread(void);
 int in_main_thread(void);
 
 #ifdef TOR_IS_MULTITHREADED
-#if 0
 typedef struct tor_cond_t tor_cond_t;
 tor_cond_t *tor_cond_new(void);
 void tor_cond_free(tor_cond_t *cond);
@@ -541,8 +544,24 @@ int tor_cond_wait(tor_cond_t *cond, tor_mutex_t *mutex);
 void tor_cond_signal_one(tor_cond_t *cond);
 void tor_cond_signal_all(tor_cond_t *cond);
 #endif
+
+/* Memory barriers.  tor_memory_barrier() makes sure that every load and
+ * store this thread did before it happens before every load and store this
+ * thread does after it, as far as any other thread can tell. */
+#if defined(__GNUC__) && \
+  (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))
+#define tor_memory_barrier() __sync_synchronize()
+#elif defined(MS_WINDOWS)
+#define tor_memory_barrier() MemoryBarrier()
+#elif defined(TOR_IS_MULTITHREADED)
+#define TOR_MEMORY_BARRIER_USES_MUTEX
+void tor_memory_barrier(void);
+#else
+#define tor_memory_barrier() STMT_NIL
 #endif
 
+int compute_num_cpus(void);
+
 /* Platform-specific helpers. */
 #ifdef MS_WINDOWS
 char *format_win32_error(DWORD err);
@@ -107,6 +107,21 @@ smartlist_remove(smartlist_t *sl, const void *element)
     }
 }
 
+/** As smartlist_remove(), but keep the remaining elements of <b>sl</b> in
+ * the order they were in. */
+void
+smartlist_remove_keeporder(smartlist_t *sl, const void *element)
+{
+  int i, j;
+  if (element == NULL)
+    return;
+  for (i = j = 0; j < sl->num_used; ++j) {
+    if (sl->list[j] != element)
+      sl->list[i++] = sl->list[j];
+  }
+  sl->num_used = i;
+}
+
 /** If <b>sl</b> is nonempty, remove and return the final element.  Otherwise,
  * return NULL. */
 void *
@@ -615,12 +630,29 @@ smartlist_uniq_strings(smartlist_t *sl)
 #define RIGHT_CHILD(i) ( 2*(i) + 2 )
 #define PARENT(i)      ( ((i)-1) / 2 )
 
+/** Helper: return a pointer to the index field of <b>p</b>, which lives
+ * <b>idx_field_offset</b> bytes into the object. */
+#define IDXP(p) ((int*)STRUCT_VAR_P(p, idx_field_offset))
+
+/** Helper: tell the item at <b>i</b> in <b>sl</b> where it lives now, if
+ * the items have an index field. */
+#define UPDATE_IDX(i)  do {                            \
+    void *updated = sl->list[i];                       \
+    if (idx_field_offset >= 0)                         \
+      *IDXP(updated) = i;                              \
+  } while (0)
+
+/** Helper: return the index of <b>p</b> in the heap, as recorded in its
+ * index field. */
+#define IDX_OF_ITEM(p) (*IDXP(p))
+
 /** Helper. <b>sl</b> may have at most one violation of the heap property:
  * the item at <b>idx</b> may be greater than one or both of its children.
  * Restore the heap property. */
 static INLINE void
 smartlist_heapify(smartlist_t *sl,
                   int (*compare)(const void *a, const void *b),
+                  int idx_field_offset,
                   int idx)
 {
   while (1) {
@@ -643,21 +675,29 @@ smartlist_heapify(smartlist_t *sl,
       void *tmp = sl->list[idx];
       sl->list[idx] = sl->list[best_idx];
       sl->list[best_idx] = tmp;
+      UPDATE_IDX(idx);
+      UPDATE_IDX(best_idx);
 
       idx = best_idx;
     }
   }
 }
 
-/** Insert <b>item</b> into the heap stored in <b>sl</b>, where order
- * is determined by <b>compare</b>. */
+/** Insert <b>item</b> into the heap stored in <b>sl</b>, where order is
+ * determined by <b>compare</b> and the offset of the item in the heap is
+ * stored in an int-typed field at position <b>idx_field_offset</b> within
+ * item.  If <b>idx_field_offset</b> is negative, the items have no index
+ * field, and smartlist_pqueue_remove() can't be used on them.
+ */
 void
 smartlist_pqueue_add(smartlist_t *sl,
                      int (*compare)(const void *a, const void *b),
+                     int idx_field_offset,
                      void *item)
 {
   int idx;
   smartlist_add(sl,item);
+  UPDATE_IDX(sl->num_used-1);
 
   for (idx = sl->num_used - 1; idx; ) {
     int parent = PARENT(idx);
@@ -665,6 +705,8 @@ smartlist_pqueue_add(smartlist_t *sl,
       void *tmp = sl->list[parent];
       sl->list[parent] = sl->list[idx];
       sl->list[idx] = tmp;
+      UPDATE_IDX(parent);
+      UPDATE_IDX(idx);
       idx = parent;
     } else {
       return;
@@ -673,32 +715,81 @@ smartlist_pqueue_add(smartlist_t *sl,
 }
 
 /** Remove and return the top-priority item from the heap stored in <b>sl</b>,
- * where order is determined by <b>compare</b>.  <b>sl</b> must not be
- * empty. */
+ * where order is determined by <b>compare</b> and the item's position is
+ * stored at position <b>idx_field_offset</b> within the item, if that is
+ * non-negative.  <b>sl</b> must not be empty. */
 void *
 smartlist_pqueue_pop(smartlist_t *sl,
-                     int (*compare)(const void *a, const void *b))
+                     int (*compare)(const void *a, const void *b),
+                     int idx_field_offset)
 {
   void *top;
   tor_assert(sl->num_used);
 
   top = sl->list[0];
+  if (idx_field_offset >= 0)
+    *IDXP(top) = -1;
   if (--sl->num_used) {
     sl->list[0] = sl->list[sl->num_used];
-    smartlist_heapify(sl, compare, 0);
+    UPDATE_IDX(0);
+    smartlist_heapify(sl, compare, idx_field_offset, 0);
   }
   return top;
 }
 
+/** Remove the item <b>item</b> from the heap stored in <b>sl</b>,
+ * where order is determined by <b>compare</b> and the item's position is
+ * stored at position <b>idx_field_offset</b> within the item, which must be
+ * non-negative.  <b>sl</b> must not be empty. */
+void
+smartlist_pqueue_remove(smartlist_t *sl,
+                        int (*compare)(const void *a, const void *b),
+                        int idx_field_offset,
+                        void *item)
+{
+  int idx;
+  tor_assert(idx_field_offset >= 0);
+  idx = IDX_OF_ITEM(item);
+  tor_assert(idx >= 0 && idx < sl->num_used);
+  tor_assert(sl->list[idx] == item);
+  *IDXP(item) = -1;
+  --sl->num_used;
+  if (idx == sl->num_used)
+    return;
+  sl->list[idx] = sl->list[sl->num_used];
+  UPDATE_IDX(idx);
+  /* The item we moved into the hole may belong either above or below it. */
+  while (idx) {
+    int parent = PARENT(idx);
+    if (compare(sl->list[idx], sl->list[parent]) < 0) {
+      void *tmp = sl->list[parent];
+      sl->list[parent] = sl->list[idx];
+      sl->list[idx] = tmp;
+      UPDATE_IDX(parent);
+      UPDATE_IDX(idx);
+      idx = parent;
+    } else {
+      break;
+    }
+  }
+  smartlist_heapify(sl, compare, idx_field_offset, idx);
+}
+
 /** Assert that the heap property is correctly maintained by the heap stored
- * in <b>sl</b>, where order is determined by <b>compare</b>. */
+ * in <b>sl</b>, where order is determined by <b>compare</b>, and that every
+ * item's index field (if <b>idx_field_offset</b> is non-negative) is
+ * correct. */
 void
 smartlist_pqueue_assert_ok(smartlist_t *sl,
-                           int (*compare)(const void *a, const void *b))
+                           int (*compare)(const void *a, const void *b),
+                           int idx_field_offset)
 {
   int i;
-  for (i = sl->num_used - 1; i > 0; --i) {
-    tor_assert(compare(sl->list[PARENT(i)], sl->list[i]) <= 0);
+  for (i = sl->num_used - 1; i >= 0; --i) {
+    if (i > 0)
+      tor_assert(compare(sl->list[PARENT(i)], sl->list[i]) <= 0);
+    if (idx_field_offset >= 0)
+      tor_assert(IDX_OF_ITEM(sl->list[i]) == i);
   }
 }
 
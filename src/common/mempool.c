@@ -560,6 +560,70 @@ assert_chunks_ok(mp_pool_t *pool, mp_chunk_t *chunk, int empty, int full)
   return n;
 }
 
+/** Return a new magazine that caches free items from <b>pool</b>.
+ *
+ * A magazine is a small stack of free items belonging to a single user of a
+ * pool (say, one connection).  Getting an item from a magazine, or releasing
+ * one to it, is just a push or a pop, except when the magazine is empty or
+ * full: then we move half a magazine's worth of items between the magazine
+ * and the pool at once.  Items from a magazine may be released to the pool,
+ * or to any other magazine for the same pool, and vice versa. */
+mp_magazine_t *
+mp_magazine_new(mp_pool_t *pool)
+{
+  mp_magazine_t *mag = ALLOC(sizeof(mp_magazine_t));
+  CHECK_ALLOC(mag);
+  mag->pool = pool;
+  mag->n_items = 0;
+  return mag;
+}
+
+/** Allocate and return an item from <b>mag</b>, refilling it from its
+ * pool if it is empty. */
+void *
+mp_magazine_get(mp_magazine_t *mag)
+{
+  if (PREDICT_UNLIKELY(mag->n_items == 0)) {
+    while (mag->n_items < MP_MAGAZINE_CAPACITY/2) {
+      void *item = mp_pool_get(mag->pool);
+      CHECK_ALLOC(item);
+      mag->items[mag->n_items++] = item;
+    }
+  }
+  return mag->items[--mag->n_items];
+}
+
+/** Return <b>item</b>, which must have been allocated from <b>mag</b>'s pool,
+ * to <b>mag</b>.  If <b>mag</b> is full, first return half its items to
+ * the pool. */
+void
+mp_magazine_release(mp_magazine_t *mag, void *item)
+{
+  if (PREDICT_UNLIKELY(mag->n_items == MP_MAGAZINE_CAPACITY)) {
+    while (mag->n_items > MP_MAGAZINE_CAPACITY/2)
+      mp_pool_release(mag->items[--mag->n_items]);
+  }
+  mag->items[mag->n_items++] = item;
+}
+
+/** Return every item held by <b>mag</b> to its pool. */
+void
+mp_magazine_clear(mp_magazine_t *mag)
+{
+  while (mag->n_items)
+    mp_pool_release(mag->items[--mag->n_items]);
+}
+
+/** Return every item held by <b>mag</b> to its pool, and free <b>mag</b>. */
+void
+mp_magazine_free(mp_magazine_t *mag)
+{
+  if (!mag)
+    return;
+  mp_magazine_clear(mag);
+  FREE(mag);
+}
+
 /** Fail with an assertion if <b>pool</b> is not internally consistent. */
 void
 mp_pool_assert_ok(mp_pool_t *pool)
@@ -22,6 +22,16 @@ void mp_pool_destroy(mp_pool_t *pool);
 void mp_pool_assert_ok(mp_pool_t *pool);
 void mp_pool_log_status(mp_pool_t *pool, int severity);
 
+/** A magazine is a small cache of free items from a memory pool, for use by
+ * a single owner.  See mempool.c for details. */
+typedef struct mp_magazine_t mp_magazine_t;
+
+mp_magazine_t *mp_magazine_new(mp_pool_t *pool);
+void *mp_magazine_get(mp_magazine_t *mag);
+void mp_magazine_release(mp_magazine_t *mag, void *item);
+void mp_magazine_clear(mp_magazine_t *mag);
+void mp_magazine_free(mp_magazine_t *mag);
+
 #define MEMPOOL_STATS
 
 #ifdef MEMPOOL_PRIVATE
@@ -57,6 +67,18 @@ struct mp_pool_t {
   uint64_t total_chunks_freed;
 #endif
 };
+
+/** How many free items can a magazine hold? */
+#define MP_MAGAZINE_CAPACITY 16
+
+struct mp_magazine_t {
+  /** The pool that our items come from and go back to. */
+  mp_pool_t *pool;
+  /** How many items are in <b>items</b>? */
+  int n_items;
+  /** Stack of free items; the top is items[n_items-1]. */
+  void *items[MP_MAGAZINE_CAPACITY];
+};
 #endif
 
 #endif
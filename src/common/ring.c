@@ -0,0 +1,188 @@
+/* Copyright (c) 2009, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file ring.c
+ * \brief Implementation for spsc_ring_t, a bounded queue for handing
+ * pointers from one thread to another without locking.
+ *
+ * The ring is an array of slots whose size is a power of two, along with
+ * two counters: <b>head</b>, the number of items the consumer has ever
+ * taken, and <b>tail</b>, the number of items the producer has ever added.
+ * Only the consumer writes head, and only the producer writes tail, so
+ * neither needs a lock: the producer fills slots and then advances tail;
+ * the consumer empties slots and then advances head.  A memory barrier on
+ * each side keeps the other thread from seeing the new counter before the
+ * slots it covers.  The counters wrap around at 2**32, which is fine, since
+ * we only ever look at their difference.
+ *
+ * The two counters live on separate cache lines, so the two threads aren't
+ * forever stealing one line from each other; and each thread keeps its own
+ * copy of the other's counter, and only looks at the real one when its
+ * copy says the ring is full (or empty).
+ *
+ * The ring is only safe with exactly one producer thread and exactly one
+ * consumer thread.
+ **/
+
+#include "orconfig.h"
+#include <stdlib.h>
+#include "ring.h"
+#include "util.h"
+#include "compat.h"
+#include "log.h"
+
+/** How many bytes do we assume are in a cache line? */
+#define CACHE_LINE_SIZE 64
+
+/** The largest capacity we allow a ring to have. */
+#define SPSC_RING_MAX_CAPACITY (1<<24)
+
+/** A bounded single-producer, single-consumer queue of pointers. */
+struct spsc_ring_t {
+  /** The slots. Set when the ring is created. */
+  void **slots;
+  /** The number of slots, minus one. Set when the ring is created. */
+  uint32_t mask;
+  char _pad0[CACHE_LINE_SIZE];
+
+  /** How many items has the consumer taken?  Written only by the
+   * consumer. */
+  volatile uint32_t head;
+  /** The consumer's copy of <b>tail</b>, as of the last time it looked. */
+  uint32_t consumer_tail;
+  char _pad1[CACHE_LINE_SIZE];
+
+  /** How many items has the producer added?  Written only by the
+   * producer. */
+  volatile uint32_t tail;
+  /** The producer's copy of <b>head</b>, as of the last time it looked. */
+  uint32_t producer_head;
+  char _pad2[CACHE_LINE_SIZE];
+};
+
+/** Return a new, empty ring with room for at least <b>capacity</b> items.
+ * (We round the capacity up to a power of two.) */
+spsc_ring_t *
+spsc_ring_new(int capacity)
+{
+  spsc_ring_t *ring;
+  uint32_t n = 1;
+
+  tor_assert(capacity > 0 && capacity <= SPSC_RING_MAX_CAPACITY);
+  while (n < (uint32_t)capacity)
+    n <<= 1;
+
+  ring = tor_malloc_zero(sizeof(spsc_ring_t));
+  ring->slots = tor_malloc_zero(sizeof(void*)*n);
+  ring->mask = n - 1;
+  return ring;
+}
+
+/** Release all storage held by <b>ring</b>.  Neither thread may be using
+ * it.  Does not free the items still on it. */
+void
+spsc_ring_free(spsc_ring_t *ring)
+{
+  if (!ring)
+    return;
+  tor_free(ring->slots);
+  tor_free(ring);
+}
+
+/** Return the number of items that <b>ring</b> can hold at once. */
+int
+spsc_ring_get_capacity(const spsc_ring_t *ring)
+{
+  return (int)(ring->mask + 1);
+}
+
+/** Producer only: add as many of the <b>n</b> items in <b>items</b> to
+ * the end of <b>ring</b>, in order, as there is room for.  Return the
+ * number we added. */
+int
+spsc_ring_push_batch(spsc_ring_t *ring, void **items, int n)
+{
+  uint32_t tail = ring->tail, room, i;
+
+  room = ring->mask + 1 - (tail - ring->producer_head);
+  if (room < (uint32_t)n) {
+    ring->producer_head = ring->head;
+    /* Don't let our writes to the slots below happen before the
+     * consumer's reads from them. */
+    tor_memory_barrier();
+    room = ring->mask + 1 - (tail - ring->producer_head);
+    if (room < (uint32_t)n)
+      n = (int)room;
+  }
+  if (n <= 0)
+    return 0;
+
+  for (i = 0; i < (uint32_t)n; ++i)
+    ring->slots[(tail + i) & ring->mask] = items[i];
+  /* The consumer mustn't see the new tail before the items. */
+  tor_memory_barrier();
+  ring->tail = tail + n;
+  return n;
+}
+
+/** Producer only: add <b>item</b> to the end of <b>ring</b>.  Return 0 on
+ * success, or -1 if the ring is full. */
+int
+spsc_ring_push(spsc_ring_t *ring, void *item)
+{
+  return spsc_ring_push_batch(ring, &item, 1) ? 0 : -1;
+}
+
+/** Consumer only: take up to <b>max</b> items from the front of
+ * <b>ring</b>, in order, and store them in <b>items</b>.  Return the number
+ * we took. */
+int
+spsc_ring_pop_batch(spsc_ring_t *ring, void **items, int max)
+{
+  uint32_t head = ring->head, avail, i;
+
+  if (max <= 0)
+    return 0;
+  avail = ring->consumer_tail - head;
+  if (avail < (uint32_t)max) {
+    ring->consumer_tail = ring->tail;
+    /* Don't read the slots below before we've seen the tail that covers
+     * them. */
+    tor_memory_barrier();
+    avail = ring->consumer_tail - head;
+    if (!avail)
+      return 0;
+  }
+  if (avail > (uint32_t)max)
+    avail = (uint32_t)max;
+
+  for (i = 0; i < avail; ++i)
+    items[i] = ring->slots[(head + i) & ring->mask];
+  /* The producer mustn't reuse the slots before we're done reading. */
+  tor_memory_barrier();
+  ring->head = head + avail;
+  return (int)avail;
+}
+
+/** Consumer only: remove and return the item at the front of <b>ring</b>,
+ * or NULL if the ring is empty. */
+void *
+spsc_ring_pop(spsc_ring_t *ring)
+{
+  void *item;
+  return spsc_ring_pop_batch(ring, &item, 1) ? item : NULL;
+}
+
+/** Consumer only: return true iff <b>ring</b> has nothing on it right now.
+ * This always looks at the producer's latest tail, and acts as a memory
+ * barrier, so a consumer about to go to sleep can tell whether the
+ * producer has added anything since it last checked. */
+int
+spsc_ring_is_empty(spsc_ring_t *ring)
+{
+  tor_memory_barrier();
+  ring->consumer_tail = ring->tail;
+  return ring->consumer_tail == ring->head;
+}
+
@@ -0,0 +1,29 @@
+/* Copyright (c) 2009, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file ring.h
+ * \brief Headers for ring.c
+ **/
+
+#ifndef _TOR_RING_H
+#define _TOR_RING_H
+
+/** A bounded first-in-first-out queue of pointers, that one thread can add
+ * to while another thread takes from it, without either one locking.  See
+ * ring.c for implementation details. */
+typedef struct spsc_ring_t spsc_ring_t;
+
+spsc_ring_t *spsc_ring_new(int capacity);
+void spsc_ring_free(spsc_ring_t *ring);
+int spsc_ring_get_capacity(const spsc_ring_t *ring);
+
+int spsc_ring_push(spsc_ring_t *ring, void *item);
+int spsc_ring_push_batch(spsc_ring_t *ring, void **items, int n);
+
+void *spsc_ring_pop(spsc_ring_t *ring);
+int spsc_ring_pop_batch(spsc_ring_t *ring, void **items, int max);
+int spsc_ring_is_empty(spsc_ring_t *ring);
+
+#endif
+
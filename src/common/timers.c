@@ -0,0 +1,318 @@
+/* Copyright (c) 2009, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file timers.c
+ * \brief Implementation for timer_wheel_t, a hierarchical timer wheel for
+ * keeping track of a large number of timeouts cheaply.
+ *
+ * A timer wheel counts time in abstract "ticks"; the caller decides how
+ * long a tick is, and calls timer_wheel_advance() as time passes.  The wheel
+ * has WHEEL_LEVELS levels of WHEEL_SIZE slots each.  A timer that expires
+ * within WHEEL_SIZE ticks goes in the slot at level 0 for its expiry tick;
+ * a timer that expires further in the future goes in a coarser slot at a
+ * higher level, covering WHEEL_SIZE times as many ticks as a slot on the
+ * level below.  Whenever the wheel's level-0 position wraps around to
+ * zero, we move ("cascade") the timers from the next slot of level 1 down
+ * to level 0, and so on up the levels.
+ *
+ * That way, scheduling or cancelling a timer is O(1), and advancing the
+ * wheel by one tick costs O(1) plus the number of timers that expire or
+ * cascade on that tick, no matter how many timers are waiting.
+ **/
+
+#include "orconfig.h"
+#include <stdlib.h>
+#include "timers.h"
+#include "util.h"
+#include "compat.h"
+#include "log.h"
+
+/** How many bits of the tick count does each level of the wheel cover? */
+#define WHEEL_BITS 6
+/** How many slots are there on each level of the wheel? */
+#define WHEEL_SIZE (1<<WHEEL_BITS)
+/** Mask for the slot index on a single level of the wheel. */
+#define WHEEL_MASK (WHEEL_SIZE-1)
+/** How many levels does the wheel have? */
+#define WHEEL_LEVELS 4
+/** How many ticks in the future can the wheel hold a timer without having
+ * to cascade it more than once per trip around the top level? */
+#define WHEEL_SPAN (U64_LITERAL(1) << (WHEEL_BITS*WHEEL_LEVELS))
+
+/** A single timeout, as stored on a timer wheel. */
+struct wheel_timer_t {
+  /** Next timer in the same slot, or NULL. */
+  struct wheel_timer_t *next;
+  /** Pointer to the pointer to this timer in its slot, or NULL if the timer
+   * isn't scheduled. */
+  struct wheel_timer_t **prevp;
+  /** The wheel this timer is scheduled on, or NULL if it isn't scheduled. */
+  timer_wheel_t *wheel;
+  /** The tick at which this timer expires. */
+  uint64_t when;
+  /** Function to call when this timer expires. */
+  wheel_timer_cb_t cb;
+  /** Argument to pass to <b>cb</b>. */
+  void *arg;
+};
+
+/** A hierarchical timer wheel. */
+struct timer_wheel_t {
+  /** The last tick we have advanced the wheel to. */
+  uint64_t now;
+  /** How many timers are scheduled on this wheel? */
+  int n_timers;
+  /** Timers that were scheduled for a tick we had already reached; they run
+   * on the next tick. */
+  wheel_timer_t *expired;
+  /** The slots for each level of the wheel. */
+  wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+/** Add <b>timer</b> to the front of the slot list at <b>headp</b>. */
+static INLINE void
+timer_link(wheel_timer_t **headp, wheel_timer_t *timer)
+{
+  timer->next = *headp;
+  if (timer->next)
+    timer->next->prevp = &timer->next;
+  *headp = timer;
+  timer->prevp = headp;
+}
+
+/** Remove <b>timer</b> from whatever slot list it's on, and note that it
+ * is no longer scheduled. */
+static INLINE void
+timer_unlink(wheel_timer_t *timer)
+{
+  *timer->prevp = timer->next;
+  if (timer->next)
+    timer->next->prevp = timer->prevp;
+  timer->next = NULL;
+  timer->prevp = NULL;
+  --timer->wheel->n_timers;
+  timer->wheel = NULL;
+}
+
+/** Put <b>timer</b>, which must not be scheduled, on the right slot of
+ * <b>wheel</b> for its expiry time. */
+static void
+timer_place(timer_wheel_t *wheel, wheel_timer_t *timer)
+{
+  uint64_t when = timer->when, delta;
+  int level;
+
+  timer->wheel = wheel;
+  ++wheel->n_timers;
+
+  if (when <= wheel->now) {
+    timer_link(&wheel->expired, timer);
+    return;
+  }
+  delta = when - wheel->now;
+  if (delta >= WHEEL_SPAN) {
+    /* Too far in the future to place exactly; park it in the farthest slot
+     * we have, and place it again when that slot cascades. */
+    when = wheel->now + WHEEL_SPAN - 1;
+    delta = WHEEL_SPAN - 1;
+  }
+  for (level = 0; level < WHEEL_LEVELS-1; ++level) {
+    if (delta < (U64_LITERAL(1) << (WHEEL_BITS*(level+1))))
+      break;
+  }
+  timer_link(&wheel->slots[level][(when >> (WHEEL_BITS*level)) & WHEEL_MASK],
+             timer);
+}
+
+/** Detach the list of timers at <b>headp</b>, and run each one in turn.
+ * Return the number of timers we ran. */
+static int
+timer_run_list(timer_wheel_t *wheel, wheel_timer_t **headp)
+{
+  wheel_timer_t *list = *headp;
+  int n = 0;
+  if (!list)
+    return 0;
+  /* Move the list somewhere that callbacks which schedule new timers won't
+   * touch, but where cancelling a timer still works. */
+  *headp = NULL;
+  list->prevp = &list;
+  while (list) {
+    wheel_timer_t *timer = list;
+    timer_unlink(timer);
+    timer->cb(timer, timer->arg, wheel->now);
+    ++n;
+  }
+  return n;
+}
+
+/** Move every timer in the current slot of level <b>level</b> of
+ * <b>wheel</b> to the right slot on a lower level. */
+static void
+timer_cascade(timer_wheel_t *wheel, int level)
+{
+  int idx = (int)((wheel->now >> (WHEEL_BITS*level)) & WHEEL_MASK);
+  wheel_timer_t *list = wheel->slots[level][idx];
+  if (!list)
+    return;
+  wheel->slots[level][idx] = NULL;
+  list->prevp = &list;
+  while (list) {
+    wheel_timer_t *timer = list;
+    timer_unlink(timer);
+    timer_place(wheel, timer);
+  }
+}
+
+/** Return a new timer wheel whose current tick is <b>now</b>. */
+timer_wheel_t *
+timer_wheel_new(uint64_t now)
+{
+  timer_wheel_t *wheel = tor_malloc_zero(sizeof(timer_wheel_t));
+  wheel->now = now;
+  return wheel;
+}
+
+/** Release all storage held by <b>wheel</b>.  Any timers still scheduled on
+ * it become unscheduled; they are not freed. */
+void
+timer_wheel_free(timer_wheel_t *wheel)
+{
+  int level, idx;
+  if (!wheel)
+    return;
+  while (wheel->expired)
+    timer_unlink(wheel->expired);
+  for (level = 0; level < WHEEL_LEVELS; ++level) {
+    for (idx = 0; idx < WHEEL_SIZE; ++idx) {
+      while (wheel->slots[level][idx])
+        timer_unlink(wheel->slots[level][idx]);
+    }
+  }
+  tor_assert(wheel->n_timers == 0);
+  tor_free(wheel);
+}
+
+/** Advance <b>wheel</b> to the tick <b>now</b>, running the callback for
+ * every timer that expires on the way, in order of expiry tick.  If
+ * <b>now</b> is before the wheel's current tick, only run the timers that
+ * were scheduled for a tick we had already reached.  Return the number of
+ * timers we ran. */
+int
+timer_wheel_advance(timer_wheel_t *wheel, uint64_t now)
+{
+  int n = timer_run_list(wheel, &wheel->expired);
+
+  if (now > wheel->now && now - wheel->now >= WHEEL_SPAN) {
+    /* We jumped past the whole wheel at once; stepping through every tick
+     * would take forever, so just take every timer off the wheel and put it
+     * back relative to the new time. */
+    wheel_timer_t *all = NULL;
+    int level, idx;
+    for (level = 0; level < WHEEL_LEVELS; ++level) {
+      for (idx = 0; idx < WHEEL_SIZE; ++idx) {
+        while (wheel->slots[level][idx]) {
+          wheel_timer_t *timer = wheel->slots[level][idx];
+          timer_unlink(timer);
+          timer->wheel = wheel;
+          ++wheel->n_timers;
+          timer_link(&all, timer);
+        }
+      }
+    }
+    wheel->now = now;
+    while (all) {
+      wheel_timer_t *timer = all;
+      timer_unlink(timer);
+      timer_place(wheel, timer);
+    }
+    return n + timer_run_list(wheel, &wheel->expired);
+  }
+
+  while (wheel->now < now) {
+    int level;
+    ++wheel->now;
+    for (level = 1; level < WHEEL_LEVELS; ++level) {
+      if ((wheel->now >> (WHEEL_BITS*(level-1))) & WHEEL_MASK)
+        break;
+      timer_cascade(wheel, level);
+    }
+    n += timer_run_list(wheel, &wheel->expired);
+    n += timer_run_list(wheel, &wheel->slots[0][wheel->now & WHEEL_MASK]);
+  }
+  return n;
+}
+
+/** Return the last tick that <b>wheel</b> has been advanced to. */
+uint64_t
+timer_wheel_get_now(const timer_wheel_t *wheel)
+{
+  return wheel->now;
+}
+
+/** Return the number of timers scheduled on <b>wheel</b>. */
+int
+timer_wheel_get_n_timers(const timer_wheel_t *wheel)
+{
+  return wheel->n_timers;
+}
+
+/** Return a new, unscheduled timer that will call <b>cb</b> with
+ * <b>arg</b> when it expires. */
+wheel_timer_t *
+wheel_timer_new(wheel_timer_cb_t cb, void *arg)
+{
+  wheel_timer_t *timer = tor_malloc_zero(sizeof(wheel_timer_t));
+  timer->cb = cb;
+  timer->arg = arg;
+  return timer;
+}
+
+/** Cancel <b>timer</b> if it's scheduled, and release its storage. */
+void
+wheel_timer_free(wheel_timer_t *timer)
+{
+  if (!timer)
+    return;
+  wheel_timer_cancel(timer);
+  tor_free(timer);
+}
+
+/** Schedule <b>timer</b> on <b>wheel</b> to expire at tick <b>when</b>,
+ * rescheduling it if it was already scheduled.  If <b>when</b> is no later
+ * than the wheel's current tick, the timer runs on the next call to
+ * timer_wheel_advance(). */
+void
+wheel_timer_schedule(timer_wheel_t *wheel, wheel_timer_t *timer,
+                     uint64_t when)
+{
+  if (timer->prevp)
+    timer_unlink(timer);
+  timer->when = when;
+  timer_place(wheel, timer);
+}
+
+/** Unschedule <b>timer</b>, if it's scheduled. */
+void
+wheel_timer_cancel(wheel_timer_t *timer)
+{
+  if (timer->prevp)
+    timer_unlink(timer);
+}
+
+/** Return true iff <b>timer</b> is scheduled. */
+int
+wheel_timer_is_scheduled(const wheel_timer_t *timer)
+{
+  return timer->prevp != NULL;
+}
+
+/** Return the tick at which <b>timer</b> is (or was last) scheduled to
+ * expire. */
+uint64_t
+wheel_timer_get_when(const wheel_timer_t *timer)
+{
+  return timer->when;
+}
+
@@ -0,0 +1,43 @@
+/* Copyright (c) 2009, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file timers.h
+ * \brief Headers for timers.c
+ **/
+
+#ifndef _TOR_TIMERS_H
+#define _TOR_TIMERS_H
+
+#include "torint.h"
+
+/** A timer wheel holds a large number of timeouts, and runs each one's
+ * callback once its time has come.  See timers.c for implementation
+ * details. */
+typedef struct timer_wheel_t timer_wheel_t;
+/** A single timeout that can be scheduled on a timer wheel. */
+typedef struct wheel_timer_t wheel_timer_t;
+
+/** Function to call when a timer expires: <b>timer</b> is the timer that
+ * expired, <b>arg</b> is the argument it was created with, and <b>now</b>
+ * is the tick at which it is running.  The timer is no longer scheduled
+ * when this is called; the callback may reschedule or free it. */
+typedef void (*wheel_timer_cb_t)(wheel_timer_t *timer, void *arg,
+                                 uint64_t now);
+
+timer_wheel_t *timer_wheel_new(uint64_t now);
+void timer_wheel_free(timer_wheel_t *wheel);
+int timer_wheel_advance(timer_wheel_t *wheel, uint64_t now);
+uint64_t timer_wheel_get_now(const timer_wheel_t *wheel);
+int timer_wheel_get_n_timers(const timer_wheel_t *wheel);
+
+wheel_timer_t *wheel_timer_new(wheel_timer_cb_t cb, void *arg);
+void wheel_timer_free(wheel_timer_t *timer);
+void wheel_timer_schedule(timer_wheel_t *wheel, wheel_timer_t *timer,
+                          uint64_t when);
+void wheel_timer_cancel(wheel_timer_t *timer);
+int wheel_timer_is_scheduled(const wheel_timer_t *timer);
+uint64_t wheel_timer_get_when(const wheel_timer_t *timer);
+
+#endif
+
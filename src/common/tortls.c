@@ -91,6 +91,10 @@ struct tor_tls_t {
    */
   unsigned long last_write_count;
   unsigned long last_read_count;
+  /** How many TLS records, and how many bytes of plaintext in them, have we
+   * written with tor_tls_write()? */
+  uint64_t n_records_written;
+  uint64_t n_bytes_written;
   /** If set, a callback to invoke whenever the client tries to renegotiate
    * the handshake. */
   void (*negotiated_callback)(tor_tls_t *tls, void *arg);
@@ -1024,6 +1028,10 @@ tor_tls_write(tor_tls_t *tls, const char *cp, size_t n)
   r = SSL_write(tls->ssl, cp, (int)n);
   err = tor_tls_get_error(tls, r, 0, "writing", LOG_INFO, LD_NET);
   if (err == TOR_TLS_DONE) {
+    /* OpenSSL splits each write into as few records as it can. */
+    tls->n_records_written +=
+      (r + TOR_TLS_MAX_RECORD_LEN - 1) / TOR_TLS_MAX_RECORD_LEN;
+    tls->n_bytes_written += r;
     return r;
   }
   if (err == TOR_TLS_WANTWRITE || err == TOR_TLS_WANTREAD) {
@@ -1032,6 +1040,17 @@ tor_tls_write(tor_tls_t *tls, const char *cp, size_t n)
   return err;
 }
 
+/** Set *<b>n_records_out</b> to the number of TLS records we have written on
+ * <b>tls</b> with tor_tls_write(), and *<b>n_bytes_out</b> to the number of
+ * bytes of data they held. */
+void
+tor_tls_get_n_records_written(tor_tls_t *tls, uint64_t *n_records_out,
+                              uint64_t *n_bytes_out)
+{
+  *n_records_out = tls->n_records_written;
+  *n_bytes_out = tls->n_bytes_written;
+}
+
 /** Perform initial handshake on <b>tls</b>.  When finished, returns
  * TOR_TLS_DONE.  On failure, returns TOR_TLS_ERROR, TOR_TLS_WANTREAD,
  * or TOR_TLS_WANTWRITE.
@@ -31,6 +31,10 @@ typedef struct tor_tls_t tor_tls_t;
 #define TOR_TLS_WANTWRITE          -1
 #define TOR_TLS_DONE                0
 
+/** The most plaintext that TLS will put in a single record.  Each record
+ * costs us a header and a MAC, so we try to write this much at a time. */
+#define TOR_TLS_MAX_RECORD_LEN 16384
+
 /** Collection of case statements for all TLS errors that are not due to
  * underlying IO failure. */
 #define CASE_TOR_TLS_ERROR_ANY_NONIO            \
@@ -63,6 +67,8 @@ int tor_tls_verify(int severity, tor_tls_t *tls, crypto_pk_env_t **identity);
 int tor_tls_check_lifetime(tor_tls_t *tls, int tolerance);
 int tor_tls_read(tor_tls_t *tls, char *cp, size_t len);
 int tor_tls_write(tor_tls_t *tls, const char *cp, size_t n);
+void tor_tls_get_n_records_written(tor_tls_t *tls, uint64_t *n_records_out,
+                                   uint64_t *n_bytes_out);
 int tor_tls_handshake(tor_tls_t *tls);
 int tor_tls_renegotiate(tor_tls_t *tls);
 int tor_tls_shutdown(tor_tls_t *tls);
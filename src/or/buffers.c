@@ -11,6 +11,7 @@
  * memory, file descriptors, or TLS connections.
  **/
 #define BUFFERS_PRIVATE
+#include <math.h>
 #include "or.h"
 #include "../common/util.h"
 #include "../common/log.h"
@@ -98,6 +99,10 @@ chunk_repack(chunk_t *chunk)
   chunk->data = &chunk->mem[0];
 }
 
+/** Allocation size for a chunk that holds exactly one full TLS record's
+ * worth of data. */
+#define TLS_CHUNK_ALLOC CHUNK_ALLOC_SIZE(TOR_TLS_MAX_RECORD_LEN)
+
 #ifdef ENABLE_BUF_FREELISTS
 /** A freelist of chunks. */
 typedef struct chunk_freelist_t {
@@ -105,23 +110,34 @@ typedef struct chunk_freelist_t {
   int max_length; /**< Never allow more than this number of chunks in the
                    * freelist. */
   int slack; /**< When trimming the freelist, leave this number of extra
-              * chunks beyond lowest_length.*/
+              * chunks beyond what we expect to need.*/
   int cur_length; /**< How many chunks on the freelist now? */
   int lowest_length; /**< What's the smallest value of cur_length since the
                       * last time we cleaned this freelist? */
-  uint64_t n_alloc;
-  uint64_t n_free;
-  uint64_t n_hit;
+  int start_length; /**< What was cur_length the last time we cleaned this
+                     * freelist? */
+  int target_length; /**< How many chunks did we decide to keep the last
+                      * time we cleaned this freelist? */
+  double demand; /**< Decaying estimate of how many chunks of this size
+                  * we need between cleanings.  See
+                  * buf_shrink_freelists(). */
+  uint64_t start_n_alloc; /**< What was n_alloc the last time we cleaned
+                           * this freelist? */
+  uint64_t n_alloc; /**< How many chunks of this size have we had to
+                     * allocate because the freelist was empty? */
+  uint64_t n_free; /**< How many chunks of this size have we really freed? */
+  uint64_t n_hit; /**< How many chunks have we taken off the freelist? */
   chunk_t *head; /**< First chunk on the freelist. */
 } chunk_freelist_t;
 
 /** Macro to help define freelists. */
-#define FL(a,m,s) { a, m, s, 0, 0, 0, 0, 0, NULL }
+#define FL(a,m,s) { a, m, s, 0, 0, 0, 0, 0.0, 0, 0, 0, 0, NULL }
 
 /** Static array of freelists, sorted by alloc_len, terminated by an entry
  * with alloc_size of 0. */
 static chunk_freelist_t freelists[] = {
-  FL(4096, 256, 8), FL(8192, 128, 4), FL(16384, 64, 4), FL(32768, 32, 2),
+  FL(4096, 256, 8), FL(8192, 128, 4), FL(16384, 64, 4),
+  FL(TLS_CHUNK_ALLOC, 64, 4), FL(32768, 32, 2), FL(65536, 16, 1),
   FL(0, 0, 0)
 };
 #undef FL
@@ -137,7 +153,8 @@ static INLINE chunk_freelist_t *
 get_freelist(size_t alloc)
 {
   int i;
-  for (i=0; freelists[i].alloc_size <= alloc; ++i) {
+  for (i=0; freelists[i].alloc_size && freelists[i].alloc_size <= alloc;
+       ++i) {
     if (freelists[i].alloc_size == alloc) {
       return &freelists[i];
     }
@@ -243,32 +260,54 @@ preferred_chunk_size(size_t target)
   while (CHUNK_SIZE_WITH_ALLOC(sz) < target) {
     sz <<= 1;
   }
+  /* Don't use a chunk twice as big as we need just because the chunk
+   * header pushed a full TLS record over a power of two. */
+  if (sz > TLS_CHUNK_ALLOC && target <= TOR_TLS_MAX_RECORD_LEN)
+    sz = TLS_CHUNK_ALLOC;
   return sz;
 }
 
-/** Remove from the freelists most chunks that have not been used since the
- * last call to buf_shrink_freelists(). */
+/** When estimating how many chunks of each size we need, how much weight
+ * do we give the estimate from the last time we cleaned the freelists,
+ * compared with what we needed since then? */
+#define FREELIST_DEMAND_DECAY 0.75
+
+/** Trim the freelists to the number of chunks we expect to need before
+ * the next call to buf_shrink_freelists(), or free them all if
+ * <b>free_all</b> is true.
+ *
+ * We need a chunk from a freelist for every time the freelist ran lower
+ * than it was at the last cleaning, and for every time it was empty and we
+ * had to allocate a chunk instead.  We keep a decaying average of that
+ * number for each freelist, and keep that many chunks (plus some slack) so
+ * that the freelists follow our load up and down without holding on to
+ * memory we needed only once. */
 void
 buf_shrink_freelists(int free_all)
 {
 #ifdef ENABLE_BUF_FREELISTS
   int i;
   for (i = 0; freelists[i].alloc_size; ++i) {
-    int slack = freelists[i].slack;
-    assert_freelist_ok(&freelists[i]);
-    if (free_all || freelists[i].lowest_length > slack) {
-      int n_to_free = free_all ? freelists[i].cur_length :
-        (freelists[i].lowest_length - slack);
-      int n_to_skip = freelists[i].cur_length - n_to_free;
-      int orig_n_to_free = n_to_free, n_freed=0;
-      int new_length = n_to_skip;
-      chunk_t **chp = &freelists[i].head;
+    chunk_freelist_t *fl = &freelists[i];
+    int needed = (fl->start_length - fl->lowest_length) +
+      (int)(fl->n_alloc - fl->start_n_alloc);
+    int target;
+    assert_freelist_ok(fl);
+    fl->demand = fl->demand * FREELIST_DEMAND_DECAY +
+      needed * (1.0 - FREELIST_DEMAND_DECAY);
+    target = free_all ? 0 : fl->slack + (int)ceil(fl->demand);
+    if (target > fl->max_length)
+      target = fl->max_length;
+    fl->target_length = target;
+
+    if (fl->cur_length > target) {
+      int n_to_skip = target, n_to_free = fl->cur_length - target;
+      chunk_t **chp = &fl->head;
       chunk_t *chunk;
       log_info(LD_MM, "Cleaning freelist for %d-byte chunks: keeping %d, "
-               "dropping %d.",
-               (int)freelists[i].alloc_size, n_to_skip, n_to_free);
+               "dropping %d.", (int)fl->alloc_size, n_to_skip, n_to_free);
       while (n_to_skip) {
-        tor_assert((*chp)->next);
+        tor_assert(*chp);
         chp = &(*chp)->next;
         --n_to_skip;
       }
@@ -278,24 +317,13 @@ buf_shrink_freelists(int free_all)
         chunk_t *next = chunk->next;
         tor_free(chunk);
         chunk = next;
-        --n_to_free;
-        ++n_freed;
-        ++freelists[i].n_free;
+        ++fl->n_free;
       }
-      if (n_to_free) {
-        log_warn(LD_BUG, "Freelist length for %d-byte chunks may have been "
-                 "messed up somehow.", (int)freelists[i].alloc_size);
-        log_warn(LD_BUG, "There were %d chunks at the start.  I decided to "
-                 "keep %d. I wanted to free %d.  I freed %d.  I somehow think "
-                 "I have %d left to free.",
-                 freelists[i].cur_length, n_to_skip, orig_n_to_free,
-                 n_freed, n_to_free);
-      }
-      // tor_assert(!n_to_free);
-      freelists[i].cur_length = new_length;
+      fl->cur_length = target;
     }
-    freelists[i].lowest_length = freelists[i].cur_length;
-    assert_freelist_ok(&freelists[i]);
+    fl->lowest_length = fl->start_length = fl->cur_length;
+    fl->start_n_alloc = fl->n_alloc;
+    assert_freelist_ok(fl);
   }
 #else
   (void) free_all;
@@ -314,10 +342,11 @@ buf_dump_freelist_sizes(int severity)
     uint64_t total = ((uint64_t)freelists[i].cur_length) *
       freelists[i].alloc_size;
     log(severity, LD_MM,
-        U64_FORMAT" bytes in %d %d-byte chunks ["U64_FORMAT
+        U64_FORMAT" bytes in %d %d-byte chunks (keeping %d) ["U64_FORMAT
         " misses; "U64_FORMAT" frees; "U64_FORMAT" hits]",
         U64_PRINTF_ARG(total),
         freelists[i].cur_length, (int)freelists[i].alloc_size,
+        freelists[i].target_length,
         U64_PRINTF_ARG(freelists[i].n_alloc),
         U64_PRINTF_ARG(freelists[i].n_free),
         U64_PRINTF_ARG(freelists[i].n_hit));
@@ -329,6 +358,37 @@ buf_dump_freelist_sizes(int severity)
 #endif
 }
 
+/** Return a newly allocated string describing the state of each freelist,
+ * one line per freelist, for the controller. */
+char *
+buf_get_freelist_status(void)
+{
+  smartlist_t *lines = smartlist_create();
+  char *result;
+#ifdef ENABLE_BUF_FREELISTS
+  char buf[256];
+  int i;
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    chunk_freelist_t *fl = &freelists[i];
+    tor_snprintf(buf, sizeof(buf),
+                 "ChunkSize=%d Held=%d Target=%d BytesHeld="U64_FORMAT
+                 " Hits="U64_FORMAT" Misses="U64_FORMAT" Frees="U64_FORMAT,
+                 (int)fl->alloc_size, fl->cur_length, fl->target_length,
+                 U64_PRINTF_ARG(((uint64_t)fl->cur_length)*fl->alloc_size),
+                 U64_PRINTF_ARG(fl->n_hit), U64_PRINTF_ARG(fl->n_alloc),
+                 U64_PRINTF_ARG(fl->n_free));
+    smartlist_add(lines, tor_strdup(buf));
+  }
+  tor_snprintf(buf, sizeof(buf), "ChunkSize=other Misses="U64_FORMAT,
+               U64_PRINTF_ARG(n_freelist_miss));
+  smartlist_add(lines, tor_strdup(buf));
+#endif
+  result = smartlist_join_strings(lines, "\r\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
 /** Magic value for buf_t.magic, to catch pointer errors. */
 #define BUFFER_MAGIC 0xB0FFF312u
 /** A resizeable buffer, optimized for reading and writing. */
@@ -527,6 +587,65 @@ buf_free(buf_t *buf)
   tor_free(buf);
 }
 
+/** Buffers passed to buf_free_later() with at least this many chunks get
+ * released a few chunks at a time by buf_free_some_deferred(), rather than
+ * all at once as buf_free() would. */
+#define BUF_FREE_LATER_MIN_CHUNKS 16
+
+/** Buffers passed to buf_free_later() that still have chunks to release. */
+static smartlist_t *bufs_to_free = NULL;
+
+/** As buf_free(), but if <b>buf</b> holds a lot of chunks, leave them for
+ * buf_free_some_deferred() to release, so that freeing many large buffers
+ * at once doesn't hold up the main loop. */
+void
+buf_free_later(buf_t *buf)
+{
+  chunk_t *chunk;
+  int n = 0;
+  for (chunk = buf->head; chunk && n < BUF_FREE_LATER_MIN_CHUNKS;
+       chunk = chunk->next)
+    ++n;
+  if (n < BUF_FREE_LATER_MIN_CHUNKS) {
+    buf_free(buf);
+    return;
+  }
+  buf->datalen = 0;
+  if (!bufs_to_free)
+    bufs_to_free = smartlist_create();
+  smartlist_add(bufs_to_free, buf);
+}
+
+/** Release up to <b>max_chunks</b> chunks from buffers passed to
+ * buf_free_later(), freeing each buffer once it's empty.  Return the number
+ * of buffers that are still waiting. */
+int
+buf_free_some_deferred(int max_chunks)
+{
+  if (!bufs_to_free)
+    return 0;
+  while (max_chunks > 0 && smartlist_len(bufs_to_free)) {
+    buf_t *buf = smartlist_get(bufs_to_free, smartlist_len(bufs_to_free)-1);
+    while (buf->head && max_chunks > 0) {
+      chunk_t *chunk = buf->head;
+      buf->head = chunk->next;
+      chunk_free(chunk);
+      --max_chunks;
+    }
+    if (!buf->head) {
+      buf->tail = NULL;
+      smartlist_pop_last(bufs_to_free);
+      buf_free(buf);
+    }
+  }
+  if (!smartlist_len(bufs_to_free)) {
+    smartlist_free(bufs_to_free);
+    bufs_to_free = NULL;
+    return 0;
+  }
+  return smartlist_len(bufs_to_free);
+}
+
 /** Append a new chunk with enough capacity to hold <b>capacity</b> bytes to
  * the tail of <b>buf</b>.  If <b>capped</b>, don't allocate a chunk bigger
  * than MAX_CHUNK_ALLOC. */
@@ -553,39 +672,27 @@ buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
   return chunk;
 }
 
-/** If we're using readv and writev, how many chunks are we willing to
- * read/write at a time? */
-#define N_IOV 3
+#if defined(HAVE_READV) && defined(HAVE_WRITEV) && !defined(MS_WINDOWS)
+/** Defined iff we read and write sockets a batch of chunks at a time, with
+ * readv() and writev(). */
+#define USE_IOVEC
+#endif
 
-/** Read up to <b>at_most</b> bytes from the socket <b>fd</b> into
- * <b>chunk</b> (which must be on <b>buf</b>). If we get an EOF, set
- * *<b>reached_eof</b> to 1.  Return -1 on error, 0 on eof or blocking,
- * and the number of bytes read otherwise. */
+/** If we're using readv and writev, how many chunks are we willing to
+ * read/write at a time?  Chunks are big enough that a few will do, and the
+ * iovec arrays live on the stack.  (POSIX promises that IOV_MAX is at least
+ * 16.) */
+#define N_IOV 16
+
+/** Helper for read_to_chunk() and read_to_chunks_iov(): look at the return
+ * value <b>read_result</b> of a read from <b>fd</b>.  If it was an error, set
+ * *<b>socket_error</b> and return -1; if it was an EOF, set
+ * *<b>reached_eof</b> and return 0; if we would have blocked, return 0;
+ * otherwise, return 1. */
 static INLINE int
-read_to_chunk(buf_t *buf, chunk_t *chunk, int fd, size_t at_most,
-              int *reached_eof, int *socket_error)
+check_read_result(int fd, ssize_t read_result, int *reached_eof,
+                  int *socket_error)
 {
-  ssize_t read_result;
-#if 0 && defined(HAVE_READV) && !defined(WIN32)
-  struct iovec iov[N_IOV];
-  int i;
-  size_t remaining = at_most;
-  for (i=0; chunk && i < N_IOV && remaining; ++i) {
-    iov[i].iov_base = CHUNK_WRITE_PTR(chunk);
-    if (remaining > CHUNK_REMAINING_CAPACITY(chunk))
-      iov[i].iov_len = CHUNK_REMAINING_CAPACITY(chunk);
-    else
-      iov[i].iov_len = remaining;
-    remaining -= iov[i].iov_len;
-    chunk = chunk->next;
-  }
-  read_result = readv(fd, iov, i);
-#else
-  if (at_most > CHUNK_REMAINING_CAPACITY(chunk))
-    at_most = CHUNK_REMAINING_CAPACITY(chunk);
-  read_result = tor_socket_recv(fd, CHUNK_WRITE_PTR(chunk), at_most, 0);
-#endif
-
   if (read_result < 0) {
     int e = tor_socket_errno(fd);
     if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
@@ -601,24 +708,127 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, int fd, size_t at_most,
     log_debug(LD_NET,"Encountered eof on fd %d", (int)fd);
     *reached_eof = 1;
     return 0;
-  } else { /* actually got bytes. */
-    buf->datalen += read_result;
-#if 0 && defined(HAVE_READV) && !defined(WIN32)
-    while ((size_t)read_result > CHUNK_REMAINING_CAPACITY(chunk)) {
-      chunk->datalen += CHUNK_REMAINING_CAPACITY(chunk);
-      read_result -= CHUNK_REMAINING_CAPACITY(chunk);
-      chunk = chunk->next;
-      tor_assert(chunk);
-    }
-#endif
-    chunk->datalen += read_result;
-    log_debug(LD_NET,"Read %ld bytes. %d on inbuf.", (long)read_result,
-              (int)buf->datalen);
-    tor_assert(read_result < INT_MAX);
-    return (int)read_result;
+  }
+  return 1;
+}
+
+#ifdef USE_IOVEC
+/** Free every chunk on <b>buf</b> after <b>last</b>, which must be on
+ * <b>buf</b>, and make <b>last</b> the tail.  If <b>last</b> is NULL, free
+ * every chunk.  The chunks must not hold any data. */
+static void
+buf_free_chunks_after(buf_t *buf, chunk_t *last)
+{
+  chunk_t *chunk = last ? last->next : buf->head;
+  if (last)
+    last->next = NULL;
+  else
+    buf->head = NULL;
+  buf->tail = last;
+  while (chunk) {
+    chunk_t *next = chunk->next;
+    tor_assert(!chunk->datalen);
+    chunk_free(chunk);
+    chunk = next;
   }
 }
 
+/** Read up to <b>at_most</b> bytes from the socket <b>fd</b> onto the end of
+ * <b>buf</b> with a single readv() call: first into whatever room is left
+ * in the last chunk, then into as many newly allocated chunks as it takes,
+ * up to N_IOV chunks in all.  We only allocate chunks for the bytes that
+ * the kernel says are waiting; new chunks that we don't fill are freed
+ * again.  If we get an EOF, set *<b>reached_eof</b> to 1.  Return -1 on
+ * error, 0 on eof or blocking, and the number of bytes read otherwise. */
+static INLINE int
+read_to_chunks_iov(buf_t *buf, int fd, size_t at_most,
+                   int *reached_eof, int *socket_error)
+{
+  struct iovec iov[N_IOV];
+  chunk_t *old_tail = buf->tail, *first = NULL, *chunk;
+  size_t remaining = at_most, pending, n;
+  ssize_t read_result;
+  int i = 0, r;
+
+  if (tor_socket_get_recv_pending(fd, &pending) == 0) {
+    /* If nothing is waiting, we still need to read to notice an EOF or an
+     * error, but one small read will do. */
+    if (pending < MIN_READ_LEN)
+      pending = MIN_READ_LEN;
+    if (remaining > pending)
+      remaining = pending;
+  }
+  if (old_tail && CHUNK_REMAINING_CAPACITY(old_tail)) {
+    first = old_tail;
+    iov[0].iov_base = CHUNK_WRITE_PTR(old_tail);
+    iov[0].iov_len = CHUNK_REMAINING_CAPACITY(old_tail);
+    if (iov[0].iov_len > remaining)
+      iov[0].iov_len = remaining;
+    remaining -= iov[0].iov_len;
+    i = 1;
+  }
+  while (remaining && i < N_IOV) {
+    chunk = buf_add_chunk_with_capacity(buf, remaining, 1);
+    if (!first)
+      first = chunk;
+    iov[i].iov_base = CHUNK_WRITE_PTR(chunk);
+    iov[i].iov_len = CHUNK_REMAINING_CAPACITY(chunk);
+    if (iov[i].iov_len > remaining)
+      iov[i].iov_len = remaining;
+    remaining -= iov[i].iov_len;
+    ++i;
+  }
+
+  read_result = readv(fd, iov, i);
+
+  r = check_read_result(fd, read_result, reached_eof, socket_error);
+  if (r <= 0) {
+    buf_free_chunks_after(buf, old_tail);
+    return r;
+  }
+  /* actually got bytes. */
+  buf->datalen += read_result;
+  n = read_result;
+  for (i = 0, chunk = first; n; ++i, chunk = chunk->next) {
+    size_t len = iov[i].iov_len < n ? iov[i].iov_len : n;
+    chunk->datalen += len;
+    n -= len;
+    if (!n)
+      buf_free_chunks_after(buf, chunk);
+  }
+  log_debug(LD_NET,"Read %ld bytes. %d on inbuf.", (long)read_result,
+            (int)buf->datalen);
+  tor_assert(read_result < INT_MAX);
+  return (int)read_result;
+}
+#else
+/** Read up to <b>at_most</b> bytes from the socket <b>fd</b> into
+ * <b>chunk</b> (which must be on <b>buf</b>). If we get an EOF, set
+ * *<b>reached_eof</b> to 1.  Return -1 on error, 0 on eof or blocking,
+ * and the number of bytes read otherwise. */
+static INLINE int
+read_to_chunk(buf_t *buf, chunk_t *chunk, int fd, size_t at_most,
+              int *reached_eof, int *socket_error)
+{
+  ssize_t read_result;
+  int r;
+  if (at_most > CHUNK_REMAINING_CAPACITY(chunk))
+    at_most = CHUNK_REMAINING_CAPACITY(chunk);
+  read_result = tor_socket_recv(fd, CHUNK_WRITE_PTR(chunk), at_most, 0);
+
+  r = check_read_result(fd, read_result, reached_eof, socket_error);
+  if (r <= 0)
+    return r;
+  /* actually got bytes. */
+  buf->datalen += read_result;
+  chunk->datalen += read_result;
+  log_debug(LD_NET,"Read %ld bytes. %d on inbuf.", (long)read_result,
+            (int)buf->datalen);
+  tor_assert(read_result < INT_MAX);
+  return (int)read_result;
+}
+#endif
+
 /** As read_to_chunk(), but return (negative) error code on error, blocking,
  * or TLS, and the number of bytes read otherwise. */
 static INLINE int
@@ -658,6 +868,9 @@ read_to_buf(int s, size_t at_most, buf_t *buf, int *reached_eof,
 
   while (at_most > total_read) {
     size_t readlen = at_most - total_read;
+#ifdef USE_IOVEC
+    r = read_to_chunks_iov(buf, s, readlen, reached_eof, socket_error);
+#else
     chunk_t *chunk;
     if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN) {
       chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
@@ -671,6 +884,7 @@ read_to_buf(int s, size_t at_most, buf_t *buf, int *reached_eof,
     }
 
     r = read_to_chunk(buf, chunk, s, readlen, reached_eof, socket_error);
+#endif
     check();
     if (r < 0)
       return r; /* Error */
@@ -736,31 +950,47 @@ read_to_buf_tls(tor_tls_t *tls, size_t at_most, buf_t *buf)
   return (int)total_read;
 }
 
-/** Helper for flush_buf(): try to write <b>sz</b> bytes from chunk
- * <b>chunk</b> of buffer <b>buf</b> onto socket <b>s</b>.  On success, deduct
- * the bytes written from *<b>buf_flushlen</b>.  Return the number of bytes
- * written on success, 0 on blocking, -1 on failure.
+#ifdef USE_IOVEC
+/** Helper for flush_buf(): try to write <b>sz</b> bytes from the front of
+ * <b>buf</b> onto socket <b>s</b> with a single writev() call, taking data
+ * from up to N_IOV chunks.  Set *<b>attempted_out</b> to the number of bytes
+ * we tried to write.  On success, deduct the bytes written from
+ * *<b>buf_flushlen</b>.  Return the number of bytes written on success, 0 on
+ * blocking, -1 on failure.
  */
 static INLINE int
-flush_chunk(int s, buf_t *buf, chunk_t *chunk, size_t sz,
-            size_t *buf_flushlen)
+flush_chunks_iov(int s, buf_t *buf, size_t sz, size_t *buf_flushlen,
+                 size_t *attempted_out)
 {
-  ssize_t write_result;
-#if 0 && defined(HAVE_WRITEV) && !defined(WIN32)
   struct iovec iov[N_IOV];
-  int i;
+  chunk_t *chunk;
   size_t remaining = sz;
-  for (i=0; chunk && i < N_IOV && remaining; ++i) {
+  ssize_t write_result;
+  int i;
+
+  for (i = 0, chunk = buf->head; chunk && i < N_IOV && remaining;
+       ++i, chunk = chunk->next) {
     iov[i].iov_base = chunk->data;
     if (remaining > chunk->datalen)
       iov[i].iov_len = chunk->datalen;
     else
       iov[i].iov_len = remaining;
     remaining -= iov[i].iov_len;
-    chunk = chunk->next;
   }
+  *attempted_out = sz - remaining;
   write_result = writev(s, iov, i);
 #else
+/** Helper for flush_buf(): try to write <b>sz</b> bytes from chunk
+ * <b>chunk</b> of buffer <b>buf</b> onto socket <b>s</b>.  On success, deduct
+ * the bytes written from *<b>buf_flushlen</b>.  Return the number of bytes
+ * written on success, 0 on blocking, -1 on failure.
+ */
+static INLINE int
+flush_chunk(int s, buf_t *buf, chunk_t *chunk, size_t sz,
+            size_t *buf_flushlen)
+{
+  ssize_t write_result;
+
   if (sz > chunk->datalen)
     sz = chunk->datalen;
   write_result = tor_socket_send(s, chunk->data, sz, 0);
@@ -845,12 +1075,16 @@ flush_buf(int s, buf_t *buf, size_t sz, size_t *buf_flushlen)
   while (sz) {
     size_t flushlen0;
     tor_assert(buf->head);
+#ifdef USE_IOVEC
+    r = flush_chunks_iov(s, buf, sz, buf_flushlen, &flushlen0);
+#else
     if (buf->head->datalen >= sz)
       flushlen0 = sz;
     else
       flushlen0 = buf->head->datalen;
 
     r = flush_chunk(s, buf, buf->head, flushlen0, buf_flushlen);
+#endif
     check();
     if (r < 0)
       return r;
@@ -886,10 +1120,24 @@ flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
   do {
     size_t flushlen0;
     if (buf->head) {
+      /* Every call to tor_tls_write() ends a TLS record, so try to hand it
+       * full records.  If the first chunk doesn't hold a full record's
+       * worth of what we're flushing, gather enough from the chunks after
+       * it; otherwise, write straight from the chunk, leaving any fraction
+       * of a record for next time. */
+      size_t want = sz > TOR_TLS_MAX_RECORD_LEN ?
+        TOR_TLS_MAX_RECORD_LEN : (size_t)sz;
+      size_t forced = tor_tls_get_forced_write_size(tls);
+      if (want < forced)
+        want = forced;
+      if (buf->head->datalen < want && buf->head->next)
+        buf_pullup(buf, want, 0);
       if ((ssize_t)buf->head->datalen >= sz)
         flushlen0 = sz;
       else
         flushlen0 = buf->head->datalen;
+      if (flushlen0 > TOR_TLS_MAX_RECORD_LEN)
+        flushlen0 -= flushlen0 % TOR_TLS_MAX_RECORD_LEN;
     } else {
       flushlen0 = 0;
     }
@@ -1031,6 +1279,69 @@ fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto)
   return 1;
 }
 
+/** Remove up to <b>max_cells</b> complete fixed-length cells from the front
+ * of <b>buf</b>, and unpack them into the first elements of
+ * <b>cells_out</b>.  Cells that lie entirely within one chunk are unpacked
+ * directly from the chunk's memory; only cells that straddle a chunk
+ * boundary get copied into a temporary buffer first.  The bytes for the
+ * whole batch are removed from <b>buf</b> at once.
+ *
+ * If link protocol <b>linkproto</b> allows variable-length cells, stop
+ * before any cell that looks like the start of one, so that the caller can
+ * handle it with fetch_var_cell_from_buf().
+ *
+ * Return the number of cells unpacked.
+ */
+int
+fetch_cells_from_buf(buf_t *buf, cell_t *cells_out, int max_cells,
+                     int linkproto)
+{
+  const chunk_t *chunk;
+  size_t pos = 0; /* Offset of the next cell within chunk->data. */
+  int n = 0;
+
+  check();
+  chunk = buf->head;
+  while (n < max_cells &&
+         buf->datalen >= ((size_t)n+1) * CELL_NETWORK_SIZE) {
+    char tmp[CELL_NETWORK_SIZE];
+    const char *body;
+    tor_assert(chunk);
+    if (chunk->datalen - pos >= CELL_NETWORK_SIZE) {
+      body = chunk->data + pos;
+      pos += CELL_NETWORK_SIZE;
+    } else {
+      /* This cell straddles chunks; gather it into tmp. */
+      size_t got = 0;
+      while (got < CELL_NETWORK_SIZE) {
+        size_t copy = chunk->datalen - pos;
+        if (copy > CELL_NETWORK_SIZE - got)
+          copy = CELL_NETWORK_SIZE - got;
+        memcpy(tmp+got, chunk->data+pos, copy);
+        got += copy;
+        pos += copy;
+        if (pos == chunk->datalen && got < CELL_NETWORK_SIZE) {
+          chunk = chunk->next;
+          pos = 0;
+        }
+      }
+      body = tmp;
+    }
+    if (linkproto != 1 && CELL_COMMAND_IS_VAR_LENGTH(get_uint8(body+2)))
+      break;
+    cell_unpack(&cells_out[n++], body);
+    if (pos == chunk->datalen) {
+      chunk = chunk->next;
+      pos = 0;
+    }
+  }
+
+  if (n)
+    buf_remove_from_front(buf, ((size_t)n) * CELL_NETWORK_SIZE);
+  check();
+  return n;
+}
+
 /** Move up to *<b>buf_flushlen</b> bytes from <b>buf_in</b> to
  * <b>buf_out</b>, and modify *<b>buf_flushlen</b> appropriately.
  * Return the number of bytes actually copied.
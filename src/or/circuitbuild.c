@@ -1253,7 +1253,7 @@ circuit_handle_first_hop(origin_circuit_t *circ)
     return 0;
   } else { /* it's already open. use it. */
     tor_assert(!circ->_base.n_hop);
-    circ->_base.n_conn = n_conn;
+    circuit_set_n_conn(TO_CIRCUIT(circ), n_conn);
     log_debug(LD_CIRC,"Conn open. Delivering first onion skin.");
     if ((err_reason = circuit_send_next_onion_skin(circ)) < 0) {
       log_info(LD_CIRC,"circuit_send_next_onion_skin failed.");
@@ -1310,7 +1310,7 @@ circuit_n_conn_done(or_connection_t *or_conn, int status)
       /* circuit_deliver_create_cell will set n_circ_id and add us to
        * orconn_circuid_circuit_map, so we don't need to call
        * set_circid_orconn here. */
-      circ->n_conn = or_conn;
+      circuit_set_n_conn(circ, or_conn);
       extend_info_free(circ->n_hop);
       circ->n_hop = NULL;
 
@@ -1713,7 +1713,7 @@ circuit_extend(cell_t *cell, circuit_t *circ)
   }
 
   tor_assert(!circ->n_hop); /* Connection is already established. */
-  circ->n_conn = n_conn;
+  circuit_set_n_conn(circ, n_conn);
   log_debug(LD_CIRC,"n_conn is %s:%u",
             n_conn->_base.address,n_conn->_base.port);
 
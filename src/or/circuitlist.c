@@ -10,7 +10,6 @@
  **/
 
 #include "or.h"
-#include "ht.h"
 
 /********* START VARIABLES **********/
 
@@ -20,53 +19,239 @@ circuit_t *global_circuitlist=NULL;
 /** A list of all the circuits in CIRCUIT_STATE_OR_WAIT. */
 static smartlist_t *circuits_pending_or_conns=NULL;
 
+/** A list of all the circuits that are marked for close, but that we
+ * haven't freed yet. */
+static smartlist_t *circuits_pending_close=NULL;
+
 static void circuit_free(circuit_t *circ);
 static void circuit_free_cpath(crypt_path_t *cpath);
 static void circuit_free_cpath_node(crypt_path_t *victim);
+static void circuit_clear_blocked_streams(circuit_t *circ);
 
 /********* END VARIABLES ************/
 
-/** A map from OR connection and circuit ID to circuit.  (Lookup performance is
- * very important here, since we need to do it every time a cell arrives.) */
-typedef struct orconn_circid_circuit_map_t {
-  HT_ENTRY(orconn_circid_circuit_map_t) node;
-  or_connection_t *or_conn;
-  circid_t circ_id;
-  circuit_t *circuit;
-} orconn_circid_circuit_map_t;
-
-/** Helper for hash tables: compare the OR connection and circuit ID for a and
- * b, and return less than, equal to, or greater than zero appropriately.
- */
+/** One slot in an OR connection's circuit ID map. */
+typedef struct circid_map_ent_t {
+  circuit_t *circuit; /**< The circuit, or NULL if this slot is empty. */
+  circid_t circ_id; /**< The circuit's ID on the connection. */
+} circid_map_ent_t;
+
+/** A map from circuit ID to circuit for a single OR connection.  (Lookup
+ * performance is very important here, since we need to do it every time a
+ * cell arrives.)  This is an open-addressed hash table with linear probing:
+ * entries live inline in <b>ents</b>, so a lookup usually touches a single
+ * cache line and never follows a pointer to a separate allocation. */
+struct circid_map_t {
+  int bits; /**< The table has 1\<\<bits slots. */
+  int n_entries; /**< How many slots are in use? */
+  circid_map_ent_t ents[1]; /**< The slots; really 1\<\<bits long. */
+};
+
+/** The smallest number of slots (as a power of two) in a circid_map_t. */
+#define CIRCID_MAP_MIN_BITS 3
+
+/** Odd multiplier for hashing circuit IDs, chosen at random so that a peer
+ * can't pick circuit IDs that all land in the same part of our table. */
+static uint32_t circid_map_hash_key = 0;
+
+/** Return the slot where a lookup for <b>circ_id</b> in <b>map</b> starts. */
+static INLINE unsigned
+circid_map_home(const circid_map_t *map, circid_t circ_id)
+{
+  return (unsigned)(((uint32_t)circ_id * circid_map_hash_key)
+                    >> (32 - map->bits));
+}
+
+/** Return the entry for <b>circ_id</b> in <b>map</b>, or NULL if there is
+ * none. <b>map</b> may be NULL. */
+static INLINE circid_map_ent_t *
+circid_map_find(circid_map_t *map, circid_t circ_id)
+{
+  unsigned mask, i;
+  if (!map)
+    return NULL;
+  mask = (1u << map->bits) - 1;
+  for (i = circid_map_home(map, circ_id); map->ents[i].circuit;
+       i = (i+1) & mask) {
+    if (map->ents[i].circ_id == circ_id)
+      return &map->ents[i];
+  }
+  return NULL;
+}
+
+/** Add an entry mapping <b>circ_id</b> to <b>circ</b> to <b>map</b>, which
+ * must not already have one for <b>circ_id</b>, and must have room. */
+static void
+circid_map_insert_new(circid_map_t *map, circid_t circ_id, circuit_t *circ)
+{
+  unsigned mask = (1u << map->bits) - 1;
+  unsigned i = circid_map_home(map, circ_id);
+  while (map->ents[i].circuit)
+    i = (i+1) & mask;
+  map->ents[i].circuit = circ;
+  map->ents[i].circ_id = circ_id;
+  ++map->n_entries;
+}
+
+/** Return a new circid_map_t with 1\<\<<b>bits</b> slots, holding all the
+ * entries of <b>old</b> (if any).  Free <b>old</b>. */
+static circid_map_t *
+circid_map_resize(circid_map_t *old, int bits)
+{
+  circid_map_t *map;
+  int i;
+  while (!circid_map_hash_key) {
+    crypto_rand((char*)&circid_map_hash_key, sizeof(circid_map_hash_key));
+    circid_map_hash_key |= 1;
+  }
+  map = tor_malloc_zero(STRUCT_OFFSET(circid_map_t, ents) +
+                        sizeof(circid_map_ent_t)*(1<<bits));
+  map->bits = bits;
+  if (old) {
+    for (i = 0; i < (1<<old->bits); ++i) {
+      if (old->ents[i].circuit)
+        circid_map_insert_new(map, old->ents[i].circ_id,
+                              old->ents[i].circuit);
+    }
+    tor_free(old);
+  }
+  return map;
+}
+
+/** Map <b>circ_id</b> to <b>circ</b> on <b>conn</b>, replacing any earlier
+ * entry for <b>circ_id</b>. */
+static void
+circid_map_set(or_connection_t *conn, circid_t circ_id, circuit_t *circ)
+{
+  circid_map_t *map = conn->circid_map;
+  circid_map_ent_t *ent = circid_map_find(map, circ_id);
+  if (ent) {
+    ent->circuit = circ;
+    return;
+  }
+  /* Keep the table at most half full, so that probe sequences stay short. */
+  if (!map)
+    map = conn->circid_map = circid_map_resize(NULL, CIRCID_MAP_MIN_BITS);
+  else if ((map->n_entries+1)*2 > (1<<map->bits))
+    map = conn->circid_map = circid_map_resize(map, map->bits+1);
+  circid_map_insert_new(map, circ_id, circ);
+}
+
+/** Remove the entry for <b>circ_id</b> from the circuit ID map of
+ * <b>conn</b>.  Return 1 if there was one, and 0 otherwise. */
+static int
+circid_map_remove(or_connection_t *conn, circid_t circ_id)
+{
+  circid_map_t *map = conn->circid_map;
+  circid_map_ent_t *ent = circid_map_find(map, circ_id);
+  unsigned mask, hole, i, home;
+  if (!ent)
+    return 0;
+
+  /* Linear probing has no tombstones: instead, move back any later entry in
+   * this run whose probe sequence passes through the slot we just emptied,
+   * so that lookups for it still find it. */
+  mask = (1u << map->bits) - 1;
+  hole = i = (unsigned)(ent - map->ents);
+  for (;;) {
+    i = (i+1) & mask;
+    if (!map->ents[i].circuit)
+      break;
+    home = circid_map_home(map, map->ents[i].circ_id);
+    /* Leave the entry alone if its home slot is cyclically in (hole, i]. */
+    if (hole <= i ? (hole < home && home <= i) : (hole < home || home <= i))
+      continue;
+    map->ents[hole] = map->ents[i];
+    hole = i;
+  }
+  map->ents[hole].circuit = NULL;
+
+  if (--map->n_entries == 0)
+    tor_free(conn->circid_map);
+  else if (map->bits > CIRCID_MAP_MIN_BITS &&
+           map->n_entries*8 < (1<<map->bits))
+    conn->circid_map = circid_map_resize(map, map->bits-1);
+  return 1;
+}
+
+/** Return a pointer to the field of <b>circ</b> that holds the next circuit
+ * on the list of circuits attached to its connection in direction
+ * <b>direction</b>. */
+static INLINE circuit_t **
+next_circ_on_orconn_p(circuit_t *circ, int direction)
+{
+  if (direction == CELL_DIRECTION_OUT)
+    return &circ->next_on_n_conn;
+  else
+    return &TO_OR_CIRCUIT(circ)->next_on_p_conn;
+}
+
+/** As next_circ_on_orconn_p, but for the previous circuit on the list. */
+static INLINE circuit_t **
+prev_circ_on_orconn_p(circuit_t *circ, int direction)
+{
+  if (direction == CELL_DIRECTION_OUT)
+    return &circ->prev_on_n_conn;
+  else
+    return &TO_OR_CIRCUIT(circ)->prev_on_p_conn;
+}
+
+/** Return a pointer to the head of the list of circuits that use
+ * <b>conn</b> in direction <b>direction</b>. */
+static INLINE circuit_t **
+orconn_circuit_list_p(or_connection_t *conn, int direction)
+{
+  if (direction == CELL_DIRECTION_OUT)
+    return &conn->n_conn_circuits;
+  else
+    return &conn->p_conn_circuits;
+}
+
+/** Return true iff <b>circ</b> is on the list of circuits that use
+ * <b>conn</b> in direction <b>direction</b>.  (Callers sometimes set
+ * circ-\>n_conn before they add the circuit to the conn-circid map.) */
 static INLINE int
-_orconn_circid_entries_eq(orconn_circid_circuit_map_t *a,
-                          orconn_circid_circuit_map_t *b)
+orconn_circuit_list_contains(or_connection_t *conn, circuit_t *circ,
+                             int direction)
 {
-  return a->or_conn == b->or_conn && a->circ_id == b->circ_id;
+  return *prev_circ_on_orconn_p(circ, direction) != NULL ||
+    *orconn_circuit_list_p(conn, direction) == circ;
 }
 
-/** Helper: return a hash based on circuit ID and the pointer value of
- * or_conn in <b>a</b>. */
-static INLINE unsigned int
-_orconn_circid_entry_hash(orconn_circid_circuit_map_t *a)
+/** Add <b>circ</b> to the list of circuits that use <b>conn</b> in
+ * direction <b>direction</b>, if it isn't there already. */
+static void
+orconn_circuit_list_add(or_connection_t *conn, circuit_t *circ,
+                        int direction)
 {
-  return (((unsigned)a->circ_id)<<8) ^ (unsigned)(uintptr_t)(a->or_conn);
+  circuit_t **headp = orconn_circuit_list_p(conn, direction);
+  if (orconn_circuit_list_contains(conn, circ, direction))
+    return;
+  *next_circ_on_orconn_p(circ, direction) = *headp;
+  *prev_circ_on_orconn_p(circ, direction) = NULL;
+  if (*headp)
+    *prev_circ_on_orconn_p(*headp, direction) = circ;
+  *headp = circ;
 }
 
-/** Map from [orconn,circid] to circuit. */
-static HT_HEAD(orconn_circid_map, orconn_circid_circuit_map_t)
-     orconn_circid_circuit_map = HT_INITIALIZER();
-HT_PROTOTYPE(orconn_circid_map, orconn_circid_circuit_map_t, node,
-             _orconn_circid_entry_hash, _orconn_circid_entries_eq)
-HT_GENERATE(orconn_circid_map, orconn_circid_circuit_map_t, node,
-            _orconn_circid_entry_hash, _orconn_circid_entries_eq, 0.6,
-            malloc, realloc, free)
-
-/** The most recently returned entry from circuit_get_by_circid_orconn;
- * used to improve performance when many cells arrive in a row from the
- * same circuit.
- */
-orconn_circid_circuit_map_t *_last_circid_orconn_ent = NULL;
+/** Remove <b>circ</b> from the list of circuits that use <b>conn</b> in
+ * direction <b>direction</b>, if it's there. */
+static void
+orconn_circuit_list_remove(or_connection_t *conn, circuit_t *circ,
+                           int direction)
+{
+  circuit_t **nextp = next_circ_on_orconn_p(circ, direction);
+  circuit_t **prevp = prev_circ_on_orconn_p(circ, direction);
+  if (!orconn_circuit_list_contains(conn, circ, direction))
+    return;
+  if (*prevp)
+    *next_circ_on_orconn_p(*prevp, direction) = *nextp;
+  else
+    *orconn_circuit_list_p(conn, direction) = *nextp;
+  if (*nextp)
+    *prev_circ_on_orconn_p(*nextp, direction) = *prevp;
+  *nextp = *prevp = NULL;
+}
 
 /** Implementation helper for circuit_set_{p,n}_circid_orconn: A circuit ID
  * and/or or_connection for circ has just changed from <b>old_conn, old_id</b>
@@ -80,8 +265,6 @@ circuit_set_circid_orconn_helper(circuit_t *circ, int direction,
                                  circid_t id,
                                  or_connection_t *conn)
 {
-  orconn_circid_circuit_map_t search;
-  orconn_circid_circuit_map_t *found;
   or_connection_t *old_conn, **conn_ptr;
   circid_t old_id, *circid_ptr;
   int was_active, make_active;
@@ -104,25 +287,15 @@ circuit_set_circid_orconn_helper(circuit_t *circ, int direction,
   if (id == old_id && conn == old_conn)
     return;
 
-  if (_last_circid_orconn_ent &&
-      ((old_id == _last_circid_orconn_ent->circ_id &&
-        old_conn == _last_circid_orconn_ent->or_conn) ||
-       (id == _last_circid_orconn_ent->circ_id &&
-        conn == _last_circid_orconn_ent->or_conn))) {
-    _last_circid_orconn_ent = NULL;
-  }
-
   if (old_conn) { /* we may need to remove it from the conn-circid map */
     tor_assert(old_conn->_base.magic == OR_CONNECTION_MAGIC);
-    search.circ_id = old_id;
-    search.or_conn = old_conn;
-    found = HT_REMOVE(orconn_circid_map, &orconn_circid_circuit_map, &search);
-    if (found) {
-      tor_free(found);
-      --old_conn->n_circuits;
+    if (circid_map_remove(old_conn, old_id)) {
+      if (--old_conn->n_circuits == 0 && old_conn->is_bad_for_new_circs)
+        connection_schedule_housekeeping(TO_CONN(old_conn), approx_time());
     }
     if (was_active && old_conn != conn)
       make_circuit_inactive_on_conn(circ,old_conn);
+    orconn_circuit_list_remove(old_conn, circ, direction);
   }
 
   /* Change the values only after we have possibly made the circuit inactive
@@ -134,21 +307,12 @@ circuit_set_circid_orconn_helper(circuit_t *circ, int direction,
     return;
 
   /* now add the new one to the conn-circid map */
-  search.circ_id = id;
-  search.or_conn = conn;
-  found = HT_FIND(orconn_circid_map, &orconn_circid_circuit_map, &search);
-  if (found) {
-    found->circuit = circ;
-  } else {
-    found = tor_malloc_zero(sizeof(orconn_circid_circuit_map_t));
-    found->circ_id = id;
-    found->or_conn = conn;
-    found->circuit = circ;
-    HT_INSERT(orconn_circid_map, &orconn_circid_circuit_map, found);
-  }
+  circid_map_set(conn, id, circ);
   if (make_active && old_conn != conn)
     make_circuit_active_on_conn(circ,conn);
 
+  orconn_circuit_list_add(conn, circ, direction);
+
   ++conn->n_circuits;
 }
 
@@ -179,6 +343,22 @@ circuit_set_n_circid_orconn(circuit_t *circ, circid_t id,
     tor_assert(bool_eq(circ->n_conn_cells.n, circ->next_active_on_n_conn));
 }
 
+/** Set the n_conn field of a circuit <b>circ</b> to <b>conn</b>, before we
+ * have picked a circuit ID for it there, and put <b>circ</b> on
+ * <b>conn</b>'s list of circuits, so that circuit_unlink_all_from_or_conn()
+ * still finds it if <b>conn</b> closes before we send the create cell. */
+void
+circuit_set_n_conn(circuit_t *circ, or_connection_t *conn)
+{
+  if (circ->n_circ_id)
+    circuit_set_n_circid_orconn(circ, 0, NULL);
+  else if (circ->n_conn)
+    orconn_circuit_list_remove(circ->n_conn, circ, CELL_DIRECTION_OUT);
+  circ->n_conn = conn;
+  if (conn)
+    orconn_circuit_list_add(conn, circ, CELL_DIRECTION_OUT);
+}
+
 /** Change the state of <b>circ</b> to <b>state</b>, adding it to or removing
  * it from lists as appropriate. */
 void
@@ -208,15 +388,30 @@ circuit_set_state(circuit_t *circ, uint8_t state)
 static void
 circuit_add(circuit_t *circ)
 {
+  circ->prev = NULL;
   if (!global_circuitlist) { /* first one */
     global_circuitlist = circ;
     circ->next = NULL;
   } else {
     circ->next = global_circuitlist;
+    global_circuitlist->prev = circ;
     global_circuitlist = circ;
   }
 }
 
+/** Remove <b>circ</b> from the global list of circuits. */
+static void
+circuit_remove(circuit_t *circ)
+{
+  if (circ->prev)
+    circ->prev->next = circ->next;
+  else
+    global_circuitlist = circ->next;
+  if (circ->next)
+    circ->next->prev = circ->prev;
+  circ->next = circ->prev = NULL;
+}
+
 /** Append to <b>out</b> all circuits in state OR_WAIT waiting for
  * the given connection. */
 void
@@ -264,32 +459,42 @@ circuit_count_pending_on_or_conn(or_connection_t *or_conn)
   return cnt;
 }
 
-/** Detach from the global circuit list, and deallocate, all
- * circuits that have been marked for close.
+/** Detach from the global circuit list, and deallocate, up to <b>max</b>
+ * circuits that have been marked for close.  Return the number of marked
+ * circuits that are left, not counting any that we can't free yet because
+ * the relay crypto threads still have cells for them.
  */
-void
-circuit_close_all_marked(void)
+int
+circuit_close_marked(int max)
 {
-  circuit_t *tmp,*m;
-
-  while (global_circuitlist && global_circuitlist->marked_for_close) {
-    tmp = global_circuitlist->next;
-    circuit_free(global_circuitlist);
-    global_circuitlist = tmp;
-  }
-
-  tmp = global_circuitlist;
-  while (tmp && tmp->next) {
-    if (tmp->next->marked_for_close) {
-      m = tmp->next->next;
-      circuit_free(tmp->next);
-      tmp->next = m;
-      /* Need to check new tmp->next; don't advance tmp. */
-    } else {
-      /* Advance tmp. */
-      tmp = tmp->next;
+  int n = 0, n_left;
+  smartlist_t *busy = NULL;
+  if (!circuits_pending_close)
+    return 0;
+  while (n < max && smartlist_len(circuits_pending_close)) {
+    /* Take circuits from the end of the list, so we don't have to shift the
+     * rest of the list down each time. */
+    circuit_t *circ = smartlist_pop_last(circuits_pending_close);
+    tor_assert(circ->marked_for_close);
+    if (! CIRCUIT_IS_ORIGIN(circ) &&
+        TO_OR_CIRCUIT(circ)->relaycrypt_n_pending) {
+      /* A relay crypto thread is still working on cells for this circuit;
+       * we'll free it on some later pass, once they're back. */
+      if (!busy)
+        busy = smartlist_create();
+      smartlist_add(busy, circ);
+      continue;
     }
+    circuit_remove(circ);
+    circuit_free(circ);
+    ++n;
   }
+  n_left = smartlist_len(circuits_pending_close);
+  if (busy) {
+    smartlist_add_all(circuits_pending_close, busy);
+    smartlist_free(busy);
+  }
+  return n_left;
 }
 
 /** Return the head of the global linked list of circuits. */
@@ -385,6 +590,12 @@ init_circuit_base(circuit_t *circ)
   circ->package_window = circuit_initial_package_window();
   circ->deliver_window = CIRCWINDOW_START;
 
+  /* Initialize the cell_ewma_t structure */
+  circ->n_cell_ewma.last_adjusted_tick = cell_ewma_get_tick();
+  circ->n_cell_ewma.cell_count = 0.0;
+  circ->n_cell_ewma.heap_index = -1;
+  circ->n_cell_ewma.is_for_p_conn = 0;
+
   circuit_add(circ);
 }
 
@@ -432,6 +643,16 @@ or_circuit_new(circid_t p_circ_id, or_connection_t *p_conn)
 
   init_circuit_base(TO_CIRCUIT(circ));
 
+  /* Initialize the cell_ewma_t structure */
+
+  /* Initialize the cell counts to 0 */
+  circ->p_cell_ewma.cell_count = 0.0;
+  circ->p_cell_ewma.last_adjusted_tick = cell_ewma_get_tick();
+  circ->p_cell_ewma.is_for_p_conn = 1;
+
+  /* It's not in any heap yet. */
+  circ->p_cell_ewma.heap_index = -1;
+
   return circ;
 }
 
@@ -504,10 +725,26 @@ circuit_free(circuit_t *circ)
    * "active" checks will be violated. */
   cell_queue_clear(&circ->n_conn_cells);
 
+  circuit_clear_blocked_streams(circ);
+  relay_forget_circuit_sendmes(circ);
+
   memset(circ, 0xAA, memlen); /* poison memory */
   tor_free(mem);
 }
 
+/** Forget every edge stream that was waiting for <b>circ</b>'s package
+ * window to open up. */
+static void
+circuit_clear_blocked_streams(circuit_t *circ)
+{
+  if (!circ->blocked_streams)
+    return;
+  SMARTLIST_FOREACH(circ->blocked_streams, edge_connection_t *, conn,
+                    conn->edge_blocked_on_circ_window = 0);
+  smartlist_free(circ->blocked_streams);
+  circ->blocked_streams = NULL;
+}
+
 /** Deallocate space associated with the linked list <b>cpath</b>. */
 static void
 circuit_free_cpath(crypt_path_t *cpath)
@@ -551,7 +788,10 @@ circuit_free_all(void)
     smartlist_free(circuits_pending_or_conns);
     circuits_pending_or_conns = NULL;
   }
-  HT_CLEAR(orconn_circid_map, &orconn_circid_circuit_map);
+  if (circuits_pending_close) {
+    smartlist_free(circuits_pending_close);
+    circuits_pending_close = NULL;
+  }
 }
 
 /** Deallocate space associated with the cpath node <b>victim</b>. */
@@ -588,6 +828,17 @@ circuit_dump_details(int severity, circuit_t *circ, int conn_array_index,
       circuit_state_to_string(circ->state), (int)circ->timestamp_created);
   if (CIRCUIT_IS_ORIGIN(circ)) { /* circ starts at this node */
     circuit_log_path(severity, LD_CIRC, TO_ORIGIN_CIRCUIT(circ));
+  } else if (TO_OR_CIRCUIT(circ)->processed_cells) {
+    or_circuit_t *orcirc = TO_OR_CIRCUIT(circ);
+    uint64_t hist[CELL_WAIT_HIST_BUCKETS];
+    char *s;
+    int i;
+    for (i = 0; i < CELL_WAIT_HIST_BUCKETS; ++i)
+      hist[i] = orcirc->cell_wait_hist[i];
+    s = cell_wait_hist_to_string(hist);
+    log(severity, LD_CIRC, "  %lu cells flushed; queue wait: %s",
+        (unsigned long)orcirc->processed_cells, s);
+    tor_free(s);
   }
 }
 
@@ -600,51 +851,66 @@ circuit_dump_by_conn(connection_t *conn, int severity)
   circuit_t *circ;
   edge_connection_t *tmpconn;
 
-  for (circ=global_circuitlist;circ;circ = circ->next) {
-    circid_t n_circ_id = circ->n_circ_id, p_circ_id = 0;
-    if (circ->marked_for_close)
-      continue;
-
-    if (! CIRCUIT_IS_ORIGIN(circ))
-      p_circ_id = TO_OR_CIRCUIT(circ)->p_circ_id;
-
-    if (! CIRCUIT_IS_ORIGIN(circ) && TO_OR_CIRCUIT(circ)->p_conn &&
-        TO_CONN(TO_OR_CIRCUIT(circ)->p_conn) == conn)
+  if (conn->type == CONN_TYPE_OR) {
+    or_connection_t *or_conn = TO_OR_CONN(conn);
+    for (circ = or_conn->p_conn_circuits; circ;
+         circ = TO_OR_CIRCUIT(circ)->next_on_p_conn) {
+      if (circ->marked_for_close)
+        continue;
       circuit_dump_details(severity, circ, conn->conn_array_index, "App-ward",
-                           p_circ_id, n_circ_id);
+                           TO_OR_CIRCUIT(circ)->p_circ_id, circ->n_circ_id);
+    }
+    for (circ = or_conn->n_conn_circuits; circ; circ = circ->next_on_n_conn) {
+      circid_t p_circ_id = 0;
+      if (circ->marked_for_close)
+        continue;
+      if (! CIRCUIT_IS_ORIGIN(circ))
+        p_circ_id = TO_OR_CIRCUIT(circ)->p_circ_id;
+      circuit_dump_details(severity, circ, conn->conn_array_index,
+                           "Exit-ward", circ->n_circ_id, p_circ_id);
+    }
+    if (!circuits_pending_or_conns)
+      return;
+    SMARTLIST_FOREACH_BEGIN(circuits_pending_or_conns, circuit_t *, c) {
+      circid_t p_circ_id = 0;
+      if (c->marked_for_close || c->n_conn || !c->n_hop)
+        continue;
+      if (! CIRCUIT_IS_ORIGIN(c))
+        p_circ_id = TO_OR_CIRCUIT(c)->p_circ_id;
+      if (tor_addr_eq(&c->n_hop->addr, &conn->addr) &&
+          c->n_hop->port == conn->port &&
+          !memcmp(or_conn->identity_digest,
+                  c->n_hop->identity_digest, DIGEST_LEN)) {
+        circuit_dump_details(severity, c, conn->conn_array_index,
+                             (c->state == CIRCUIT_STATE_OPEN &&
+                              !CIRCUIT_IS_ORIGIN(c)) ?
+                               "Endpoint" : "Pending",
+                             c->n_circ_id, p_circ_id);
+      }
+    } SMARTLIST_FOREACH_END(c);
+  } else if (CONN_IS_EDGE(conn)) {
+    circ = TO_EDGE_CONN(conn)->on_circuit;
+    if (!circ || circ->marked_for_close)
+      return;
     if (CIRCUIT_IS_ORIGIN(circ)) {
       for (tmpconn=TO_ORIGIN_CIRCUIT(circ)->p_streams; tmpconn;
            tmpconn=tmpconn->next_stream) {
         if (TO_CONN(tmpconn) == conn) {
           circuit_dump_details(severity, circ, conn->conn_array_index,
-                               "App-ward", p_circ_id, n_circ_id);
+                               "App-ward", 0, circ->n_circ_id);
         }
       }
-    }
-    if (circ->n_conn && TO_CONN(circ->n_conn) == conn)
-      circuit_dump_details(severity, circ, conn->conn_array_index, "Exit-ward",
-                           n_circ_id, p_circ_id);
-    if (! CIRCUIT_IS_ORIGIN(circ)) {
-      for (tmpconn=TO_OR_CIRCUIT(circ)->n_streams; tmpconn;
+    } else {
+      or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+      for (tmpconn=or_circ->n_streams; tmpconn;
            tmpconn=tmpconn->next_stream) {
         if (TO_CONN(tmpconn) == conn) {
           circuit_dump_details(severity, circ, conn->conn_array_index,
-                               "Exit-ward", n_circ_id, p_circ_id);
+                               "Exit-ward", circ->n_circ_id,
+                               or_circ->p_circ_id);
         }
       }
     }
-    if (!circ->n_conn && circ->n_hop &&
-        tor_addr_eq(&circ->n_hop->addr, &conn->addr) &&
-        circ->n_hop->port == conn->port &&
-        conn->type == CONN_TYPE_OR &&
-        !memcmp(TO_OR_CONN(conn)->identity_digest,
-                circ->n_hop->identity_digest, DIGEST_LEN)) {
-      circuit_dump_details(severity, circ, conn->conn_array_index,
-                           (circ->state == CIRCUIT_STATE_OPEN &&
-                            !CIRCUIT_IS_ORIGIN(circ)) ?
-                             "Endpoint" : "Pending",
-                           n_circ_id, p_circ_id);
-    }
   }
 }
 
@@ -674,20 +940,8 @@ circuit_get_by_global_id(uint32_t id)
 static INLINE circuit_t *
 circuit_get_by_circid_orconn_impl(circid_t circ_id, or_connection_t *conn)
 {
-  orconn_circid_circuit_map_t search;
-  orconn_circid_circuit_map_t *found;
-
-  if (_last_circid_orconn_ent &&
-      circ_id == _last_circid_orconn_ent->circ_id &&
-      conn == _last_circid_orconn_ent->or_conn) {
-    found = _last_circid_orconn_ent;
-  } else {
-    search.circ_id = circ_id;
-    search.or_conn = conn;
-    found = HT_FIND(orconn_circid_map, &orconn_circid_circuit_map, &search);
-    _last_circid_orconn_ent = found;
-  }
-  if (found && found->circuit)
+  circid_map_ent_t *found = circid_map_find(conn->circid_map, circ_id);
+  if (found)
     return found->circuit;
 
   return NULL;
@@ -763,20 +1017,18 @@ circuit_unlink_all_from_or_conn(or_connection_t *conn, int reason)
 
   connection_or_unlink_all_active_circs(conn);
 
-  for (circ = global_circuitlist; circ; circ = circ->next) {
-    int mark = 0;
-    if (circ->n_conn == conn) {
-        circuit_set_n_circid_orconn(circ, 0, NULL);
-        mark = 1;
-    }
-    if (! CIRCUIT_IS_ORIGIN(circ)) {
-      or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
-      if (or_circ->p_conn == conn) {
-        circuit_set_p_circid_orconn(or_circ, 0, NULL);
-        mark = 1;
-      }
-    }
-    if (mark && !circ->marked_for_close)
+  /* Unlinking a circuit removes it from conn's lists, so keep taking the
+   * first one until there are none left. */
+  while ((circ = conn->n_conn_circuits)) {
+    circuit_set_n_circid_orconn(circ, 0, NULL);
+    if (! CIRCUIT_IS_ORIGIN(circ) && TO_OR_CIRCUIT(circ)->p_conn == conn)
+      circuit_set_p_circid_orconn(TO_OR_CIRCUIT(circ), 0, NULL);
+    if (!circ->marked_for_close)
+      circuit_mark_for_close(circ, reason);
+  }
+  while ((circ = conn->p_conn_circuits)) {
+    circuit_set_p_circid_orconn(TO_OR_CIRCUIT(circ), 0, NULL);
+    if (!circ->marked_for_close)
       circuit_mark_for_close(circ, reason);
   }
 }
@@ -1007,7 +1259,7 @@ circuit_expire_all_dirty_circs(void)
 }
 
 /** Mark <b>circ</b> to be closed next time we call
- * circuit_close_all_marked(). Do any cleanup needed:
+ * circuit_close_marked(). Do any cleanup needed:
  *   - If state is onionskin_pending, remove circ from the onion_pending
  *     list.
  *   - If circ isn't open yet: call circuit_build_failed() if we're
@@ -1127,9 +1379,15 @@ _circuit_mark_for_close(circuit_t *circ, int reason, int line,
     for (conn=ocirc->p_streams; conn; conn=conn->next_stream)
       connection_edge_destroy(circ->n_circ_id, conn);
   }
+  /* The streams are no longer attached to us, so they can't wait for us
+   * either. */
+  circuit_clear_blocked_streams(circ);
 
   circ->marked_for_close = line;
   circ->marked_for_close_file = file;
+  if (!circuits_pending_close)
+    circuits_pending_close = smartlist_create();
+  smartlist_add(circuits_pending_close, circ);
 
   if (!CIRCUIT_IS_ORIGIN(circ)) {
     or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
@@ -594,6 +594,11 @@ circuit_detach_stream(circuit_t *circ, edge_connection_t *conn)
   tor_assert(circ);
   tor_assert(conn);
 
+  if (conn->edge_blocked_on_circ_window) {
+    if (circ->blocked_streams)
+      smartlist_remove_keeporder(circ->blocked_streams, conn);
+    conn->edge_blocked_on_circ_window = 0;
+  }
   conn->cpath_layer = NULL; /* make sure we don't keep a stale pointer */
   conn->on_circuit = NULL;
 
@@ -841,7 +846,7 @@ circuit_build_failed(origin_circuit_t *circ)
                "Our circuit failed to get a response from the first hop "
                "(%s:%d). I'm going to try to rotate to a better connection.",
                n_conn->_base.address, n_conn->_base.port);
-      n_conn->is_bad_for_new_circs = 1;
+      connection_or_mark_bad_for_new_circs(n_conn);
     } else {
       log_info(LD_OR,
                "Our circuit died before the first hop with no connection");
@@ -166,6 +166,7 @@ static config_var_t _option_vars[] = {
   V(CellStatistics,              BOOL,     "0"),
   V(CircuitBuildTimeout,         INTERVAL, "0"),
   V(CircuitIdleTimeout,          INTERVAL, "1 hour"),
+  V(CircuitPriorityHalflife,     DOUBLE,   "-100.0"),
   V(ClientDNSRejectInternalAddresses, BOOL,"1"),
   V(ClientOnly,                  BOOL,     "0"),
   V(ConsensusParams,             STRING,   NULL),
@@ -188,6 +189,7 @@ static config_var_t _option_vars[] = {
   V(DirPolicy,                   LINELIST, NULL),
   V(DirPort,                     UINT,     "0"),
   V(DirPortFrontPage,            FILENAME, NULL),
+  V(DirPrecompressDescriptors,   BOOL,     "0"),
   OBSOLETE("DirPostPeriod"),
   OBSOLETE("DirRecordUsageByCountry"),
   OBSOLETE("DirRecordUsageGranularity"),
@@ -271,7 +273,7 @@ static config_var_t _option_vars[] = {
   V(Nickname,                    STRING,   NULL),
   V(NoPublish,                   BOOL,     "0"),
   VAR("NodeFamily",              LINELIST, NodeFamilies,         NULL),
-  V(NumCpus,                     UINT,     "1"),
+  V(NumCpus,                     UINT,     "0"),
   V(NumEntryGuards,              UINT,     "3"),
   V(ORListenAddress,             LINELIST, NULL),
   V(ORPort,                      UINT,     "0"),
@@ -293,6 +295,7 @@ static config_var_t _option_vars[] = {
   V(RejectPlaintextPorts,        CSV,      ""),
   V(RelayBandwidthBurst,         MEMUNIT,  "0"),
   V(RelayBandwidthRate,          MEMUNIT,  "0"),
+  V(RelayCryptoThreads,          UINT,     "0"),
   OBSOLETE("RendExcludeNodes"),
   OBSOLETE("RendNodes"),
   V(RendPostPeriod,              INTERVAL, "1 hour"),
@@ -311,6 +314,7 @@ static config_var_t _option_vars[] = {
   V(ServerDNSTestAddresses,      CSV,
       "www.google.com,www.mit.edu,www.yahoo.com,www.slashdot.org"),
   V(ShutdownWaitLength,          INTERVAL, "30 seconds"),
+  V(SignatureCheckThreads,       UINT,     "0"),
   V(SocksListenAddress,          LINELIST, NULL),
   V(SocksPolicy,                 LINELIST, NULL),
   V(SocksPort,                   UINT,     "9050"),
@@ -321,6 +325,7 @@ static config_var_t _option_vars[] = {
   OBSOLETE("SysLog"),
   V(TestSocks,                   BOOL,     "0"),
   OBSOLETE("TestVia"),
+  V(TokenBucketRefillInterval,   UINT,     "100"),
   V(TrackHostExits,              CSV,      NULL),
   V(TrackHostExitsExpire,        INTERVAL, "30 minutes"),
   OBSOLETE("TrafficShaping"),
@@ -571,7 +576,8 @@ static config_var_description_t options_description[] = {
     "family in the same circuit." },
   { "Nickname", "Set the server nickname." },
   { "NoPublish", "{DEPRECATED}" },
-  { "NumCPUs", "How many processes to use at once for public-key crypto." },
+  { "NumCPUs", "How many threads or processes to use at once for public-key "
+    "crypto.  0 means one per CPU." },
   { "ORPort", "Advertise this port to listen for connections from Tor clients "
     "and servers." },
   { "ORListenAddress", "Bind to this address to listen for connections from "
@@ -1449,6 +1455,10 @@ options_act(or_options_t *old_options)
       (!routerset_equal(old_options->EntryNodes,options->EntryNodes))))
     entry_nodes_should_be_added();
 
+  /* Pick the circuit scheduling algorithm based on CircuitPriorityHalflife
+   * and the current consensus. */
+  cell_ewma_set_scale_factor(options, networkstatus_get_latest_consensus());
+
   /* Since our options changed, we might need to regenerate and upload our
    * server descriptor.
    */
@@ -3379,6 +3389,23 @@ options_validate(or_options_t *old_options, or_options_t *options,
   if (options->KeepalivePeriod < 1)
     REJECT("KeepalivePeriod option must be positive.");
 
+#ifndef TOR_IS_MULTITHREADED
+  if (options->RelayCryptoThreads)
+    REJECT("RelayCryptoThreads is not supported on this platform.");
+#endif
+  if (options->RelayCryptoThreads > MAX_RELAYCRYPT_THREADS)
+    REJECT("RelayCryptoThreads must be at most 16.");
+#ifndef TOR_IS_MULTITHREADED
+  if (options->SignatureCheckThreads)
+    REJECT("SignatureCheckThreads is not supported on this platform.");
+#endif
+  if (options->SignatureCheckThreads > MAX_SIGCHECK_THREADS)
+    REJECT("SignatureCheckThreads must be at most 16.");
+
+  if (options->TokenBucketRefillInterval < 1 ||
+      options->TokenBucketRefillInterval > 1000)
+    REJECT("TokenBucketRefillInterval must be between 1 and 1000 msec.");
+
   if (ensure_bandwidth_cap(&options->BandwidthRate,
                            "BandwidthRate", msg) < 0)
     return -1;
@@ -3822,6 +3849,18 @@ options_transition_allowed(or_options_t *old, or_options_t *new_val,
     return -1;
   }
 
+  if (old->RelayCryptoThreads != new_val->RelayCryptoThreads) {
+    *msg = tor_strdup("While Tor is running, changing RelayCryptoThreads "
+                      "is not allowed.");
+    return -1;
+  }
+
+  if (old->SignatureCheckThreads != new_val->SignatureCheckThreads) {
+    *msg = tor_strdup("While Tor is running, changing "
+                      "SignatureCheckThreads is not allowed.");
+    return -1;
+  }
+
   if (old->CellStatistics != new_val->CellStatistics ||
       old->DirReqStatistics != new_val->DirReqStatistics ||
       old->EntryStatistics != new_val->EntryStatistics ||
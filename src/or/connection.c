@@ -11,6 +11,7 @@
  **/
 
 #include "or.h"
+#include "timers.h"
 
 static connection_t *connection_create_listener(
                                struct sockaddr *listensockaddr,
@@ -180,6 +181,10 @@ or_connection_new(int socket_family)
   or_conn->timestamp_last_added_nonpadding = time(NULL);
   or_conn->next_circ_id = crypto_rand_int(1<<15);
 
+  or_conn->active_circuit_pqueue = smartlist_create();
+  or_conn->active_circuit_pqueue_last_recalibrated = cell_ewma_get_tick();
+  or_conn->sched_heap_idx = -1;
+
   return or_conn;
 }
 
@@ -349,8 +354,8 @@ _connection_free(connection_t *conn)
   }
 
   if (!connection_is_listener(conn)) {
-    buf_free(conn->inbuf);
-    buf_free(conn->outbuf);
+    buf_free_later(conn->inbuf);
+    buf_free_later(conn->outbuf);
   } else {
     if (conn->socket_family == AF_UNIX) {
       /* For now only control ports can be Unix domain sockets
@@ -365,6 +370,7 @@ _connection_free(connection_t *conn)
   }
 
   tor_free(conn->address);
+  wheel_timer_free(conn->housekeeping_timer);
 
   if (connection_speaks_cells(conn)) {
     or_connection_t *or_conn = TO_OR_CONN(conn);
@@ -377,6 +383,10 @@ _connection_free(connection_t *conn)
       or_conn->handshake_state = NULL;
     }
     tor_free(or_conn->nickname);
+    scheduler_forget_conn(or_conn);
+    smartlist_free(or_conn->active_circuit_pqueue);
+    connection_or_free_cell_magazine(or_conn);
+    tor_free(or_conn->circid_map);
   }
   if (CONN_IS_EDGE(conn)) {
     edge_connection_t *edge_conn = TO_EDGE_CONN(conn);
@@ -387,6 +397,7 @@ _connection_free(connection_t *conn)
     }
     if (edge_conn->rend_data)
       rend_data_free(edge_conn->rend_data);
+    relay_forget_edge_sendmes(edge_conn);
   }
   if (conn->type == CONN_TYPE_CONTROL) {
     control_connection_t *control_conn = TO_CONTROL_CONN(conn);
@@ -1873,10 +1884,10 @@ connection_is_rate_limited(connection_t *conn)
 extern int global_read_bucket, global_write_bucket;
 extern int global_relayed_read_bucket, global_relayed_write_bucket;
 
-/** Did either global write bucket run dry last second? If so,
- * we are likely to run dry again this second, so be stingy with the
- * tokens we just put in. */
-static int write_buckets_empty_last_second = 0;
+/** When did we last refill the buckets and find either global write bucket
+ * dry?  If that was within the last second or so, we are likely to run dry
+ * again soon, so be stingy with the tokens we just put in. */
+static time_t write_buckets_last_empty_at = -100;
 
 /** How many seconds of no active local circuits will make the
  * connection revert to the "relayed" bandwidth class? */
@@ -2016,7 +2027,7 @@ global_write_bucket_low(connection_t *conn, size_t attempt, int priority)
   if (smaller_bucket < (int)attempt)
     return 1; /* not enough space no matter the priority */
 
-  if (write_buckets_empty_last_second)
+  if (approx_time() - write_buckets_last_empty_at < 2)
     return 1; /* we're already hitting our limits, no more please */
 
   if (priority == 1) { /* old-style v1 query */
@@ -2140,41 +2151,58 @@ connection_bucket_init(void)
   }
 }
 
+/** How many milliseconds' worth of tokens have we added to the buckets
+ * since we started?  See connection_bucket_refill(). */
+static uint64_t bucket_refill_msec = 0;
+
+/** Return the number of tokens that a bucket with rate <b>rate</b> per
+ * second has earned by <b>msec</b> milliseconds after we started, rounded
+ * down, modulo the tokens earned in whole seconds. */
+static INLINE int64_t
+bucket_tokens_earned_in_second(int rate, uint64_t msec)
+{
+  return ((int64_t)rate * (int64_t)(msec % 1000)) / 1000;
+}
+
 /** Refill a single <b>bucket</b> called <b>name</b> with bandwidth rate
- * <b>rate</b> and bandwidth burst <b>burst</b>, assuming that
- * <b>seconds_elapsed</b> seconds have passed since the last call.
+ * <b>rate</b> and bandwidth burst <b>burst</b>, for the time from
+ * <b>old_msec</b> to <b>new_msec</b> milliseconds after we started.
+ *
+ * We refill many times a second, so rounding rate*elapsed/1000 down on
+ * every refill would lose a noticeable part of the rate.  Instead, we add
+ * the difference between the tokens earned by <b>new_msec</b> and by
+ * <b>old_msec</b>, each rounded down: that's as exact as keeping the bucket
+ * in fixed point, without changing the type of every bucket.
  **/
 static void
 connection_bucket_refill_helper(int *bucket, int rate, int burst,
-                                int seconds_elapsed, const char *name)
+                                uint64_t old_msec, uint64_t new_msec,
+                                const char *name)
 {
   int starting_bucket = *bucket;
-  if (starting_bucket < burst && seconds_elapsed) {
-    if (((burst - starting_bucket)/seconds_elapsed) < rate) {
+  if (starting_bucket < burst && new_msec > old_msec) {
+    int64_t incr = (int64_t)rate * (int64_t)(new_msec/1000 - old_msec/1000)
+      + bucket_tokens_earned_in_second(rate, new_msec)
+      - bucket_tokens_earned_in_second(rate, old_msec);
+    if (incr >= (int64_t)burst - starting_bucket) {
       *bucket = burst;  /* We would overflow the bucket; just set it to
                          * the maximum. */
     } else {
-      int incr = rate*seconds_elapsed;
-      *bucket += incr;
-      if (*bucket > burst || *bucket < starting_bucket) {
-        /* If we overflow the burst, or underflow our starting bucket,
-         * cap the bucket value to burst. */
-        /* XXXX this might be redundant now, but it doesn't show up
-         * in profiles.  Remove it after analysis. */
-        *bucket = burst;
-      }
+      *bucket += (int)incr;
     }
     log(LOG_DEBUG, LD_NET,"%s now %d.", name, *bucket);
   }
 }
 
-/** A second has rolled over; increment buckets appropriately. */
+/** <b>milliseconds_elapsed</b> msec have passed since we last refilled the
+ * buckets; increment them appropriately. */
 void
-connection_bucket_refill(int seconds_elapsed, time_t now)
+connection_bucket_refill(int milliseconds_elapsed, time_t now)
 {
   or_options_t *options = get_options();
   smartlist_t *conns = get_connection_array();
   int relayrate, relayburst;
+  uint64_t old_msec = bucket_refill_msec, new_msec;
 
   if (options->RelayBandwidthRate) {
     relayrate = (int)options->RelayBandwidthRate;
@@ -2184,25 +2212,26 @@ connection_bucket_refill(int seconds_elapsed, time_t now)
     relayburst = (int)options->BandwidthBurst;
   }
 
-  tor_assert(seconds_elapsed >= 0);
+  tor_assert(milliseconds_elapsed >= 0);
+  new_msec = bucket_refill_msec += milliseconds_elapsed;
 
-  write_buckets_empty_last_second =
-    global_relayed_write_bucket <= 0 || global_write_bucket <= 0;
+  if (global_relayed_write_bucket <= 0 || global_write_bucket <= 0)
+    write_buckets_last_empty_at = now;
 
   /* refill the global buckets */
   connection_bucket_refill_helper(&global_read_bucket,
                                   (int)options->BandwidthRate,
                                   (int)options->BandwidthBurst,
-                                  seconds_elapsed, "global_read_bucket");
+                                  old_msec, new_msec, "global_read_bucket");
   connection_bucket_refill_helper(&global_write_bucket,
                                   (int)options->BandwidthRate,
                                   (int)options->BandwidthBurst,
-                                  seconds_elapsed, "global_write_bucket");
+                                  old_msec, new_msec, "global_write_bucket");
   connection_bucket_refill_helper(&global_relayed_read_bucket,
-                                  relayrate, relayburst, seconds_elapsed,
+                                  relayrate, relayburst, old_msec, new_msec,
                                   "global_relayed_read_bucket");
   connection_bucket_refill_helper(&global_relayed_write_bucket,
-                                  relayrate, relayburst, seconds_elapsed,
+                                  relayrate, relayburst, old_msec, new_msec,
                                   "global_relayed_write_bucket");
 
   /* refill the per-connection buckets */
@@ -2214,7 +2243,7 @@ connection_bucket_refill(int seconds_elapsed, time_t now)
         connection_bucket_refill_helper(&or_conn->read_bucket,
                                         or_conn->bandwidthrate,
                                         or_conn->bandwidthburst,
-                                        seconds_elapsed,
+                                        old_msec, new_msec,
                                         "or_conn->read_bucket");
         //log_fn(LOG_DEBUG,"Receiver bucket %d now %d.", i,
         //       conn->read_bucket);
@@ -2653,11 +2682,14 @@ connection_handle_write(connection_t *conn, int force)
     result = flush_buf_tls(or_conn->tls, conn->outbuf,
                            max_to_write, &conn->outbuf_flushlen);
 
-    /* If we just flushed the last bytes, check if this tunneled dir
-     * request is done. */
-    if (buf_datalen(conn->outbuf) == 0 && conn->dirreq_id)
-      geoip_change_dirreq_state(conn->dirreq_id, DIRREQ_TUNNELED,
-                                DIRREQ_OR_CONN_BUFFER_FLUSHED);
+    /* If we just flushed the last bytes, note it, and check if this
+     * tunneled dir request is done. */
+    if (buf_datalen(conn->outbuf) == 0) {
+      or_conn->timestamp_lastempty = now;
+      if (conn->dirreq_id)
+        geoip_change_dirreq_state(conn->dirreq_id, DIRREQ_TUNNELED,
+                                  DIRREQ_OR_CONN_BUFFER_FLUSHED);
+    }
 
     switch (result) {
       CASE_TOR_TLS_ERROR_ANY:
@@ -141,7 +141,7 @@ cell_pack(packed_cell_t *dst, const cell_t *src)
 /** Unpack the network-order buffer <b>src</b> into a host-order
  * cell_t structure <b>dest</b>.
  */
-static void
+void
 cell_unpack(cell_t *dest, const char *src)
 {
   dest->circ_id = ntohs(*(uint16_t*)(src));
@@ -229,25 +229,50 @@ connection_or_process_inbuf(or_connection_t *conn)
  * drops below this size. */
 #define OR_CONN_LOWWATER (16*1024)
 
-/** Called whenever we have flushed some data on an or_conn: add more data
- * from active circuits. */
+/** Called whenever we have flushed some data on an or_conn: if we're under
+ * the low water mark, ask the cell scheduler to add more data from active
+ * circuits. */
 int
 connection_or_flushed_some(or_connection_t *conn)
+{
+  if (conn->active_circuits &&
+      buf_datalen(conn->_base.outbuf) < OR_CONN_LOWWATER)
+    scheduler_conn_wants_to_write(conn);
+  return 0;
+}
+
+/** Return the number of cells that the cell scheduler should add to
+ * <b>conn</b>'s outbuf right now, at time <b>now</b>.  We fill the outbuf
+ * until it's just over the high water mark; but if we can tell how much
+ * room the kernel has in the socket's send buffer, we don't add more than
+ * that, since any extra cells would only wait on the outbuf, where we can
+ * no longer choose which circuit goes next. */
+int
+connection_or_get_cell_allowance(or_connection_t *conn, time_t now)
 {
   size_t datalen = buf_datalen(conn->_base.outbuf);
-  /* If we're under the low water mark, add cells until we're just over the
-   * high water mark. */
-  if (datalen < OR_CONN_LOWWATER) {
-    ssize_t n = (OR_CONN_HIGHWATER - datalen + CELL_NETWORK_SIZE-1)
-      / CELL_NETWORK_SIZE;
-    time_t now = approx_time();
-    while (conn->active_circuits && n > 0) {
-      int flushed;
-      flushed = connection_or_flush_from_first_active_circuit(conn, 1, now);
-      n -= flushed;
+  size_t limit = OR_CONN_HIGHWATER;
+  size_t space;
+
+  if (conn->_base.s >= 0) {
+    /* The kernel grows the send buffer as the connection speeds up, but
+     * there's no need to ask about it more than once a second. */
+    if (conn->sched_sndbuf_checked != now) {
+      if (tor_socket_get_send_buffer_size(conn->_base.s,
+                                          &conn->sched_sndbuf) < 0)
+        conn->sched_sndbuf = 0;
+      conn->sched_sndbuf_checked = now;
     }
+    if (conn->sched_sndbuf &&
+        tor_socket_get_send_space(conn->_base.s, conn->sched_sndbuf,
+                                  &space) == 0 &&
+        space < limit)
+      limit = space;
   }
-  return 0;
+
+  if (datalen >= limit)
+    return 0;
+  return (int)((limit - datalen + CELL_NETWORK_SIZE-1) / CELL_NETWORK_SIZE);
 }
 
 /** Connection <b>conn</b> has finished writing and has no bytes left on
@@ -550,7 +575,7 @@ connection_or_group_set_badness(or_connection_t *head)
                "(fd %d, %d secs old).",
                or_conn->_base.address, or_conn->_base.port, or_conn->_base.s,
                (int)(now - or_conn->_base.timestamp_created));
-      or_conn->is_bad_for_new_circs = 1;
+      connection_or_mark_bad_for_new_circs(or_conn);
     }
 
     if (or_conn->is_bad_for_new_circs) {
@@ -582,7 +607,7 @@ connection_or_group_set_badness(or_connection_t *head)
                "another connection to that OR that is.",
                or_conn->_base.address, or_conn->_base.port, or_conn->_base.s,
                (int)(now - or_conn->_base.timestamp_created));
-      or_conn->is_bad_for_new_circs = 1;
+      connection_or_mark_bad_for_new_circs(or_conn);
       continue;
     }
 
@@ -623,7 +648,7 @@ connection_or_group_set_badness(or_connection_t *head)
                  or_conn->_base.address, or_conn->_base.port, or_conn->_base.s,
                  (int)(now - or_conn->_base.timestamp_created),
                  best->_base.s, (int)(now - best->_base.timestamp_created));
-        or_conn->is_bad_for_new_circs = 1;
+        connection_or_mark_bad_for_new_circs(or_conn);
       } else if (!tor_addr_compare(&or_conn->real_addr,
                                    &best->real_addr, CMP_EXACT)) {
         log_info(LD_OR,
@@ -633,12 +658,23 @@ connection_or_group_set_badness(or_connection_t *head)
                  or_conn->_base.address, or_conn->_base.port, or_conn->_base.s,
                  (int)(now - or_conn->_base.timestamp_created),
                  best->_base.s, (int)(now - best->_base.timestamp_created));
-        or_conn->is_bad_for_new_circs = 1;
+        connection_or_mark_bad_for_new_circs(or_conn);
       }
     }
   }
 }
 
+/** Note that <b>or_conn</b> should get no new circuits.  If it has no
+ * circuits either, make sure we close it the next time we do housekeeping
+ * for connections. */
+void
+connection_or_mark_bad_for_new_circs(or_connection_t *or_conn)
+{
+  or_conn->is_bad_for_new_circs = 1;
+  if (!or_conn->n_circuits)
+    connection_schedule_housekeeping(TO_CONN(or_conn), approx_time());
+}
+
 /** Go through all the OR connections, and set the is_bad_for_new_circs
  * flag on:
  *    - all connections that are too old.
@@ -1171,10 +1207,16 @@ connection_fetch_var_cell_from_buf(or_connection_t *conn, var_cell_t **out)
   return fetch_var_cell_from_buf(conn->_base.inbuf, out, conn->link_proto);
 }
 
+/** How many fixed-length cells do we pull off an OR connection's inbuf in a
+ * single batch? */
+#define OR_CELL_BATCH_SIZE 16
+
 /** Process cells from <b>conn</b>'s inbuf.
  *
- * Loop: while inbuf contains a cell, pull it off the inbuf, unpack it,
- * and hand it to command_process_cell().
+ * Loop: while inbuf contains cells, pull as many as we can (up to
+ * OR_CELL_BATCH_SIZE) off the inbuf at once, unpacking them straight out of
+ * the buffer's chunks, and hand each to command_process_cell().  Once the
+ * inbuf is empty, send whatever sendmes the delivered data cells call for.
  *
  * Always return 0.
  */
@@ -1190,27 +1232,29 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
               tor_tls_get_pending_bytes(conn->tls));
     if (connection_fetch_var_cell_from_buf(conn, &var_cell)) {
       if (!var_cell)
-        return 0; /* not yet. */
+        break; /* not yet. */
       circuit_build_times_network_is_live(&circ_times);
       command_process_var_cell(var_cell, conn);
       var_cell_free(var_cell);
     } else {
-      char buf[CELL_NETWORK_SIZE];
-      cell_t cell;
-      if (buf_datalen(conn->_base.inbuf) < CELL_NETWORK_SIZE) /* whole response
-                                                                 available? */
-        return 0; /* not yet */
+      cell_t cells[OR_CELL_BATCH_SIZE];
+      int i, n_cells;
 
-      circuit_build_times_network_is_live(&circ_times);
-      connection_fetch_from_buf(buf, CELL_NETWORK_SIZE, TO_CONN(conn));
-
-      /* retrieve cell info from buf (create the host-order struct from the
-       * network-order string) */
-      cell_unpack(&cell, buf);
+      n_cells = fetch_cells_from_buf(conn->_base.inbuf, cells,
+                                     OR_CELL_BATCH_SIZE, conn->link_proto);
+      if (!n_cells)
+        break; /* not yet */
 
-      command_process_cell(&cell, conn);
+      circuit_build_times_network_is_live(&circ_times);
+      for (i = 0; i < n_cells; ++i)
+        command_process_cell(&cells[i], conn);
     }
   }
+
+  /* Now that we've handled everything that arrived, see whether the data
+   * cells we delivered call for any sendmes. */
+  relay_flush_pending_sendmes();
+  return 0;
 }
 
 /** Write a destroy cell with circ ID <b>circ_id</b> and reason <b>reason</b>
@@ -0,0 +1,544 @@
+/* Copyright (c) 2009, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file consdiff.c
+ * \brief Compute and apply line-based diffs between consensus documents.
+ *
+ * A directory cache that has an older consensus of ours can send us a diff
+ * from that consensus to its newest one, rather than the whole thing.  Most
+ * of a consensus is routerstatus entries, and from one hour to the next
+ * most of them don't change at all, so the diff is a lot smaller.
+ *
+ * A diff looks like this:
+ * \verbatim
+ *   network-status-diff-version 1
+ *   hash <hex SHA256 of base document> <hex SHA256 of target document>
+ *   <ed commands>
+ * \endverbatim
+ * Each ed command is "N,Md", "Nd", "N,Mc", "Nc", or "Na", with 1-based line
+ * numbers in the base document; after each "c" or "a" command come the new
+ * lines, then a line holding only ".".  The commands run from the bottom of
+ * the document to the top, so no command's line numbers are changed by the
+ * commands before it.  Anyone applying a diff checks both hashes, so a diff
+ * can never turn the wrong base, or a broken diff, into something we'd
+ * believe; the result still has to pass the ordinary signature checks.
+ *
+ * To keep computing a diff cheap, we don't compare the whole documents at
+ * once.  Instead, we split each into its header, its routerstatus entries
+ * (each one starting with an "r" line), and its footer.  Entries are in
+ * order of identity digest, so we can match up the entries for the same
+ * router in the two documents in one pass; then we only need a real
+ * longest-common-subsequence search within each pair of matching entries,
+ * and within the headers and the footers.
+ **/
+
+#include "or.h"
+
+/** The first line of every consensus diff. */
+#define CONSDIFF_VERSION_LINE "network-status-diff-version 1\n"
+
+/** The biggest longest-common-subsequence table we'll build, in cells.
+ * If a part of two documents that we're comparing is bigger than this, we
+ * just replace it all. */
+#define CONSDIFF_MAX_LCS_CELLS (1<<20)
+
+/** A line of a document, not counting its newline. */
+typedef struct cdline_t {
+  const char *s; /**< Where the line starts. */
+  size_t len; /**< How long the line is. */
+} cdline_t;
+
+/** A hunk of a diff: replace the base document's lines from
+ * <b>base_start</b> up to but not including <b>base_end</b> with the target
+ * document's lines from <b>target_start</b> up to but not including
+ * <b>target_end</b>.  Line indices start at 0. */
+typedef struct cdhunk_t {
+  int base_start, base_end;
+  int target_start, target_end;
+} cdhunk_t;
+
+/** Split <b>doc</b> into lines, set *<b>n_out</b> to the number of lines,
+ * and return a newly allocated array of them.  Return NULL if <b>doc</b>
+ * doesn't end with a newline. */
+static cdline_t *
+consdiff_split_lines(const char *doc, int *n_out)
+{
+  size_t doc_len = strlen(doc);
+  const char *cp = doc, *eol;
+  cdline_t *lines;
+  int n = 0, cap = 256;
+
+  if (doc_len && doc[doc_len-1] != '\n')
+    return NULL;
+  lines = tor_malloc(sizeof(cdline_t)*cap);
+  while (*cp) {
+    eol = strchr(cp, '\n');
+    tor_assert(eol);
+    if (n == cap) {
+      cap *= 2;
+      lines = tor_realloc(lines, sizeof(cdline_t)*cap);
+    }
+    lines[n].s = cp;
+    lines[n].len = eol - cp;
+    ++n;
+    cp = eol+1;
+  }
+  *n_out = n;
+  return lines;
+}
+
+/** Return true iff the lines <b>a</b> and <b>b</b> are the same. */
+static INLINE int
+consdiff_lines_eq(const cdline_t *a, const cdline_t *b)
+{
+  return a->len == b->len && !memcmp(a->s, b->s, a->len);
+}
+
+/** Return true iff <b>line</b> starts with <b>prefix</b>. */
+static INLINE int
+consdiff_line_starts_with(const cdline_t *line, const char *prefix)
+{
+  size_t n = strlen(prefix);
+  return line->len >= n && !memcmp(line->s, prefix, n);
+}
+
+/** Add a hunk to the end of <b>hunks</b>, replacing base lines
+ * <b>bs</b>..<b>be</b> with target lines <b>ts</b>..<b>te</b>.  If it
+ * starts right where the last hunk ends, just make the last hunk longer,
+ * so that no two hunks ever touch. */
+static void
+consdiff_add_hunk(smartlist_t *hunks, int bs, int be, int ts, int te)
+{
+  cdhunk_t *last, *h;
+  if (bs == be && ts == te)
+    return;
+  last = smartlist_len(hunks) ? smartlist_get(hunks, smartlist_len(hunks)-1)
+    : NULL;
+  if (last && last->base_end == bs && last->target_end == ts) {
+    last->base_end = be;
+    last->target_end = te;
+    return;
+  }
+  h = tor_malloc(sizeof(cdhunk_t));
+  h->base_start = bs;
+  h->base_end = be;
+  h->target_start = ts;
+  h->target_end = te;
+  smartlist_add(hunks, h);
+}
+
+/** Add to <b>hunks</b>, in order, the hunks that turn base lines
+ * <b>bs</b>..<b>be</b> into target lines <b>ts</b>..<b>te</b>, using a
+ * longest-common-subsequence search to keep as many lines as we can. */
+static void
+consdiff_diff_range(smartlist_t *hunks,
+                    const cdline_t *base, int bs, int be,
+                    const cdline_t *target, int ts, int te)
+{
+  int n, m, i, j, gap_i, gap_j;
+  int *lcs;
+
+  /* Lines that are the same at the start and end are easy. */
+  while (bs < be && ts < te && consdiff_lines_eq(&base[bs], &target[ts]))
+    ++bs, ++ts;
+  while (bs < be && ts < te &&
+         consdiff_lines_eq(&base[be-1], &target[te-1]))
+    --be, --te;
+  n = be - bs;
+  m = te - ts;
+  if (!n || !m || (uint64_t)(n+1)*(m+1) > CONSDIFF_MAX_LCS_CELLS) {
+    consdiff_add_hunk(hunks, bs, be, ts, te);
+    return;
+  }
+
+  /* lcs[i*(m+1)+j] is the length of the longest common subsequence of
+   * base lines i.. and target lines j.. of our range. */
+#define LCS(i,j) lcs[(i)*(m+1)+(j)]
+  lcs = tor_malloc(sizeof(int)*(n+1)*(m+1));
+  for (i = n; i >= 0; --i) {
+    for (j = m; j >= 0; --j) {
+      if (i == n || j == m)
+        LCS(i,j) = 0;
+      else if (consdiff_lines_eq(&base[bs+i], &target[ts+j]))
+        LCS(i,j) = LCS(i+1,j+1) + 1;
+      else if (LCS(i+1,j) >= LCS(i,j+1))
+        LCS(i,j) = LCS(i+1,j);
+      else
+        LCS(i,j) = LCS(i,j+1);
+    }
+  }
+
+  /* Walk the table, making a hunk out of everything between two lines we
+   * keep. */
+  i = j = gap_i = gap_j = 0;
+  while (i < n && j < m) {
+    if (consdiff_lines_eq(&base[bs+i], &target[ts+j])) {
+      consdiff_add_hunk(hunks, bs+gap_i, bs+i, ts+gap_j, ts+j);
+      gap_i = ++i;
+      gap_j = ++j;
+    } else if (LCS(i+1,j) >= LCS(i,j+1)) {
+      ++i;
+    } else {
+      ++j;
+    }
+  }
+  consdiff_add_hunk(hunks, bs+gap_i, be, ts+gap_j, te);
+#undef LCS
+  tor_free(lcs);
+}
+
+/** Find the routerstatus entries in the <b>n</b> lines at <b>lines</b>.
+ * On success, set *<b>first_out</b> to the index of the first entry's "r"
+ * line, set *<b>footer_out</b> to the index of the first line after the
+ * last entry, set *<b>starts_out</b> to a newly allocated array of the
+ * index of each entry's "r" line, set *<b>keys_out</b> to a newly allocated
+ * array of each entry's identity digest, and return the number of entries.
+ * Return -1 if the document doesn't look like a consensus, or if its
+ * entries aren't in order of identity digest. */
+static int
+consdiff_find_entries(const cdline_t *lines, int n, int *first_out,
+                      int *footer_out, int **starts_out, char **keys_out)
+{
+  int first, footer, i, n_entries = 0;
+  int *starts;
+  char *keys;
+
+  for (first = 0; first < n; ++first) {
+    if (consdiff_line_starts_with(&lines[first], "r "))
+      break;
+  }
+  for (footer = first; footer < n; ++footer) {
+    if (consdiff_line_starts_with(&lines[footer], "directory-footer") ||
+        consdiff_line_starts_with(&lines[footer], "directory-signature "))
+      break;
+  }
+  if (first == n || footer == n)
+    return -1;
+
+  starts = tor_malloc(sizeof(int)*(footer-first));
+  keys = tor_malloc(DIGEST_LEN*(footer-first));
+  for (i = first; i < footer; ++i) {
+    const char *cp, *eol = lines[i].s + lines[i].len;
+    char d64[BASE64_DIGEST_LEN+1];
+    char *key = keys + DIGEST_LEN*n_entries;
+    if (!consdiff_line_starts_with(&lines[i], "r "))
+      continue;
+    /* "r" nickname identity ... */
+    cp = memchr(lines[i].s+2, ' ', lines[i].len-2);
+    if (!cp || eol - (cp+1) < BASE64_DIGEST_LEN)
+      goto err;
+    memcpy(d64, cp+1, BASE64_DIGEST_LEN);
+    d64[BASE64_DIGEST_LEN] = '\0';
+    if (digest_from_base64(key, d64) < 0)
+      goto err;
+    if (n_entries && memcmp(key-DIGEST_LEN, key, DIGEST_LEN) >= 0)
+      goto err;
+    starts[n_entries++] = i;
+  }
+
+  *first_out = first;
+  *footer_out = footer;
+  *starts_out = starts;
+  *keys_out = keys;
+  return n_entries;
+ err:
+  tor_free(starts);
+  tor_free(keys);
+  return -1;
+}
+
+/** Add to <b>hunks</b>, in order, the hunks that turn the <b>n_base</b>
+ * lines at <b>base</b> into the <b>n_target</b> lines at <b>target</b>. */
+static void
+consdiff_diff_documents(smartlist_t *hunks,
+                        const cdline_t *base, int n_base,
+                        const cdline_t *target, int n_target)
+{
+  int b_first, b_footer, t_first, t_footer, nb, nt, i, j;
+  int *b_starts = NULL, *t_starts = NULL;
+  char *b_keys = NULL, *t_keys = NULL;
+
+  nb = consdiff_find_entries(base, n_base, &b_first, &b_footer,
+                             &b_starts, &b_keys);
+  nt = nb < 0 ? -1 : consdiff_find_entries(target, n_target, &t_first,
+                                           &t_footer, &t_starts, &t_keys);
+  if (nb < 0 || nt < 0) {
+    /* We can't match up the entries; just compare the whole things. */
+    consdiff_diff_range(hunks, base, 0, n_base, target, 0, n_target);
+    goto done;
+  }
+
+  consdiff_diff_range(hunks, base, 0, b_first, target, 0, t_first);
+  i = j = 0;
+  while (i < nb || j < nt) {
+    int b_start = i < nb ? b_starts[i] : b_footer;
+    int b_end = i+1 < nb ? b_starts[i+1] : b_footer;
+    int t_start = j < nt ? t_starts[j] : t_footer;
+    int t_end = j+1 < nt ? t_starts[j+1] : t_footer;
+    int c;
+    if (i == nb)
+      c = 1;
+    else if (j == nt)
+      c = -1;
+    else
+      c = memcmp(b_keys+DIGEST_LEN*i, t_keys+DIGEST_LEN*j, DIGEST_LEN);
+    if (c == 0) {
+      /* The same router is in both: compare its entries. */
+      consdiff_diff_range(hunks, base, b_start, b_end,
+                          target, t_start, t_end);
+      ++i, ++j;
+    } else if (c < 0) {
+      /* The router went away. */
+      consdiff_add_hunk(hunks, b_start, b_end, t_start, t_start);
+      ++i;
+    } else {
+      /* The router is new. */
+      consdiff_add_hunk(hunks, b_start, b_start, t_start, t_end);
+      ++j;
+    }
+  }
+  consdiff_diff_range(hunks, base, b_footer, n_base,
+                      target, t_footer, n_target);
+
+ done:
+  tor_free(b_starts);
+  tor_free(t_starts);
+  tor_free(b_keys);
+  tor_free(t_keys);
+}
+
+/** Return a newly allocated diff that turns the consensus <b>base</b> into
+ * the consensus <b>target</b>, as described at the top of this file.
+ * Return NULL if we can't express the change as a diff. */
+char *
+consdiff_generate(const char *base, const char *target)
+{
+  cdline_t *b_lines = NULL, *t_lines = NULL;
+  int n_base = 0, n_target = 0, i;
+  smartlist_t *hunks = smartlist_create();
+  smartlist_t *chunks = smartlist_create();
+  char b_digest[DIGEST256_LEN], t_digest[DIGEST256_LEN];
+  char b_hex[HEX_DIGEST256_LEN+1], t_hex[HEX_DIGEST256_LEN+1];
+  char buf[2*HEX_DIGEST256_LEN+16];
+  char *result = NULL;
+
+  if (!(b_lines = consdiff_split_lines(base, &n_base)) ||
+      !(t_lines = consdiff_split_lines(target, &n_target)))
+    goto done;
+  /* A line with just a "." on it would end an ed command's new lines. */
+  for (i = 0; i < n_target; ++i) {
+    if (t_lines[i].len == 1 && t_lines[i].s[0] == '.')
+      goto done;
+  }
+
+  consdiff_diff_documents(hunks, b_lines, n_base, t_lines, n_target);
+
+  crypto_digest256(b_digest, base, strlen(base), DIGEST_SHA256);
+  crypto_digest256(t_digest, target, strlen(target), DIGEST_SHA256);
+  base16_encode(b_hex, sizeof(b_hex), b_digest, DIGEST256_LEN);
+  base16_encode(t_hex, sizeof(t_hex), t_digest, DIGEST256_LEN);
+  smartlist_add(chunks, tor_strdup(CONSDIFF_VERSION_LINE));
+  tor_snprintf(buf, sizeof(buf), "hash %s %s\n", b_hex, t_hex);
+  smartlist_add(chunks, tor_strdup(buf));
+
+  /* Bottom to top, so that no command moves the lines of the ones after
+   * it. */
+  for (i = smartlist_len(hunks)-1; i >= 0; --i) {
+    const cdhunk_t *h = smartlist_get(hunks, i);
+    char cmd = (h->target_start == h->target_end) ? 'd' :
+      (h->base_start == h->base_end) ? 'a' : 'c';
+    if (cmd == 'a')
+      tor_snprintf(buf, sizeof(buf), "%da\n", h->base_start);
+    else if (h->base_end == h->base_start+1)
+      tor_snprintf(buf, sizeof(buf), "%d%c\n", h->base_end, cmd);
+    else
+      tor_snprintf(buf, sizeof(buf), "%d,%d%c\n", h->base_start+1,
+                   h->base_end, cmd);
+    smartlist_add(chunks, tor_strdup(buf));
+    if (cmd != 'd') {
+      const cdline_t *last = &t_lines[h->target_end-1];
+      const char *start = t_lines[h->target_start].s;
+      smartlist_add(chunks, tor_strndup(start, last->s+last->len+1-start));
+      smartlist_add(chunks, tor_strdup(".\n"));
+    }
+  }
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+
+ done:
+  SMARTLIST_FOREACH(hunks, cdhunk_t *, h, tor_free(h));
+  smartlist_free(hunks);
+  SMARTLIST_FOREACH(chunks, char *, c, tor_free(c));
+  smartlist_free(chunks);
+  tor_free(b_lines);
+  tor_free(t_lines);
+  return result;
+}
+
+/** Return true iff <b>s</b> starts with a consensus diff header. */
+int
+consdiff_looks_like_diff(const char *s)
+{
+  return !strcmpstart(s, CONSDIFF_VERSION_LINE);
+}
+
+/** A piece of the document that consdiff_apply() is building. */
+typedef struct cdchunk_t {
+  const char *s; /**< Where the piece starts. */
+  size_t len; /**< How long the piece is. */
+} cdchunk_t;
+
+/** Add the piece of <b>len</b> bytes at <b>s</b> to <b>chunks</b>. */
+static void
+consdiff_add_chunk(smartlist_t *chunks, const char *s, size_t len)
+{
+  cdchunk_t *c;
+  if (!len)
+    return;
+  c = tor_malloc(sizeof(cdchunk_t));
+  c->s = s;
+  c->len = len;
+  smartlist_add(chunks, c);
+}
+
+/** Add base lines <b>from</b> up to but not including <b>to</b> to
+ * <b>chunks</b>. */
+static void
+consdiff_add_lines(smartlist_t *chunks, const cdline_t *lines,
+                   int from, int to)
+{
+  if (from < to)
+    consdiff_add_chunk(chunks, lines[from].s,
+                       lines[to-1].s + lines[to-1].len + 1 - lines[from].s);
+}
+
+/** Apply the consensus diff <b>diff</b> to the consensus <b>base</b>, and
+ * return the newly allocated result.  Return NULL if <b>diff</b> is
+ * malformed, if it isn't a diff from <b>base</b>, or if the result isn't
+ * the document the diff says it should be. */
+char *
+consdiff_apply(const char *base, const char *diff)
+{
+  cdline_t *lines = NULL;
+  smartlist_t *chunks = smartlist_create();
+  char b_digest[DIGEST256_LEN], t_digest[DIGEST256_LEN];
+  char digest[DIGEST256_LEN];
+  const char *cp = diff, *eol;
+  char *result = NULL, *out;
+  size_t len = 0;
+  int n = 0, cur, limit, i;
+
+  if (!consdiff_looks_like_diff(cp)) {
+    log_warn(LD_DIR, "Consensus diff has an unrecognized header.");
+    goto done;
+  }
+  cp += strlen(CONSDIFF_VERSION_LINE);
+  if (strcmpstart(cp, "hash ") ||
+      strlen(cp) < 5+2*HEX_DIGEST256_LEN+2 ||
+      cp[5+HEX_DIGEST256_LEN] != ' ' ||
+      cp[5+2*HEX_DIGEST256_LEN+1] != '\n' ||
+      base16_decode(b_digest, DIGEST256_LEN, cp+5, HEX_DIGEST256_LEN) < 0 ||
+      base16_decode(t_digest, DIGEST256_LEN, cp+6+HEX_DIGEST256_LEN,
+                    HEX_DIGEST256_LEN) < 0) {
+    log_warn(LD_DIR, "Consensus diff has a malformed hash line.");
+    goto done;
+  }
+  cp += 5+2*HEX_DIGEST256_LEN+2;
+
+  crypto_digest256(digest, base, strlen(base), DIGEST_SHA256);
+  if (memcmp(digest, b_digest, DIGEST256_LEN)) {
+    log_warn(LD_DIR, "Consensus diff is not from the consensus we have.");
+    goto done;
+  }
+  if (!(lines = consdiff_split_lines(base, &n))) {
+    log_warn(LD_DIR, "Can't apply a consensus diff to a consensus that "
+             "doesn't end with a newline.");
+    goto done;
+  }
+
+  /* Build the result from the bottom up: cur is the first base line we
+   * haven't used yet, counting from the bottom, and every command has to
+   * touch only lines above limit. */
+  cur = n;
+  limit = n+1;
+  while (*cp) {
+    long start, end;
+    char *next;
+    char cmd;
+    const char *new_lines = NULL;
+    size_t new_len = 0;
+
+    eol = strchr(cp, '\n');
+    if (!eol || !TOR_ISDIGIT(*cp))
+      goto malformed;
+    start = end = strtol(cp, &next, 10);
+    if (*next == ',') {
+      if (!TOR_ISDIGIT(next[1]))
+        goto malformed;
+      end = strtol(next+1, &next, 10);
+    }
+    cmd = *next++;
+    if (next != eol || (cmd != 'a' && cmd != 'c' && cmd != 'd'))
+      goto malformed;
+    if (cmd == 'a') {
+      if (start != end || start < 0 || start >= limit || start > n)
+        goto malformed;
+    } else {
+      if (start < 1 || start > end || end >= limit || end > n)
+        goto malformed;
+    }
+    cp = eol+1;
+
+    if (cmd != 'd') {
+      /* The new lines run up to a line with just a "." on it. */
+      new_lines = cp;
+      while (strcmpstart(cp, ".\n")) {
+        if (!(eol = strchr(cp, '\n')))
+          goto malformed;
+        cp = eol+1;
+      }
+      new_len = cp - new_lines;
+      if (!new_len)
+        goto malformed;
+      cp += 2;
+    }
+
+    if (cmd == 'a') {
+      consdiff_add_lines(chunks, lines, (int)start, cur);
+      consdiff_add_chunk(chunks, new_lines, new_len);
+      cur = limit = (int)start;
+    } else {
+      consdiff_add_lines(chunks, lines, (int)end, cur);
+      consdiff_add_chunk(chunks, new_lines, new_len);
+      cur = (int)start-1;
+      limit = (int)start;
+    }
+  }
+  consdiff_add_lines(chunks, lines, 0, cur);
+
+  SMARTLIST_FOREACH(chunks, cdchunk_t *, c, len += c->len);
+  result = out = tor_malloc(len+1);
+  for (i = smartlist_len(chunks)-1; i >= 0; --i) {
+    cdchunk_t *c = smartlist_get(chunks, i);
+    memcpy(out, c->s, c->len);
+    out += c->len;
+  }
+  *out = '\0';
+
+  crypto_digest256(digest, result, len, DIGEST_SHA256);
+  if (memcmp(digest, t_digest, DIGEST256_LEN)) {
+    log_warn(LD_DIR, "Consensus diff didn't give us the consensus it was "
+             "supposed to.");
+    tor_free(result);
+  }
+  goto done;
+
+ malformed:
+  log_warn(LD_DIR, "Malformed command in consensus diff.");
+ done:
+  SMARTLIST_FOREACH(chunks, cdchunk_t *, c, tor_free(c));
+  smartlist_free(chunks);
+  tor_free(lines);
+  return result;
+}
+
@@ -1316,6 +1316,10 @@ getinfo_helper_misc(control_connection_t *conn, const char *question,
     *answer = tor_dup_ip(addr);
   } else if (!strcmp(question, "dir-usage")) {
     *answer = directory_dump_request_log();
+  } else if (!strcmp(question, "buffer-freelists")) {
+    *answer = buf_get_freelist_status();
+  } else if (!strcmp(question, "event-changes")) {
+    *answer = connection_get_event_change_status();
   } else if (!strcmp(question, "fingerprint")) {
     routerinfo_t *me = router_get_my_routerinfo();
     if (!me)
@@ -1669,6 +1673,29 @@ getinfo_helper_events(control_connection_t *control_conn,
     *answer = smartlist_join_strings(status, "\r\n", 0, NULL);
     SMARTLIST_FOREACH(status, char *, cp, tor_free(cp));
     smartlist_free(status);
+  } else if (!strcmp(question, "orconn-scheduler")) {
+    smartlist_t *conns = get_connection_array();
+    smartlist_t *status = smartlist_create();
+    SMARTLIST_FOREACH_BEGIN(conns, connection_t *, base_conn) {
+      char *s, *sched;
+      char name[128];
+      size_t slen;
+      or_connection_t *conn;
+      if (base_conn->type != CONN_TYPE_OR || base_conn->marked_for_close ||
+          base_conn->state != OR_CONN_STATE_OPEN)
+        continue;
+      conn = TO_OR_CONN(base_conn);
+      orconn_target_get_name(name, sizeof(name), conn);
+      sched = connection_or_get_scheduler_status(conn);
+      slen = strlen(name)+strlen(sched)+2;
+      s = tor_malloc(slen+1);
+      tor_snprintf(s, slen, "%s %s", name, sched);
+      smartlist_add(status, s);
+      tor_free(sched);
+    } SMARTLIST_FOREACH_END(base_conn);
+    *answer = smartlist_join_strings(status, "\r\n", 0, NULL);
+    SMARTLIST_FOREACH(status, char *, cp, tor_free(cp));
+    smartlist_free(status);
   } else if (!strcmpstart(question, "address-mappings/")) {
     time_t min_e, max_e;
     smartlist_t *mappings;
@@ -1844,6 +1871,8 @@ static const getinfo_item_t getinfo_items[] = {
   ITEM("circuit-status", events, "List of current circuits originating here."),
   ITEM("stream-status", events,"List of current streams."),
   ITEM("orconn-status", events, "A list of current OR connections."),
+  ITEM("orconn-scheduler", events,
+       "Circuit scheduler state for each open OR connection."),
   PREFIX("address-mappings/", events, NULL),
   DOC("address-mappings/all", "Current address mappings."),
   DOC("address-mappings/cache", "Current cached DNS replies."),
@@ -1868,6 +1897,11 @@ static const getinfo_item_t getinfo_items[] = {
       "current version"),
   ITEM("address", misc, "IP address of this Tor host, if we can guess it."),
   ITEM("dir-usage", misc, "Breakdown of bytes transferred over DirPort."),
+  ITEM("buffer-freelists", misc,
+       "Sizes and hit rates of the buffer chunk freelists."),
+  ITEM("event-changes", misc,
+       "How often connections start or stop reading or writing, and how "
+       "often we tell libevent about it."),
   PREFIX("desc-annotations/id/", dir, "Router annotations by hexdigest."),
   PREFIX("dir/server/", dir,"Router descriptors as retrieved from a DirPort."),
   PREFIX("dir/status/", dir,
@@ -5,18 +5,26 @@
 
 /**
  * \file cpuworker.c
- * \brief Implements a farm of 'CPU worker' processes to perform
+ * \brief Implements a farm of 'CPU worker' threads or processes to perform
  * CPU-intensive tasks in another thread or process, to not
  * interrupt the main thread.
  *
+ * When we have threads, the workers share a single locked job queue, and
+ * post their answers onto a reply queue; they wake the main thread up by
+ * writing a byte to one socketpair, and the main thread handles every
+ * reply that has arrived each time it wakes.  Without threads, we fork
+ * worker processes and talk to each one over its own socketpair.
+ *
  * Right now, we only use this for processing onionskins.
  **/
 
 #include "or.h"
 
-/** The maximum number of cpuworker processes we will keep around. */
+/** The maximum number of cpuworker threads or processes we will keep
+ * around. */
 #define MAX_CPUWORKERS 16
-/** The minimum number of cpuworker processes we will keep around. */
+/** The minimum number of cpuworker threads or processes we will keep
+ * around. */
 #define MIN_CPUWORKERS 1
 
 /** The tag specifies which circuit this onionskin was from. */
@@ -27,18 +35,132 @@
 
 /** How many cpuworkers we have running right now. */
 static int num_cpuworkers=0;
-/** How many of the running cpuworkers have an assigned task right now. */
+/** How many of the running cpuworkers have an assigned task right now.
+ * (With threads, this is the number of onionskins handed to the pool and
+ * not yet answered.) */
 static int num_cpuworkers_busy=0;
 /** We need to spawn new cpuworkers whenever we rotate the onion keys
  * on platforms where execution contexts==processes.  This variable stores
  * the last time we got a key rotation event. */
 static time_t last_rotation_time=0;
 
-static void cpuworker_main(void *data) ATTR_NORETURN;
-static int spawn_cpuworker(void);
+/** How many onionskins have we gotten answers for? */
+static uint64_t stats_n_onionskins_answered = 0;
+/** Total microseconds between handing those onionskins to a worker and
+ * processing the answer. */
+static uint64_t stats_onionskin_usec_total = 0;
+/** Largest number of microseconds any one onionskin has spent at a worker.*/
+static uint64_t stats_onionskin_usec_max = 0;
+/** Largest number of onionskins we've had at the workers at once. */
+static int stats_max_busy = 0;
+
 static void spawn_enough_cpuworkers(void);
 static void process_pending_task(connection_t *cpuworker);
 
+/** Return the number of cpuworkers we want, based on the NumCPUs option,
+ * or on the number of CPUs we have if NumCPUs is 0. */
+static int
+get_num_cpuworkers_needed(void)
+{
+  int n = get_options()->NumCpus;
+  if (n == 0)
+    n = compute_num_cpus();
+
+  if (n < MIN_CPUWORKERS)
+    n = MIN_CPUWORKERS;
+  if (n > MAX_CPUWORKERS)
+    n = MAX_CPUWORKERS;
+  return n;
+}
+
+/** Note that an onionskin has just been handed to a worker. */
+static INLINE void
+note_cpuworker_busy(void)
+{
+  if (++num_cpuworkers_busy > stats_max_busy)
+    stats_max_busy = num_cpuworkers_busy;
+}
+
+/** Handle the answer from a cpuworker for the onionskin we got from circuit
+ * <b>circ_id</b> on the OR connection with global identifier
+ * <b>conn_id</b>.  If <b>success</b>, <b>reply</b> holds the
+ * ONIONSKIN_REPLY_LEN-byte reply and <b>keys</b> holds the negotiated key
+ * material.  If <b>started</b> is provided, it holds the time at which we
+ * handed the onionskin to the worker. */
+static void
+cpuworker_handle_answer(uint64_t conn_id, circid_t circ_id, int success,
+                        const char *reply, const char *keys,
+                        const struct timeval *started)
+{
+  connection_t *tmp_conn;
+  or_connection_t *p_conn = NULL;
+  circuit_t *circ = NULL;
+
+  ++stats_n_onionskins_answered;
+  if (started) {
+    struct timeval now;
+    long usec;
+    tor_gettimeofday(&now);
+    usec = tv_udiff(started, &now);
+    if (usec > 0) {
+      stats_onionskin_usec_total += usec;
+      if ((uint64_t)usec > stats_onionskin_usec_max)
+        stats_onionskin_usec_max = usec;
+    }
+  }
+
+  /* parse out the circ it was talking about */
+  tmp_conn = connection_get_by_global_id(conn_id);
+  if (tmp_conn && !tmp_conn->marked_for_close &&
+      tmp_conn->type == CONN_TYPE_OR)
+    p_conn = TO_OR_CONN(tmp_conn);
+
+  if (p_conn)
+    circ = circuit_get_by_circid_orconn(circ_id, p_conn);
+
+  if (!success) {
+    log_debug(LD_OR,
+              "decoding onionskin failed. "
+              "(Old key or bad software.) Closing.");
+    if (circ)
+      circuit_mark_for_close(circ, END_CIRC_REASON_TORPROTOCOL);
+    return;
+  }
+  if (!circ) {
+    /* This happens because somebody sends us a destroy cell and the
+     * circuit goes away, while the cpuworker is working. This is also
+     * why our tag doesn't include a pointer to the circ, because we'd
+     * never know if it's still valid.
+     */
+    log_debug(LD_OR,"processed onion for a circ that's gone. Dropping.");
+    return;
+  }
+  tor_assert(! CIRCUIT_IS_ORIGIN(circ));
+  if (onionskin_answer(TO_OR_CIRCUIT(circ), CELL_CREATED, reply, keys) < 0) {
+    log_warn(LD_OR,"onionskin_answer failed. Closing.");
+    circuit_mark_for_close(circ, END_CIRC_REASON_INTERNAL);
+    return;
+  }
+  log_debug(LD_OR,"onionskin_answer succeeded. Yay.");
+}
+
+/** Log the onionskin processing statistics at log level <b>severity</b>. */
+void
+cpuworker_log_stats(int severity)
+{
+  log(severity, LD_OR,
+      "CPU workers: %d running, %d onionskins outstanding (at most %d).",
+      num_cpuworkers, num_cpuworkers_busy, stats_max_busy);
+  if (stats_n_onionskins_answered)
+    log(severity, LD_OR,
+        "Answered "U64_FORMAT" onionskins; average latency "U64_FORMAT
+        " usec, max "U64_FORMAT" usec.",
+        U64_PRINTF_ARG(stats_n_onionskins_answered),
+        U64_PRINTF_ARG(stats_onionskin_usec_total /
+                       stats_n_onionskins_answered),
+        U64_PRINTF_ARG(stats_onionskin_usec_max));
+}
+
 /** Initialize the cpuworker subsystem.
  */
 void
@@ -57,6 +179,339 @@ connection_cpu_finished_flushing(connection_t *conn)
   return 0;
 }
 
+#ifdef TOR_IS_MULTITHREADED
+
+/** How many onionskins per worker thread will we hand to the pool before
+ * we start leaving them on the onion queue in onion.c?  A little slack
+ * keeps threads from going idle between batches of answers, but onionskins
+ * that reach the pool can no longer be culled when they get too old. */
+#define CPUWORKER_JOBS_PER_THREAD 2
+
+/** An onionskin that we've handed to the worker threads, along with the
+ * answer once a worker has computed it. */
+typedef struct cpuworker_job_t {
+  struct cpuworker_job_t *next; /**< Next job on the same queue. */
+  uint64_t conn_id; /**< Global identifier of the circuit's p_conn. */
+  circid_t circ_id; /**< The circuit's p_circ_id. */
+  struct timeval started; /**< When did we hand this job to the pool? */
+  int success; /**< True iff the handshake succeeded. */
+  char onionskin[ONIONSKIN_CHALLENGE_LEN]; /**< The question. */
+  char reply[ONIONSKIN_REPLY_LEN]; /**< The reply, if success. */
+  char keys[CPATH_KEY_MATERIAL_LEN]; /**< The negotiated keys, if success. */
+} cpuworker_job_t;
+
+/** A first-in-first-out list of cpuworker_job_t. */
+typedef struct cpuworker_jobqueue_t {
+  cpuworker_job_t *head; /**< Oldest job, or NULL if empty. */
+  cpuworker_job_t *tail; /**< Newest job, or NULL if empty. */
+} cpuworker_jobqueue_t;
+
+/** Protects every variable below that is marked as shared. */
+static tor_mutex_t *cpuworker_lock = NULL;
+/** Signalled when a job is added to pending_jobs, or when some threads
+ * should exit. */
+static tor_cond_t *cpuworker_cond = NULL;
+/** Jobs waiting for a worker thread. Shared. */
+static cpuworker_jobqueue_t pending_jobs = { NULL, NULL };
+/** Jobs that a worker thread has answered. Shared. */
+static cpuworker_jobqueue_t answered_jobs = { NULL, NULL };
+/** How many worker threads do we want?  Shared; only the main thread
+ * changes it. */
+static int num_threads_wanted = 0;
+/** Incremented every time the onion keys change, so that worker threads
+ * know to fetch new copies.  Shared. */
+static unsigned int onion_key_generation = 0;
+/** The worker threads' end of the socketpair they use to wake up the main
+ * thread when answers are waiting.  Shared. */
+static int notify_fd = -1;
+/** The main thread's end of that socketpair, or NULL if we haven't set it
+ * up. */
+static connection_t *notify_conn = NULL;
+
+/** Add <b>job</b> to the end of <b>q</b>. */
+static INLINE void
+jobqueue_push(cpuworker_jobqueue_t *q, cpuworker_job_t *job)
+{
+  job->next = NULL;
+  if (q->tail)
+    q->tail->next = job;
+  else
+    q->head = job;
+  q->tail = job;
+}
+
+/** Remove and return the first job on <b>q</b>, or NULL if it's empty. */
+static INLINE cpuworker_job_t *
+jobqueue_pop(cpuworker_jobqueue_t *q)
+{
+  cpuworker_job_t *job = q->head;
+  if (job) {
+    q->head = job->next;
+    if (!q->head)
+      q->tail = NULL;
+    job->next = NULL;
+  }
+  return job;
+}
+
+/** Body of a worker thread: take onionskins off pending_jobs and answer
+ * them, until there are more threads than we want. */
+static void
+cpuworker_thread_main(void *data)
+{
+  crypto_pk_env_t *onion_key = NULL, *last_onion_key = NULL;
+  unsigned int generation;
+  (void)data;
+
+  tor_mutex_acquire(cpuworker_lock);
+  generation = onion_key_generation;
+  tor_mutex_release(cpuworker_lock);
+  dup_onion_keys(&onion_key, &last_onion_key);
+
+  tor_mutex_acquire(cpuworker_lock);
+  for (;;) {
+    cpuworker_job_t *job;
+    unsigned int new_generation;
+
+    while (!pending_jobs.head && num_cpuworkers <= num_threads_wanted)
+      tor_cond_wait(cpuworker_cond, cpuworker_lock);
+    if (num_cpuworkers > num_threads_wanted)
+      break;
+    job = jobqueue_pop(&pending_jobs);
+    new_generation = onion_key_generation;
+    tor_mutex_release(cpuworker_lock);
+
+    if (new_generation != generation) {
+      crypto_free_pk_env(onion_key);
+      if (last_onion_key)
+        crypto_free_pk_env(last_onion_key);
+      dup_onion_keys(&onion_key, &last_onion_key);
+      generation = new_generation;
+    }
+
+    if (onion_skin_server_handshake(job->onionskin, onion_key,
+                                    last_onion_key, job->reply, job->keys,
+                                    CPATH_KEY_MATERIAL_LEN) < 0) {
+      log_debug(LD_OR,"onion_skin_server_handshake failed.");
+      job->success = 0;
+    } else {
+      log_debug(LD_OR,"onion_skin_server_handshake succeeded.");
+      job->success = 1;
+    }
+
+    tor_mutex_acquire(cpuworker_lock);
+    if (!answered_jobs.head) {
+      /* The main thread has already collected everything we told it about
+       * before, so it needs a fresh wakeup. */
+      char b = 0;
+      if (send(notify_fd, &b, 1, 0) != 1)
+        log_warn(LD_BUG, "Couldn't wake up main thread from cpuworker: %s",
+                 tor_socket_strerror(tor_socket_errno(notify_fd)));
+    }
+    jobqueue_push(&answered_jobs, job);
+  }
+  --num_cpuworkers;
+  tor_mutex_release(cpuworker_lock);
+
+  log_info(LD_OR, "CPU worker thread exiting.");
+  crypto_free_pk_env(onion_key);
+  if (last_onion_key)
+    crypto_free_pk_env(last_onion_key);
+  crypto_thread_cleanup();
+  spawn_exit();
+}
+
+/** Create the socketpair that worker threads use to wake the main thread,
+ * and add the main thread's end to the connection list.  Return 0 on
+ * success, -1 on failure. */
+static int
+cpuworker_setup_notify(void)
+{
+  int fds[2];
+  int err;
+  connection_t *conn;
+
+  if ((err = tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) < 0) {
+    log_warn(LD_NET, "Couldn't construct socketpair for cpuworkers: %s",
+             tor_socket_strerror(-err));
+    return -1;
+  }
+
+  conn = connection_new(CONN_TYPE_CPUWORKER, AF_UNIX);
+  set_socket_nonblocking(fds[0]);
+  conn->s = fds[0];
+  conn->address = tor_strdup("localhost");
+  if (connection_add(conn) < 0) { /* no space, forget it */
+    log_warn(LD_NET,"connection_add for cpuworker failed. Giving up.");
+    connection_free(conn); /* this closes fds[0] */
+    tor_close_socket(fds[1]);
+    return -1;
+  }
+  conn->state = CPUWORKER_STATE_IDLE;
+  connection_start_reading(conn);
+
+  tor_mutex_acquire(cpuworker_lock);
+  if (notify_fd >= 0)
+    tor_close_socket(notify_fd);
+  notify_fd = fds[1];
+  tor_mutex_release(cpuworker_lock);
+
+  notify_conn = conn;
+  return 0;
+}
+
+/** If we have too few or too many worker threads, start new ones or tell
+ * some to exit.
+ */
+static void
+spawn_enough_cpuworkers(void)
+{
+  if (!cpuworker_lock) {
+    cpuworker_lock = tor_mutex_new();
+    cpuworker_cond = tor_cond_new();
+  }
+  if (!notify_conn && cpuworker_setup_notify() < 0)
+    return;
+
+  tor_mutex_acquire(cpuworker_lock);
+  num_threads_wanted = get_num_cpuworkers_needed();
+  while (num_cpuworkers < num_threads_wanted) {
+    if (spawn_func(cpuworker_thread_main, NULL) < 0) {
+      log_warn(LD_GENERAL,"Cpuworker spawn failed. Will try again later.");
+      break;
+    }
+    log_debug(LD_OR,"just spawned a cpu worker thread.");
+    num_cpuworkers++;
+  }
+  if (num_cpuworkers > num_threads_wanted)
+    tor_cond_signal_all(cpuworker_cond);
+  tor_mutex_release(cpuworker_lock);
+}
+
+/** Called when the onion key has changed, or when NumCPUs may have
+ * changed.  Tell the worker threads to pick up the new keys before their
+ * next onionskin, and adjust the number of threads.
+ */
+void
+cpuworkers_rotate(void)
+{
+  if (cpuworker_lock) {
+    tor_mutex_acquire(cpuworker_lock);
+    ++onion_key_generation;
+    tor_mutex_release(cpuworker_lock);
+  }
+  last_rotation_time = time(NULL);
+  if (server_mode(get_options()))
+    spawn_enough_cpuworkers();
+}
+
+/** Our wakeup socketpair got closed somehow.  Set up a new one next time
+ * we need it. */
+int
+connection_cpu_reached_eof(connection_t *conn)
+{
+  log_warn(LD_BUG,"Read eof on cpuworker wakeup socket. Replacing it.");
+  if (conn == notify_conn)
+    notify_conn = NULL;
+  connection_mark_for_close(conn);
+  return 0;
+}
+
+/** Called when a worker thread has woken us up: handle every answer that
+ * the worker threads have posted, and then give them more work.
+ */
+int
+connection_cpu_process_inbuf(connection_t *conn)
+{
+  cpuworker_job_t *job, *next;
+
+  tor_assert(conn);
+  tor_assert(conn->type == CONN_TYPE_CPUWORKER);
+
+  /* The bytes themselves mean nothing; they're just wakeups. */
+  buf_clear(conn->inbuf);
+
+  tor_mutex_acquire(cpuworker_lock);
+  job = answered_jobs.head;
+  answered_jobs.head = answered_jobs.tail = NULL;
+  tor_mutex_release(cpuworker_lock);
+
+  for ( ; job; job = next) {
+    next = job->next;
+    num_cpuworkers_busy--;
+    cpuworker_handle_answer(job->conn_id, job->circ_id, job->success,
+                            job->reply, job->keys, &job->started);
+    tor_free(job);
+  }
+
+  process_pending_task(NULL);
+  return 0;
+}
+
+/** Move as many tasks from the onion queue to the worker threads as they
+ * will take. */
+static void
+process_pending_task(connection_t *cpuworker)
+{
+  or_circuit_t *circ;
+  char *onionskin = NULL;
+  (void)cpuworker;
+
+  while (num_cpuworkers_busy < num_threads_wanted*CPUWORKER_JOBS_PER_THREAD &&
+         (circ = onion_next_task(&onionskin))) {
+    if (assign_onionskin_to_cpuworker(NULL, circ, onionskin))
+      log_warn(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+  }
+}
+
+/** Try to hand the public key operations necessary to respond to
+ * <b>onionskin</b> for the circuit <b>circ</b> to the worker threads.
+ * (<b>cpuworker</b> must be NULL.)  If they already have enough to do,
+ * queue the task onto the pending onion list and return.  Return 0 if we
+ * successfully assign or queue the task, or -1 on failure.
+ */
+int
+assign_onionskin_to_cpuworker(connection_t *cpuworker,
+                              or_circuit_t *circ, char *onionskin)
+{
+  cpuworker_job_t *job;
+  tor_assert(!cpuworker);
+
+  if (!notify_conn)
+    spawn_enough_cpuworkers();
+
+  if (num_cpuworkers_busy >= num_threads_wanted*CPUWORKER_JOBS_PER_THREAD) {
+    log_debug(LD_OR,"No idle cpuworkers. Queuing.");
+    if (onion_pending_add(circ, onionskin) < 0) {
+      tor_free(onionskin);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (!circ->p_conn) {
+    log_info(LD_OR,"circ->p_conn gone. Failing circ.");
+    tor_free(onionskin);
+    return -1;
+  }
+
+  job = tor_malloc_zero(sizeof(cpuworker_job_t));
+  job->conn_id = circ->p_conn->_base.global_identifier;
+  job->circ_id = circ->p_circ_id;
+  memcpy(job->onionskin, onionskin, ONIONSKIN_CHALLENGE_LEN);
+  tor_free(onionskin);
+  tor_gettimeofday(&job->started);
+  note_cpuworker_busy();
+
+  tor_mutex_acquire(cpuworker_lock);
+  jobqueue_push(&pending_jobs, job);
+  tor_cond_signal_one(cpuworker_cond);
+  tor_mutex_release(cpuworker_lock);
+  return 0;
+}
+
+#else
+
 /** Pack global_id and circ_id; set *tag to the result. (See note on
  * cpuworker_main for wire format.) */
 static void
@@ -125,9 +580,6 @@ connection_cpu_process_inbuf(connection_t *conn)
   char buf[LEN_ONION_RESPONSE];
   uint64_t conn_id;
   circid_t circ_id;
-  connection_t *tmp_conn;
-  or_connection_t *p_conn = NULL;
-  circuit_t *circ;
 
   tor_assert(conn);
   tor_assert(conn->type == CONN_TYPE_CPUWORKER);
@@ -143,47 +595,13 @@ connection_cpu_process_inbuf(connection_t *conn)
     connection_fetch_from_buf(&success,1,conn);
     connection_fetch_from_buf(buf,LEN_ONION_RESPONSE-1,conn);
 
-    /* parse out the circ it was talking about */
     tag_unpack(buf, &conn_id, &circ_id);
-    circ = NULL;
-    tmp_conn = connection_get_by_global_id(conn_id);
-    if (tmp_conn && !tmp_conn->marked_for_close &&
-        tmp_conn->type == CONN_TYPE_OR)
-      p_conn = TO_OR_CONN(tmp_conn);
-
-    if (p_conn)
-      circ = circuit_get_by_circid_orconn(circ_id, p_conn);
-
-    if (success == 0) {
-      log_debug(LD_OR,
-                "decoding onionskin failed. "
-                "(Old key or bad software.) Closing.");
-      if (circ)
-        circuit_mark_for_close(circ, END_CIRC_REASON_TORPROTOCOL);
-      goto done_processing;
-    }
-    if (!circ) {
-      /* This happens because somebody sends us a destroy cell and the
-       * circuit goes away, while the cpuworker is working. This is also
-       * why our tag doesn't include a pointer to the circ, because we'd
-       * never know if it's still valid.
-       */
-      log_debug(LD_OR,"processed onion for a circ that's gone. Dropping.");
-      goto done_processing;
-    }
-    tor_assert(! CIRCUIT_IS_ORIGIN(circ));
-    if (onionskin_answer(TO_OR_CIRCUIT(circ), CELL_CREATED, buf+TAG_LEN,
-                         buf+TAG_LEN+ONIONSKIN_REPLY_LEN) < 0) {
-      log_warn(LD_OR,"onionskin_answer failed. Closing.");
-      circuit_mark_for_close(circ, END_CIRC_REASON_INTERNAL);
-      goto done_processing;
-    }
-    log_debug(LD_OR,"onionskin_answer succeeded. Yay.");
+    cpuworker_handle_answer(conn_id, circ_id, success != 0, buf+TAG_LEN,
+                            buf+TAG_LEN+ONIONSKIN_REPLY_LEN, NULL);
   } else {
     tor_assert(0); /* don't ask me to do handshakes yet */
   }
 
-done_processing:
   conn->state = CPUWORKER_STATE_IDLE;
   num_cpuworkers_busy--;
   if (conn->timestamp_created < last_rotation_time) {
@@ -228,12 +646,10 @@ cpuworker_main(void *data)
   crypto_pk_env_t *onion_key = NULL, *last_onion_key = NULL;
 
   fd = fdarray[1]; /* this side is ours */
-#ifndef TOR_IS_MULTITHREADED
   tor_close_socket(fdarray[0]); /* this is the side of the socketpair the
                                  * parent uses */
   tor_free_all(1); /* so the child doesn't hold the parent's fd's open */
   handle_signals(0); /* ignore interrupts from the keyboard, etc */
-#endif
   tor_free(data);
 
   dup_onion_keys(&onion_key, &last_onion_key);
@@ -327,10 +743,8 @@ spawn_cpuworker(void)
   fd = fdarray[0];
   spawn_func(cpuworker_main, (void*)fdarray);
   log_debug(LD_OR,"just spawned a cpu worker.");
-#ifndef TOR_IS_MULTITHREADED
   tor_close_socket(fdarray[1]); /* don't need the worker's side of the pipe */
   tor_free(fdarray);
-#endif
 
   conn = connection_new(CONN_TYPE_CPUWORKER, AF_UNIX);
 
@@ -358,12 +772,7 @@ spawn_cpuworker(void)
 static void
 spawn_enough_cpuworkers(void)
 {
-  int num_cpuworkers_needed = get_options()->NumCpus;
-
-  if (num_cpuworkers_needed < MIN_CPUWORKERS)
-    num_cpuworkers_needed = MIN_CPUWORKERS;
-  if (num_cpuworkers_needed > MAX_CPUWORKERS)
-    num_cpuworkers_needed = MAX_CPUWORKERS;
+  int num_cpuworkers_needed = get_num_cpuworkers_needed();
 
   while (num_cpuworkers < num_cpuworkers_needed) {
     if (spawn_cpuworker() < 0) {
@@ -470,7 +879,7 @@ assign_onionskin_to_cpuworker(connection_t *cpuworker,
      * see how long it's been since we asked the question, and sometimes
      * we check before the first call to connection_handle_write(). */
     cpuworker->timestamp_lastwritten = time(NULL);
-    num_cpuworkers_busy++;
+    note_cpuworker_busy();
 
     qbuf[0] = CPUWORKER_TASK_ONION;
     connection_write_to_buf(qbuf, 1, cpuworker);
@@ -481,3 +890,4 @@ assign_onionskin_to_cpuworker(connection_t *cpuworker,
   return 0;
 }
 
+#endif /* TOR_IS_MULTITHREADED */
@@ -82,6 +82,10 @@ static void directory_initiate_command_rend(const char *address,
 #define ALLOW_DIRECTORY_TIME_SKEW (30*60)
 
 #define X_ADDRESS_HEADER "X-Your-Address-Is: "
+/** A client sends this header with a consensus request to say which
+ * consensus it has, by the hex SHA256 digest of the whole document, so
+ * that the cache can answer with a diff from that one. */
+#define X_DIFF_FROM_CONSENSUS_HEADER "X-Or-Diff-From-Consensus: "
 
 /** HTTP cache control: how long do we tell proxies they can cache each
  * kind of document we serve? */
@@ -932,6 +936,7 @@ directory_send_command(dir_connection_t *conn,
   char proxyauthstring[256];
   char hoststring[128];
   char imsstring[RFC1123_TIME_LEN+32];
+  char diffstring[HEX_DIGEST256_LEN+64];
   char *url;
   char request[8192];
   const char *httpcommand = NULL;
@@ -985,6 +990,17 @@ directory_send_command(dir_connection_t *conn,
     proxyauthstring[0] = 0;
   }
 
+  /* Tell the cache which consensus we have, so it can send us a diff. */
+  diffstring[0] = '\0';
+  if (purpose == DIR_PURPOSE_FETCH_CONSENSUS) {
+    char digest[DIGEST256_LEN], hex[HEX_DIGEST256_LEN+1];
+    if (networkstatus_get_consensus_text_digest(digest) == 0) {
+      base16_encode(hex, sizeof(hex), digest, DIGEST256_LEN);
+      tor_snprintf(diffstring, sizeof(diffstring), "\r\n%s%s",
+                   X_DIFF_FROM_CONSENSUS_HEADER, hex);
+    }
+  }
+
   switch (purpose) {
     case DIR_PURPOSE_FETCH_V2_NETWORKSTATUS:
       tor_assert(resource);
@@ -1095,9 +1111,10 @@ directory_send_command(dir_connection_t *conn,
 
   if (!strcmp(httpcommand, "GET") && !payload) {
     tor_snprintf(request, sizeof(request),
-                 " HTTP/1.0\r\nHost: %s%s%s\r\n\r\n",
+                 " HTTP/1.0\r\nHost: %s%s%s%s\r\n\r\n",
                  hoststring,
                  imsstring,
+                 diffstring,
                  proxyauthstring);
   } else {
     tor_snprintf(request, sizeof(request),
@@ -1328,41 +1345,116 @@ body_is_plausible(const char *body, size_t len, int purpose)
   }
 }
 
-/** Called when we've just fetched a bunch of router descriptors in
- * <b>body</b>.  The list <b>which</b>, if present, holds digests for
- * descriptors we requested: descriptor digests if <b>descriptor_digests</b>
- * is true, or identity digests otherwise.  Parse the descriptors, validate
- * them, and annotate them as having purpose <b>purpose</b> and as having been
- * downloaded from <b>source</b>.
- *
- * Return the number of routers actually added. */
-static int
-load_downloaded_routers(const char *body, smartlist_t *which,
-                        int descriptor_digests,
-                        int router_purpose,
-                        const char *source)
+/** What we need to remember about a fetch of router descriptors or
+ * extra-info documents until we've added what it brought us to our
+ * directory.  See dir_descriptors_loaded(). */
+typedef struct dir_desc_fetch_t {
+  /** The fingerprints we asked for and haven't got yet, or NULL if we
+   * didn't ask by fingerprint.  See load_downloaded_descriptors(). */
+  smartlist_t *which;
+  /** How many fingerprints did we ask for? */
+  int n_asked_for;
+  /** True iff we fetched extra-info documents. */
+  int was_ei;
+  /** True iff <b>which</b> holds descriptor digests, not identity
+   * digests. */
+  int descriptor_digests;
+  /** The purpose of the routers we fetched. */
+  int router_purpose;
+  /** The address and port of the directory server we fetched them from. */
+  char *address;
+  uint16_t port;
+} dir_desc_fetch_t;
+
+/** Release all storage held by <b>fetch</b>. */
+static void
+dir_desc_fetch_free(dir_desc_fetch_t *fetch)
+{
+  if (fetch->which) {
+    SMARTLIST_FOREACH(fetch->which, char *, cp, tor_free(cp));
+    smartlist_free(fetch->which);
+  }
+  tor_free(fetch->address);
+  tor_free(fetch);
+}
+
+/** Called once we've added to our directory the <b>n_added</b> new router
+ * descriptors or extra-info documents that the fetch <b>arg</b> brought us,
+ * whether right away or once the signature checking threads have checked
+ * them.  Mark the ones we asked for and didn't get as failed, and free
+ * <b>arg</b>.  If <b>n_added</b> is negative, we're shutting down: just
+ * free it. */
+static void
+dir_descriptors_loaded(int n_added, void *arg)
+{
+  dir_desc_fetch_t *fetch = arg;
+
+  if (n_added < 0) {
+    dir_desc_fetch_free(fetch);
+    return;
+  }
+  if (!fetch->was_ei) {
+    control_event_bootstrap(BOOTSTRAP_STATUS_LOADING_DESCRIPTORS,
+                            count_loading_descriptors_progress());
+    if (n_added)
+      directory_info_has_arrived(time(NULL), 0);
+  }
+  if (fetch->which) { /* mark remaining ones as failed */
+    log_info(LD_DIR, "Received %d/%d %s requested from %s:%d",
+             fetch->n_asked_for-smartlist_len(fetch->which),
+             fetch->n_asked_for,
+             fetch->was_ei ? "extra-info documents" : "router descriptors",
+             fetch->address, (int)fetch->port);
+    if (smartlist_len(fetch->which)) {
+      dir_routerdesc_download_failed(fetch->which, 200,
+                                     fetch->router_purpose,
+                                     fetch->was_ei,
+                                     fetch->descriptor_digests);
+    }
+  }
+  dir_desc_fetch_free(fetch);
+}
+
+/** Called when we've just fetched a bunch of router descriptors or
+ * extra-info documents in <b>body</b>, as described by <b>fetch</b>.  The
+ * list <b>fetch</b>-&gt;which, if present, holds digests for descriptors
+ * we requested: descriptor digests if <b>fetch</b>-&gt;descriptor_digests
+ * is true, or identity digests otherwise; as we learn them, we remove them
+ * from the list.  Parse the descriptors, validate them, and annotate them
+ * as having their purpose and as having been downloaded from
+ * <b>fetch</b>-&gt;address.  Then call dir_descriptors_loaded(), which
+ * takes <b>fetch</b>: right away, or, if the signature checking threads
+ * are running, once they've checked the signatures. */
+static void
+load_downloaded_descriptors(const char *body, dir_desc_fetch_t *fetch)
 {
   char buf[256];
   char time_buf[ISO_TIME_LEN+1];
-  int added = 0;
-  int general = router_purpose == ROUTER_PURPOSE_GENERAL;
-  format_iso_time(time_buf, time(NULL));
-  tor_assert(source);
+  int general = fetch->router_purpose == ROUTER_PURPOSE_GENERAL;
+
+  if (fetch->was_ei) {
+    router_load_downloaded_descriptors(body, 1, fetch->which,
+                                       fetch->descriptor_digests, NULL,
+                                       dir_descriptors_loaded, fetch);
+    return;
+  }
 
+  format_iso_time(time_buf, time(NULL));
   if (tor_snprintf(buf, sizeof(buf),
                    "@downloaded-at %s\n"
                    "@source %s\n"
-                   "%s%s%s", time_buf, escaped(source),
+                   "%s%s%s", time_buf, escaped(fetch->address),
                    !general ? "@purpose " : "",
-                   !general ? router_purpose_to_string(router_purpose) : "",
-                   !general ? "\n" : "")<0)
-    return added;
-
-  added = router_load_routers_from_string(body, NULL, SAVED_NOWHERE, which,
-                                  descriptor_digests, buf);
-  control_event_bootstrap(BOOTSTRAP_STATUS_LOADING_DESCRIPTORS,
-                          count_loading_descriptors_progress());
-  return added;
+                   !general ?
+                     router_purpose_to_string(fetch->router_purpose) : "",
+                   !general ? "\n" : "")<0) {
+    dir_descriptors_loaded(0, fetch);
+    return;
+  }
+
+  router_load_downloaded_descriptors(body, 0, fetch->which,
+                                     fetch->descriptor_digests, buf,
+                                     dir_descriptors_loaded, fetch);
 }
 
 /** We are a client, and we've finished reading the server's
@@ -1624,6 +1716,20 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
     }
     log_info(LD_DIR,"Received consensus directory (size %d) from server "
              "'%s:%d'",(int) body_len, conn->_base.address, conn->_base.port);
+    if (consdiff_looks_like_diff(body)) {
+      char *consensus = networkstatus_apply_consensus_diff(body);
+      if (!consensus) {
+        log_info(LD_DIR, "Unable to apply consensus diff downloaded from "
+                 "server '%s:%d'. I'll fetch a whole consensus soon.",
+                 conn->_base.address, conn->_base.port);
+        tor_free(body); tor_free(headers); tor_free(reason);
+        networkstatus_consensus_download_failed(0);
+        return -1;
+      }
+      tor_free(body);
+      body = consensus;
+      body_len = strlen(body);
+    }
     if ((r=networkstatus_set_current_consensus(body, "ns", 0))<0) {
       log_fn(r<-1?LOG_WARN:LOG_INFO, LD_DIR,
              "Unable to load consensus directory downloaded from "
@@ -1755,31 +1861,15 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
                   (!strcmpstart(conn->requested_resource, "all") ||
                    (!strcmpstart(conn->requested_resource, "authority") &&
                     get_options()->UseBridges)))) {
-      /* as we learn from them, we remove them from 'which' */
-      if (was_ei) {
-        router_load_extrainfo_from_string(body, NULL, SAVED_NOWHERE, which,
-                                          descriptor_digests);
-      } else {
-        //router_load_routers_from_string(body, NULL, SAVED_NOWHERE, which,
-        //                       descriptor_digests, conn->router_purpose);
-        if (load_downloaded_routers(body, which, descriptor_digests,
-                                conn->router_purpose,
-                                conn->_base.address))
-          directory_info_has_arrived(now, 0);
-      }
-    }
-    if (which) { /* mark remaining ones as failed */
-      log_info(LD_DIR, "Received %d/%d %s requested from %s:%d",
-               n_asked_for-smartlist_len(which), n_asked_for,
-               was_ei ? "extra-info documents" : "router descriptors",
-               conn->_base.address, (int)conn->_base.port);
-      if (smartlist_len(which)) {
-        dir_routerdesc_download_failed(which, status_code,
-                                       conn->router_purpose,
-                                       was_ei, descriptor_digests);
-      }
-      SMARTLIST_FOREACH(which, char *, cp, tor_free(cp));
-      smartlist_free(which);
+      dir_desc_fetch_t *fetch = tor_malloc_zero(sizeof(dir_desc_fetch_t));
+      fetch->which = which;
+      fetch->n_asked_for = n_asked_for;
+      fetch->was_ei = was_ei;
+      fetch->descriptor_digests = descriptor_digests;
+      fetch->router_purpose = conn->router_purpose;
+      fetch->address = tor_strdup(conn->_base.address);
+      fetch->port = conn->_base.port;
+      load_downloaded_descriptors(body, fetch);
     }
     if (directory_conn_is_self_reachability_test(conn))
       router_dirport_found_reachable();
@@ -2505,6 +2595,7 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
     const char *request_type = NULL;
     const char *key = url + strlen("/tor/status/");
     long lifetime = NETWORKSTATUS_CACHE_LIFETIME;
+    cached_dir_t *diff = NULL;
 
     if (!is_v3) {
       dirserv_get_networkstatus_v2_fingerprints(dir_fps, key);
@@ -2551,6 +2642,16 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
         goto done;
       }
 
+      {
+        /* If the client has a consensus we can diff from, send the diff
+         * instead. */
+        char *have = http_get_header(headers, X_DIFF_FROM_CONSENSUS_HEADER);
+        if (have) {
+          diff = dirserv_find_consensus_diff(flavor ? flavor : "ns", have);
+          tor_free(have);
+        }
+      }
+
       {
         char *fp = tor_malloc_zero(DIGEST_LEN);
         if (flavor)
@@ -2583,7 +2684,10 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
       goto done;
     }
 
-    dlen = dirserv_estimate_data_size(dir_fps, 0, compressed);
+    if (diff)
+      dlen = compressed ? diff->dir_z_len : diff->dir_len;
+    else
+      dlen = dirserv_estimate_data_size(dir_fps, 0, compressed);
     if (global_write_bucket_low(TO_CONN(conn), dlen, 2)) {
       log_debug(LD_DIRSERV,
                "Client asked for network status lists, but we've been "
@@ -2615,12 +2719,21 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
     (void) request_type;
     write_http_response_header(conn, -1, compressed,
                                smartlist_len(dir_fps) == 1 ? lifetime : 0);
-    conn->fingerprint_stack = dir_fps;
+    if (diff) {
+      SMARTLIST_FOREACH(dir_fps, char *, fp, tor_free(fp));
+      smartlist_free(dir_fps);
+      conn->cached_dir = diff;
+      conn->cached_dir_offset = 0;
+      ++diff->refcnt;
+      conn->dir_spool_src = DIR_SPOOL_CACHED_DIR;
+    } else {
+      conn->fingerprint_stack = dir_fps;
+      conn->dir_spool_src = DIR_SPOOL_NETWORKSTATUS;
+    }
     if (! compressed)
       conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD);
 
     /* Prime the connection with some data. */
-    conn->dir_spool_src = DIR_SPOOL_NETWORKSTATUS;
     connection_dirserv_flushed_some(conn);
     goto done;
   }
@@ -2753,7 +2866,9 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
     conn->dir_spool_src = DIR_SPOOL_MICRODESC;
     conn->fingerprint_stack = fps;
 
-    if (compressed)
+    if (compressed && get_options()->DirPrecompressDescriptors)
+      conn->spool_compressed = 1;
+    else if (compressed)
       conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD);
 
     connection_dirserv_flushed_some(conn);
@@ -2821,7 +2936,9 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
         goto done;
       }
       write_http_response_header(conn, -1, compressed, cache_lifetime);
-      if (compressed)
+      if (compressed && get_options()->DirPrecompressDescriptors)
+        conn->spool_compressed = 1;
+      else if (compressed)
         conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD);
       /* Prime the connection with some data. */
       connection_dirserv_flushed_some(conn);
@@ -62,6 +62,10 @@ static signed_descriptor_t *get_signed_descriptor_by_fp(const char *fp,
                                                         int extrainfo,
                                                         time_t publish_cutoff);
 static int dirserv_add_extrainfo(extrainfo_t *ei, const char **msg);
+static void dirserv_update_consensus_diffs(const char *flavor_name,
+                                           const char *old_body,
+                                           const char *new_body,
+                                           time_t published);
 
 /************** Measured Bandwidth parsing code ******/
 #define MAX_MEASUREMENT_AGE (3*24*60*60) /* 3 days */
@@ -1220,6 +1224,26 @@ static digestmap_t *cached_v2_networkstatus = NULL;
 /** Map from flavor name to the v3 consensuses that we're currently serving. */
 static strmap_t *cached_consensuses = NULL;
 
+/** An older consensus that we can serve a diff from, to bring a client
+ * that has it up to the consensus we're serving now. */
+typedef struct consensus_diff_base_t {
+  /** SHA256 digest of the whole consensus document. */
+  char digest[DIGEST256_LEN];
+  /** The consensus document. */
+  char *body;
+  /** A diff from <b>body</b> to the consensus of the same flavor that we're
+   * serving now, or NULL if we couldn't make one smaller than the consensus
+   * itself. */
+  cached_dir_t *diff;
+} consensus_diff_base_t;
+
+/** How many older consensuses of each flavor do we keep diffs from? */
+#define MAX_CONSENSUS_DIFF_BASES 4
+
+/** Map from flavor name to a smartlist of consensus_diff_base_t for the
+ * last few consensuses of that flavor we served, oldest first. */
+static strmap_t *consensus_diff_bases = NULL;
+
 /** Possibly replace the contents of <b>d</b> with the value of
  * <b>directory</b> published on <b>when</b>, unless <b>when</b> is older than
  * the last value, or too far in the future.
@@ -1404,8 +1428,116 @@ dirserv_set_cached_consensus_networkstatus(const char *networkstatus,
   memcpy(&new_networkstatus->digests, digests, sizeof(digests_t));
   old_networkstatus = strmap_set(cached_consensuses, flavor_name,
                                  new_networkstatus);
-  if (old_networkstatus)
+  if (old_networkstatus) {
+    dirserv_update_consensus_diffs(flavor_name, old_networkstatus->dir,
+                                   networkstatus, published);
     cached_dir_decref(old_networkstatus);
+  }
+}
+
+/** Release all storage held by the consensus_diff_base_t <b>b</b>. */
+static void
+consensus_diff_base_free(consensus_diff_base_t *b)
+{
+  if (!b)
+    return;
+  tor_free(b->body);
+  if (b->diff)
+    cached_dir_decref(b->diff);
+  tor_free(b);
+}
+
+/** Helper for strmap_free: free a list of consensus_diff_base_t. */
+static void
+_free_consensus_diff_bases(void *_bases)
+{
+  smartlist_t *bases = _bases;
+  SMARTLIST_FOREACH(bases, consensus_diff_base_t *, b,
+                    consensus_diff_base_free(b));
+  smartlist_free(bases);
+}
+
+/** We've just replaced the consensus of type <b>flavor_name</b> that we
+ * serve, <b>old_body</b>, with <b>new_body</b>, published at
+ * <b>published</b>.  Remember the old one, forget the oldest one we were
+ * keeping if we have too many, and make a diff from each one we're
+ * keeping to the new one. */
+static void
+dirserv_update_consensus_diffs(const char *flavor_name, const char *old_body,
+                               const char *new_body, time_t published)
+{
+  smartlist_t *bases;
+  consensus_diff_base_t *b;
+  size_t new_len = strlen(new_body);
+
+  if (!strcmp(old_body, new_body))
+    return;
+  if (!consensus_diff_bases)
+    consensus_diff_bases = strmap_new();
+  if (!(bases = strmap_get(consensus_diff_bases, flavor_name))) {
+    bases = smartlist_create();
+    strmap_set(consensus_diff_bases, flavor_name, bases);
+  }
+
+  b = tor_malloc_zero(sizeof(consensus_diff_base_t));
+  crypto_digest256(b->digest, old_body, strlen(old_body), DIGEST_SHA256);
+  b->body = tor_strdup(old_body);
+  smartlist_add(bases, b);
+  while (smartlist_len(bases) > MAX_CONSENSUS_DIFF_BASES) {
+    consensus_diff_base_free(smartlist_get(bases, 0));
+    smartlist_del_keeporder(bases, 0);
+  }
+
+  SMARTLIST_FOREACH_BEGIN(bases, consensus_diff_base_t *, base) {
+    char *diff;
+    if (base->diff) {
+      cached_dir_decref(base->diff);
+      base->diff = NULL;
+    }
+    diff = consdiff_generate(base->body, new_body);
+    if (diff && strlen(diff) < new_len) {
+      base->diff = new_cached_dir(diff, published);
+    } else {
+      log_info(LD_DIRSERV, "Couldn't make a useful diff to our new %s "
+               "consensus from one we had before.", flavor_name);
+      tor_free(diff);
+    }
+  } SMARTLIST_FOREACH_END(base);
+}
+
+/** Return a diff from one of the consensuses of type <b>flavor_name</b>
+ * listed in <b>digests</b>, a comma-separated list of hex-encoded SHA256
+ * digests of whole consensus documents, to the one we're serving now.
+ * Return NULL if we have no such diff. */
+cached_dir_t *
+dirserv_find_consensus_diff(const char *flavor_name, const char *digests)
+{
+  smartlist_t *bases, *hexes;
+  cached_dir_t *result = NULL;
+  char digest[DIGEST256_LEN];
+
+  if (!consensus_diff_bases ||
+      !(bases = strmap_get(consensus_diff_bases, flavor_name)))
+    return NULL;
+
+  hexes = smartlist_create();
+  smartlist_split_string(hexes, digests, ",",
+                         SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+  SMARTLIST_FOREACH_BEGIN(hexes, const char *, hex) {
+    if (result)
+      break;
+    if (strlen(hex) != HEX_DIGEST256_LEN ||
+        base16_decode(digest, DIGEST256_LEN, hex, HEX_DIGEST256_LEN) < 0)
+      continue;
+    SMARTLIST_FOREACH(bases, consensus_diff_base_t *, b,
+      if (b->diff && !memcmp(b->digest, digest, DIGEST256_LEN)) {
+        result = b->diff;
+        break;
+      });
+  } SMARTLIST_FOREACH_END(hex);
+  SMARTLIST_FOREACH(hexes, char *, cp, tor_free(cp));
+  smartlist_free(hexes);
+  return result;
 }
 
 /** Remove any v2 networkstatus from the directory cache that was published
@@ -3294,6 +3426,204 @@ dirserv_estimate_microdesc_size(const smartlist_t *fps, int compressed)
  * below this threshold. */
 #define DIRSERV_BUFFER_MIN 16384
 
+/* Compressed descriptor cache.
+ *
+ * A cache that answers a compressed request for descriptors or
+ * microdescriptors would otherwise run every body it sends through a
+ * connection's own zlib stream, compressing the same popular bodies over
+ * and over.  With DirPrecompressDescriptors set, we instead compress each
+ * body once, as its own complete zlib stream, and keep it here, keyed by
+ * the digest of the body; a response is just these compressed bodies, one
+ * after another.  Every version of Tor decompresses a run of concatenated
+ * zlib streams as a single body, so clients can't tell the difference --
+ * except that the response is larger, since each body is compressed
+ * without the others.
+ *
+ * Bodies we haven't sent lately fall out of the cache, oldest first, once
+ * it holds more than COMPRESSED_BODY_CACHE_MAX bytes.
+ */
+
+/** A compressed copy of a descriptor or microdescriptor body. */
+typedef struct compressed_body_t {
+  /** The digest we were given for the body: the descriptor digest, or the
+   * first DIGEST_LEN bytes of the microdescriptor digest. */
+  char digest[DIGEST_LEN];
+  /** How long is the uncompressed body? */
+  size_t body_len;
+  /** The body, compressed as a single zlib stream. */
+  char *z;
+  /** How long is <b>z</b>? */
+  size_t z_len;
+  /** The next less recently used entry, or NULL. */
+  struct compressed_body_t *older;
+  /** The next more recently used entry, or NULL. */
+  struct compressed_body_t *newer;
+} compressed_body_t;
+
+/** The most bytes of compressed bodies that we'll keep around. */
+#define COMPRESSED_BODY_CACHE_MAX (16<<20)
+
+/** Map from digest to compressed_body_t, for every body in the cache. */
+static digestmap_t *compressed_body_map = NULL;
+/** The most and least recently used entries in compressed_body_map. */
+static compressed_body_t *compressed_body_newest = NULL,
+  *compressed_body_oldest = NULL;
+/** How many bytes of compressed bodies are in the cache? */
+static size_t compressed_body_cache_bytes = 0;
+/** How many times have we found the body we wanted in the cache, and how
+ * many times did we have to compress it? */
+static uint64_t compressed_body_hits = 0, compressed_body_misses = 0;
+
+/** Take <b>ent</b> off the list of cache entries in order of use. */
+static void
+compressed_body_unlink(compressed_body_t *ent)
+{
+  if (ent->older)
+    ent->older->newer = ent->newer;
+  else
+    compressed_body_oldest = ent->newer;
+  if (ent->newer)
+    ent->newer->older = ent->older;
+  else
+    compressed_body_newest = ent->older;
+  ent->older = ent->newer = NULL;
+}
+
+/** Put <b>ent</b> at the most recently used end of the list of cache
+ * entries. */
+static void
+compressed_body_link_newest(compressed_body_t *ent)
+{
+  ent->older = compressed_body_newest;
+  ent->newer = NULL;
+  if (compressed_body_newest)
+    compressed_body_newest->newer = ent;
+  else
+    compressed_body_oldest = ent;
+  compressed_body_newest = ent;
+}
+
+/** Remove <b>ent</b> from the cache, and free it. */
+static void
+compressed_body_remove(compressed_body_t *ent)
+{
+  compressed_body_unlink(ent);
+  digestmap_remove(compressed_body_map, ent->digest);
+  compressed_body_cache_bytes -= ent->z_len;
+  tor_free(ent->z);
+  tor_free(ent);
+}
+
+/** Return the body of <b>body_len</b> bytes at <b>body</b>, whose digest
+ * is <b>digest</b>, compressed as a complete zlib stream, and set
+ * *<b>z_len_out</b> to its length.  Use the copy in the cache if there is
+ * one; otherwise compress the body and add it to the cache.  The result is
+ * only good until the next call to this function.  Return NULL if we
+ * can't compress the body. */
+const char *
+dirserv_get_compressed_body(const char *digest, const char *body,
+                            size_t body_len, size_t *z_len_out)
+{
+  compressed_body_t *ent;
+  char *z = NULL;
+  size_t z_len = 0;
+
+  if (!compressed_body_map)
+    compressed_body_map = digestmap_new();
+
+  ent = digestmap_get(compressed_body_map, digest);
+  if (ent && ent->body_len == body_len) {
+    ++compressed_body_hits;
+    compressed_body_unlink(ent);
+    compressed_body_link_newest(ent);
+    *z_len_out = ent->z_len;
+    return ent->z;
+  }
+  if (ent) {
+    /* Same digest, different length: can't be the same body. */
+    compressed_body_remove(ent);
+  }
+
+  ++compressed_body_misses;
+  if (tor_gzip_compress(&z, &z_len, body, body_len, ZLIB_METHOD) < 0) {
+    log_warn(LD_BUG, "Couldn't compress a %d-byte descriptor body.",
+             (int)body_len);
+    return NULL;
+  }
+  ent = tor_malloc_zero(sizeof(compressed_body_t));
+  memcpy(ent->digest, digest, DIGEST_LEN);
+  ent->body_len = body_len;
+  ent->z = z;
+  ent->z_len = z_len;
+  digestmap_set(compressed_body_map, digest, ent);
+  compressed_body_link_newest(ent);
+  compressed_body_cache_bytes += z_len;
+
+  while (compressed_body_cache_bytes > COMPRESSED_BODY_CACHE_MAX &&
+         compressed_body_oldest != ent)
+    compressed_body_remove(compressed_body_oldest);
+
+  *z_len_out = ent->z_len;
+  return ent->z;
+}
+
+/** Log how well the compressed descriptor cache is doing, at log level
+ * <b>severity</b>. */
+void
+dirserv_log_compressed_body_stats(int severity)
+{
+  if (!compressed_body_map)
+    return;
+  log(severity, LD_DIRSERV, "Compressed descriptor cache: %d bodies in %lu "
+      "bytes; "U64_FORMAT" hits, "U64_FORMAT" misses.",
+      digestmap_size(compressed_body_map),
+      (unsigned long)compressed_body_cache_bytes,
+      U64_PRINTF_ARG(compressed_body_hits),
+      U64_PRINTF_ARG(compressed_body_misses));
+}
+
+/** Remove every body from the compressed descriptor cache, and free it. */
+void
+dirserv_compressed_body_cache_free_all(void)
+{
+  while (compressed_body_oldest)
+    compressed_body_remove(compressed_body_oldest);
+  if (compressed_body_map) {
+    digestmap_free(compressed_body_map, NULL);
+    compressed_body_map = NULL;
+  }
+  tor_assert(compressed_body_cache_bytes == 0);
+  compressed_body_hits = compressed_body_misses = 0;
+}
+
+/** Spooling helper: write the <b>body_len</b>-byte body at <b>body</b>,
+ * whose digest is <b>digest</b>, to <b>conn</b>.  If <b>conn</b> wants
+ * precompressed bodies, take it from the compressed descriptor cache; if
+ * it has a zlib stream, compress it there, finishing the stream if
+ * <b>last</b> is true; otherwise send it as-is. */
+static void
+connection_dirserv_write_body(dir_connection_t *conn, const char *digest,
+                              const char *body, size_t body_len, int last)
+{
+  if (conn->spool_compressed) {
+    size_t z_len;
+    const char *z = dirserv_get_compressed_body(digest, body, body_len,
+                                                &z_len);
+    if (z) {
+      connection_write_to_buf(z, z_len, TO_CONN(conn));
+      conn->spool_compressed_sent_any = 1;
+    }
+  } else if (conn->zlib_state) {
+    connection_write_to_buf_zlib(body, body_len, conn, last);
+    if (last) {
+      tor_zlib_free(conn->zlib_state);
+      conn->zlib_state = NULL;
+    }
+  } else {
+    connection_write_to_buf(body, body_len, TO_CONN(conn));
+  }
+}
+
 /** Spooling helper: called when we have no more data to spool to <b>conn</b>.
  * Flushes any remaining data to be (un)compressed, and changes the spool
  * source to NONE.  Returns 0 on success, negative on failure. */
@@ -3305,6 +3635,16 @@ connection_dirserv_finish_spooling(dir_connection_t *conn)
     tor_zlib_free(conn->zlib_state);
     conn->zlib_state = NULL;
   }
+  if (conn->spool_compressed && !conn->spool_compressed_sent_any) {
+    /* We found none of the bodies we were asked for.  Send an empty zlib
+     * stream, just as a zlib stream that never got any data would. */
+    char *z = NULL;
+    size_t z_len = 0;
+    if (tor_gzip_compress(&z, &z_len, "", 0, ZLIB_METHOD) == 0)
+      connection_write_to_buf(z, z_len, TO_CONN(conn));
+    tor_free(z);
+  }
+  conn->spool_compressed = conn->spool_compressed_sent_any = 0;
   conn->dir_spool_src = DIR_SPOOL_NONE;
   return 0;
 }
@@ -3312,8 +3652,8 @@ connection_dirserv_finish_spooling(dir_connection_t *conn)
 /** Spooling helper: called when we're sending a bunch of server descriptors,
  * and the outbuf has become too empty. Pulls some entries from
  * fingerprint_stack, and writes the corresponding servers onto outbuf.  If we
- * run out of entries, flushes the zlib state and sets the spool source to
- * NONE.  Returns 0 on success, negative on failure.
+ * run out of entries, finishes any compressed stream and sets the spool
+ * source to NONE.  Returns 0 on success, negative on failure.
  */
 static int
 connection_dirserv_add_servers_to_outbuf(dir_connection_t *conn)
@@ -3352,26 +3692,16 @@ connection_dirserv_add_servers_to_outbuf(dir_connection_t *conn)
     sd->last_served_at = now;
 #endif
     body = signed_descriptor_get_body(sd);
-    if (conn->zlib_state) {
-      /* XXXX022 This 'last' business should actually happen on the last
-       * routerinfo, not on the last fingerprint. */
-      int last = ! smartlist_len(conn->fingerprint_stack);
-      connection_write_to_buf_zlib(body, sd->signed_descriptor_len, conn,
-                                   last);
-      if (last) {
-        tor_zlib_free(conn->zlib_state);
-        conn->zlib_state = NULL;
-      }
-    } else {
-      connection_write_to_buf(body,
-                              sd->signed_descriptor_len,
-                              TO_CONN(conn));
-    }
+    /* XXXX022 This 'last' business should actually happen on the last
+     * routerinfo, not on the last fingerprint. */
+    connection_dirserv_write_body(conn, sd->signed_descriptor_digest, body,
+                                  sd->signed_descriptor_len,
+                                  !smartlist_len(conn->fingerprint_stack));
   }
 
   if (!smartlist_len(conn->fingerprint_stack)) {
     /* We just wrote the last one; finish up. */
-    conn->dir_spool_src = DIR_SPOOL_NONE;
+    connection_dirserv_finish_spooling(conn);
     smartlist_free(conn->fingerprint_stack);
     conn->fingerprint_stack = NULL;
   }
@@ -3381,8 +3711,8 @@ connection_dirserv_add_servers_to_outbuf(dir_connection_t *conn)
 /** Spooling helper: called when we're sending a bunch of microdescriptors,
  * and the outbuf has become too empty. Pulls some entries from
  * fingerprint_stack, and writes the corresponding microdescs onto outbuf.  If
- * we run out of entries, flushes the zlib state and sets the spool source to
- * NONE.  Returns 0 on success, negative on failure.
+ * we run out of entries, finishes any compressed stream and sets the spool
+ * source to NONE.  Returns 0 on success, negative on failure.
  */
 static int
 connection_dirserv_add_microdescs_to_outbuf(dir_connection_t *conn)
@@ -3395,21 +3725,13 @@ connection_dirserv_add_microdescs_to_outbuf(dir_connection_t *conn)
     tor_free(fp256);
     if (!md)
       continue;
-    if (conn->zlib_state) {
-      /* XXXX022 This 'last' business should actually happen on the last
-       * routerinfo, not on the last fingerprint. */
-      int last = !smartlist_len(conn->fingerprint_stack);
-      connection_write_to_buf_zlib(md->body, md->bodylen, conn, last);
-      if (last) {
-        tor_zlib_free(conn->zlib_state);
-        conn->zlib_state = NULL;
-      }
-    } else {
-      connection_write_to_buf(md->body, md->bodylen, TO_CONN(conn));
-    }
+    /* XXXX022 This 'last' business should actually happen on the last
+     * routerinfo, not on the last fingerprint. */
+    connection_dirserv_write_body(conn, md->digest, md->body, md->bodylen,
+                                  !smartlist_len(conn->fingerprint_stack));
   }
   if (!smartlist_len(conn->fingerprint_stack)) {
-    conn->dir_spool_src = DIR_SPOOL_NONE;
+    connection_dirserv_finish_spooling(conn);
     smartlist_free(conn->fingerprint_stack);
     conn->fingerprint_stack = NULL;
   }
@@ -3540,6 +3862,7 @@ void
 dirserv_free_all(void)
 {
   dirserv_free_fingerprint_list();
+  dirserv_compressed_body_cache_free_all();
 
   cached_dir_decref(the_directory);
   clear_cached_dir(&the_runningrouters);
@@ -3554,5 +3877,9 @@ dirserv_free_all(void)
     strmap_free(cached_consensuses, _free_cached_dir);
     cached_consensuses = NULL;
   }
+  if (consensus_diff_bases) {
+    strmap_free(consensus_diff_bases, _free_consensus_diff_bases);
+    consensus_diff_bases = NULL;
+  }
 }
 
@@ -17,6 +17,7 @@
 #include <openssl/crypto.h>
 #endif
 #include "memarea.h"
+#include "timers.h"
 
 #ifdef HAVE_EVENT2_EVENT_H
 #include <event2/event.h>
@@ -34,24 +35,26 @@ static void conn_read_callback(int fd, short event, void *_conn);
 static void conn_write_callback(int fd, short event, void *_conn);
 static void signal_callback(int fd, short events, void *arg);
 static void second_elapsed_callback(int fd, short event, void *args);
+static void refill_callback(int fd, short event, void *args);
 static int conn_close_if_marked(int i);
+static void reap_marked_conns_and_circuits(int conns_only);
 static void connection_start_reading_from_linked_conn(connection_t *conn);
 static int connection_should_read_from_linked_conn(connection_t *conn);
 
 /********* START VARIABLES **********/
 
-int global_read_bucket; /**< Max number of bytes I can read this second. */
-int global_write_bucket; /**< Max number of bytes I can write this second. */
+int global_read_bucket; /**< Max number of bytes I can read right now. */
+int global_write_bucket; /**< Max number of bytes I can write right now. */
 
-/** Max number of relayed (bandwidth class 1) bytes I can read this second. */
+/** Max number of relayed (bandwidth class 1) bytes I can read right now. */
 int global_relayed_read_bucket;
-/** Max number of relayed (bandwidth class 1) bytes I can write this second. */
+/** Max number of relayed (bandwidth class 1) bytes I can write right now. */
 int global_relayed_write_bucket;
 
-/** What was the read bucket before the last second_elapsed_callback() call?
+/** What was the read bucket after the last refill_callback() call?
  * (used to determine how many bytes we've read). */
 static int stats_prev_global_read_bucket;
-/** What was the write bucket before the last second_elapsed_callback() call?
+/** What was the write bucket after the last refill_callback() call?
  * (used to determine how many bytes we've written). */
 static int stats_prev_global_write_bucket;
 /* XXX we might want to keep stats about global_relayed_*_bucket too. Or not.*/
@@ -59,6 +62,11 @@ static int stats_prev_global_write_bucket;
 static uint64_t stats_n_bytes_read = 0;
 /** How many bytes have we written since we started the process? */
 static uint64_t stats_n_bytes_written = 0;
+/** What was stats_n_bytes_read at the last second_elapsed_callback() call? */
+static uint64_t stats_prev_n_read = 0;
+/** What was stats_n_bytes_written at the last second_elapsed_callback()
+ * call? */
+static uint64_t stats_prev_n_written = 0;
 /** What time did this process start up? */
 time_t time_of_process_start = 0;
 /** How many seconds have we been running? */
@@ -86,6 +94,54 @@ static smartlist_t *active_linked_connection_lst = NULL;
  * to handle linked connections. */
 static int called_loop_once = 0;
 
+/** List of connections that have started or stopped reading or writing
+ * since the last time we told libevent about it. */
+static smartlist_t *conns_with_event_changes = NULL;
+/** Event that we make active to call connection_apply_event_changes() once
+ * libevent has run the callbacks that are ready now. */
+static struct event *apply_event_changes_ev = NULL;
+/** How many times have connections started or stopped reading or writing on
+ * their sockets? */
+static uint64_t stats_n_event_changes_requested = 0;
+/** How many times have we actually added or removed a connection's read or
+ * write event with libevent?  (Each is usually one epoll_ctl() or similar
+ * system call.) */
+static uint64_t stats_n_event_changes_applied = 0;
+/** Value of stats_n_event_changes_requested as of the last second. */
+static uint64_t stats_prev_n_event_changes_requested = 0;
+/** Value of stats_n_event_changes_applied as of the last second. */
+static uint64_t stats_prev_n_event_changes_applied = 0;
+/** How many event changes were requested in the last full second? */
+static uint64_t event_changes_requested_last_second = 0;
+/** How many event changes did we apply in the last full second? */
+static uint64_t event_changes_applied_last_second = 0;
+
+/** Most marked connections that we close in a single pass of
+ * reap_marked_conns_and_circuits(). */
+#define MAX_CONNS_CLOSED_PER_PASS 64
+/** Most marked circuits that we free in a single pass of
+ * reap_marked_conns_and_circuits(). */
+#define MAX_CIRCS_FREED_PER_PASS 256
+/** Most buffer chunks left over from freed connections that we release in a
+ * single pass of reap_marked_conns_and_circuits(). */
+#define MAX_BUF_CHUNKS_FREED_PER_PASS 256
+/** If we spend more than this many msec of a single second closing
+ * connections and freeing circuits, say so in the logs. */
+#define REAP_STALL_LOG_MSEC 100
+
+/** Event to finish closing the marked connections and circuits that
+ * reap_marked_conns_and_circuits() didn't get to, on the next trip through
+ * the event loop. */
+static struct event *reaper_event = NULL;
+/** How many connections have we closed since we started? */
+static uint64_t stats_n_conns_reaped = 0;
+/** How many usec have we spent closing connections and freeing circuits
+ * since the last call to second_elapsed_callback()? */
+static uint64_t reap_usec_this_second = 0;
+/** What's the largest number of usec we've spent closing connections and
+ * freeing circuits in any one second? */
+static uint64_t reap_usec_max_per_second = 0;
+
 /** We set this to 1 when we've opened a circuit, so we can print a log
  * entry to inform the user that Tor is working. */
 int has_completed_circuit=0;
@@ -139,6 +195,9 @@ connection_add(connection_t *conn)
          conn->s, EV_WRITE|EV_PERSIST, conn_write_callback, conn);
   }
 
+  if (conn->type == CONN_TYPE_OR || conn->type == CONN_TYPE_DIR)
+    connection_schedule_housekeeping(conn, approx_time());
+
   log_debug(LD_NET,"new conn type %s, socket %d, address %s, n_conns %d.",
             conn_type_to_string(conn->type), conn->s, conn->address,
             smartlist_len(connection_array));
@@ -150,6 +209,12 @@ connection_add(connection_t *conn)
 void
 connection_unregister_events(connection_t *conn)
 {
+  if (conn->event_change_pending) {
+    smartlist_remove(conns_with_event_changes, conn);
+    conn->event_change_pending = 0;
+  }
+  conn->want_read = conn->want_write = 0;
+  conn->read_event_added = conn->write_event_added = 0;
   if (conn->read_event) {
     if (event_del(conn->read_event))
       log_warn(LD_BUG, "Error removing read event for %d", conn->s);
@@ -184,6 +249,8 @@ connection_remove(connection_t *conn)
   tor_assert(conn->conn_array_index >= 0);
   current_index = conn->conn_array_index;
   connection_unregister_events(conn); /* This is redundant, but cheap. */
+  if (conn->housekeeping_timer)
+    wheel_timer_cancel(conn->housekeeping_timer);
   if (current_index == smartlist_len(connection_array)-1) { /* at the end */
     smartlist_del(connection_array, current_index);
     return 0;
@@ -221,7 +288,8 @@ connection_unlink(connection_t *conn)
     conn->linked_conn = NULL;
   }
   smartlist_remove(closeable_connection_lst, conn);
-  smartlist_remove(active_linked_connection_lst, conn);
+  if (conn->active_on_link)
+    smartlist_remove(active_linked_connection_lst, conn);
   if (conn->type == CONN_TYPE_EXIT) {
     assert_connection_edge_not_dns_pending(TO_EDGE_CONN(conn));
   }
@@ -246,14 +314,15 @@ add_connection_to_closeable_list(connection_t *conn)
 int
 connection_is_on_closeable_list(connection_t *conn)
 {
-  return smartlist_isin(closeable_connection_lst, conn);
+  return closeable_connection_lst &&
+    smartlist_isin(closeable_connection_lst, conn);
 }
 
 /** Return true iff conn is in the current poll array. */
 int
 connection_in_array(connection_t *conn)
 {
-  return smartlist_isin(connection_array, conn);
+  return connection_array && smartlist_isin(connection_array, conn);
 }
 
 /** Set <b>*array</b> to an array of all connections, and <b>*n</b>
@@ -285,14 +354,102 @@ connection_watch_events(connection_t *conn, watchable_events_t events)
     connection_stop_writing(conn);
 }
 
+/** Libevent callback: tell libevent about the connections that have
+ * started or stopped reading or writing. */
+static void
+apply_event_changes_callback(int fd, short event, void *arg)
+{
+  (void)fd;
+  (void)event;
+  (void)arg;
+  connection_apply_event_changes();
+}
+
+/** Note that <b>conn</b> has just started or stopped reading or writing.
+ * Rather than adding or removing its event with libevent right away, we
+ * wait until libevent has run every callback that's ready, and then make
+ * all the changes at once: that way a connection that stops reading and
+ * starts again before then (as rate-limited connections often do) costs
+ * no system calls at all. */
+static void
+connection_note_event_change(connection_t *conn)
+{
+  ++stats_n_event_changes_requested;
+  if (conn->event_change_pending)
+    return;
+  if (!conns_with_event_changes)
+    conns_with_event_changes = smartlist_create();
+  smartlist_add(conns_with_event_changes, conn);
+  conn->event_change_pending = 1;
+  if (smartlist_len(conns_with_event_changes) == 1) {
+    if (!apply_event_changes_ev)
+      apply_event_changes_ev = tor_evtimer_new(tor_libevent_get_base(),
+                                        apply_event_changes_callback, NULL);
+    event_active(apply_event_changes_ev, EV_TIMEOUT, 1);
+  }
+}
+
+/** Make libevent watch the read and write events of every connection that
+ * has started or stopped reading or writing since we last called this
+ * function, according to its want_read and want_write flags. */
+void
+connection_apply_event_changes(void)
+{
+  if (!conns_with_event_changes)
+    return;
+  SMARTLIST_FOREACH_BEGIN(conns_with_event_changes, connection_t *, conn) {
+    conn->event_change_pending = 0;
+    if (conn->want_read != conn->read_event_added) {
+      int r = conn->want_read ? event_add(conn->read_event, NULL)
+                              : event_del(conn->read_event);
+      ++stats_n_event_changes_applied;
+      if (r)
+        log_warn(LD_NET, "Error from libevent setting read event state for "
+                 "%d to %swatched: %s", conn->s, conn->want_read ? "" : "un",
+                 tor_socket_strerror(tor_socket_errno(conn->s)));
+      else
+        conn->read_event_added = conn->want_read;
+    }
+    if (conn->want_write != conn->write_event_added) {
+      int r = conn->want_write ? event_add(conn->write_event, NULL)
+                               : event_del(conn->write_event);
+      ++stats_n_event_changes_applied;
+      if (r)
+        log_warn(LD_NET, "Error from libevent setting write event state for "
+                 "%d to %swatched: %s", conn->s, conn->want_write ? "" : "un",
+                 tor_socket_strerror(tor_socket_errno(conn->s)));
+      else
+        conn->write_event_added = conn->want_write;
+    }
+  } SMARTLIST_FOREACH_END(conn);
+  smartlist_clear(conns_with_event_changes);
+}
+
+/** Return a newly allocated string describing how often connections have
+ * started or stopped reading or writing, and how often we've actually had
+ * to tell libevent about it, for the "event-changes" GETINFO key. */
+char *
+connection_get_event_change_status(void)
+{
+  char buf[256];
+  tor_snprintf(buf, sizeof(buf),
+               "Requested="U64_FORMAT" Applied="U64_FORMAT" "
+               "RequestedLastSecond="U64_FORMAT" "
+               "AppliedLastSecond="U64_FORMAT"\r\n",
+               U64_PRINTF_ARG(stats_n_event_changes_requested),
+               U64_PRINTF_ARG(stats_n_event_changes_applied),
+               U64_PRINTF_ARG(event_changes_requested_last_second),
+               U64_PRINTF_ARG(event_changes_applied_last_second));
+  return tor_strdup(buf);
+}
+
 /** Return true iff <b>conn</b> is listening for read events. */
 int
 connection_is_reading(connection_t *conn)
 {
   tor_assert(conn);
 
-  return conn->reading_from_linked_conn ||
-    (conn->read_event && event_pending(conn->read_event, EV_READ, NULL));
+  return conn->reading_from_linked_conn || conn->want_read;
 }
 
 /** Tell the main loop to stop notifying <b>conn</b> of any read events. */
@@ -305,12 +462,9 @@ connection_stop_reading(connection_t *conn)
   if (conn->linked) {
     conn->reading_from_linked_conn = 0;
     connection_stop_reading_from_linked_conn(conn);
-  } else {
-    if (event_del(conn->read_event))
-      log_warn(LD_NET, "Error from libevent setting read event state for %d "
-               "to unwatched: %s",
-               conn->s,
-               tor_socket_strerror(tor_socket_errno(conn->s)));
+  } else if (conn->want_read) {
+    conn->want_read = 0;
+    connection_note_event_change(conn);
   }
 }
 
@@ -325,12 +479,9 @@ connection_start_reading(connection_t *conn)
     conn->reading_from_linked_conn = 1;
     if (connection_should_read_from_linked_conn(conn))
       connection_start_reading_from_linked_conn(conn);
-  } else {
-    if (event_add(conn->read_event, NULL))
-      log_warn(LD_NET, "Error from libevent setting read event state for %d "
-               "to watched: %s",
-               conn->s,
-               tor_socket_strerror(tor_socket_errno(conn->s)));
+  } else if (!conn->want_read) {
+    conn->want_read = 1;
+    connection_note_event_change(conn);
   }
 }
 
@@ -340,8 +491,7 @@ connection_is_writing(connection_t *conn)
 {
   tor_assert(conn);
 
-  return conn->writing_to_linked_conn ||
-    (conn->write_event && event_pending(conn->write_event, EV_WRITE, NULL));
+  return conn->writing_to_linked_conn || conn->want_write;
 }
 
 /** Tell the main loop to stop notifying <b>conn</b> of any write events. */
@@ -355,12 +505,9 @@ connection_stop_writing(connection_t *conn)
     conn->writing_to_linked_conn = 0;
     if (conn->linked_conn)
       connection_stop_reading_from_linked_conn(conn->linked_conn);
-  } else {
-    if (event_del(conn->write_event))
-      log_warn(LD_NET, "Error from libevent setting write event state for %d "
-               "to unwatched: %s",
-               conn->s,
-               tor_socket_strerror(tor_socket_errno(conn->s)));
+  } else if (conn->want_write) {
+    conn->want_write = 0;
+    connection_note_event_change(conn);
   }
 }
 
@@ -376,12 +523,9 @@ connection_start_writing(connection_t *conn)
     if (conn->linked_conn &&
         connection_should_read_from_linked_conn(conn->linked_conn))
       connection_start_reading_from_linked_conn(conn->linked_conn);
-  } else {
-    if (event_add(conn->write_event, NULL))
-      log_warn(LD_NET, "Error from libevent setting write event state for %d "
-               "to watched: %s",
-               conn->s,
-               tor_socket_strerror(tor_socket_errno(conn->s)));
+  } else if (!conn->want_write) {
+    conn->want_write = 1;
+    connection_note_event_change(conn);
   }
 }
 
@@ -447,19 +591,79 @@ connection_stop_reading_from_linked_conn(connection_t *conn)
   }
 }
 
-/** Close all connections that have been scheduled to get closed. */
-static void
+/** Close up to MAX_CONNS_CLOSED_PER_PASS of the connections that have been
+ * scheduled to get closed.  Return true iff there are more that we could
+ * close right away. */
+static int
 close_closeable_connections(void)
 {
-  int i;
-  for (i = 0; i < smartlist_len(closeable_connection_lst); ) {
-    connection_t *conn = smartlist_get(closeable_connection_lst, i);
-    if (conn->conn_array_index < 0) {
+  smartlist_t *batch;
+  int n_closed = 0, n_held = 0;
+
+  if (!smartlist_len(closeable_connection_lst))
+    return 0;
+  /* Take the whole list, so that connection_unlink() doesn't have to search
+   * a long list for every connection we close.  Whatever we don't close
+   * goes back on the new list, along with anything marked meanwhile. */
+  batch = closeable_connection_lst;
+  closeable_connection_lst = smartlist_create();
+  SMARTLIST_FOREACH_BEGIN(batch, connection_t *, conn) {
+    if (n_closed >= MAX_CONNS_CLOSED_PER_PASS) {
+      smartlist_add(closeable_connection_lst, conn);
+    } else if (conn->conn_array_index < 0) {
       connection_unlink(conn); /* blow it away right now */
+      ++n_closed;
+    } else if (conn_close_if_marked(conn->conn_array_index)) {
+      ++n_closed;
     } else {
-      if (!conn_close_if_marked(conn->conn_array_index))
-        ++i;
+      /* Still flushing; we'll try again when it's writable. */
+      smartlist_add(closeable_connection_lst, conn);
+      ++n_held;
     }
+  } SMARTLIST_FOREACH_END(conn);
+  smartlist_free(batch);
+  stats_n_conns_reaped += n_closed;
+
+  return smartlist_len(closeable_connection_lst) > n_held;
+}
+
+/** Libevent callback: finish closing marked connections and freeing marked
+ * circuits. */
+static void
+reaper_callback(int fd, short event, void *args)
+{
+  (void)fd;
+  (void)event;
+  (void)args;
+  reap_marked_conns_and_circuits(0);
+}
+
+/** Close marked connections and, unless <b>conns_only</b> is set, free
+ * marked circuits and the buffers of closed connections.  Do only a bounded
+ * amount of work, so that a burst of closes (say, when a busy relay we're
+ * connected to restarts) can't stall the main loop; if there's work left
+ * over, arrange to come back to it on the next trip through the loop. */
+static void
+reap_marked_conns_and_circuits(int conns_only)
+{
+  uint64_t start = tor_gettime_monotonic_usec();
+  int more = close_closeable_connections();
+
+  if (!conns_only) {
+    if (circuit_close_marked(MAX_CIRCS_FREED_PER_PASS))
+      more = 1;
+    if (buf_free_some_deferred(MAX_BUF_CHUNKS_FREED_PER_PASS))
+      more = 1;
+  }
+  reap_usec_this_second += tor_gettime_monotonic_usec() - start;
+
+  if (more) {
+    struct timeval no_time = { 0, 0 };
+    if (!reaper_event)
+      reaper_event = tor_evtimer_new(tor_libevent_get_base(),
+                                     reaper_callback, NULL);
+    if (event_add(reaper_event, &no_time) < 0)
+      log_warn(LD_BUG, "Couldn't schedule event to close connections.");
   }
 }
 
@@ -474,6 +678,11 @@ conn_read_callback(int fd, short event, void *_conn)
 
   log_debug(LD_NET,"socket %d wants to read.",conn->s);
 
+  /* We may have stopped reading since libevent found this event ready;
+   * if so, we just haven't told libevent yet. */
+  if (!conn->linked && !conn->want_read)
+    return;
+
   /* assert_connection_ok(conn, time(NULL)); */
 
   if (connection_handle_read(conn) < 0) {
@@ -492,7 +701,7 @@ conn_read_callback(int fd, short event, void *_conn)
   assert_connection_ok(conn, time(NULL));
 
   if (smartlist_len(closeable_connection_lst))
-    close_closeable_connections();
+    reap_marked_conns_and_circuits(1);
 }
 
 /** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
@@ -506,6 +715,10 @@ conn_write_callback(int fd, short events, void *_conn)
 
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "socket %d wants to write.",conn->s));
 
+  /* As in conn_read_callback(), we may have stopped writing already. */
+  if (!conn->linked && !conn->want_write)
+    return;
+
   /* assert_connection_ok(conn, time(NULL)); */
 
   if (connection_handle_write(conn, 0) < 0) {
@@ -529,7 +742,7 @@ conn_write_callback(int fd, short events, void *_conn)
   assert_connection_ok(conn, time(NULL));
 
   if (smartlist_len(closeable_connection_lst))
-    close_closeable_connections();
+    reap_marked_conns_and_circuits(1);
 }
 
 /** If the connection at connection_array[i] is marked for close, then:
@@ -687,31 +900,33 @@ directory_info_has_arrived(time_t now, int from_cache)
 }
 
 /** Perform regular maintenance tasks for a single connection.  This
- * function gets run once per second per connection by run_scheduled_events.
+ * function gets run from the housekeeping timer wheel, whenever something
+ * about <b>conn</b> might need attention.  Return the next time that we
+ * need to check it, or 0 if we don't need to check it again.
  */
-static void
-run_connection_housekeeping(int i, time_t now)
+static time_t
+run_connection_housekeeping(connection_t *conn, time_t now)
 {
   cell_t cell;
-  connection_t *conn = smartlist_get(connection_array, i);
   or_options_t *options = get_options();
   or_connection_t *or_conn;
+  time_t next_check;
 
   if (conn->outbuf && !buf_datalen(conn->outbuf) && conn->type == CONN_TYPE_OR)
     TO_OR_CONN(conn)->timestamp_lastempty = now;
 
   if (conn->marked_for_close) {
     /* nothing to do here */
-    return;
+    return 0;
   }
 
   /* Expire any directory connections that haven't been active (sent
    * if a server or received if a client) for 5 min */
-  if (conn->type == CONN_TYPE_DIR &&
-      ((DIR_CONN_IS_SERVER(conn) &&
-        conn->timestamp_lastwritten + DIR_CONN_MAX_STALL < now) ||
-       (!DIR_CONN_IS_SERVER(conn) &&
-        conn->timestamp_lastread + DIR_CONN_MAX_STALL < now))) {
+  if (conn->type == CONN_TYPE_DIR) {
+    time_t last_active = DIR_CONN_IS_SERVER(conn) ?
+      conn->timestamp_lastwritten : conn->timestamp_lastread;
+    if (last_active + DIR_CONN_MAX_STALL >= now)
+      return last_active + DIR_CONN_MAX_STALL + 1;
     log_info(LD_DIR,"Expiring wedged directory conn (fd %d, purpose %d)",
              conn->s, conn->purpose);
     /* This check is temporary; it's to let us know whether we should consider
@@ -724,11 +939,11 @@ run_connection_housekeeping(int i, time_t now)
     } else {
       connection_mark_for_close(conn);
     }
-    return;
+    return 0;
   }
 
   if (!connection_speaks_cells(conn))
-    return; /* we're all done here, the rest is just for OR conns */
+    return 0; /* we're all done here, the rest is just for OR conns */
 
   or_conn = TO_OR_CONN(conn);
 
@@ -744,7 +959,7 @@ run_connection_housekeeping(int i, time_t now)
                                    "Tor gave up on the connection");
     connection_mark_for_close(conn);
     conn->hold_open_until_flushed = 1;
-    return;
+    return 0;
   }
 
   /* If we haven't written to an OR connection for a while, then either nuke
@@ -758,6 +973,7 @@ run_connection_housekeeping(int i, time_t now)
                conn->s,conn->address, conn->port);
       connection_mark_for_close(conn);
       conn->hold_open_until_flushed = 1;
+      return 0;
     } else if (we_are_hibernating() && !or_conn->n_circuits &&
                !buf_datalen(conn->outbuf)) {
       /* We're hibernating, there's no circuits, and nothing to flush.*/
@@ -766,6 +982,7 @@ run_connection_housekeeping(int i, time_t now)
                conn->s,conn->address, conn->port);
       connection_mark_for_close(conn);
       conn->hold_open_until_flushed = 1;
+      return 0;
     } else if (!clique_mode(options) && !or_conn->n_circuits &&
                now >= or_conn->timestamp_last_added_nonpadding +
                                            maxCircuitlessPeriod &&
@@ -776,6 +993,7 @@ run_connection_housekeeping(int i, time_t now)
                conn->s,conn->address, conn->port);
       connection_mark_for_close(conn);
       conn->hold_open_until_flushed = 1;
+      return 0;
     } else if (
          now >= or_conn->timestamp_lastempty + options->KeepalivePeriod*10 &&
          now >= conn->timestamp_lastwritten + options->KeepalivePeriod*10) {
@@ -786,6 +1004,7 @@ run_connection_housekeeping(int i, time_t now)
              (int)buf_datalen(conn->outbuf),
              (int)(now-conn->timestamp_lastwritten));
       connection_mark_for_close(conn);
+      return 0;
     } else if (!buf_datalen(conn->outbuf)) {
       /* either in clique mode, or we've got a circuit. send a padding cell. */
       log_fn(LOG_DEBUG,LD_OR,"Sending keepalive to (%s:%d)",
@@ -795,6 +1014,77 @@ run_connection_housekeeping(int i, time_t now)
       connection_or_write_cell_to_buf(&cell, or_conn);
     }
   }
+
+  /* Check again when the keepalive period next runs out, or in a second if
+   * it already has and we couldn't do anything about it yet. */
+  next_check = conn->timestamp_lastwritten + options->KeepalivePeriod;
+  if (next_check <= now)
+    next_check = now + 1;
+  return next_check;
+}
+
+/** Timer wheel for connection housekeeping and for periodic tasks.  Its
+ * ticks are seconds on the monotonic clock, so that setting the system
+ * clock back or forward doesn't stall our timers or make them all fire at
+ * once; run_scheduled_events() advances it. */
+static timer_wheel_t *housekeeping_wheel = NULL;
+
+/** Return the current tick for the housekeeping timer wheel. */
+static uint64_t
+housekeeping_wheel_now(void)
+{
+  return tor_gettime_monotonic_usec() / 1000000;
+}
+
+/** Return the housekeeping timer wheel, creating it if necessary. */
+static timer_wheel_t *
+get_housekeeping_wheel(void)
+{
+  if (!housekeeping_wheel)
+    housekeeping_wheel = timer_wheel_new(housekeeping_wheel_now());
+  return housekeeping_wheel;
+}
+
+/** Return the housekeeping tick at which the time of day will be
+ * <b>when</b>, going by the clock as it is now. */
+static uint64_t
+housekeeping_tick_for_time(time_t when)
+{
+  time_t now = approx_time();
+  uint64_t tick = housekeeping_wheel_now();
+  return when > now ? tick + (uint64_t)(when - now) : tick;
+}
+
+/** Timer callback: do housekeeping for the connection <b>arg</b>, and
+ * reschedule <b>timer</b> for the next time it needs any. */
+static void
+connection_housekeeping_cb(wheel_timer_t *timer, void *arg, uint64_t tick)
+{
+  connection_t *conn = arg;
+  time_t next_check = run_connection_housekeeping(conn, approx_time());
+  (void)tick;
+  if (next_check)
+    wheel_timer_schedule(housekeeping_wheel, timer,
+                         housekeeping_tick_for_time(next_check));
+}
+
+/** Make sure that we do housekeeping for <b>conn</b> no later than
+ * <b>when</b>: for example, because it might have just become idle.  If
+ * <b>when</b> has already passed, we do it the next time we run scheduled
+ * events. */
+void
+connection_schedule_housekeeping(connection_t *conn, time_t when)
+{
+  timer_wheel_t *wheel = get_housekeeping_wheel();
+  uint64_t tick = housekeeping_tick_for_time(when);
+  if (!conn->housekeeping_timer) {
+    conn->housekeeping_timer =
+      wheel_timer_new(connection_housekeeping_cb, conn);
+  } else if (wheel_timer_is_scheduled(conn->housekeeping_timer) &&
+             wheel_timer_get_when(conn->housekeeping_timer) <= tick) {
+    return;
+  }
+  wheel_timer_schedule(wheel, conn->housekeeping_timer, tick);
 }
 
 /** Honor a NEWNYM request: make future requests unlinkable to past
@@ -808,6 +1098,280 @@ signewnym_impl(time_t now)
   signewnym_is_pending = 0;
 }
 
+/** Periodic task: launch any router descriptor downloads we need.  Return
+ * the number of seconds until we should run again. */
+static int
+fetch_descriptors_task(time_t now, or_options_t *options)
+{
+  update_router_descriptor_downloads(now);
+  update_extrainfo_downloads(now);
+  if (options->UseBridges)
+    fetch_bridge_descriptors(now);
+  if (router_have_minimum_dir_info())
+    return LAZY_DESCRIPTOR_RETRY_INTERVAL;
+  else
+    return GREEDY_DESCRIPTOR_RETRY_INTERVAL;
+}
+
+/** Periodic task: forgive descriptors that we failed to download. */
+static int
+reset_descriptor_failures_task(time_t now, or_options_t *options)
+{
+  (void)now;
+  (void)options;
+  router_reset_descriptor_download_failures();
+  return DESCRIPTOR_FAILURE_RESET_INTERVAL;
+}
+
+/** How often do we add more entropy to OpenSSL's RNG pool? */
+#define ENTROPY_INTERVAL (60*60)
+
+/** Periodic task: add more entropy to OpenSSL's RNG pool.  We seeded it at
+ * startup, so this doesn't run until ENTROPY_INTERVAL after that. */
+static int
+add_entropy_task(time_t now, or_options_t *options)
+{
+  (void)now;
+  (void)options;
+  /* We already seeded once, so don't die on failure. */
+  crypto_seed_rng(0);
+  return ENTROPY_INTERVAL;
+}
+
+/** Periodic task: discount older stability information so that new
+ * stability info counts more. */
+static int
+downrate_stability_task(time_t now, or_options_t *options)
+{
+  time_t next = rep_hist_downrate_old_runs(now);
+  (void)options;
+  return next > now ? (int)(next - now) : 1;
+}
+
+/** How often do we save stability information to disk, if we're an
+ * authority that tests reachability? */
+#define SAVE_STABILITY_INTERVAL (30*60)
+
+/** Periodic task: if we're an authority that tests reachability, save the
+ * stability information to disk. */
+static int
+save_stability_task(time_t now, or_options_t *options)
+{
+  if (authdir_mode_tests_reachability(options) &&
+      rep_hist_record_mtbf_data(now, 1)<0) {
+    log_warn(LD_GENERAL, "Couldn't store mtbf data.");
+  }
+  return SAVE_STABILITY_INTERVAL;
+}
+
+/** How often do we check whether our v3 authority certificate is close to
+ * expiring? */
+#define CHECK_V3_CERTIFICATE_INTERVAL (5*60)
+
+/** Periodic task: if we're a v3 authority, check whether our cert is close
+ * to expiring and warn the admin if it is. */
+static int
+check_v3_certificate_task(time_t now, or_options_t *options)
+{
+  (void)now;
+  (void)options;
+  v3_authority_check_key_expiry();
+  return CHECK_V3_CERTIFICATE_INTERVAL;
+}
+
+/*XXXX RD: This value needs to be the same as REASONABLY_LIVE_TIME in
+ * networkstatus_get_reasonably_live_consensus(), but that value is way
+ * way too high.  Arma: is the bridge issue there resolved yet? -NM */
+#define NS_EXPIRY_SLOP (24*60*60)
+/** How often do we check whether our networkstatus has expired? */
+#define CHECK_EXPIRED_NS_INTERVAL (2*60)
+
+/** Periodic task: check whether our networkstatus has expired. */
+static int
+check_expired_networkstatus_task(time_t now, or_options_t *options)
+{
+  networkstatus_t *ns = networkstatus_get_latest_consensus();
+  (void)options;
+  if (ns && ns->valid_until < now+NS_EXPIRY_SLOP &&
+      router_have_minimum_dir_info()) {
+    router_dir_info_changed();
+  }
+  return CHECK_EXPIRED_NS_INTERVAL;
+}
+
+/** How often do we remove old information from rephist and the rend
+ * cache? */
+#define CLEAN_CACHES_INTERVAL (30*60)
+
+/** Periodic task: remove old information from rephist and the rend
+ * cache. */
+static int
+clean_caches_task(time_t now, or_options_t *options)
+{
+  rep_history_clean(now - options->RephistTrackTime);
+  rend_cache_clean();
+  rend_cache_clean_v2_descs_as_dir();
+  return CLEAN_CACHES_INTERVAL;
+}
+
+/** How often do we retry initializing DNS, if it failed? */
+#define RETRY_DNS_INTERVAL (10*60)
+
+/** Periodic task: if we're a server and initializing dns failed, retry. */
+static int
+retry_dns_task(time_t now, or_options_t *options)
+{
+  (void)now;
+  if (server_mode(options) && has_dns_init_failed())
+    dns_init();
+  return RETRY_DNS_INTERVAL;
+}
+
+/** Periodic task: relaunch listeners if any died. */
+static int
+check_listeners_task(time_t now, or_options_t *options)
+{
+  (void)now;
+  (void)options;
+  if (we_are_hibernating())
+    return 1;
+  retry_all_listeners(NULL, NULL);
+  return 60;
+}
+
+/** How often do we look for OR connections that are too old, or that have
+ * better connections to the same router, and mark them bad for new
+ * circuits? */
+#define SET_BAD_CONNECTIONS_INTERVAL (10)
+
+/** Periodic task: mark OR connections that new circuits shouldn't use.
+ * Marking a connection with no circuits also schedules it for
+ * housekeeping, which will close it. */
+static int
+set_bad_connections_task(time_t now, or_options_t *options)
+{
+  (void)now;
+  (void)options;
+  connection_or_set_bad_connections();
+  return SET_BAD_CONNECTIONS_INTERVAL;
+}
+
+/** How often do we check buffers and pools for empty space that can be
+ * deallocated? */
+#define MEM_SHRINK_INTERVAL (60)
+
+/** Periodic task: free unused space in buffers and pools. */
+static int
+shrink_memory_task(time_t now, or_options_t *options)
+{
+  (void)now;
+  (void)options;
+  SMARTLIST_FOREACH(connection_array, connection_t *, conn, {
+      if (conn->outbuf)
+        buf_shrink(conn->outbuf);
+      if (conn->inbuf)
+        buf_shrink(conn->inbuf);
+      if (conn->type == CONN_TYPE_OR)
+        connection_or_clear_cell_magazine(TO_OR_CONN(conn));
+    });
+  clean_cell_pool();
+  buf_shrink_freelists(0);
+  return MEM_SHRINK_INTERVAL;
+}
+
+/** How often do we write hidden service usage statistics and the bridge
+ * networkstatus file to disk, if we're configured to? */
+#define WRITE_HSUSAGE_INTERVAL (30*60)
+#define BRIDGE_STATUSFILE_INTERVAL (30*60)
+
+/** Periodic task: write hidden service usage statistics to disk. */
+static int
+write_hs_statistics_task(time_t now, or_options_t *options)
+{
+  if (options->HSAuthorityRecordStats)
+    hs_usage_write_statistics_to_file(now);
+  return WRITE_HSUSAGE_INTERVAL;
+}
+
+/** Periodic task: write the bridge networkstatus file to disk. */
+static int
+write_bridge_status_file_task(time_t now, or_options_t *options)
+{
+  if (options->BridgeAuthoritativeDir)
+    networkstatus_dump_bridge_status_to_file(now);
+  return BRIDGE_STATUSFILE_INTERVAL;
+}
+
+/** A task that we run every so often from the housekeeping timer wheel. */
+typedef struct periodic_task_t {
+  /** Run the task, and return how many seconds to wait before running it
+   * again. */
+  int (*fn)(time_t now, or_options_t *options);
+  /** How long after startup do we first run the task? */
+  int initial_delay;
+  /** Timer for the next run of the task. */
+  wheel_timer_t *timer;
+} periodic_task_t;
+
+/** All of our periodic tasks. */
+static periodic_task_t periodic_tasks[] = {
+  { fetch_descriptors_task, 0, NULL },
+  { reset_descriptor_failures_task, 0, NULL },
+  { add_entropy_task, ENTROPY_INTERVAL, NULL },
+  { downrate_stability_task, 0, NULL },
+  { save_stability_task, SAVE_STABILITY_INTERVAL, NULL },
+  { check_v3_certificate_task, 0, NULL },
+  { check_expired_networkstatus_task, 0, NULL },
+  { clean_caches_task, 0, NULL },
+  { retry_dns_task, 0, NULL },
+  { check_listeners_task, 0, NULL },
+  { set_bad_connections_task, 0, NULL },
+  { shrink_memory_task, 0, NULL },
+  { write_hs_statistics_task, 0, NULL },
+  { write_bridge_status_file_task, 0, NULL },
+  { NULL, 0, NULL }
+};
+
+/** Timer callback: run the periodic task <b>arg</b>, and reschedule
+ * <b>timer</b> for its next run. */
+static void
+periodic_task_cb(wheel_timer_t *timer, void *arg, uint64_t tick)
+{
+  periodic_task_t *task = arg;
+  int delay = task->fn(approx_time(), get_options());
+  if (delay < 1)
+    delay = 1;
+  wheel_timer_schedule(housekeeping_wheel, timer, tick + delay);
+}
+
+/** Schedule each periodic task for its first run. */
+static void
+periodic_tasks_init(void)
+{
+  timer_wheel_t *wheel = get_housekeeping_wheel();
+  uint64_t tick = housekeeping_wheel_now();
+  periodic_task_t *task;
+  for (task = periodic_tasks; task->fn; ++task) {
+    if (!task->timer)
+      task->timer = wheel_timer_new(periodic_task_cb, task);
+    wheel_timer_schedule(wheel, task->timer, tick + task->initial_delay);
+  }
+}
+
+/** Release all storage held by the periodic tasks and the housekeeping
+ * timer wheel. */
+static void
+periodic_tasks_free_all(void)
+{
+  periodic_task_t *task;
+  for (task = periodic_tasks; task->fn; ++task) {
+    wheel_timer_free(task->timer);
+    task->timer = NULL;
+  }
+  timer_wheel_free(housekeeping_wheel);
+  housekeeping_wheel = NULL;
+}
+
 /** Perform regular maintenance tasks.  This function gets run once per
  * second by second_elapsed_callback().
  */
@@ -815,25 +1379,11 @@ static void
 run_scheduled_events(time_t now)
 {
   static time_t last_rotated_x509_certificate = 0;
-  static time_t time_to_check_v3_certificate = 0;
-  static time_t time_to_check_listeners = 0;
   static time_t time_to_check_descriptor = 0;
   static time_t time_to_check_ipaddress = 0;
-  static time_t time_to_shrink_memory = 0;
-  static time_t time_to_try_getting_descriptors = 0;
-  static time_t time_to_reset_descriptor_failures = 0;
-  static time_t time_to_add_entropy = 0;
-  static time_t time_to_write_hs_statistics = 0;
-  static time_t time_to_write_bridge_status_file = 0;
-  static time_t time_to_downrate_stability = 0;
-  static time_t time_to_save_stability = 0;
-  static time_t time_to_clean_caches = 0;
   static time_t time_to_recheck_bandwidth = 0;
-  static time_t time_to_check_for_expired_networkstatus = 0;
   static time_t time_to_write_stats_files = 0;
-  static time_t time_to_retry_dns_init = 0;
   or_options_t *options = get_options();
-  int i;
   int have_dir_info;
 
   /** 0. See if we've been asked to shut down and our timeout has
@@ -866,23 +1416,6 @@ run_scheduled_events(time_t now)
       router_upload_dir_desc_to_dirservers(0);
   }
 
-  if (time_to_try_getting_descriptors < now) {
-    update_router_descriptor_downloads(now);
-    update_extrainfo_downloads(now);
-    if (options->UseBridges)
-      fetch_bridge_descriptors(now);
-    if (router_have_minimum_dir_info())
-      time_to_try_getting_descriptors = now + LAZY_DESCRIPTOR_RETRY_INTERVAL;
-    else
-      time_to_try_getting_descriptors = now + GREEDY_DESCRIPTOR_RETRY_INTERVAL;
-  }
-
-  if (time_to_reset_descriptor_failures < now) {
-    router_reset_descriptor_download_failures();
-    time_to_reset_descriptor_failures =
-      now + DESCRIPTOR_FAILURE_RESET_INTERVAL;
-  }
-
   /** 1b. Every MAX_SSL_KEY_LIFETIME seconds, we change our TLS context. */
   if (!last_rotated_x509_certificate)
     last_rotated_x509_certificate = now;
@@ -898,16 +1431,6 @@ run_scheduled_events(time_t now)
      * connection_run_housekeeping() above. */
   }
 
-  if (time_to_add_entropy < now) {
-    if (time_to_add_entropy) {
-      /* We already seeded once, so don't die on failure. */
-      crypto_seed_rng(0);
-    }
-/** How often do we add more entropy to OpenSSL's RNG pool? */
-#define ENTROPY_INTERVAL (60*60)
-    time_to_add_entropy = now + ENTROPY_INTERVAL;
-  }
-
   /** 1c. If we have to change the accounting interval or record
    * bandwidth used in this accounting interval, do so. */
   if (accounting_is_enabled(options))
@@ -919,46 +1442,7 @@ run_scheduled_events(time_t now)
     dirserv_test_reachability(now, 0);
   }
 
-  /** 1d. Periodically, we discount older stability information so that new
-   * stability info counts more, and save the stability information to disk as
-   * appropriate. */
-  if (time_to_downrate_stability < now)
-    time_to_downrate_stability = rep_hist_downrate_old_runs(now);
-  if (authdir_mode_tests_reachability(options)) {
-    if (time_to_save_stability < now) {
-      if (time_to_save_stability && rep_hist_record_mtbf_data(now, 1)<0) {
-        log_warn(LD_GENERAL, "Couldn't store mtbf data.");
-      }
-#define SAVE_STABILITY_INTERVAL (30*60)
-      time_to_save_stability = now + SAVE_STABILITY_INTERVAL;
-    }
-  }
-
-  /* 1e. Periodically, if we're a v3 authority, we check whether our cert is
-   * close to expiring and warn the admin if it is. */
-  if (time_to_check_v3_certificate < now) {
-    v3_authority_check_key_expiry();
-#define CHECK_V3_CERTIFICATE_INTERVAL (5*60)
-    time_to_check_v3_certificate = now + CHECK_V3_CERTIFICATE_INTERVAL;
-  }
-
-  /* 1f. Check whether our networkstatus has expired.
-   */
-  if (time_to_check_for_expired_networkstatus < now) {
-    networkstatus_t *ns = networkstatus_get_latest_consensus();
-    /*XXXX RD: This value needs to be the same as REASONABLY_LIVE_TIME in
-     * networkstatus_get_reasonably_live_consensus(), but that value is way
-     * way too high.  Arma: is the bridge issue there resolved yet? -NM */
-#define NS_EXPIRY_SLOP (24*60*60)
-    if (ns && ns->valid_until < now+NS_EXPIRY_SLOP &&
-        router_have_minimum_dir_info()) {
-      router_dir_info_changed();
-    }
-#define CHECK_EXPIRED_NS_INTERVAL (2*60)
-    time_to_check_for_expired_networkstatus = now + CHECK_EXPIRED_NS_INTERVAL;
-  }
-
-  /* 1g. Check whether we should write statistics to disk.
+  /* 1d. Check whether we should write statistics to disk.
    */
   if (time_to_write_stats_files >= 0 && time_to_write_stats_files < now) {
 #define WRITE_STATS_INTERVAL (24*60*60)
@@ -997,23 +1481,6 @@ run_scheduled_events(time_t now)
     }
   }
 
-  /* Remove old information from rephist and the rend cache. */
-  if (time_to_clean_caches < now) {
-    rep_history_clean(now - options->RephistTrackTime);
-    rend_cache_clean();
-    rend_cache_clean_v2_descs_as_dir();
-#define CLEAN_CACHES_INTERVAL (30*60)
-    time_to_clean_caches = now + CLEAN_CACHES_INTERVAL;
-  }
-
-#define RETRY_DNS_INTERVAL (10*60)
-  /* If we're a server and initializing dns failed, retry periodically. */
-  if (time_to_retry_dns_init < now) {
-    time_to_retry_dns_init = now + RETRY_DNS_INTERVAL;
-    if (server_mode(options) && has_dns_init_failed())
-      dns_init();
-  }
-
   /** 2. Periodically, we consider force-uploading our descriptor
    * (if we've passed our internal checks). */
 
@@ -1098,12 +1565,6 @@ run_scheduled_events(time_t now)
    */
   connection_expire_held_open();
 
-  /** 3d. And every 60 seconds, we relaunch listeners if any died. */
-  if (!we_are_hibernating() && time_to_check_listeners < now) {
-    retry_all_listeners(NULL, NULL);
-    time_to_check_listeners = now+60;
-  }
-
   /** 4. Every second, we try a new circuit if there are no valid
    *    circuits. Every NewCircuitPeriod seconds, we expire circuits
    *    that became dirty more than MaxCircuitDirtiness seconds ago,
@@ -1113,28 +1574,12 @@ run_scheduled_events(time_t now)
   if (have_dir_info && !we_are_hibernating())
     circuit_build_needed_circs(now);
 
-  /** 5. We do housekeeping for each connection... */
-  connection_or_set_bad_connections();
-  for (i=0;i<smartlist_len(connection_array);i++) {
-    run_connection_housekeeping(i, now);
-  }
-  if (time_to_shrink_memory < now) {
-    SMARTLIST_FOREACH(connection_array, connection_t *, conn, {
-        if (conn->outbuf)
-          buf_shrink(conn->outbuf);
-        if (conn->inbuf)
-          buf_shrink(conn->inbuf);
-      });
-    clean_cell_pool();
-    buf_shrink_freelists(0);
-/** How often do we check buffers and pools for empty space that can be
- * deallocated? */
-#define MEM_SHRINK_INTERVAL (60)
-    time_to_shrink_memory = now + MEM_SHRINK_INTERVAL;
-  }
+  /** 5. We do housekeeping for each connection that needs it, and run
+   * any periodic tasks whose time has come. */
+  timer_wheel_advance(get_housekeeping_wheel(), housekeeping_wheel_now());
 
   /** 6. And remove any marked circuits... */
-  circuit_close_all_marked();
+  reap_marked_conns_and_circuits(0);
 
   /** 7. And upload service descriptors if necessary. */
   if (has_completed_circuit && !we_are_hibernating()) {
@@ -1146,7 +1591,7 @@ run_scheduled_events(time_t now)
    * because if we marked a conn for close and left its socket -1, then
    * we'll pass it to poll/select and bad things will happen.
    */
-  close_closeable_connections();
+  reap_marked_conns_and_circuits(1);
 
   /** 8b. And if anything in our state is ready to get flushed to disk, we
    * flush it. */
@@ -1164,19 +1609,6 @@ run_scheduled_events(time_t now)
     }
   }
 
-  /** 10. write hidden service usage statistic to disk */
-  if (options->HSAuthorityRecordStats && time_to_write_hs_statistics < now) {
-    hs_usage_write_statistics_to_file(now);
-#define WRITE_HSUSAGE_INTERVAL (30*60)
-    time_to_write_hs_statistics = now+WRITE_HSUSAGE_INTERVAL;
-  }
-  /** 10b. write bridge networkstatus file to disk */
-  if (options->BridgeAuthoritativeDir &&
-      time_to_write_bridge_status_file < now) {
-    networkstatus_dump_bridge_status_to_file(now);
-#define BRIDGE_STATUSFILE_INTERVAL (30*60)
-    time_to_write_bridge_status_file = now+BRIDGE_STATUSFILE_INTERVAL;
-  }
 }
 
 /** Libevent timer: used to invoke second_elapsed_callback() once per
@@ -1189,9 +1621,10 @@ static int n_libevent_errors = 0;
 static void
 second_elapsed_callback(int fd, short event, void *args)
 {
-  /* XXXX This could be sensibly refactored into multiple callbacks, and we
-   * could use Libevent's timers for this rather than checking the current
-   * time against a bunch of timeouts every second. */
+  /* XXXX Connection housekeeping and the simpler periodic tasks now run from
+   * the housekeeping timer wheel; the rest of run_scheduled_events() could
+   * sensibly move there too, rather than checking the current time against
+   * a bunch of timeouts every second. */
   static struct timeval one_second;
   static time_t current_second = 0;
   time_t now;
@@ -1216,21 +1649,30 @@ second_elapsed_callback(int fd, short event, void *args)
   update_approx_time(now);
 
   /* the second has rolled over. check more stuff. */
-  bytes_written = stats_prev_global_write_bucket - global_write_bucket;
-  bytes_read = stats_prev_global_read_bucket - global_read_bucket;
+  bytes_written = (size_t)(stats_n_bytes_written - stats_prev_n_written);
+  bytes_read = (size_t)(stats_n_bytes_read - stats_prev_n_read);
   seconds_elapsed = current_second ? (int)(now - current_second) : 0;
-  stats_n_bytes_read += bytes_read;
-  stats_n_bytes_written += bytes_written;
+  stats_prev_n_read = stats_n_bytes_read;
+  stats_prev_n_written = stats_n_bytes_written;
+
+  if (reap_usec_this_second > reap_usec_max_per_second)
+    reap_usec_max_per_second = reap_usec_this_second;
+  if (reap_usec_this_second >= REAP_STALL_LOG_MSEC*1000)
+    log_info(LD_NET, "Spent %d msec in the last second closing connections "
+             "and freeing circuits.", (int)(reap_usec_this_second/1000));
+  reap_usec_this_second = 0;
+
+  event_changes_requested_last_second =
+    stats_n_event_changes_requested - stats_prev_n_event_changes_requested;
+  event_changes_applied_last_second =
+    stats_n_event_changes_applied - stats_prev_n_event_changes_applied;
+  stats_prev_n_event_changes_requested = stats_n_event_changes_requested;
+  stats_prev_n_event_changes_applied = stats_n_event_changes_applied;
   if (accounting_is_enabled(options) && seconds_elapsed >= 0)
     accounting_add_bytes(bytes_read, bytes_written, seconds_elapsed);
   control_event_bandwidth_used((uint32_t)bytes_read,(uint32_t)bytes_written);
   control_event_stream_bandwidth_used();
 
-  if (seconds_elapsed > 0)
-    connection_bucket_refill(seconds_elapsed, now);
-  stats_prev_global_read_bucket = global_read_bucket;
-  stats_prev_global_write_bucket = global_write_bucket;
-
   if (server_mode(options) &&
       !we_are_hibernating() &&
       seconds_elapsed > 0 &&
@@ -1290,6 +1732,55 @@ second_elapsed_callback(int fd, short event, void *args)
             "Error from libevent when setting one-second timeout event");
 }
 
+/** Libevent timer: used to invoke refill_callback() every
+ * TokenBucketRefillInterval msec. */
+static struct event *refill_event = NULL;
+
+/** Libevent callback: invoked every TokenBucketRefillInterval msec.  Notes
+ * how many bytes we've read and written since the last call, then refills
+ * the token buckets for the time that has passed.  Refilling in small
+ * steps, rather than once a second, keeps us from sending a full second's
+ * worth of traffic in one burst at the start of every second and then
+ * stalling for the rest of it. */
+static void
+refill_callback(int fd, short event, void *args)
+{
+  static uint64_t last_refill_usec = 0;
+  struct timeval interval;
+  uint64_t now_usec;
+  int msec_elapsed;
+  or_options_t *options = get_options();
+  (void)fd;
+  (void)event;
+  (void)args;
+  if (!refill_event) {
+    refill_event = tor_evtimer_new(tor_libevent_get_base(),
+                                   refill_callback, NULL);
+  }
+
+  now_usec = tor_gettime_monotonic_usec();
+  if (!last_refill_usec)
+    last_refill_usec = now_usec;
+  msec_elapsed = (int)((now_usec - last_refill_usec) / 1000);
+  /* Keep the leftover fraction of a msec for next time. */
+  last_refill_usec += (uint64_t)msec_elapsed * 1000;
+
+  stats_n_bytes_read += stats_prev_global_read_bucket - global_read_bucket;
+  stats_n_bytes_written +=
+    stats_prev_global_write_bucket - global_write_bucket;
+
+  if (msec_elapsed > 0)
+    connection_bucket_refill(msec_elapsed, approx_time());
+  stats_prev_global_read_bucket = global_read_bucket;
+  stats_prev_global_write_bucket = global_write_bucket;
+
+  interval.tv_sec = options->TokenBucketRefillInterval / 1000;
+  interval.tv_usec = (options->TokenBucketRefillInterval % 1000) * 1000;
+  if (event_add(refill_event, &interval))
+    log_err(LD_NET,
+            "Error from libevent when setting token bucket refill event");
+}
+
 #ifndef MS_WINDOWS
 /** Called when a possibly ignorable libevent error occurs; ensures that we
  * don't get into an infinite loop by ignoring too many errors from
@@ -1478,8 +1969,11 @@ do_main_loop(void)
     cpu_init();
   }
 
-  /* set up once-a-second callback. */
+  /* set up periodic tasks and the once-a-second callback. */
+  periodic_tasks_init();
   second_elapsed_callback(0,0,NULL);
+  /* set up the token bucket refill callback. */
+  refill_callback(0,0,NULL);
 
   for (;;) {
     if (nt_service_is_stopping())
@@ -1494,6 +1988,10 @@ do_main_loop(void)
                       event_active(conn->read_event, EV_READ, 1));
     called_loop_once = smartlist_len(active_linked_connection_lst) ? 1 : 0;
 
+    /* Tell libevent which connections started or stopped reading or writing
+     * since the loop last ran. */
+    connection_apply_event_changes();
+
     update_approx_time(time(NULL));
 
     /* poll until we have an event, or the second ends, or until we have
@@ -1693,12 +2191,21 @@ dumpstats(int severity)
       if (conn->type == CONN_TYPE_OR) {
         or_connection_t *or_conn = TO_OR_CONN(conn);
         if (or_conn->tls) {
+          uint64_t n_records;
+          uint64_t n_bytes;
           tor_tls_get_buffer_sizes(or_conn->tls, &rbuf_cap, &rbuf_len,
                                    &wbuf_cap, &wbuf_len);
           log(severity, LD_GENERAL,
               "Conn %d: %d/%d bytes used on OpenSSL read buffer; "
               "%d/%d bytes used on write buffer.",
               i, (int)rbuf_len, (int)rbuf_cap, (int)wbuf_len, (int)wbuf_cap);
+          tor_tls_get_n_records_written(or_conn->tls, &n_records, &n_bytes);
+          if (n_records)
+            log(severity, LD_GENERAL,
+                "Conn %d: wrote "U64_FORMAT" bytes in "U64_FORMAT
+                " TLS records (%d bytes per record).", i,
+                U64_PRINTF_ARG(n_bytes), U64_PRINTF_ARG(n_records),
+                (int)(n_bytes / n_records));
         }
       }
     }
@@ -1753,7 +2260,16 @@ dumpstats(int severity)
   rep_hist_dump_stats(now,severity);
   rend_service_dump_stats(severity);
   dump_pk_ops(severity);
+  cpuworker_log_stats(severity);
+  relaycrypt_log_stats(severity);
+  sigcheck_log_stats(severity);
+  scheduler_log_stats(severity);
+  log(severity, LD_NET, "Closed "U64_FORMAT" connections; spent at most "
+      U64_FORMAT" msec of any one second closing connections and freeing "
+      "circuits.", U64_PRINTF_ARG(stats_n_conns_reaped),
+      U64_PRINTF_ARG(reap_usec_max_per_second/1000));
   dump_distinct_digest_count(severity);
+  dirserv_log_compressed_body_stats(severity);
 }
 
 /** Called by exit() as we shut down the process.
@@ -1980,12 +2496,19 @@ tor_free_all(int postfork)
   hs_usage_free_all();
   dns_free_all();
   clear_pending_onions();
+  relaycrypt_free_all();
+  sigcheck_free_all();
+  relay_free_all();
   circuit_free_all();
   entry_guards_free_all();
   connection_free_all();
+  scheduler_free_all();
+  periodic_tasks_free_all();
+  buf_free_some_deferred(INT_MAX);
   buf_shrink_freelists(1);
   memarea_clear_freelist();
   microdesc_free_all();
+  routerparse_free_all();
   if (!postfork) {
     config_free_all();
     router_free_all();
@@ -2003,6 +2526,22 @@ tor_free_all(int postfork)
   if (active_linked_connection_lst)
     smartlist_free(active_linked_connection_lst);
   tor_free(timeout_event);
+  if (reaper_event) {
+    tor_event_free(reaper_event);
+    reaper_event = NULL;
+  }
+  if (apply_event_changes_ev) {
+    tor_event_free(apply_event_changes_ev);
+    apply_event_changes_ev = NULL;
+  }
+  if (conns_with_event_changes) {
+    smartlist_free(conns_with_event_changes);
+    conns_with_event_changes = NULL;
+  }
+  if (refill_event) {
+    tor_event_free(refill_event);
+    refill_event = NULL;
+  }
   if (!postfork) {
     release_lockfile();
   }
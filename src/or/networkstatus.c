@@ -32,6 +32,12 @@ static strmap_t *unnamed_server_map = NULL;
 
 /** Most recently received and validated v3 consensus network status. */
 static networkstatus_t *current_consensus = NULL;
+/** SHA256 digest of the whole text of current_consensus, as we stored it
+ * in cached-consensus.  Valid only if have_current_consensus_text_digest
+ * is set. */
+static char current_consensus_text_digest[DIGEST256_LEN];
+/** True iff current_consensus_text_digest is valid. */
+static int have_current_consensus_text_digest = 0;
 
 /** A v3 consensus networkstatus that we've received, but which we don't
  * have enough certificates to be happy about. */
@@ -369,6 +375,16 @@ networkstatus_vote_free(networkstatus_t *ns)
 
     smartlist_free(ns->routerstatus_list);
   }
+  if (ns->deferred_entries) {
+    SMARTLIST_FOREACH(ns->deferred_entries, deferred_routerstatus_t *, dr,
+      {
+        if (dr->rs)
+          routerstatus_free(dr->rs);
+        tor_free(dr);
+      });
+    smartlist_free(ns->deferred_entries);
+  }
+  tor_free(ns->deferred_body);
   if (ns->desc_digest_map)
     digestmap_free(ns->desc_digest_map, NULL);
 
@@ -875,6 +891,8 @@ networkstatus_v2_find_entry(networkstatus_v2_t *ns, const char *digest)
 routerstatus_t *
 networkstatus_vote_find_entry(networkstatus_t *ns, const char *digest)
 {
+  if (PREDICT_UNLIKELY(ns->deferred_entries))
+    return networkstatus_decode_deferred_entry(ns, digest);
   return smartlist_bsearch(ns->routerstatus_list, digest,
                            compare_digest_to_routerstatus_entry);
 }
@@ -887,6 +905,7 @@ int
 networkstatus_vote_find_entry_idx(networkstatus_t *ns,
                                   const char *digest, int *found_out)
 {
+  networkstatus_decode_deferred_entries(ns);
   return smartlist_bsearch_idx(ns->routerstatus_list, digest,
                                compare_digest_to_routerstatus_entry,
                                found_out);
@@ -1503,8 +1522,18 @@ networkstatus_set_current_consensus(const char *consensus,
     return -2;
   }
 
-  /* Make sure it's parseable. */
-  c = networkstatus_parse_vote_from_string(consensus, NULL, NS_TYPE_CONSENSUS);
+  /* Make sure it's parseable.  We'll need every routerstatus entry of the
+   * flavor we use, so decode those now; for any other flavor, don't decode
+   * the entries until we know we're going to use it.  (Installing a usable
+   * consensus walks all its entries: to copy over what we knew from the old
+   * one, to update the named server map, and to decide which descriptors to
+   * fetch.  Until those can work from the deferred index, deferring the
+   * entries here would only add a pass.) */
+  if (flav == USABLE_CONSENSUS_FLAVOR)
+    c = networkstatus_parse_vote_from_string(consensus, NULL,
+                                             NS_TYPE_CONSENSUS);
+  else
+    c = networkstatus_parse_consensus_lazily(consensus);
   if (!c) {
     log_warn(LD_DIR, "Unable to parse networkstatus consensus");
     result = -2;
@@ -1630,6 +1659,7 @@ networkstatus_set_current_consensus(const char *consensus,
     authority_certs_fetch_missing(c, now);
 
   if (flav == USABLE_CONSENSUS_FLAVOR) {
+    networkstatus_decode_deferred_entries(c);
     notify_control_networkstatus_changed(current_consensus, c);
 
     if (current_consensus) {
@@ -1670,11 +1700,15 @@ networkstatus_set_current_consensus(const char *consensus,
   if (flav == USABLE_CONSENSUS_FLAVOR) {
     current_consensus = c;
     c = NULL; /* Prevent free. */
+    crypto_digest256(current_consensus_text_digest, consensus,
+                     strlen(consensus), DIGEST_SHA256);
+    have_current_consensus_text_digest = 1;
 
     /* XXXXNM Microdescs: needs a non-ns variant. */
     update_consensus_networkstatus_fetch_time(now);
     dirvote_recalculate_timing(get_options(), now);
     routerstatus_list_update_named_server_map();
+    cell_ewma_set_scale_factor(get_options(), current_consensus);
   }
 
   if (!from_cache) {
@@ -1706,6 +1740,47 @@ networkstatus_set_current_consensus(const char *consensus,
   return result;
 }
 
+/** Set <b>digest_out</b> to the SHA256 digest of the whole text of our
+ * current consensus, so that we can ask a directory cache for a diff from
+ * it.  Return 0 on success, or -1 if we have no consensus to diff from. */
+int
+networkstatus_get_consensus_text_digest(char *digest_out)
+{
+  if (!current_consensus || !have_current_consensus_text_digest)
+    return -1;
+  memcpy(digest_out, current_consensus_text_digest, DIGEST256_LEN);
+  return 0;
+}
+
+/** Apply <b>diff</b>, a consensus diff that a directory cache sent us, to
+ * the consensus we have cached on disk.  Return the new consensus in a
+ * newly allocated string, or NULL if we couldn't.  The result has not been
+ * checked at all beyond matching the digest the diff promised: the caller
+ * should hand it to networkstatus_set_current_consensus() like any other
+ * consensus we download. */
+char *
+networkstatus_apply_consensus_diff(const char *diff)
+{
+  char *fname, *base, *result;
+
+  fname = get_datadir_fname("cached-consensus");
+  base = read_file_to_str(fname, RFTS_IGNORE_MISSING, NULL);
+  tor_free(fname);
+  if (!base) {
+    log_info(LD_DIR, "Got a consensus diff, but we have no cached "
+             "consensus to apply it to.");
+    result = NULL;
+  } else {
+    result = consdiff_apply(base, diff);
+    tor_free(base);
+  }
+  if (!result) {
+    /* Don't ask for another diff until we have a whole new consensus. */
+    have_current_consensus_text_digest = 0;
+  }
+  return result;
+}
+
 /** Called when we have gotten more certificates: see whether we can
  * now verify a pending consensus. */
 void
@@ -2160,6 +2235,7 @@ networkstatus_free_all(void)
   if (current_consensus) {
     networkstatus_vote_free(current_consensus);
     current_consensus = NULL;
+    have_current_consensus_text_digest = 0;
   }
   for (i=0; i < N_CONSENSUS_FLAVORS; ++i) {
     consensus_waiting_for_certs_t *waiting = &consensus_waiting_for_certs[i];
@@ -849,22 +849,16 @@ typedef struct var_cell_t {
 typedef struct packed_cell_t {
   struct packed_cell_t *next; /**< Next cell queued on this circuit. */
   char body[CELL_NETWORK_SIZE]; /**< Cell as packed for network. */
+  uint32_t inserted_time; /**< When was this cell added to its queue?  In
+                           * microseconds on the monotonic clock, modulo
+                           * 2**32. */
 } packed_cell_t;
 
-/** Number of cells added to a circuit queue including their insertion
- * time on 10 millisecond detail; used for buffer statistics. */
-typedef struct insertion_time_elem_t {
-  struct insertion_time_elem_t *next; /**< Next element in queue. */
-  uint32_t insertion_time; /**< When were cells inserted (in 10 ms steps
-                             * starting at 0:00 of the current day)? */
-  unsigned counter; /**< How many cells were inserted? */
-} insertion_time_elem_t;
-
-/** Queue of insertion times. */
-typedef struct insertion_time_queue_t {
-  struct insertion_time_elem_t *first; /**< First element in queue. */
-  struct insertion_time_elem_t *last; /**< Last element in queue. */
-} insertion_time_queue_t;
+/** Number of buckets in a histogram of how long cells waited on circuit
+ * queues.  Bucket 0 counts cells that waited under 1 msec; bucket i counts
+ * cells that waited at least 2**(i-1) and under 2**i msec; the last bucket
+ * counts everything longer.  See cell_wait_hist_bucket(). */
+#define CELL_WAIT_HIST_BUCKETS 14
 
 /** A queue of cells on a circuit, waiting to be added to the
  * or_connection_t's outbuf. */
@@ -872,7 +866,6 @@ typedef struct cell_queue_t {
   packed_cell_t *head; /**< The first cell, or NULL if the queue is empty. */
   packed_cell_t *tail; /**< The last cell, or NULL if the queue is empty. */
   int n; /**< The number of cells in the queue. */
-  insertion_time_queue_t *insertion_times; /**< Insertion times of cells. */
 } cell_queue_t;
 
 /** Beginning of a RELAY cell payload. */
@@ -938,6 +931,21 @@ typedef struct connection_t {
    * calling connection_handle_write() recursively. */
   unsigned int in_flushed_some:1;
 
+  /* For connections with sockets: we don't tell libevent right away when we
+   * start or stop reading or writing; see connection_apply_event_changes().
+   */
+  /** True iff we want to be told when we can read from s. */
+  unsigned int want_read:1;
+  /** True iff we want to be told when we can write to s. */
+  unsigned int want_write:1;
+  /** True iff libevent is currently watching read_event. */
+  unsigned int read_event_added:1;
+  /** True iff libevent is currently watching write_event. */
+  unsigned int write_event_added:1;
+  /** True iff we're on the list of connections whose events we need to
+   * update with libevent. */
+  unsigned int event_change_pending:1;
+
   /* For linked connections:
    */
   unsigned int linked:1; /**< True if there is, or has been, a linked_conn. */
@@ -1001,6 +1009,10 @@ typedef struct connection_t {
 
   /** Unique ID for measuring tunneled network status requests. */
   uint64_t dirreq_id;
+
+  /** Timer for the next time we need to check whether this connection has
+   * expired or needs a keepalive, or NULL if we never have. */
+  struct wheel_timer_t *housekeeping_timer;
 } connection_t;
 
 /** Stores flags and information related to the portion of a v2 Tor OR
@@ -1016,6 +1028,10 @@ typedef struct or_handshake_state_t {
   unsigned int received_versions : 1;
 } or_handshake_state_t;
 
+/** A map from circuit ID to circuit for a single OR connection.  Defined in
+ * circuitlist.c. */
+typedef struct circid_map_t circid_map_t;
+
 /** Subtype of connection_t for an "OR connection" -- that is, one that speaks
  * cells over TLS. */
 typedef struct or_connection_t {
@@ -1050,6 +1066,9 @@ typedef struct or_connection_t {
    * because the connection is too old, or because there's a better one, etc.
    */
   unsigned int is_bad_for_new_circs:1;
+  /** True iff this connection is on the cell scheduler's list of
+   * connections to consider on its next run. */
+  unsigned int scheduler_pending:1;
   uint8_t link_proto; /**< What protocol version are we using? 0 for
                        * "none negotiated yet." */
   circid_t next_circ_id; /**< Which circ_id do we try to use next on
@@ -1070,11 +1089,48 @@ typedef struct or_connection_t {
                     * bandwidthburst. (OPEN ORs only) */
   int n_circuits; /**< How many circuits use this connection as p_conn or
                    * n_conn ? */
+  /** Head of the list of circuits that use this connection as n_conn,
+   * linked through next_on_n_conn. */
+  struct circuit_t *n_conn_circuits;
+  /** Head of the list of circuits that use this connection as p_conn,
+   * linked through next_on_p_conn. */
+  struct circuit_t *p_conn_circuits;
+  /** Map from circuit ID to the circuit with that ID on this connection, in
+   * either direction; NULL if there are no such circuits. */
+  circid_map_t *circid_map;
 
   /** Double-linked ring of circuits with queued cells waiting for room to
    * free up on this connection's outbuf.  Every time we pull cells from a
    * circuit, we advance this pointer to the next circuit in the ring. */
   struct circuit_t *active_circuits;
+  /** Priority queue of cell_ewma_t for circuits with queued cells waiting for
+   * room to free up on this connection's outbuf.  Kept in heap order
+   * according to EWMA.
+   *
+   * This is redundant with active_circuits; if we ever decide only to use the
+   * cell_ewma algorithm for choosing circuits, we can remove active_circuits.
+   */
+  smartlist_t *active_circuit_pqueue;
+  /** The tick on which the cell_ewma_ts in active_circuit_pqueue last had
+   * their ewma values rescaled. */
+  unsigned active_circuit_pqueue_last_recalibrated;
+  /** Free packed cells for the circuit queues that flush onto this
+   * connection; see packed_cell_alloc(). */
+  struct mp_magazine_t *cell_magazine;
+  /** While the cell scheduler is running: the priority of the next cell we
+   * would flush from this connection; lower is sooner. */
+  double sched_priority;
+  /** While the cell scheduler is running: our position in its priority
+   * queue of connections, or -1 if we aren't in it. */
+  int sched_heap_idx;
+  /** While the cell scheduler is running: how many more cells will fit on
+   * this connection right now. */
+  int sched_cells_allowed;
+  /** How many bytes the kernel's send buffer for this connection's socket
+   * holds, as of <b>sched_sndbuf_checked</b>; 0 if we don't know. */
+  size_t sched_sndbuf;
+  /** When did we last look up <b>sched_sndbuf</b>? */
+  time_t sched_sndbuf_checked;
   struct or_connection_t *next_with_same_id; /**< Next connection with same
                                               * identity digest as this one. */
 } or_connection_t;
@@ -1140,6 +1196,13 @@ typedef struct edge_connection_t {
   /** True iff we've blocked reading until the circuit has fewer queued
    * cells. */
   unsigned int edge_blocked_on_circ:1;
+  /** True iff we've stopped reading because our circuit's package window
+   * (or our hop's, at the origin) was empty, and we're on the circuit's
+   * blocked_streams list waiting for a circuit-level sendme. */
+  unsigned int edge_blocked_on_circ_window:1;
+  /** True iff we've delivered data on this stream since we last checked
+   * whether to send a stream-level sendme. */
+  unsigned int sendme_pending:1;
   /** For AP connections only. If 1, and we fail to reach the chosen exit,
    * stop requiring it. */
   unsigned int chosen_exit_optional:1;
@@ -1185,6 +1248,12 @@ typedef struct dir_connection_t {
   off_t cached_dir_offset;
   /** The zlib object doing on-the-fly compression for spooled data. */
   tor_zlib_state_t *zlib_state;
+  /** True iff we're spooling descriptors or microdescriptors, and should
+   * send each one precompressed from the compressed descriptor cache. */
+  unsigned int spool_compressed : 1;
+  /** True iff we've sent at least one precompressed body on this
+   * connection. */
+  unsigned int spool_compressed_sent_any : 1;
 
   /** What rendezvous service are we querying for? */
   rend_data_t *rend_data;
@@ -1723,6 +1792,20 @@ typedef enum {
 /** How many different consensus flavors are there? */
 #define N_CONSENSUS_FLAVORS ((int)(FLAV_MICRODESC)+1)
 
+/** Where to find one routerstatus entry in a consensus that we parsed
+ * without decoding its entries.  See networkstatus_parse_consensus_lazily().
+ */
+typedef struct deferred_routerstatus_t {
+  /** The identity digest from the entry's "r" line. */
+  char identity_digest[DIGEST_LEN];
+  /** Where the entry starts in its consensus's deferred_body. */
+  size_t offset;
+  /** The entry, if we have decoded it already; else NULL. */
+  routerstatus_t *rs;
+  /** True iff we tried to decode this entry and couldn't. */
+  unsigned int failed : 1;
+} deferred_routerstatus_t;
+
 /** A common structure to hold a v3 network status vote, or a v3 network
  * status consensus. */
 typedef struct networkstatus_t {
@@ -1777,6 +1860,14 @@ typedef struct networkstatus_t {
   /** If present, a map from descriptor digest to elements of
    * routerstatus_list. */
   digestmap_t *desc_digest_map;
+
+  /** Consensus only: if we haven't decoded the routerstatus entries yet,
+   * a copy of their text.  Until we decode them all, routerstatus_list is
+   * empty. */
+  char *deferred_body;
+  /** Consensus only: if we haven't decoded the routerstatus entries yet, a
+   * deferred_routerstatus_t for each one, sorted by identity digest. */
+  smartlist_t *deferred_entries;
 } networkstatus_t;
 
 /** A set of signatures for a networkstatus consensus.  Unless otherwise
@@ -2018,6 +2109,42 @@ typedef struct {
  * "backward" (towards the OP).  At the OR, a circuit has only two stream
  * ciphers: one for data going forward, and one for data going backward.
  */
+
+/**
+ * The cell_ewma_t structure keeps track of how many cells a circuit has
+ * transferred recently.  It keeps an EWMA (exponentially weighted moving
+ * average) of the number of cells flushed from the circuit queue onto a
+ * connection in connection_or_flush_from_first_active_circuit().
+ */
+typedef struct {
+  /** The last 'tick' at which we recalibrated cell_count.
+   *
+   * A cell sent at exactly the start of this tick has weight 1.0. Cells sent
+   * since the start of this tick have weight greater than 1.0; ones sent
+   * earlier have less weight. */
+  unsigned last_adjusted_tick;
+  /** The EWMA of the cell count. */
+  double cell_count;
+  /** True iff this is the cell count for a circuit's previous
+   * connection. */
+  unsigned int is_for_p_conn : 1;
+  /** The position of the circuit within the OR connection's priority
+   * queue, or -1 if the circuit isn't in a priority queue. */
+  int heap_index;
+} cell_ewma_t;
+
+/** What time it is, in the forms that flushing cells from circuit queues
+ * needs.  The cell scheduler looks them up once per pass, with
+ * cell_flush_time_init(), rather than once for every cell it flushes. */
+typedef struct cell_flush_time_t {
+  time_t now; /**< The current time, in seconds. */
+  unsigned tick; /**< The current cell_ewma tick. */
+  /** How much a cell flushed now adds to its circuit's cell_ewma count, or
+   * -1 if the cell_ewma algorithm is disabled. */
+  double ewma_increment;
+  uint32_t now_usec; /**< The current time, for measuring cell latency. */
+} cell_flush_time_t;
+
 typedef struct circuit_t {
   uint32_t magic; /**< For memory and type debugging: must equal
                    * ORIGIN_CIRCUIT_MAGIC or OR_CIRCUIT_MAGIC. */
@@ -2039,6 +2166,13 @@ typedef struct circuit_t {
   /** True iff we are waiting for p_conn_cells to become less full before
    * allowing n_streams to add any more cells. (OR circuit only.) */
   unsigned int streams_blocked_on_p_conn : 1;
+  /** True iff we've received data on this circuit since we last checked
+   * whether to send a circuit-level sendme. */
+  unsigned int sendme_pending : 1;
+  /** The edge streams attached to this circuit that have stopped reading
+   * because the package window they use was empty, in the order they
+   * stopped.  NULL if there have never been any. */
+  smartlist_t *blocked_streams;
 
   uint8_t state; /**< Current status of this circuit. */
   uint8_t purpose; /**< Why are we creating this circuit? */
@@ -2077,10 +2211,23 @@ typedef struct circuit_t {
    * cells to n_conn.  NULL if we have no cells pending, or if we're not
    * linked to an OR connection. */
   struct circuit_t *prev_active_on_n_conn;
+  /** Next circuit in the list of circuits that use our n_conn as their
+   * n_conn.  NULL at the end of the list, or if we have no n_conn. */
+  struct circuit_t *next_on_n_conn;
+  /** Previous circuit in the list of circuits that use our n_conn as their
+   * n_conn.  NULL at the start of the list, or if we have no n_conn. */
+  struct circuit_t *prev_on_n_conn;
   struct circuit_t *next; /**< Next circuit in linked list of all circuits. */
+  /** Previous circuit in linked list of all circuits. */
+  struct circuit_t *prev;
 
   /** Unique ID for measuring tunneled network status requests. */
   uint64_t dirreq_id;
+
+  /** The EWMA count for the number of cells flushed from the
+   * n_conn_cells queue.  Used to determine which circuit to flush from next.
+   */
+  cell_ewma_t n_cell_ewma;
 } circuit_t;
 
 /** Largest number of relay_early cells that we can send on a given
@@ -2149,6 +2296,12 @@ typedef struct or_circuit_t {
    * cells to p_conn.  NULL if we have no cells pending, or if we're not
    * linked to an OR connection. */
   struct circuit_t *prev_active_on_p_conn;
+  /** Next circuit in the list of circuits that use our p_conn as their
+   * p_conn.  NULL at the end of the list, or if we have no p_conn. */
+  struct circuit_t *next_on_p_conn;
+  /** Previous circuit in the list of circuits that use our p_conn as their
+   * p_conn.  NULL at the start of the list, or if we have no p_conn. */
+  struct circuit_t *prev_on_p_conn;
 
   /** The circuit_id used in the previous (backward) hop of this circuit. */
   circid_t p_circ_id;
@@ -2208,10 +2361,23 @@ typedef struct or_circuit_t {
    * time when writing buffer stats to disk. */
   uint32_t processed_cells;
 
-  /** Total time in milliseconds that cells spent in both app-ward and
+  /** Total time in microseconds that cells spent in both app-ward and
    * exit-ward queues of this circuit; reset every time when writing
    * buffer stats to disk. */
   uint64_t total_cell_waiting_time;
+
+  /** Histogram of how long the cells counted in <b>processed_cells</b>
+   * waited in this circuit's queues; reset along with them. */
+  uint32_t cell_wait_hist[CELL_WAIT_HIST_BUCKETS];
+
+  /** The EWMA count for the number of cells flushed from the
+   * p_conn_cells queue. */
+  cell_ewma_t p_cell_ewma;
+
+  /** How many relay cells on this circuit have we handed to the relay
+   * crypto threads without getting them back yet?  We can't free the
+   * circuit until this is zero. See relaycrypt.c. */
+  int relaycrypt_n_pending;
 } or_circuit_t;
 
 /** Convert a circuit subtype to a circuit_t.*/
@@ -2257,6 +2423,10 @@ typedef struct config_line_t {
 
 typedef struct routerset_t routerset_t;
 
+/** A batch of RSA signatures to check all at once, maybe in more than one
+ * thread.  See sigcheck.c. */
+typedef struct sigcheck_batch_t sigcheck_batch_t;
+
 /** Configuration options for a Tor process. */
 typedef struct {
   uint32_t _magic;
@@ -2329,6 +2499,10 @@ typedef struct {
   config_line_t *RecommendedServerVersions;
   /** Whether dirservers refuse router descriptors with private IPs. */
   int DirAllowPrivateAddresses;
+  /** Directory cache only: should we answer compressed requests for
+   * descriptors by sending each one's body compressed on its own, from a
+   * cache, rather than compressing the whole answer as we send it? */
+  int DirPrecompressDescriptors;
   char *User; /**< Name of user to run Tor as. */
   char *Group; /**< Name of group to run Tor as. */
   int ORPort; /**< Port to listen on for OR connections. */
@@ -2463,7 +2637,15 @@ typedef struct {
                                  * willing to use for all relayed conns? */
   uint64_t RelayBandwidthBurst; /**< How much bandwidth, at maximum, will we
                                  * use in a second for all relayed conns? */
+  int TokenBucketRefillInterval; /**< How often do we refill the token
+                                  * buckets, in msec? */
   int NumCpus; /**< How many CPUs should we try to use? */
+  int RelayCryptoThreads; /**< How many threads should crypt relay cells on
+                           * circuits through us?  0 for "use the main
+                           * thread". */
+  int SignatureCheckThreads; /**< How many threads should help check big
+                              * batches of signatures on directory
+                              * objects?  0 for "use the main thread". */
   int RunTesting; /**< If true, create testing circuits to measure how well the
                    * other ORs are running. */
   config_line_t *RendConfigLines; /**< List of configuration lines
@@ -2732,6 +2914,12 @@ typedef struct {
    * to make this false. */
   int ReloadTorrcOnSIGHUP;
 
+  /** The length of time that we think an initial circuit's cell counts
+   * should take to decay to half of its original value, in seconds.  If
+   * negative, use the consensus parameter or our default.  If zero,
+   * schedule circuits round-robin. */
+  double CircuitPriorityHalflife;
+
 } or_options_t;
 
 /** Persistent state for an onion router, as saved to disk. */
@@ -2837,10 +3025,13 @@ struct socks_request_t {
 buf_t *buf_new(void);
 buf_t *buf_new_with_capacity(size_t size);
 void buf_free(buf_t *buf);
+void buf_free_later(buf_t *buf);
+int buf_free_some_deferred(int max_chunks);
 void buf_clear(buf_t *buf);
 void buf_shrink(buf_t *buf);
 void buf_shrink_freelists(int free_all);
 void buf_dump_freelist_sizes(int severity);
+char *buf_get_freelist_status(void);
 
 size_t buf_datalen(const buf_t *buf);
 size_t buf_allocation(const buf_t *buf);
@@ -2860,6 +3051,8 @@ int write_to_buf_zlib(buf_t *buf, tor_zlib_state_t *state,
 int move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen);
 int fetch_from_buf(char *string, size_t string_len, buf_t *buf);
 int fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto);
+int fetch_cells_from_buf(buf_t *buf, cell_t *cells_out, int max_cells,
+                         int linkproto);
 int fetch_from_buf_http(buf_t *buf,
                         char **headers_out, size_t max_headerlen,
                         char **body_out, size_t *body_used, size_t max_bodylen,
@@ -3100,8 +3293,9 @@ void circuit_set_p_circid_orconn(or_circuit_t *circ, circid_t id,
                                  or_connection_t *conn);
 void circuit_set_n_circid_orconn(circuit_t *circ, circid_t id,
                                  or_connection_t *conn);
+void circuit_set_n_conn(circuit_t *circ, or_connection_t *conn);
 void circuit_set_state(circuit_t *circ, uint8_t state);
-void circuit_close_all_marked(void);
+int circuit_close_marked(int max);
 int32_t circuit_initial_package_window(void);
 origin_circuit_t *origin_circuit_new(void);
 or_circuit_t *or_circuit_new(circid_t p_circ_id, or_connection_t *p_conn);
@@ -3289,7 +3483,7 @@ int retry_all_listeners(smartlist_t *replaced_conns,
 ssize_t connection_bucket_write_limit(connection_t *conn, time_t now);
 int global_write_bucket_low(connection_t *conn, size_t attempt, int priority);
 void connection_bucket_init(void);
-void connection_bucket_refill(int seconds_elapsed, time_t now);
+void connection_bucket_refill(int milliseconds_elapsed, time_t now);
 
 int connection_handle_read(connection_t *conn);
 
@@ -3443,11 +3637,13 @@ or_connection_t *connection_or_get_for_extend(const char *digest,
                                               const tor_addr_t *target_addr,
                                               const char **msg_out,
                                               int *launch_out);
+void connection_or_mark_bad_for_new_circs(or_connection_t *or_conn);
 void connection_or_set_bad_connections(void);
 
 int connection_or_reached_eof(or_connection_t *conn);
 int connection_or_process_inbuf(or_connection_t *conn);
 int connection_or_flushed_some(or_connection_t *conn);
+int connection_or_get_cell_allowance(or_connection_t *conn, time_t now);
 int connection_or_finished_flushing(or_connection_t *conn);
 int connection_or_finished_connecting(or_connection_t *conn);
 
@@ -3475,10 +3671,17 @@ int connection_or_compute_link_auth_hmac(or_connection_t *conn,
 int is_or_protocol_version_known(uint16_t version);
 
 void cell_pack(packed_cell_t *dest, const cell_t *src);
+void cell_unpack(cell_t *dest, const char *src);
 void var_cell_pack_header(const var_cell_t *cell, char *hdr_out);
 var_cell_t *var_cell_new(uint16_t payload_len);
 void var_cell_free(var_cell_t *cell);
 
+/********************************* consdiff.c ***************************/
+
+char *consdiff_generate(const char *base, const char *target);
+char *consdiff_apply(const char *base, const char *diff);
+int consdiff_looks_like_diff(const char *s);
+
 /********************************* control.c ***************************/
 
 /** Used to indicate the type of a circuit event passed to the controller.
@@ -3628,6 +3831,7 @@ int connection_cpu_process_inbuf(connection_t *conn);
 int assign_onionskin_to_cpuworker(connection_t *cpuworker,
                                   or_circuit_t *circ,
                                   char *onionskin);
+void cpuworker_log_stats(int severity);
 
 /********************************* directory.c ***************************/
 
@@ -3834,6 +4038,12 @@ int routerstatus_format_entry(char *buf, size_t buf_len,
                               routerstatus_t *rs, const char *platform,
                               routerstatus_format_type_t format);
 void dirserv_free_all(void);
+cached_dir_t *dirserv_find_consensus_diff(const char *flavor_name,
+                                          const char *digests);
+const char *dirserv_get_compressed_body(const char *digest, const char *body,
+                                        size_t body_len, size_t *z_len_out);
+void dirserv_log_compressed_body_stats(int severity);
+void dirserv_compressed_body_cache_free_all(void);
 void cached_dir_decref(cached_dir_t *d);
 cached_dir_t *new_cached_dir(char *s, time_t published);
 
@@ -4094,6 +4304,7 @@ void connection_unregister_events(connection_t *conn);
 int connection_in_array(connection_t *conn);
 void add_connection_to_closeable_list(connection_t *conn);
 int connection_is_on_closeable_list(connection_t *conn);
+void connection_schedule_housekeeping(connection_t *conn, time_t when);
 
 smartlist_t *get_connection_array(void);
 
@@ -4111,6 +4322,8 @@ void connection_stop_writing(connection_t *conn);
 void connection_start_writing(connection_t *conn);
 
 void connection_stop_reading_from_linked_conn(connection_t *conn);
+void connection_apply_event_changes(void);
+char *connection_get_event_change_status(void);
 
 void directory_all_unreachable(time_t now);
 void directory_info_has_arrived(time_t now, int from_cache);
@@ -4242,6 +4455,8 @@ networkstatus_t *networkstatus_get_reasonably_live_consensus(time_t now);
 int networkstatus_set_current_consensus(const char *consensus,
                                         const char *flavor,
                                         unsigned flags);
+int networkstatus_get_consensus_text_digest(char *digest_out);
+char *networkstatus_apply_consensus_diff(const char *diff);
 void networkstatus_note_certs_arrived(void);
 void routers_update_all_from_networkstatus(time_t now, int dir_version);
 void routerstatus_list_update_from_consensus_networkstatus(time_t now);
@@ -4390,6 +4605,13 @@ extern uint64_t stats_n_relay_cells_delivered;
 
 int circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                                cell_direction_t cell_direction);
+int circuit_receive_crypted_relay_cell(cell_t *cell, circuit_t *circ,
+                                       cell_direction_t cell_direction,
+                                       crypt_path_t *layer_hint,
+                                       int recognized);
+int relay_crypt_or_circuit_cell(or_circuit_t *circ, cell_t *cell,
+                                cell_direction_t cell_direction,
+                                char *recognized);
 
 void relay_header_pack(char *dest, const relay_header_t *src);
 void relay_header_unpack(relay_header_t *dest, const char *src);
@@ -4402,6 +4624,10 @@ int connection_edge_send_command(edge_connection_t *fromconn,
 int connection_edge_package_raw_inbuf(edge_connection_t *conn,
                                       int package_partial);
 void connection_edge_consider_sending_sendme(edge_connection_t *conn);
+void relay_flush_pending_sendmes(void);
+void relay_forget_circuit_sendmes(circuit_t *circ);
+void relay_forget_edge_sendmes(edge_connection_t *conn);
+void relay_free_all(void);
 
 extern uint64_t stats_n_data_cells_packaged;
 extern uint64_t stats_n_data_bytes_packaged;
@@ -4415,22 +4641,48 @@ void dump_cell_pool_usage(int severity);
 
 void cell_queue_clear(cell_queue_t *queue);
 void cell_queue_append(cell_queue_t *queue, packed_cell_t *cell);
-void cell_queue_append_packed_copy(cell_queue_t *queue, const cell_t *cell);
+void connection_or_clear_cell_magazine(or_connection_t *conn);
+void connection_or_free_cell_magazine(or_connection_t *conn);
+int cell_wait_hist_bucket(uint32_t usec);
+char *cell_wait_hist_to_string(const uint64_t *hist);
 
 void append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
                                   cell_t *cell, cell_direction_t direction);
 void connection_or_unlink_all_active_circs(or_connection_t *conn);
 int connection_or_flush_from_first_active_circuit(or_connection_t *conn,
-                                                  int max, time_t now);
+                                               int max,
+                                               const cell_flush_time_t *ft);
 void assert_active_circuits_ok(or_connection_t *orconn);
 void make_circuit_inactive_on_conn(circuit_t *circ, or_connection_t *conn);
 void make_circuit_active_on_conn(circuit_t *circ, or_connection_t *conn);
+char *connection_or_get_scheduler_status(or_connection_t *orconn);
+double connection_or_next_circuit_ewma(or_connection_t *orconn,
+                                       const cell_flush_time_t *ft);
+
+void cell_ewma_set_scale_factor(or_options_t *options,
+                                networkstatus_t *consensus);
+unsigned cell_ewma_get_tick(void);
+void cell_flush_time_init(cell_flush_time_t *ft);
 
 int append_address_to_payload(char *payload_out, const tor_addr_t *addr);
 const char *decode_address_from_payload(tor_addr_t *addr_out,
                                         const char *payload,
                                         int payload_len);
 
+/********************************* relaycrypt.c ***************************/
+
+/** The most relay crypto threads we'll allow RelayCryptoThreads to ask
+ * for. */
+#define MAX_RELAYCRYPT_THREADS 16
+
+int relaycrypt_enabled(void);
+void relaycrypt_queue_cell(or_circuit_t *circ, const cell_t *cell,
+                           cell_direction_t cell_direction, int originated);
+void relaycrypt_process_answers(void);
+int relaycrypt_get_n_pending(void);
+void relaycrypt_log_stats(int severity);
+void relaycrypt_free_all(void);
+
 /********************************* rephist.c ***************************/
 
 void rep_hist_init(void);
@@ -4960,6 +5212,15 @@ void router_load_extrainfo_from_string(const char *s, const char *eos,
                                        saved_location_t saved_location,
                                        smartlist_t *requested_fingerprints,
                                        int descriptor_digests);
+/** A function to call once router_load_downloaded_descriptors() has added
+ * what it can to our directory, with the number of entries it added (or
+ * -1 if we're shutting down first) and the argument given there. */
+typedef void (*router_load_done_fn)(int n_added, void *arg);
+void router_load_downloaded_descriptors(const char *s, int is_extrainfo,
+                                        smartlist_t *requested_fingerprints,
+                                        int descriptor_digests,
+                                        const char *prepend_annotations,
+                                        router_load_done_fn done, void *arg);
 void routerlist_retry_directory_downloads(time_t now);
 int router_exit_policy_all_routers_reject(uint32_t addr, uint16_t port,
                                           int need_uptime);
@@ -5059,6 +5320,16 @@ int router_parse_list_from_string(const char **s, const char *eos,
                                   int is_extrainfo,
                                   int allow_annotations,
                                   const char *prepend_annotations);
+int router_parse_list_from_string_batched(const char **s, const char *eos,
+                                          smartlist_t *dest,
+                                          saved_location_t saved_location,
+                                          int is_extrainfo,
+                                          int allow_annotations,
+                                          const char *prepend_annotations,
+                                          sigcheck_batch_t *batch);
+void router_parse_list_remove_bad_signatures(smartlist_t *list,
+                                           const sigcheck_batch_t *batch,
+                                           int is_extrainfo);
 int router_parse_routerlist_from_directory(const char *s,
                                            routerlist_t **dest,
                                            crypto_pk_env_t *pkey,
@@ -5088,6 +5359,10 @@ networkstatus_v2_t *networkstatus_v2_parse_from_string(const char *s);
 networkstatus_t *networkstatus_parse_vote_from_string(const char *s,
                                                  const char **eos_out,
                                                  networkstatus_type_t ns_type);
+networkstatus_t *networkstatus_parse_consensus_lazily(const char *s);
+routerstatus_t *networkstatus_decode_deferred_entry(networkstatus_t *ns,
+                                                    const char *digest);
+void networkstatus_decode_deferred_entries(networkstatus_t *ns);
 ns_detached_signatures_t *networkstatus_parse_detached_signatures(
                                           const char *s, const char *eos);
 
@@ -5112,6 +5387,61 @@ int rend_parse_introduction_points(rend_service_descriptor_t *parsed,
                                    const char *intro_points_encoded,
                                    size_t intro_points_encoded_size);
 int rend_parse_client_keys(strmap_t *parsed_clients, const char *str);
+void routerparse_free_all(void);
+
+#ifdef ROUTERPARSE_PRIVATE
+/* Used only by routerparse.c and test.c */
+int routerparse_check_token_indices(void);
+#endif
+
+/********************************* scheduler.c ************************/
+
+void scheduler_conn_wants_to_write(or_connection_t *conn);
+void scheduler_forget_conn(or_connection_t *conn);
+void scheduler_run(void);
+void scheduler_note_cell_latency(int bucket);
+void scheduler_log_stats(int severity);
+void scheduler_free_all(void);
+
+/********************************* sigcheck.c ************************/
+
+/** The most signature checking threads we'll allow SignatureCheckThreads to
+ * ask for. */
+#define MAX_SIGCHECK_THREADS 16
+
+/** Result of a job in a sigcheck_batch_t: we haven't checked it yet. */
+#define SIGCHECK_PENDING -1
+/** Result of a job in a sigcheck_batch_t: the signature is good. */
+#define SIGCHECK_OK 0
+/** Result of a job in a sigcheck_batch_t: the signature couldn't be
+ * decrypted with the key. */
+#define SIGCHECK_INVALID 1
+/** Result of a job in a sigcheck_batch_t: the signature was of some other
+ * digest. */
+#define SIGCHECK_MISMATCH 2
+
+/** A function to call in the main thread once every signature in a batch
+ * handed to sigcheck_batch_queue() is checked, with the batch and the
+ * argument given there.  If <b>cancelled</b>, we're shutting down, and the
+ * results may not be set: just release whatever the jobs refer to. */
+typedef void (*sigcheck_done_fn)(sigcheck_batch_t *batch, void *arg,
+                                 int cancelled);
+
+sigcheck_batch_t *sigcheck_batch_new(void);
+void sigcheck_batch_free(sigcheck_batch_t *batch);
+int sigcheck_batch_add(sigcheck_batch_t *batch, crypto_pk_env_t *key,
+                       const char *digest, size_t digest_len,
+                       const char *sig, size_t sig_len, void *arg);
+int sigcheck_batch_len(const sigcheck_batch_t *batch);
+void *sigcheck_batch_get_arg(const sigcheck_batch_t *batch, int idx);
+int sigcheck_batch_get_result(const sigcheck_batch_t *batch, int idx);
+int sigcheck_enabled(void);
+void sigcheck_batch_queue(sigcheck_batch_t *batch, sigcheck_done_fn done,
+                          void *arg);
+void sigcheck_process_answers(void);
+int sigcheck_get_n_pending(void);
+void sigcheck_log_stats(int severity);
+void sigcheck_free_all(void);
 
 #endif
 
@@ -10,6 +10,7 @@
  *    receiving from circuits, plus queuing on circuits.
  **/
 
+#include <math.h>
 #include "or.h"
 #include "mempool.h"
 
@@ -29,11 +30,16 @@ circuit_consider_sending_sendme(circuit_t *circ, crypt_path_t *layer_hint);
 static void
 circuit_resume_edge_reading(circuit_t *circ, crypt_path_t *layer_hint);
 static int
-circuit_resume_edge_reading_helper(edge_connection_t *conn,
-                                   circuit_t *circ,
-                                   crypt_path_t *layer_hint);
-static int
-circuit_consider_stop_edge_reading(circuit_t *circ, crypt_path_t *layer_hint);
+circuit_consider_stop_edge_reading(circuit_t *circ, edge_connection_t *conn);
+static void relay_note_pending_sendme(circuit_t *circ,
+                                      edge_connection_t *conn);
+static int connection_edge_package_data_cell(edge_connection_t *conn,
+                                             circuit_t *circ,
+                                             size_t length);
+static void append_packed_cell_to_circuit_queue(circuit_t *circ,
+                                                or_connection_t *orconn,
+                                                packed_cell_t *cell,
+                                                cell_direction_t direction);
 
 /** Stats: how many relay cells have originated at this hop, or have
  * been relayed onward (not recognized at this hop)?
@@ -44,22 +50,22 @@ uint64_t stats_n_relay_cells_relayed = 0;
  */
 uint64_t stats_n_relay_cells_delivered = 0;
 
-/** Update digest from the payload of cell. Assign integrity part to
- * cell.
+/** Update digest from the relay cell payload <b>payload</b>. Assign
+ * integrity part to the payload.
  */
 static void
-relay_set_digest(crypto_digest_env_t *digest, cell_t *cell)
+relay_set_digest(crypto_digest_env_t *digest, char *payload)
 {
   char integrity[4];
   relay_header_t rh;
 
-  crypto_digest_add_bytes(digest, cell->payload, CELL_PAYLOAD_SIZE);
+  crypto_digest_add_bytes(digest, payload, CELL_PAYLOAD_SIZE);
   crypto_digest_get_digest(digest, integrity, 4);
 //  log_fn(LOG_DEBUG,"Putting digest of %u %u %u %u into relay cell.",
 //    integrity[0], integrity[1], integrity[2], integrity[3]);
-  relay_header_unpack(&rh, cell->payload);
+  relay_header_unpack(&rh, payload);
   memcpy(rh.integrity, integrity, 4);
-  relay_header_pack(cell->payload, &rh);
+  relay_header_pack(payload, &rh);
 }
 
 /** Does the digest for this circuit indicate that this cell is for us?
@@ -142,10 +148,8 @@ int
 circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                            cell_direction_t cell_direction)
 {
-  or_connection_t *or_conn=NULL;
   crypt_path_t *layer_hint=NULL;
   char recognized=0;
-  int reason;
 
   tor_assert(cell);
   tor_assert(circ);
@@ -154,11 +158,37 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
   if (circ->marked_for_close)
     return 0;
 
+  if (! CIRCUIT_IS_ORIGIN(circ) && relaycrypt_enabled()) {
+    /* A relay crypto thread will crypt it, and hand it back to
+     * circuit_receive_crypted_relay_cell(). */
+    relaycrypt_queue_cell(TO_OR_CIRCUIT(circ), cell, cell_direction, 0);
+    return 0;
+  }
+
   if (relay_crypt(circ, cell, cell_direction, &layer_hint, &recognized) < 0) {
     log_warn(LD_BUG,"relay crypt failed. Dropping connection.");
     return -END_CIRC_REASON_INTERNAL;
   }
 
+  return circuit_receive_crypted_relay_cell(cell, circ, cell_direction,
+                                            layer_hint, recognized);
+}
+
+/** Handle a relay cell that has already been crypted for this hop, as in
+ * circuit_receive_relay_cell(): if <b>recognized</b> is set, deliver it to
+ * the right stream (<b>layer_hint</b> is the hop that recognized it, if we
+ * are the origin); otherwise relay it onward.
+ *
+ * Return -<b>reason</b> on failure.
+ */
+int
+circuit_receive_crypted_relay_cell(cell_t *cell, circuit_t *circ,
+                                   cell_direction_t cell_direction,
+                                   crypt_path_t *layer_hint, int recognized)
+{
+  or_connection_t *or_conn=NULL;
+  int reason;
+
   if (recognized) {
     edge_connection_t *conn = relay_lookup_conn(circ, cell, cell_direction,
                                                 layer_hint);
@@ -294,32 +324,84 @@ relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
       log_fn(LOG_PROTOCOL_WARN, LD_OR,
              "Incoming cell at client not recognized. Closing.");
       return -1;
-    } else { /* we're in the middle. Just one crypt. */
-      if (relay_crypt_one_payload(TO_OR_CIRCUIT(circ)->p_crypto,
-                                  cell->payload, 1) < 0)
-        return -1;
-//      log_fn(LOG_DEBUG,"Skipping recognized check, because we're not "
-//             "the client.");
     }
-  } else /* cell_direction == CELL_DIRECTION_OUT */ {
-    /* we're in the middle. Just one crypt. */
+  }
+  /* we're in the middle. Just one crypt. */
+  return relay_crypt_or_circuit_cell(TO_OR_CIRCUIT(circ), cell,
+                                     cell_direction, recognized);
+}
 
-    if (relay_crypt_one_payload(TO_OR_CIRCUIT(circ)->n_crypto,
-                                cell->payload, 0) < 0)
+/** Do the one crypt that we owe <b>cell</b> as a hop in the middle of
+ * <b>circ</b>: encrypt it if it's heading toward the origin, or decrypt it
+ * and check whether it's for us if it's heading away.  Set *<b>recognized</b>
+ * to 1 if the cell is for us.
+ *
+ * This touches nothing but <b>cell</b> and the relay ciphers and n_digest of
+ * <b>circ</b>, so a relay crypto thread can call it while it owns those.
+ *
+ * Return -1 to indicate that we should mark the circuit for close,
+ * else return 0.
+ */
+int
+relay_crypt_or_circuit_cell(or_circuit_t *circ, cell_t *cell,
+                            cell_direction_t cell_direction, char *recognized)
+{
+  relay_header_t rh;
+
+  if (cell_direction == CELL_DIRECTION_IN) {
+    if (relay_crypt_one_payload(circ->p_crypto, cell->payload, 1) < 0)
       return -1;
+//    log_fn(LOG_DEBUG,"Skipping recognized check, because we're not "
+//           "the client.");
+    return 0;
+  }
 
-    relay_header_unpack(&rh, cell->payload);
-    if (rh.recognized == 0) {
-      /* it's possibly recognized. have to check digest to be sure. */
-      if (relay_digest_matches(TO_OR_CIRCUIT(circ)->n_digest, cell)) {
-        *recognized = 1;
-        return 0;
-      }
+  if (relay_crypt_one_payload(circ->n_crypto, cell->payload, 0) < 0)
+    return -1;
+
+  relay_header_unpack(&rh, cell->payload);
+  if (rh.recognized == 0) {
+    /* it's possibly recognized. have to check digest to be sure. */
+    if (relay_digest_matches(circ->n_digest, cell)) {
+      *recognized = 1;
+      return 0;
     }
   }
   return 0;
 }
 
+/** Encrypt the relay cell payload <b>payload</b>, which we're packaging
+ * from an edge and whose digest is already set, to every layer it needs:
+ * from hop <b>layer_hint</b> back to the first hop if we're the origin,
+ * else to our own layer.
+ *
+ * Return -1 if the crypto fails, else return 0.
+ */
+static int
+relay_encrypt_edge_payload(circuit_t *circ, char *payload,
+                           cell_direction_t cell_direction,
+                           crypt_path_t *layer_hint)
+{
+  if (cell_direction == CELL_DIRECTION_OUT) {
+    crypt_path_t *thishop = layer_hint; /* counter for repeated crypts */
+    /* moving from farthest to nearest hop */
+    do {
+      tor_assert(thishop);
+      /* XXXX RD This is a bug, right? */
+      log_debug(LD_OR,"crypting a layer of the relay cell.");
+      if (relay_crypt_one_payload(thishop->f_crypto, payload, 1) < 0) {
+        return -1;
+      }
+
+      thishop = thishop->prev;
+    } while (thishop != TO_ORIGIN_CIRCUIT(circ)->cpath->prev);
+    return 0;
+  } else {
+    return relay_crypt_one_payload(TO_OR_CIRCUIT(circ)->p_crypto,
+                                   payload, 1);
+  }
+}
+
 /** Package a relay cell from an edge:
  *  - Encrypt it to the right layer
  *  - Append it to the appropriate cell_queue on <b>circ</b>.
@@ -332,28 +414,13 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
   or_connection_t *conn; /* where to send the cell */
 
   if (cell_direction == CELL_DIRECTION_OUT) {
-    crypt_path_t *thishop; /* counter for repeated crypts */
     conn = circ->n_conn;
     if (!CIRCUIT_IS_ORIGIN(circ) || !conn) {
       log_warn(LD_BUG,"outgoing relay cell has n_conn==NULL. Dropping.");
       return 0; /* just drop it */
     }
 
-    relay_set_digest(layer_hint->f_digest, cell);
-
-    thishop = layer_hint;
-    /* moving from farthest to nearest hop */
-    do {
-      tor_assert(thishop);
-      /* XXXX RD This is a bug, right? */
-      log_debug(LD_OR,"crypting a layer of the relay cell.");
-      if (relay_crypt_one_payload(thishop->f_crypto, cell->payload, 1) < 0) {
-        return -1;
-      }
-
-      thishop = thishop->prev;
-    } while (thishop != TO_ORIGIN_CIRCUIT(circ)->cpath->prev);
-
+    relay_set_digest(layer_hint->f_digest, cell->payload);
   } else { /* incoming cell */
     or_circuit_t *or_circ;
     if (CIRCUIT_IS_ORIGIN(circ)) {
@@ -365,10 +432,18 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
     }
     or_circ = TO_OR_CIRCUIT(circ);
     conn = or_circ->p_conn;
-    relay_set_digest(or_circ->p_digest, cell);
-    if (relay_crypt_one_payload(or_circ->p_crypto, cell->payload, 1) < 0)
-      return -1;
+    relay_set_digest(or_circ->p_digest, cell->payload);
+    if (relaycrypt_enabled()) {
+      /* Cells we relay toward the origin get crypted by a relay crypto
+       * thread; this one has to stay in line behind them. */
+      ++stats_n_relay_cells_relayed;
+      relaycrypt_queue_cell(or_circ, cell, CELL_DIRECTION_IN, 1);
+      return 0;
+    }
   }
+  if (relay_encrypt_edge_payload(circ, cell->payload, cell_direction,
+                                 layer_hint) < 0)
+    return -1;
   ++stats_n_relay_cells_relayed;
 
   append_cell_to_circuit_queue(circ, conn, cell, cell_direction);
@@ -488,6 +563,56 @@ relay_command_to_string(uint8_t command)
   }
 }
 
+/** We're about to send a relay cell with command <b>relay_command</b>
+ * from the origin of <b>origin_circ</b> to hop <b>cpath_layer</b>.  Return
+ * the cell command to send it with: CELL_RELAY_EARLY if we should spend
+ * one of the circuit's relay_early cells on it, else CELL_RELAY.
+ */
+static uint8_t
+relay_choose_cell_command(origin_circuit_t *origin_circ,
+                          uint8_t relay_command, crypt_path_t *cpath_layer)
+{
+  if (origin_circ->remaining_relay_early_cells > 0 &&
+      (relay_command == RELAY_COMMAND_EXTEND ||
+       (cpath_layer != origin_circ->cpath &&
+        !CIRCUIT_PURPOSE_IS_ESTABLISHED_REND(origin_circ->_base.purpose)))) {
+    /* If we've got any relay_early cells left, and we're sending
+     * an extend cell or (we're not talking to the first hop and we're
+     * not talking to a rendezvous circuit), use one of them.
+     * Don't worry about the conn protocol version:
+     * append_cell_to_circuit_queue will fix it up. */
+    /* XXX For now, clients don't use RELAY_EARLY cells when sending
+     * relay cells on rendezvous circuits. See bug 1038. Eventually,
+     * we can take this behavior away in favor of having clients avoid
+     * rendezvous points running 0.2.1.3-alpha through 0.2.1.18. -RD */
+    --origin_circ->remaining_relay_early_cells;
+    log_debug(LD_OR, "Sending a RELAY_EARLY cell; %d remaining.",
+              (int)origin_circ->remaining_relay_early_cells);
+    /* Memorize the command that is sent as RELAY_EARLY cell; helps debug
+     * task 878. */
+    origin_circ->relay_early_commands[
+        origin_circ->relay_early_cells_sent++] = relay_command;
+    return CELL_RELAY_EARLY;
+  } else if (relay_command == RELAY_COMMAND_EXTEND) {
+    /* If no RELAY_EARLY cells can be sent over this circuit, log which
+     * commands have been sent as RELAY_EARLY cells before; helps debug
+     * task 878. */
+    smartlist_t *commands_list = smartlist_create();
+    int i = 0;
+    char *commands = NULL;
+    for (; i < origin_circ->relay_early_cells_sent; i++)
+      smartlist_add(commands_list, (char *)
+          relay_command_to_string(origin_circ->relay_early_commands[i]));
+    commands = smartlist_join_strings(commands_list, ",", 0, NULL);
+    log_warn(LD_BUG, "Uh-oh.  We're sending a RELAY_COMMAND_EXTEND cell, "
+             "but we have run out of RELAY_EARLY cells on that circuit. "
+             "Commands sent before: %s", commands);
+    tor_free(commands);
+    smartlist_free(commands_list);
+  }
+  return CELL_RELAY;
+}
+
 /** Make a relay cell out of <b>relay_command</b> and <b>payload</b>, and send
  * it onto the open circuit <b>circ</b>. <b>stream_id</b> is the ID on
  * <b>circ</b> for the stream that's sending the relay cell, or 0 if it's a
@@ -539,51 +664,12 @@ relay_send_command_from_edge(uint16_t stream_id, circuit_t *circ,
     geoip_change_dirreq_state(circ->dirreq_id, DIRREQ_TUNNELED,
                               DIRREQ_END_CELL_SENT);
 
-  if (cell_direction == CELL_DIRECTION_OUT && circ->n_conn) {
-    /* if we're using relaybandwidthrate, this conn wants priority */
-    circ->n_conn->client_used = approx_time();
-  }
-
   if (cell_direction == CELL_DIRECTION_OUT) {
-    origin_circuit_t *origin_circ = TO_ORIGIN_CIRCUIT(circ);
-    if (origin_circ->remaining_relay_early_cells > 0 &&
-        (relay_command == RELAY_COMMAND_EXTEND ||
-         (cpath_layer != origin_circ->cpath &&
-          !CIRCUIT_PURPOSE_IS_ESTABLISHED_REND(circ->purpose)))) {
-      /* If we've got any relay_early cells left, and we're sending
-       * an extend cell or (we're not talking to the first hop and we're
-       * not talking to a rendezvous circuit), use one of them.
-       * Don't worry about the conn protocol version:
-       * append_cell_to_circuit_queue will fix it up. */
-      /* XXX For now, clients don't use RELAY_EARLY cells when sending
-       * relay cells on rendezvous circuits. See bug 1038. Eventually,
-       * we can take this behavior away in favor of having clients avoid
-       * rendezvous points running 0.2.1.3-alpha through 0.2.1.18. -RD */
-      cell.command = CELL_RELAY_EARLY;
-      --origin_circ->remaining_relay_early_cells;
-      log_debug(LD_OR, "Sending a RELAY_EARLY cell; %d remaining.",
-                (int)origin_circ->remaining_relay_early_cells);
-      /* Memorize the command that is sent as RELAY_EARLY cell; helps debug
-       * task 878. */
-      origin_circ->relay_early_commands[
-          origin_circ->relay_early_cells_sent++] = relay_command;
-    } else if (relay_command == RELAY_COMMAND_EXTEND) {
-      /* If no RELAY_EARLY cells can be sent over this circuit, log which
-       * commands have been sent as RELAY_EARLY cells before; helps debug
-       * task 878. */
-      smartlist_t *commands_list = smartlist_create();
-      int i = 0;
-      char *commands = NULL;
-      for (; i < origin_circ->relay_early_cells_sent; i++)
-        smartlist_add(commands_list, (char *)
-            relay_command_to_string(origin_circ->relay_early_commands[i]));
-      commands = smartlist_join_strings(commands_list, ",", 0, NULL);
-      log_warn(LD_BUG, "Uh-oh.  We're sending a RELAY_COMMAND_EXTEND cell, "
-               "but we have run out of RELAY_EARLY cells on that circuit. "
-               "Commands sent before: %s", commands);
-      tor_free(commands);
-      smartlist_free(commands_list);
-    }
+    /* if we're using relaybandwidthrate, this conn wants priority */
+    if (circ->n_conn)
+      circ->n_conn->client_used = approx_time();
+    cell.command = relay_choose_cell_command(TO_ORIGIN_CIRCUIT(circ),
+                                             relay_command, cpath_layer);
   }
 
   if (circuit_package_relay_cell(&cell, circ, cell_direction, cpath_layer)
@@ -1069,9 +1155,8 @@ connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
       log_debug(domain,"circ deliver_window now %d.", layer_hint ?
                 layer_hint->deliver_window : circ->deliver_window);
 
-      circuit_consider_sending_sendme(circ, layer_hint);
-
       if (!conn) {
+        relay_note_pending_sendme(circ, NULL);
         log_info(domain,"data cell dropped, unknown stream (streamid %d).",
                  rh.stream_id);
         return 0;
@@ -1086,7 +1171,7 @@ connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
       stats_n_data_bytes_received += rh.length;
       connection_write_to_buf(cell->payload + RELAY_HEADER_SIZE,
                               rh.length, TO_CONN(conn));
-      connection_edge_consider_sending_sendme(conn);
+      relay_note_pending_sendme(circ, conn);
       return 0;
     case RELAY_COMMAND_END:
       reason = rh.length > 0 ?
@@ -1275,7 +1360,6 @@ int
 connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial)
 {
   size_t amount_to_process, length;
-  char payload[CELL_PAYLOAD_SIZE];
   circuit_t *circ;
   unsigned domain = conn->cpath_layer ? LD_APP : LD_EXIT;
 
@@ -1297,7 +1381,13 @@ repeat_connection_edge_package_raw_inbuf:
     return -1;
   }
 
-  if (circuit_consider_stop_edge_reading(circ, conn->cpath_layer))
+  amount_to_process = buf_datalen(conn->_base.inbuf);
+
+  /* A stream with nothing to send doesn't need to wait for the window. */
+  if (!amount_to_process)
+    return 0;
+
+  if (circuit_consider_stop_edge_reading(circ, conn))
     return 0;
 
   if (conn->package_window <= 0) {
@@ -1307,11 +1397,6 @@ repeat_connection_edge_package_raw_inbuf:
     return 0;
   }
 
-  amount_to_process = buf_datalen(conn->_base.inbuf);
-
-  if (!amount_to_process)
-    return 0;
-
   if (!package_partial && amount_to_process < RELAY_PAYLOAD_SIZE)
     return 0;
 
@@ -1323,13 +1408,10 @@ repeat_connection_edge_package_raw_inbuf:
   stats_n_data_bytes_packaged += length;
   stats_n_data_cells_packaged += 1;
 
-  connection_fetch_from_buf(payload, length, TO_CONN(conn));
-
   log_debug(domain,"(%d) Packaging %d bytes (%d waiting).", conn->_base.s,
-            (int)length, (int)buf_datalen(conn->_base.inbuf));
+            (int)length, (int)(buf_datalen(conn->_base.inbuf) - length));
 
-  if (connection_edge_send_command(conn, RELAY_COMMAND_DATA,
-                                   payload, length) < 0 )
+  if (connection_edge_package_data_cell(conn, circ, length) < 0)
     /* circuit got marked for close, don't continue, don't need to mark conn */
     return 0;
 
@@ -1344,7 +1426,6 @@ repeat_connection_edge_package_raw_inbuf:
   if (--conn->package_window <= 0) { /* is it 0 after decrement? */
     connection_stop_reading(TO_CONN(conn));
     log_debug(domain,"conn->package_window reached 0.");
-    circuit_consider_stop_edge_reading(circ, conn->cpath_layer);
     return 0; /* don't process the inbuf any more */
   }
   log_debug(domain,"conn->package_window is now %d",conn->package_window);
@@ -1389,93 +1470,108 @@ connection_edge_consider_sending_sendme(edge_connection_t *conn)
 }
 
 /** The circuit <b>circ</b> has received a circuit-level sendme
- * (on hop <b>layer_hint</b>, if we're the OP). Go through all the
- * attached streams and let them resume reading and packaging, if
- * their stream windows allow it.
+ * (on hop <b>layer_hint</b>, if we're the OP). Go through the streams
+ * that stopped reading because that window was empty, in the order they
+ * stopped, and let them resume reading and packaging, if their stream
+ * windows allow it.  Streams that are still reading never stopped, so we
+ * don't need to look at them.
  */
 static void
 circuit_resume_edge_reading(circuit_t *circ, crypt_path_t *layer_hint)
 {
+  smartlist_t *blocked = circ->blocked_streams;
+  int i, n, n_kept = 0;
 
   log_debug(layer_hint?LD_APP:LD_EXIT,"resuming");
 
-  if (CIRCUIT_IS_ORIGIN(circ))
-    circuit_resume_edge_reading_helper(TO_ORIGIN_CIRCUIT(circ)->p_streams,
-                                       circ, layer_hint);
-  else
-    circuit_resume_edge_reading_helper(TO_OR_CIRCUIT(circ)->n_streams,
-                                       circ, layer_hint);
-}
-
-/** A helper function for circuit_resume_edge_reading() above.
- * The arguments are the same, except that <b>conn</b> is the head
- * of a linked list of edge streams that should each be considered.
- */
-static int
-circuit_resume_edge_reading_helper(edge_connection_t *conn,
-                                   circuit_t *circ,
-                                   crypt_path_t *layer_hint)
-{
-  for ( ; conn; conn=conn->next_stream) {
+  if (!blocked || circ->marked_for_close)
+    return;
+  /* Streams that block again while we're packaging go on a fresh list,
+   * behind the ones we haven't gotten to yet. */
+  circ->blocked_streams = NULL;
+  n = smartlist_len(blocked);
+  for (i = 0; i < n; ++i) {
+    edge_connection_t *conn = smartlist_get(blocked, i);
+    int window = layer_hint ? layer_hint->package_window :
+                              circ->package_window;
+    if (!conn->edge_blocked_on_circ_window) {
+      /* It was detached from the circuit while we were packaging. */
+      continue;
+    }
+    if (circ->marked_for_close) {
+      /* Packaging closed the circuit; nobody is waiting any more. */
+      conn->edge_blocked_on_circ_window = 0;
+      continue;
+    }
+    if (conn->cpath_layer != layer_hint || window <= 0) {
+      /* Waiting on another hop, or the window has filled up again. */
+      smartlist_set(blocked, n_kept++, conn);
+      continue;
+    }
+    conn->edge_blocked_on_circ_window = 0;
     if (conn->_base.marked_for_close)
       continue;
-    if ((!layer_hint && conn->package_window > 0) ||
-        (layer_hint && conn->package_window > 0 &&
-         conn->cpath_layer == layer_hint)) {
-      connection_start_reading(TO_CONN(conn));
-      /* handle whatever might still be on the inbuf */
-      if (connection_edge_package_raw_inbuf(conn, 1)<0) {
-        /* (We already sent an end cell if possible) */
-        connection_mark_for_close(TO_CONN(conn));
-        continue;
-      }
-
-      /* If the circuit won't accept any more data, return without looking
-       * at any more of the streams. Any connections that should be stopped
-       * have already been stopped by connection_edge_package_raw_inbuf. */
-      if (circuit_consider_stop_edge_reading(circ, layer_hint))
-        return -1;
+    if (conn->package_window <= 0) {
+      /* Its stream-level sendme will start it reading again. */
+      continue;
+    }
+    connection_start_reading(TO_CONN(conn));
+    /* handle whatever might still be on the inbuf */
+    if (connection_edge_package_raw_inbuf(conn, 1)<0) {
+      /* (We already sent an end cell if possible) */
+      connection_mark_for_close(TO_CONN(conn));
+      continue;
     }
   }
-  return 0;
+  if (circ->marked_for_close) {
+    /* circuit_mark_for_close() has already forgotten the streams that were
+     * on circ->blocked_streams, and detached the rest; the streams we kept
+     * mustn't think they're still waiting on a circuit that's going away. */
+    for (i = 0; i < n_kept; ++i) {
+      edge_connection_t *conn = smartlist_get(blocked, i);
+      conn->edge_blocked_on_circ_window = 0;
+    }
+    smartlist_free(blocked);
+    return;
+  }
+  for (i = smartlist_len(blocked) - 1; i >= n_kept; --i)
+    smartlist_del_keeporder(blocked, i);
+  if (circ->blocked_streams) {
+    smartlist_add_all(blocked, circ->blocked_streams);
+    smartlist_free(circ->blocked_streams);
+  }
+  circ->blocked_streams = blocked;
 }
 
-/** Check if the package window for <b>circ</b> is empty (at
- * hop <b>layer_hint</b> if it's defined).
+/** Check if the package window that <b>conn</b> uses on <b>circ</b> (the
+ * circuit's, or that of the hop <b>conn</b> is attached to if we're the OP)
+ * is empty.
  *
- * If yes, tell edge streams to stop reading and return 1.
- * Else return 0.
+ * If yes, stop reading on <b>conn</b>, remember it so that we can resume
+ * it when a circuit-level sendme arrives, and return 1.  Else return 0.
  */
 static int
-circuit_consider_stop_edge_reading(circuit_t *circ, crypt_path_t *layer_hint)
+circuit_consider_stop_edge_reading(circuit_t *circ, edge_connection_t *conn)
 {
-  edge_connection_t *conn = NULL;
+  crypt_path_t *layer_hint = conn->cpath_layer;
   unsigned domain = layer_hint ? LD_APP : LD_EXIT;
+  int window = layer_hint ? layer_hint->package_window : circ->package_window;
 
-  if (!layer_hint) {
-    or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
-    log_debug(domain,"considering circ->package_window %d",
-              circ->package_window);
-    if (circ->package_window <= 0) {
-      log_debug(domain,"yes, not-at-origin. stopped.");
-      for (conn = or_circ->n_streams; conn; conn=conn->next_stream)
-        connection_stop_reading(TO_CONN(conn));
-      return 1;
-    }
+  log_debug(domain,"considering %s package_window %d",
+            layer_hint ? "layer_hint->" : "circ->", window);
+  if (window > 0)
     return 0;
+
+  log_debug(domain,"yes, %s. stopped.",
+            layer_hint ? "at-origin" : "not-at-origin");
+  connection_stop_reading(TO_CONN(conn));
+  if (!conn->edge_blocked_on_circ_window) {
+    if (!circ->blocked_streams)
+      circ->blocked_streams = smartlist_create();
+    smartlist_add(circ->blocked_streams, conn);
+    conn->edge_blocked_on_circ_window = 1;
   }
-  /* else, layer hint is defined, use it */
-  log_debug(domain,"considering layer_hint->package_window %d",
-            layer_hint->package_window);
-  if (layer_hint->package_window <= 0) {
-    log_debug(domain,"yes, at-origin. stopped.");
-    for (conn = TO_ORIGIN_CIRCUIT(circ)->p_streams; conn;
-         conn=conn->next_stream)
-      if (conn->cpath_layer == layer_hint)
-        connection_stop_reading(TO_CONN(conn));
-    return 1;
-  }
-  return 0;
+  return 1;
 }
 
 /** Check if the deliver_window for circuit <b>circ</b> (at hop
@@ -1505,6 +1601,110 @@ circuit_consider_sending_sendme(circuit_t *circ, crypt_path_t *layer_hint)
   }
 }
 
+/** Circuits that have received data cells since the last call to
+ * relay_flush_pending_sendmes(). */
+static smartlist_t *circuits_pending_sendme = NULL;
+/** Edge streams that have received data cells since the last call to
+ * relay_flush_pending_sendmes(). */
+static smartlist_t *streams_pending_sendme = NULL;
+
+/** We've just delivered a data cell on <b>circ</b> (and to <b>conn</b>, if
+ * it's set).  Remember to check whether to send circuit-level and
+ * stream-level sendmes once we're done with the current batch of cells,
+ * rather than checking after every cell. */
+static void
+relay_note_pending_sendme(circuit_t *circ, edge_connection_t *conn)
+{
+  if (!circ->sendme_pending) {
+    if (!circuits_pending_sendme)
+      circuits_pending_sendme = smartlist_create();
+    smartlist_add(circuits_pending_sendme, circ);
+    circ->sendme_pending = 1;
+  }
+  if (conn && !conn->sendme_pending) {
+    if (!streams_pending_sendme)
+      streams_pending_sendme = smartlist_create();
+    smartlist_add(streams_pending_sendme, conn);
+    conn->sendme_pending = 1;
+  }
+}
+
+/** Send whatever circuit-level and stream-level sendmes are due on the
+ * circuits and streams that have received data since we were last called.
+ * Called once we're done processing a batch of cells. */
+void
+relay_flush_pending_sendmes(void)
+{
+  if (circuits_pending_sendme) {
+    SMARTLIST_FOREACH_BEGIN(circuits_pending_sendme, circuit_t *, circ) {
+      circ->sendme_pending = 0;
+      if (circ->marked_for_close)
+        continue;
+      if (CIRCUIT_IS_ORIGIN(circ)) {
+        /* We don't know which hops the data came from, but there are only
+         * a few of them. */
+        crypt_path_t *head = TO_ORIGIN_CIRCUIT(circ)->cpath, *hop = head;
+        while (hop) {
+          circuit_consider_sending_sendme(circ, hop);
+          hop = hop->next;
+          if (hop == head || circ->marked_for_close)
+            break;
+        }
+      } else {
+        circuit_consider_sending_sendme(circ, NULL);
+      }
+    } SMARTLIST_FOREACH_END(circ);
+    smartlist_clear(circuits_pending_sendme);
+  }
+  if (streams_pending_sendme) {
+    SMARTLIST_FOREACH_BEGIN(streams_pending_sendme, edge_connection_t *,
+                            conn) {
+      conn->sendme_pending = 0;
+      if (!conn->_base.marked_for_close)
+        connection_edge_consider_sending_sendme(conn);
+    } SMARTLIST_FOREACH_END(conn);
+    smartlist_clear(streams_pending_sendme);
+  }
+}
+
+/** <b>circ</b> is about to be freed; forget any sendmes it has pending. */
+void
+relay_forget_circuit_sendmes(circuit_t *circ)
+{
+  if (circ->sendme_pending) {
+    smartlist_remove(circuits_pending_sendme, circ);
+    circ->sendme_pending = 0;
+  }
+}
+
+/** <b>conn</b> is about to be freed; forget any sendmes it has pending. */
+void
+relay_forget_edge_sendmes(edge_connection_t *conn)
+{
+  if (conn->sendme_pending) {
+    smartlist_remove(streams_pending_sendme, conn);
+    conn->sendme_pending = 0;
+  }
+}
+
+/** Release all storage held for pending sendmes. */
+void
+relay_free_all(void)
+{
+  if (circuits_pending_sendme) {
+    SMARTLIST_FOREACH(circuits_pending_sendme, circuit_t *, circ,
+                      circ->sendme_pending = 0);
+    smartlist_free(circuits_pending_sendme);
+    circuits_pending_sendme = NULL;
+  }
+  if (streams_pending_sendme) {
+    SMARTLIST_FOREACH(streams_pending_sendme, edge_connection_t *, conn,
+                      conn->sendme_pending = 0);
+    smartlist_free(streams_pending_sendme);
+    streams_pending_sendme = NULL;
+  }
+}
+
 /** Stop reading on edge connections when we have this many cells
  * waiting on the appropriate queue. */
 #define CELL_QUEUE_HIGHWATER_SIZE 256
@@ -1525,10 +1725,6 @@ static int total_cells_allocated = 0;
 /** A memory pool to allocate packed_cell_t objects. */
 static mp_pool_t *cell_pool = NULL;
 
-/** Memory pool to allocate insertion_time_elem_t objects used for cell
- * statistics. */
-static mp_pool_t *it_pool = NULL;
-
 /** Allocate structures to hold cells. */
 void
 init_cell_pool(void)
@@ -1537,8 +1733,7 @@ init_cell_pool(void)
   cell_pool = mp_pool_new(sizeof(packed_cell_t), 128*1024);
 }
 
-/** Free all storage used to hold cells (and insertion times if we measure
- * cell statistics). */
+/** Free all storage used to hold cells. */
 void
 free_cell_pool(void)
 {
@@ -1547,10 +1742,6 @@ free_cell_pool(void)
     mp_pool_destroy(cell_pool);
     cell_pool = NULL;
   }
-  if (it_pool) {
-    mp_pool_destroy(it_pool);
-    it_pool = NULL;
-  }
 }
 
 /** Free excess storage in cell pool. */
@@ -1561,20 +1752,48 @@ clean_cell_pool(void)
   mp_pool_clean(cell_pool, 0, 1);
 }
 
-/** Release storage held by <b>cell</b>. */
+/** Release storage held by <b>cell</b>, to the cell magazine of
+ * <b>conn</b> if <b>conn</b> is not NULL and has one. */
 static INLINE void
-packed_cell_free(packed_cell_t *cell)
+packed_cell_free(or_connection_t *conn, packed_cell_t *cell)
 {
   --total_cells_allocated;
-  mp_pool_release(cell);
+  if (conn && conn->cell_magazine)
+    mp_magazine_release(conn->cell_magazine, cell);
+  else
+    mp_pool_release(cell);
 }
 
-/** Allocate and return a new packed_cell_t. */
+/** Allocate and return a new packed_cell_t, to be flushed onto <b>conn</b>
+ * if <b>conn</b> is not NULL.  Each connection keeps a small magazine of
+ * free cells, so that queueing a cell and flushing it again usually costs
+ * us no more than a push and a pop. */
 static INLINE packed_cell_t *
-packed_cell_alloc(void)
+packed_cell_alloc(or_connection_t *conn)
 {
   ++total_cells_allocated;
-  return mp_pool_get(cell_pool);
+  if (!conn)
+    return mp_pool_get(cell_pool);
+  if (PREDICT_UNLIKELY(!conn->cell_magazine))
+    conn->cell_magazine = mp_magazine_new(cell_pool);
+  return mp_magazine_get(conn->cell_magazine);
+}
+
+/** Return all the free cells cached by <b>conn</b> to the cell pool. */
+void
+connection_or_clear_cell_magazine(or_connection_t *conn)
+{
+  if (conn->cell_magazine)
+    mp_magazine_clear(conn->cell_magazine);
+}
+
+/** Return all the free cells cached by <b>conn</b> to the cell pool, and
+ * release the storage used to cache them. */
+void
+connection_or_free_cell_magazine(or_connection_t *conn)
+{
+  mp_magazine_free(conn->cell_magazine);
+  conn->cell_magazine = NULL;
 }
 
 /** Log current statistics for cell pool allocation at log level
@@ -1596,11 +1815,60 @@ dump_cell_pool_usage(int severity)
   mp_pool_log_status(cell_pool, severity);
 }
 
-/** Allocate a new copy of packed <b>cell</b>. */
+/** Return the current time on the monotonic clock in microseconds, modulo
+ * 2**32.  Differences between two such values are right so long as they are
+ * under about 71 minutes apart. */
+static INLINE uint32_t
+cell_queue_now_usec(void)
+{
+  return (uint32_t)tor_gettime_monotonic_usec();
+}
+
+/** Return the index of the bucket in a cell wait histogram that counts
+ * cells that waited <b>usec</b> microseconds.  See CELL_WAIT_HIST_BUCKETS. */
+int
+cell_wait_hist_bucket(uint32_t usec)
+{
+  uint32_t msec = usec / 1000;
+  int bucket = 0;
+  while (msec && bucket < CELL_WAIT_HIST_BUCKETS-1) {
+    msec >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
+
+/** Return a newly allocated string describing the CELL_WAIT_HIST_BUCKETS
+ * counts in <b>hist</b>, in the form "<1ms:N <2ms:N ... >=4096ms:N". */
+char *
+cell_wait_hist_to_string(const uint64_t *hist)
+{
+  smartlist_t *elts = smartlist_create();
+  char *result;
+  char buf[64];
+  int i;
+
+  for (i = 0; i < CELL_WAIT_HIST_BUCKETS; ++i) {
+    if (i < CELL_WAIT_HIST_BUCKETS-1)
+      tor_snprintf(buf, sizeof(buf), "<%dms:"U64_FORMAT, 1<<i,
+                   U64_PRINTF_ARG(hist[i]));
+    else
+      tor_snprintf(buf, sizeof(buf), ">=%dms:"U64_FORMAT, 1<<(i-1),
+                   U64_PRINTF_ARG(hist[i]));
+    smartlist_add(elts, tor_strdup(buf));
+  }
+  result = smartlist_join_strings(elts, " ", 0, NULL);
+  SMARTLIST_FOREACH(elts, char *, cp, tor_free(cp));
+  smartlist_free(elts);
+  return result;
+}
+
+/** Allocate a new copy of packed <b>cell</b>, to be flushed onto
+ * <b>conn</b>. */
 static INLINE packed_cell_t *
-packed_cell_copy(const cell_t *cell)
+packed_cell_copy(or_connection_t *conn, const cell_t *cell)
 {
-  packed_cell_t *c = packed_cell_alloc();
+  packed_cell_t *c = packed_cell_alloc(conn);
   cell_pack(c, cell);
   c->next = NULL;
   return c;
@@ -1621,44 +1889,6 @@ cell_queue_append(cell_queue_t *queue, packed_cell_t *cell)
   ++queue->n;
 }
 
-/** Append a newly allocated copy of <b>cell</b> to the end of <b>queue</b> */
-void
-cell_queue_append_packed_copy(cell_queue_t *queue, const cell_t *cell)
-{
-  packed_cell_t *copy = packed_cell_copy(cell);
-  /* Remember the time when this cell was put in the queue. */
-  if (get_options()->CellStatistics) {
-    struct timeval now;
-    uint32_t added;
-    insertion_time_queue_t *it_queue = queue->insertion_times;
-    if (!it_pool)
-      it_pool = mp_pool_new(sizeof(insertion_time_elem_t), 1024);
-    tor_gettimeofday(&now);
-#define SECONDS_IN_A_DAY 86400L
-    added = (uint32_t)(((now.tv_sec % SECONDS_IN_A_DAY) * 100L)
-            + ((uint32_t)now.tv_usec / (uint32_t)10000L));
-    if (!it_queue) {
-      it_queue = tor_malloc_zero(sizeof(insertion_time_queue_t));
-      queue->insertion_times = it_queue;
-    }
-    if (it_queue->last && it_queue->last->insertion_time == added) {
-      it_queue->last->counter++;
-    } else {
-      insertion_time_elem_t *elem = mp_pool_get(it_pool);
-      elem->next = NULL;
-      elem->insertion_time = added;
-      elem->counter = 1;
-      if (it_queue->last) {
-        it_queue->last->next = elem;
-        it_queue->last = elem;
-      } else {
-        it_queue->first = it_queue->last = elem;
-      }
-    }
-  }
-  cell_queue_append(queue, copy);
-}
-
 /** Remove and free every cell in <b>queue</b>. */
 void
 cell_queue_clear(cell_queue_t *queue)
@@ -1667,19 +1897,11 @@ cell_queue_clear(cell_queue_t *queue)
   cell = queue->head;
   while (cell) {
     next = cell->next;
-    packed_cell_free(cell);
+    packed_cell_free(NULL, cell);
     cell = next;
   }
   queue->head = queue->tail = NULL;
   queue->n = 0;
-  if (queue->insertion_times) {
-    while (queue->insertion_times->first) {
-      insertion_time_elem_t *elem = queue->insertion_times->first;
-      queue->insertion_times->first = elem->next;
-      mp_pool_release(elem);
-    }
-    tor_free(queue->insertion_times);
-  }
 }
 
 /** Extract and return the cell at the head of <b>queue</b>; return NULL if
@@ -1699,6 +1921,204 @@ cell_queue_pop(cell_queue_t *queue)
   return cell;
 }
 
+/* ====== EWMA circuit scheduling ====== */
+
+/** How long does a tick last (seconds)? */
+#define EWMA_TICK_LEN 10
+
+/** What is the default half-life, in seconds, that we use for cell_ewma if
+ * neither our configuration nor the consensus says otherwise? */
+#define EWMA_DEFAULT_HALFLIFE 30.0
+
+/** Anything smaller than this we treat as zero. */
+#define EPSILON 0.00001
+/** The natural logarithm of 0.5. */
+#define LOG_ONEHALF -0.69314718055994529
+
+/** The per-tick scale factor to be used when computing cell-count EWMA
+ * values.  (A cell sent N ticks before the start of the current tick
+ * has value ewma_scale_factor ** N.)
+ */
+static double ewma_scale_factor = 0.1;
+/** True iff we are choosing circuits by their cell EWMA, rather than
+ * round-robin. */
+static int ewma_enabled = 0;
+
+/** Return the tick in which <b>now</b> falls, and set
+ * *<b>remainder_out</b> to the fraction of that tick which has elapsed. */
+static INLINE unsigned int
+cell_ewma_tick_from_timeval(const struct timeval *now,
+                            double *remainder_out)
+{
+  unsigned res = (unsigned) (now->tv_sec / EWMA_TICK_LEN);
+  double rem = (now->tv_sec % EWMA_TICK_LEN) +
+    ((double)(now->tv_usec)) / 1.0e6;
+  *remainder_out = rem / EWMA_TICK_LEN;
+  return res;
+}
+
+/** Compute and return the current cell_ewma tick. */
+unsigned int
+cell_ewma_get_tick(void)
+{
+  return ((unsigned)approx_time() / EWMA_TICK_LEN);
+}
+
+/** Set <b>ft</b> to the current time, for flushing cells from circuit
+ * queues with connection_or_flush_from_first_active_circuit(). */
+void
+cell_flush_time_init(cell_flush_time_t *ft)
+{
+  struct timeval now;
+  tor_gettimeofday(&now);
+  ft->now = now.tv_sec;
+  if (ewma_enabled) {
+    double fractional_tick;
+    ft->tick = cell_ewma_tick_from_timeval(&now, &fractional_tick);
+    ft->ewma_increment = pow(ewma_scale_factor, -fractional_tick);
+  } else {
+    ft->tick = cell_ewma_get_tick();
+    ft->ewma_increment = -1;
+  }
+  ft->now_usec = cell_queue_now_usec();
+}
+
+/** Adjust the global cell scale factor based on <b>options</b> and the
+ * consensus parameters in <b>consensus</b>.  Called whenever either one
+ * changes. */
+void
+cell_ewma_set_scale_factor(or_options_t *options, networkstatus_t *consensus)
+{
+  int32_t halflife_ms;
+  double halflife;
+  const char *source;
+  if (options && options->CircuitPriorityHalflife >= -EPSILON) {
+    halflife = options->CircuitPriorityHalflife;
+    source = "CircuitPriorityHalflife in configuration";
+  } else if (consensus &&
+             (halflife_ms = networkstatus_get_param(
+                 consensus, "CircuitPriorityHalflifeMsec", -1)) >= 0) {
+    halflife = ((double)halflife_ms)/1000.0;
+    source = "CircuitPriorityHalflifeMsec in consensus";
+  } else {
+    halflife = EWMA_DEFAULT_HALFLIFE;
+    source = "Default value";
+  }
+
+  if (halflife <= EPSILON) {
+    /* The cell EWMA algorithm is disabled. */
+    ewma_scale_factor = 0.1;
+    ewma_enabled = 0;
+    log_info(LD_OR,
+             "Disabled cell_ewma algorithm because of value in %s",
+             source);
+  } else {
+    /* convert halflife into halflife-per-tick. */
+    halflife /= EWMA_TICK_LEN;
+    /* compute per-tick scale factor. */
+    ewma_scale_factor = exp( LOG_ONEHALF / halflife );
+    ewma_enabled = 1;
+    log_info(LD_OR,
+             "Enabled cell_ewma algorithm because of value in %s; "
+             "scale factor is %f per %d seconds",
+             source, ewma_scale_factor, EWMA_TICK_LEN);
+  }
+}
+
+/** Return the multiplier necessary to convert the value of a cell sent in
+ * 'from_tick' to one sent in 'to_tick'. */
+static INLINE double
+get_scale_factor(unsigned from_tick, unsigned to_tick)
+{
+  /* This math can wrap around, but that's okay: unsigned overflow is
+     well-defined */
+  int diff = (int)(to_tick - from_tick);
+  return pow(ewma_scale_factor, diff);
+}
+
+/** Adjust the cell count of <b>ewma</b> so that it is scaled with respect to
+ * <b>cur_tick</b> */
+static void
+scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick)
+{
+  double factor = get_scale_factor(ewma->last_adjusted_tick, cur_tick);
+  ewma->cell_count *= factor;
+  ewma->last_adjusted_tick = cur_tick;
+}
+
+/** Adjust the cell count of every active circuit on <b>conn</b> so
+ * that they are scaled with respect to <b>cur_tick</b> */
+static void
+scale_active_circuits(or_connection_t *conn, unsigned cur_tick)
+{
+  double factor = get_scale_factor(
+              conn->active_circuit_pqueue_last_recalibrated,
+              cur_tick);
+  /** Ordinarily it isn't okay to change the value of an element in a heap,
+   * but it's okay here, since we are preserving the order. */
+  SMARTLIST_FOREACH(conn->active_circuit_pqueue, cell_ewma_t *, e, {
+      tor_assert(e->last_adjusted_tick ==
+                 conn->active_circuit_pqueue_last_recalibrated);
+      e->cell_count *= factor;
+      e->last_adjusted_tick = cur_tick;
+  });
+  conn->active_circuit_pqueue_last_recalibrated = cur_tick;
+}
+
+/** Helper for sorting cell_ewma_t values in their priority queue. */
+static int
+compare_cell_ewma_counts(const void *p1, const void *p2)
+{
+  const cell_ewma_t *e1=p1, *e2=p2;
+  if (e1->cell_count < e2->cell_count)
+    return -1;
+  else if (e1->cell_count > e2->cell_count)
+    return 1;
+  else
+    return 0;
+}
+
+/** Given a cell_ewma_t, return a pointer to the circuit containing it. */
+static circuit_t *
+cell_ewma_to_circuit(cell_ewma_t *ewma)
+{
+  if (ewma->is_for_p_conn) {
+    /* This is an or_circuit_t's p_cell_ewma. */
+    or_circuit_t *orcirc = SUBTYPE_P(ewma, or_circuit_t, p_cell_ewma);
+    return TO_CIRCUIT(orcirc);
+  } else {
+    /* This is some circuit's n_cell_ewma. */
+    return SUBTYPE_P(ewma, circuit_t, n_cell_ewma);
+  }
+}
+
+/** Add <b>ewma</b> to the priority queue of active circuits on
+ * <b>conn</b>, after scaling it to the queue's last recalibration tick. */
+static void
+add_cell_ewma_to_conn(or_connection_t *conn, cell_ewma_t *ewma)
+{
+  tor_assert(ewma->heap_index == -1);
+  scale_single_cell_ewma(ewma,
+                         conn->active_circuit_pqueue_last_recalibrated);
+
+  smartlist_pqueue_add(conn->active_circuit_pqueue,
+                       compare_cell_ewma_counts,
+                       STRUCT_OFFSET(cell_ewma_t, heap_index),
+                       ewma);
+}
+
+/** Remove <b>ewma</b> from <b>conn</b>'s priority queue of active
+ * circuits. */
+static void
+remove_cell_ewma_from_conn(or_connection_t *conn, cell_ewma_t *ewma)
+{
+  tor_assert(ewma->heap_index != -1);
+  smartlist_pqueue_remove(conn->active_circuit_pqueue,
+                          compare_cell_ewma_counts,
+                          STRUCT_OFFSET(cell_ewma_t, heap_index),
+                          ewma);
+}
+
 /** Return a pointer to the "next_active_on_{n,p}_conn" pointer of <b>circ</b>,
  * depending on whether <b>conn</b> matches n_conn or p_conn. */
 static INLINE circuit_t **
@@ -1755,6 +2175,15 @@ make_circuit_active_on_conn(circuit_t *circ, or_connection_t *conn)
     *prev_circ_on_conn_p(head, conn) = circ;
     *prevp = old_tail;
   }
+
+  if (circ->n_conn == conn) {
+    add_cell_ewma_to_conn(conn, &circ->n_cell_ewma);
+  } else {
+    or_circuit_t *orcirc = TO_OR_CIRCUIT(circ);
+    tor_assert(conn == orcirc->p_conn);
+    add_cell_ewma_to_conn(conn, &orcirc->p_cell_ewma);
+  }
+
   assert_active_circuits_ok_paranoid(conn);
 }
 
@@ -1784,6 +2213,15 @@ make_circuit_inactive_on_conn(circuit_t *circ, or_connection_t *conn)
     if (conn->active_circuits == circ)
       conn->active_circuits = next;
   }
+
+  if (circ->n_conn == conn) {
+    remove_cell_ewma_from_conn(conn, &circ->n_cell_ewma);
+  } else {
+    or_circuit_t *orcirc = TO_OR_CIRCUIT(circ);
+    tor_assert(conn == orcirc->p_conn);
+    remove_cell_ewma_from_conn(conn, &orcirc->p_cell_ewma);
+  }
+
   *prevp = *nextp = NULL;
   assert_active_circuits_ok_paranoid(conn);
 }
@@ -1804,6 +2242,10 @@ connection_or_unlink_all_active_circs(or_connection_t *orconn)
     cur = next;
   } while (cur != head);
   orconn->active_circuits = NULL;
+
+  SMARTLIST_FOREACH(orconn->active_circuit_pqueue, cell_ewma_t *, e,
+                    e->heap_index = -1);
+  smartlist_clear(orconn->active_circuit_pqueue);
 }
 
 /** Block (if <b>block</b> is true) or unblock (if <b>block</b> is false)
@@ -1848,18 +2290,41 @@ set_streams_blocked_on_circ(circuit_t *circ, or_connection_t *orconn,
 /** Pull as many cells as possible (but no more than <b>max</b>) from the
  * queue of the first active circuit on <b>conn</b>, and write then to
  * <b>conn</b>-&gt;outbuf.  Return the number of cells written.  Advance
- * the active circuit pointer to the next active circuit in the ring. */
+ * the active circuit pointer to the next active circuit in the ring.
+ * <b>ft</b> is the current time, as set by cell_flush_time_init().
+ *
+ * If the cell_ewma algorithm is enabled, the "first" active circuit is
+ * the one with the lowest weighted count of recently flushed cells, rather
+ * than the one at the head of the ring. */
 int
 connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
-                                              time_t now)
+                                              const cell_flush_time_t *ft)
 {
   int n_flushed;
   cell_queue_t *queue;
   circuit_t *circ;
   int streams_blocked;
+
+  /* The EWMA cell counter for the circuit we're flushing. */
+  cell_ewma_t *cell_ewma = NULL;
+
+  uint32_t wait_usec;
+  int bucket, cell_stats;
+
   circ = conn->active_circuits;
   if (!circ) return 0;
   assert_active_circuits_ok_paranoid(conn);
+
+  /* See if we're doing the ewma circuit selection algorithm. */
+  if (ft->ewma_increment >= 0) {
+    if (ft->tick != conn->active_circuit_pqueue_last_recalibrated) {
+      scale_active_circuits(conn, ft->tick);
+    }
+
+    cell_ewma = smartlist_get(conn->active_circuit_pqueue, 0);
+    circ = cell_ewma_to_circuit(cell_ewma);
+  }
+
   if (circ->n_conn == conn) {
     queue = &circ->n_conn_cells;
     streams_blocked = circ->streams_blocked_on_n_conn;
@@ -1868,40 +2333,21 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
     streams_blocked = circ->streams_blocked_on_p_conn;
   }
   tor_assert(*next_circ_on_conn_p(circ,conn));
+  cell_stats = get_options()->CellStatistics;
 
   for (n_flushed = 0; n_flushed < max && queue->head; ) {
     packed_cell_t *cell = cell_queue_pop(queue);
     tor_assert(*next_circ_on_conn_p(circ,conn));
 
-    /* Calculate the exact time that this cell has spent in the queue. */
-    if (get_options()->CellStatistics && !CIRCUIT_IS_ORIGIN(circ)) {
-      struct timeval now;
-      uint32_t flushed;
-      uint32_t cell_waiting_time;
-      insertion_time_queue_t *it_queue = queue->insertion_times;
-      tor_gettimeofday(&now);
-      flushed = (uint32_t)((now.tv_sec % SECONDS_IN_A_DAY) * 100L +
-                 (uint32_t)now.tv_usec / (uint32_t)10000L);
-      if (!it_queue || !it_queue->first) {
-        log_warn(LD_BUG, "Cannot determine insertion time of cell.");
-      } else {
-        or_circuit_t *orcirc = TO_OR_CIRCUIT(circ);
-        insertion_time_elem_t *elem = it_queue->first;
-        cell_waiting_time =
-            (uint32_t)((flushed * 10L + SECONDS_IN_A_DAY * 1000L -
-                        elem->insertion_time * 10L) %
-                       (SECONDS_IN_A_DAY * 1000L));
-#undef SECONDS_IN_A_DAY
-        elem->counter--;
-        if (elem->counter < 1) {
-          it_queue->first = elem->next;
-          if (elem == it_queue->last)
-            it_queue->last = NULL;
-          mp_pool_release(elem);
-        }
-        orcirc->total_cell_waiting_time += cell_waiting_time;
-        orcirc->processed_cells++;
-      }
+    /* Note how long this cell spent in the queue. */
+    wait_usec = ft->now_usec - cell->inserted_time;
+    bucket = cell_wait_hist_bucket(wait_usec);
+    scheduler_note_cell_latency(bucket);
+    if (cell_stats && !CIRCUIT_IS_ORIGIN(circ)) {
+      or_circuit_t *orcirc = TO_OR_CIRCUIT(circ);
+      orcirc->total_cell_waiting_time += wait_usec;
+      orcirc->processed_cells++;
+      orcirc->cell_wait_hist[bucket]++;
     }
 
     /* If we just flushed our queue and this circuit is used for a
@@ -1913,9 +2359,22 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
 
     connection_write_to_buf(cell->body, CELL_NETWORK_SIZE, TO_CONN(conn));
 
-    packed_cell_free(cell);
+    packed_cell_free(conn, cell);
     ++n_flushed;
-    if (circ != conn->active_circuits) {
+    if (cell_ewma) {
+      if (cell_ewma->heap_index == -1) {
+        /* The current circuit just got made inactive by a call in
+         * connection_write_to_buf(); it's no longer in the queue. */
+        assert_active_circuits_ok_paranoid(conn);
+        goto done;
+      }
+      /* Charge the circuit for the cell, and move it to its new place in
+       * the priority queue right away, so that the queue stays consistent
+       * with the ring if anything else touches it. */
+      cell_ewma->cell_count += ft->ewma_increment;
+      remove_cell_ewma_from_conn(conn, cell_ewma);
+      add_cell_ewma_to_conn(conn, cell_ewma);
+    } else if (circ != conn->active_circuits) {
       /* If this happens, the current circuit just got made inactive by
        * a call in connection_write_to_buf().  That's nothing to worry about:
        * circuit_make_inactive_on_conn() already advanced conn->active_circuits
@@ -1941,7 +2400,7 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
   }
  done:
   if (n_flushed)
-    conn->timestamp_last_added_nonpadding = now;
+    conn->timestamp_last_added_nonpadding = ft->now;
   return n_flushed;
 }
 
@@ -1950,6 +2409,24 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
 void
 append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
                              cell_t *cell, cell_direction_t direction)
+{
+  if (cell->command == CELL_RELAY_EARLY && orconn->link_proto < 2) {
+    /* V1 connections don't understand RELAY_EARLY. */
+    cell->command = CELL_RELAY;
+  }
+
+  append_packed_cell_to_circuit_queue(circ, orconn,
+                                      packed_cell_copy(orconn, cell),
+                                      direction);
+}
+
+/** Add the already packed <b>cell</b>, which we allocated for
+ * <b>orconn</b>, to the queue of <b>circ</b> writing to <b>orconn</b>
+ * transmitting in <b>direction</b>. */
+static void
+append_packed_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
+                                    packed_cell_t *cell,
+                                    cell_direction_t direction)
 {
   cell_queue_t *queue;
   int streams_blocked;
@@ -1961,12 +2438,11 @@ append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
     queue = &orcirc->p_conn_cells;
     streams_blocked = circ->streams_blocked_on_p_conn;
   }
-  if (cell->command == CELL_RELAY_EARLY && orconn->link_proto < 2) {
-    /* V1 connections don't understand RELAY_EARLY. */
-    cell->command = CELL_RELAY;
-  }
 
-  cell_queue_append_packed_copy(queue, cell);
+  /* Remember when this cell was put in the queue, so we can tell how long
+   * it waited there once we flush it. */
+  cell->inserted_time = cell_queue_now_usec();
+  cell_queue_append(queue, cell);
 
   /* If we have too many cells on the circuit, we should stop reading from
    * the edge streams for a while. */
@@ -1975,19 +2451,100 @@ append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
 
   if (queue->n == 1) {
     /* This was the first cell added to the queue.  We need to make this
-     * circuit active. */
+     * circuit active, and let the scheduler know that this connection has
+     * something to send. */
     log_debug(LD_GENERAL, "Made a circuit active.");
     make_circuit_active_on_conn(circ, orconn);
+    scheduler_conn_wants_to_write(orconn);
   }
+}
 
-  if (! buf_datalen(orconn->_base.outbuf)) {
-    /* There is no data at all waiting to be sent on the outbuf.  Add a
-     * cell, so that we can notice when it gets flushed, flushed_some can
-     * get called, and we can start putting more data onto the buffer then.
-     */
-    log_debug(LD_GENERAL, "Primed a buffer.");
-    connection_or_flush_from_first_active_circuit(orconn, 1, approx_time());
+/** Take <b>length</b> bytes from the front of <b>conn</b>'s inbuf, and
+ * send them in a relay data cell onto <b>conn</b>'s circuit <b>circ</b>.
+ *
+ * This does what fetching the bytes and calling
+ * connection_edge_send_command() would do, but it builds the cell right in
+ * the packed cell that we queue: the bytes go straight from the inbuf's
+ * chunks into the packed cell, and we set the digest and encrypt them
+ * there, so that we copy each byte only once.
+ *
+ * If you can't send the cell, mark the circuit for close and return -1.
+ * Else return 0.
+ */
+static int
+connection_edge_package_data_cell(edge_connection_t *conn, circuit_t *circ,
+                                  size_t length)
+{
+  crypt_path_t *layer_hint = conn->cpath_layer;
+  cell_direction_t cell_direction;
+  or_connection_t *orconn;
+  crypto_digest_env_t *digest;
+  packed_cell_t *cell;
+  relay_header_t rh;
+  circid_t circ_id;
+  uint8_t command = CELL_RELAY;
+  char *payload;
+
+  tor_assert(length <= RELAY_PAYLOAD_SIZE);
+
+  if (layer_hint && CIRCUIT_IS_ORIGIN(circ) && circ->n_conn) {
+    cell_direction = CELL_DIRECTION_OUT;
+    orconn = circ->n_conn;
+    circ_id = circ->n_circ_id;
+    digest = layer_hint->f_digest;
+    /* if we're using relaybandwidthrate, this conn wants priority */
+    orconn->client_used = approx_time();
+    command = relay_choose_cell_command(TO_ORIGIN_CIRCUIT(circ),
+                                        RELAY_COMMAND_DATA, layer_hint);
+    if (command == CELL_RELAY_EARLY && orconn->link_proto < 2) {
+      /* V1 connections don't understand RELAY_EARLY. */
+      command = CELL_RELAY;
+    }
+  } else if (!layer_hint && !CIRCUIT_IS_ORIGIN(circ) &&
+             TO_OR_CIRCUIT(circ)->p_conn && !relaycrypt_enabled()) {
+    or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+    cell_direction = CELL_DIRECTION_IN;
+    orconn = or_circ->p_conn;
+    circ_id = or_circ->p_circ_id;
+    digest = or_circ->p_digest;
+  } else {
+    /* The cell has to go through a relay crypto thread, or something is
+     * odd about the circuit: take the long way. */
+    char data[RELAY_PAYLOAD_SIZE];
+    connection_fetch_from_buf(data, length, TO_CONN(conn));
+    return connection_edge_send_command(conn, RELAY_COMMAND_DATA,
+                                        data, length);
+  }
+
+  cell = packed_cell_alloc(orconn);
+  cell->next = NULL;
+  *(uint16_t*)cell->body = htons(circ_id);
+  *(uint8_t*)(cell->body+2) = command;
+  payload = cell->body+3;
+
+  memset(&rh, 0, sizeof(rh));
+  rh.command = RELAY_COMMAND_DATA;
+  rh.stream_id = conn->stream_id;
+  rh.length = length;
+  relay_header_pack(payload, &rh);
+  connection_fetch_from_buf(payload+RELAY_HEADER_SIZE, length, TO_CONN(conn));
+  memset(payload+RELAY_HEADER_SIZE+length, 0, RELAY_PAYLOAD_SIZE-length);
+
+  log_debug(LD_OR,"delivering %d cell %s.", RELAY_COMMAND_DATA,
+            cell_direction == CELL_DIRECTION_OUT ? "forward" : "backward");
+
+  relay_set_digest(digest, payload);
+  if (relay_encrypt_edge_payload(circ, payload, cell_direction,
+                                 layer_hint) < 0) {
+    packed_cell_free(orconn, cell);
+    log_warn(LD_BUG,"relay_encrypt_edge_payload failed. Closing.");
+    circuit_mark_for_close(circ, END_CIRC_REASON_INTERNAL);
+    return -1;
   }
+  ++stats_n_relay_cells_relayed;
+
+  append_packed_cell_to_circuit_queue(circ, orconn, cell, cell_direction);
+  return 0;
 }
 
 /** Append an encoded value of <b>addr</b> to <b>payload_out</b>, which must
@@ -2050,6 +2607,68 @@ decode_address_from_payload(tor_addr_t *addr_out, const char *payload,
   return payload + 2 + (uint8_t)payload[1];
 }
 
+/** Return a newly allocated string describing the state of the circuit
+ * scheduler on <b>orconn</b>, for the controller.  The string is of the
+ * form "ActiveCircuits=N QueuedCells=N MinCellCount=F MaxCellCount=F",
+ * where the cell counts are the lowest and highest EWMA cell counts among
+ * the active circuits (0 if there are none, or if we're scheduling
+ * round-robin). */
+char *
+connection_or_get_scheduler_status(or_connection_t *orconn)
+{
+  char buf[256];
+  int n_active = 0, n_cells = 0;
+  double min_count = 0.0, max_count = 0.0;
+  circuit_t *head = orconn->active_circuits, *cur = head;
+
+  if (head) {
+    do {
+      if (orconn == cur->n_conn)
+        n_cells += cur->n_conn_cells.n;
+      else
+        n_cells += TO_OR_CIRCUIT(cur)->p_conn_cells.n;
+      ++n_active;
+      cur = *next_circ_on_conn_p(cur, orconn);
+    } while (cur != head);
+  }
+
+  if (ewma_enabled && smartlist_len(orconn->active_circuit_pqueue)) {
+    /* Report the counts as of now, not as of the last recalibration. */
+    double factor = get_scale_factor(
+                            orconn->active_circuit_pqueue_last_recalibrated,
+                            cell_ewma_get_tick());
+    cell_ewma_t *first = smartlist_get(orconn->active_circuit_pqueue, 0);
+    min_count = first->cell_count * factor;
+    SMARTLIST_FOREACH(orconn->active_circuit_pqueue, cell_ewma_t *, e,
+      if (e->cell_count * factor > max_count)
+        max_count = e->cell_count * factor);
+  }
+
+  tor_snprintf(buf, sizeof(buf),
+               "ActiveCircuits=%d QueuedCells=%d "
+               "MinCellCount=%.2f MaxCellCount=%.2f",
+               n_active, n_cells, min_count, max_count);
+  return tor_strdup(buf);
+}
+
+/** Return the cell_ewma count, as of the tick in <b>ft</b>, of the circuit
+ * we would flush next on <b>orconn</b>, or -1.0 if we're scheduling
+ * circuits round-robin.  Used to compare circuits on different
+ * connections. */
+double
+connection_or_next_circuit_ewma(or_connection_t *orconn,
+                                const cell_flush_time_t *ft)
+{
+  cell_ewma_t *first;
+  if (ft->ewma_increment < 0 || !smartlist_len(orconn->active_circuit_pqueue))
+    return -1.0;
+  /* Rescale the whole queue now, so that we only do it once per tick. */
+  if (ft->tick != orconn->active_circuit_pqueue_last_recalibrated)
+    scale_active_circuits(orconn, ft->tick);
+  first = smartlist_get(orconn->active_circuit_pqueue, 0);
+  return first->cell_count;
+}
+
 /** Fail with an assert if the active circuits ring on <b>orconn</b> is
  * corrupt.  */
 void
@@ -2057,8 +2676,11 @@ assert_active_circuits_ok(or_connection_t *orconn)
 {
   circuit_t *head = orconn->active_circuits;
   circuit_t *cur = head;
-  if (! head)
+  int n = 0;
+  if (! head) {
+    tor_assert(smartlist_len(orconn->active_circuit_pqueue) == 0);
     return;
+  }
   do {
     circuit_t *next = *next_circ_on_conn_p(cur, orconn);
     circuit_t *prev = *prev_circ_on_conn_p(cur, orconn);
@@ -2066,7 +2688,26 @@ assert_active_circuits_ok(or_connection_t *orconn)
     tor_assert(prev);
     tor_assert(*next_circ_on_conn_p(prev, orconn) == cur);
     tor_assert(*prev_circ_on_conn_p(next, orconn) == cur);
+    if (orconn == cur->n_conn) {
+      tor_assert(cur->n_cell_ewma.heap_index != -1);
+      tor_assert(smartlist_get(orconn->active_circuit_pqueue,
+                               cur->n_cell_ewma.heap_index) ==
+                 &cur->n_cell_ewma);
+    } else {
+      or_circuit_t *orcirc = TO_OR_CIRCUIT(cur);
+      tor_assert(orcirc->p_cell_ewma.heap_index != -1);
+      tor_assert(smartlist_get(orconn->active_circuit_pqueue,
+                               orcirc->p_cell_ewma.heap_index) ==
+                 &orcirc->p_cell_ewma);
+    }
+    ++n;
     cur = next;
   } while (cur != head);
+
+  tor_assert(n == smartlist_len(orconn->active_circuit_pqueue));
+
+  smartlist_pqueue_assert_ok(orconn->active_circuit_pqueue,
+                             compare_cell_ewma_counts,
+                             STRUCT_OFFSET(cell_ewma_t, heap_index));
 }
 
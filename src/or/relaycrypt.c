@@ -0,0 +1,570 @@
+/* Copyright (c) 2009, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file relaycrypt.c
+ * \brief Crypt relay cells on circuits through us in a set of worker
+ * threads, instead of in the main thread.
+ *
+ * When RelayCryptoThreads is set, every relay cell on an or_circuit_t that
+ * needs crypting -- cells arriving from either side, and cells we
+ * originate toward the client -- goes to one of the relay crypto threads.
+ * Each circuit belongs to a single thread (its "shard"), which crypts that
+ * circuit's cells in the order they arrived; since the threads crypt
+ * nothing else, and the main thread leaves a circuit's relay ciphers alone
+ * while that circuit has cells out, nobody needs to lock the circuit.  The
+ * main thread hands cells to each thread on a lock-free spsc_ring_t, and
+ * only takes the thread's lock to wake it up when it has gone to sleep.
+ * The threads post crypted cells to an answer queue and wake up the main
+ * thread, which relays or delivers them just as it would a cell that it
+ * had crypted itself.
+ *
+ * Connections, buffers, TLS, cell queues, and everything else stay in the
+ * main thread: none of that code is safe to call from anywhere else.
+ **/
+
+#include "or.h"
+#include "ring.h"
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+#ifdef TOR_IS_MULTITHREADED
+
+/** How many cells can wait on the ring for each relay crypto thread?  When
+ * a ring is full, more cells wait in the main thread. */
+#define RELAYCRYPT_RING_SIZE 1024
+/** How many cells does a relay crypto thread take off its ring at once? */
+#define RELAYCRYPT_BATCH_SIZE 64
+
+/** A relay cell on its way through a relay crypto thread. */
+typedef struct relaycrypt_job_t {
+  struct relaycrypt_job_t *next; /**< Next job on the same queue. */
+  or_circuit_t *circ; /**< The circuit the cell is on. */
+  cell_t cell; /**< The cell: uncrypted on the way in, crypted on the way
+                * out. */
+  uint8_t cell_direction; /**< A cell_direction_t: which way is it going? */
+  unsigned int originated:1; /**< True iff we packaged this cell ourselves;
+                              * it's inbound, and its digest is set. */
+  unsigned int recognized:1; /**< Set by the worker: is the cell for us? */
+  unsigned int failed:1; /**< Set by the worker: did crypting fail? */
+} relaycrypt_job_t;
+
+/** A first-in-first-out list of relaycrypt_job_t. */
+typedef struct relaycrypt_jobqueue_t {
+  relaycrypt_job_t *head; /**< Oldest job, or NULL if empty. */
+  relaycrypt_job_t *tail; /**< Newest job, or NULL if empty. */
+} relaycrypt_jobqueue_t;
+
+/** One relay crypto thread, and the cells it has yet to crypt. */
+typedef struct relaycrypt_shard_t {
+  /** Cells waiting for this thread.  The main thread adds to it, and the
+   * relay crypto thread takes from it. */
+  spsc_ring_t *jobs;
+  /** Cells waiting for room on <b>jobs</b>.  Only the main thread touches
+   * this. */
+  relaycrypt_jobqueue_t backlog;
+  /** Protects the fields below. */
+  tor_mutex_t *lock;
+  /** Signalled when jobs arrive for a sleeping thread, when the thread
+   * should exit, and when it has exited. */
+  tor_cond_t *cond;
+  /** True iff the thread has found its ring empty and is going to sleep.
+   * Only the thread writes it; the main thread may read it without the
+   * lock. */
+  volatile int sleeping;
+  /** True iff the main thread wants this thread to exit. */
+  int exiting;
+  /** True iff the thread is still running. */
+  int running;
+} relaycrypt_shard_t;
+
+/** The relay crypto threads, or NULL if we haven't started them. */
+static relaycrypt_shard_t *shards = NULL;
+/** How many entries are there in <b>shards</b>? */
+static int n_shards = 0;
+/** True iff we tried to start the threads and couldn't; we crypt in the
+ * main thread instead. */
+static int relaycrypt_broken = 0;
+
+/** Protects answered_jobs and notify_fd. */
+static tor_mutex_t *answer_lock = NULL;
+/** Jobs that a thread has finished.  Protected by answer_lock. */
+static relaycrypt_jobqueue_t answered_jobs = { NULL, NULL };
+/** The threads' end of the socketpair they use to wake the main thread.
+ * Protected by answer_lock. */
+static int notify_fd = -1;
+/** The main thread's end of that socketpair. */
+static int notify_read_fd = -1;
+/** Event to read from notify_read_fd. */
+static struct event *notify_event = NULL;
+
+/** How many cells have we handed to the threads without getting them
+ * back? */
+static int n_pending = 0;
+/** The largest value n_pending has had. */
+static int stats_max_pending = 0;
+/** How many cells have the threads crypted for us? */
+static uint64_t stats_n_cells_crypted = 0;
+/** How many cells have had to wait for room on a full ring? */
+static uint64_t stats_n_cells_backlogged = 0;
+
+/** Add <b>job</b> to the end of <b>q</b>. */
+static INLINE void
+jobqueue_push(relaycrypt_jobqueue_t *q, relaycrypt_job_t *job)
+{
+  job->next = NULL;
+  if (q->tail)
+    q->tail->next = job;
+  else
+    q->head = job;
+  q->tail = job;
+}
+
+/** Free <b>job</b> without handling it. */
+static void
+relaycrypt_drop_job(relaycrypt_job_t *job)
+{
+  --job->circ->relaycrypt_n_pending;
+  --n_pending;
+  tor_free(job);
+}
+
+/** Drop every job on <b>q</b> without handling it, and make <b>q</b>
+ * empty. */
+static void
+jobqueue_clear(relaycrypt_jobqueue_t *q)
+{
+  relaycrypt_job_t *job, *next;
+  for (job = q->head; job; job = next) {
+    next = job->next;
+    relaycrypt_drop_job(job);
+  }
+  q->head = q->tail = NULL;
+}
+
+/** Body of a relay crypto thread: crypt the cells on our shard's ring, a
+ * batch at a time, and post the results to answered_jobs, until the main
+ * thread tells us to exit. */
+static void
+relaycrypt_thread_main(void *data)
+{
+  relaycrypt_shard_t *shard = data;
+  void *batch[RELAYCRYPT_BATCH_SIZE];
+
+  for (;;) {
+    relaycrypt_job_t *jobs, *last;
+    int i, n = spsc_ring_pop_batch(shard->jobs, batch, RELAYCRYPT_BATCH_SIZE);
+
+    if (!n) {
+      int exiting;
+      tor_mutex_acquire(shard->lock);
+      shard->sleeping = 1;
+      /* The main thread checks <b>sleeping</b> after it adds to the ring,
+       * and we check the ring after we set <b>sleeping</b>, so one of us
+       * will notice the other. */
+      while (!shard->exiting && spsc_ring_is_empty(shard->jobs))
+        tor_cond_wait(shard->cond, shard->lock);
+      shard->sleeping = 0;
+      exiting = shard->exiting;
+      tor_mutex_release(shard->lock);
+      if (exiting)
+        break;
+      continue;
+    }
+
+    for (i = 0; i < n; ++i) {
+      relaycrypt_job_t *job = batch[i];
+      char recognized = 0;
+      if (relay_crypt_or_circuit_cell(job->circ, &job->cell,
+                                      job->cell_direction, &recognized) < 0)
+        job->failed = 1;
+      job->recognized = recognized ? 1 : 0;
+      job->next = (i+1 < n) ? batch[i+1] : NULL;
+    }
+    jobs = batch[0];
+    last = batch[n-1];
+
+    tor_mutex_acquire(answer_lock);
+    if (!answered_jobs.head) {
+      /* The main thread has already collected everything we told it about
+       * before, so it needs a fresh wakeup. */
+      char b = 0;
+      if (send(notify_fd, &b, 1, 0) != 1)
+        log_warn(LD_BUG, "Couldn't wake up main thread from relay crypto "
+                 "thread: %s",
+                 tor_socket_strerror(tor_socket_errno(notify_fd)));
+      answered_jobs.head = jobs;
+    } else {
+      answered_jobs.tail->next = jobs;
+    }
+    answered_jobs.tail = last;
+    tor_mutex_release(answer_lock);
+  }
+
+  tor_mutex_acquire(shard->lock);
+  shard->running = 0;
+  tor_cond_signal_all(shard->cond);
+  tor_mutex_release(shard->lock);
+
+  crypto_thread_cleanup();
+  spawn_exit();
+}
+
+/** Libevent callback: a relay crypto thread has woken us up.  Handle every
+ * cell the threads have crypted. */
+static void
+relaycrypt_notify_cb(evutil_socket_t fd, short events, void *arg)
+{
+  char buf[256];
+  (void)events;
+  (void)arg;
+
+  /* The bytes themselves mean nothing; they're just wakeups. */
+  while (recv(fd, buf, sizeof(buf), 0) > 0)
+    ;
+  relaycrypt_process_answers();
+}
+
+/** Start the relay crypto threads.  Return 0 on success, -1 on failure. */
+static int
+relaycrypt_start(void)
+{
+  int fds[2];
+  int err, i, n_wanted = get_options()->RelayCryptoThreads;
+
+  if ((err = tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) < 0) {
+    log_warn(LD_NET, "Couldn't construct socketpair for relay crypto "
+             "threads: %s", tor_socket_strerror(-err));
+    return -1;
+  }
+  set_socket_nonblocking(fds[0]);
+  notify_event = tor_event_new(tor_libevent_get_base(), fds[0],
+                               EV_READ|EV_PERSIST, relaycrypt_notify_cb,
+                               NULL);
+  if (event_add(notify_event, NULL) < 0) {
+    log_warn(LD_BUG, "Couldn't add event for relay crypto threads.");
+    tor_event_free(notify_event);
+    notify_event = NULL;
+    tor_close_socket(fds[0]);
+    tor_close_socket(fds[1]);
+    return -1;
+  }
+  notify_read_fd = fds[0];
+  answer_lock = tor_mutex_new();
+  notify_fd = fds[1];
+
+  shards = tor_malloc_zero(sizeof(relaycrypt_shard_t)*n_wanted);
+  for (i = 0; i < n_wanted; ++i) {
+    relaycrypt_shard_t *shard = &shards[n_shards];
+    shard->jobs = spsc_ring_new(RELAYCRYPT_RING_SIZE);
+    shard->lock = tor_mutex_new();
+    shard->cond = tor_cond_new();
+    shard->running = 1;
+    if (spawn_func(relaycrypt_thread_main, shard) < 0) {
+      log_warn(LD_GENERAL, "Couldn't spawn relay crypto thread.");
+      spsc_ring_free(shard->jobs);
+      tor_mutex_free(shard->lock);
+      tor_cond_free(shard->cond);
+      memset(shard, 0, sizeof(relaycrypt_shard_t));
+      break;
+    }
+    ++n_shards;
+  }
+  if (!n_shards) {
+    relaycrypt_free_all();
+    return -1;
+  }
+  log_info(LD_OR, "Started %d relay crypto thread(s).", n_shards);
+  return 0;
+}
+
+/** Return true iff relay cells on circuits through us should be crypted in
+ * the relay crypto threads.  Start the threads if we need them and they
+ * aren't running yet. */
+int
+relaycrypt_enabled(void)
+{
+  if (n_shards)
+    return 1;
+  if (relaycrypt_broken || get_options()->RelayCryptoThreads == 0)
+    return 0;
+  if (relaycrypt_start() < 0) {
+    log_warn(LD_OR, "Couldn't start relay crypto threads; crypting relay "
+             "cells in the main thread instead.");
+    relaycrypt_broken = 1;
+    return 0;
+  }
+  return 1;
+}
+
+/** Return the shard that crypts the cells on <b>circ</b>.  It depends only
+ * on where the circuit lives in memory, so it doesn't change while the
+ * circuit is around. */
+static INLINE relaycrypt_shard_t *
+relaycrypt_get_shard(const or_circuit_t *circ)
+{
+  uint32_t h = (uint32_t)(((uintptr_t)circ) >> 4);
+  h *= 0x9E3779B1u;
+  return &shards[(h >> 16) % n_shards];
+}
+
+/** We just added cells to the ring of <b>shard</b>: if its thread is
+ * asleep, wake it up. */
+static void
+relaycrypt_wake_shard(relaycrypt_shard_t *shard)
+{
+  /* Make sure the thread can see the cells before we look at whether it's
+   * asleep. */
+  tor_memory_barrier();
+  if (shard->sleeping) {
+    tor_mutex_acquire(shard->lock);
+    tor_cond_signal_one(shard->cond);
+    tor_mutex_release(shard->lock);
+  }
+}
+
+/** Move as many cells from the backlog of <b>shard</b> onto its ring as
+ * there is room for. */
+static void
+relaycrypt_flush_backlog(relaycrypt_shard_t *shard)
+{
+  int n = 0;
+  while (shard->backlog.head) {
+    relaycrypt_job_t *job = shard->backlog.head, *next = job->next;
+    /* Once the job is on the ring, it belongs to the relay crypto thread;
+     * don't touch it again. */
+    if (spsc_ring_push(shard->jobs, job) < 0)
+      break;
+    shard->backlog.head = next;
+    ++n;
+  }
+  if (!shard->backlog.head)
+    shard->backlog.tail = NULL;
+  if (n)
+    relaycrypt_wake_shard(shard);
+}
+
+/** Hand <b>cell</b>, on <b>circ</b> and heading in direction
+ * <b>cell_direction</b>, to a relay crypto thread.  If <b>originated</b>,
+ * we packaged the cell ourselves, and it only needs to be encrypted and
+ * queued toward the client; otherwise, it arrived on one of the circuit's
+ * connections, and it goes back to circuit_receive_crypted_relay_cell().
+ * Either way, cells on the same circuit come back in the order we queued
+ * them.  relaycrypt_enabled() must have returned true. */
+void
+relaycrypt_queue_cell(or_circuit_t *circ, const cell_t *cell,
+                      cell_direction_t cell_direction, int originated)
+{
+  relaycrypt_shard_t *shard;
+  relaycrypt_job_t *job;
+
+  tor_assert(n_shards);
+  tor_assert(!originated || cell_direction == CELL_DIRECTION_IN);
+
+  job = tor_malloc(sizeof(relaycrypt_job_t));
+  job->circ = circ;
+  memcpy(&job->cell, cell, sizeof(cell_t));
+  job->cell_direction = (uint8_t)cell_direction;
+  job->originated = originated ? 1 : 0;
+  job->recognized = job->failed = 0;
+
+  ++circ->relaycrypt_n_pending;
+  if (++n_pending > stats_max_pending)
+    stats_max_pending = n_pending;
+
+  shard = relaycrypt_get_shard(circ);
+  if (!shard->backlog.head && spsc_ring_push(shard->jobs, job) == 0) {
+    relaycrypt_wake_shard(shard);
+  } else {
+    /* Stay behind the cells that are already waiting for room. */
+    ++stats_n_cells_backlogged;
+    jobqueue_push(&shard->backlog, job);
+    relaycrypt_flush_backlog(shard);
+  }
+}
+
+/** Handle a cell that a relay crypto thread has crypted: queue it, or
+ * deliver it, or close its circuit if something went wrong. */
+static void
+relaycrypt_handle_answer(relaycrypt_job_t *job)
+{
+  or_circuit_t *circ = job->circ;
+  int reason;
+
+  --circ->relaycrypt_n_pending;
+  --n_pending;
+  ++stats_n_cells_crypted;
+
+  if (circ->_base.marked_for_close)
+    return;
+  if (job->failed) {
+    log_warn(LD_BUG,"relay crypt failed. Dropping connection.");
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_INTERNAL);
+    return;
+  }
+  if (job->originated) {
+    if (circ->p_conn)
+      append_cell_to_circuit_queue(TO_CIRCUIT(circ), circ->p_conn,
+                                   &job->cell, CELL_DIRECTION_IN);
+    return;
+  }
+  reason = circuit_receive_crypted_relay_cell(&job->cell, TO_CIRCUIT(circ),
+                                              job->cell_direction, NULL,
+                                              job->recognized);
+  if (reason < 0) {
+    log_fn(LOG_PROTOCOL_WARN,LD_PROTOCOL,
+           "circuit_receive_crypted_relay_cell failed. Closing.");
+    circuit_mark_for_close(TO_CIRCUIT(circ), -reason);
+  }
+}
+
+/** Handle every cell that the relay crypto threads have crypted so far. */
+void
+relaycrypt_process_answers(void)
+{
+  relaycrypt_job_t *job, *next;
+  int i;
+
+  if (!answer_lock)
+    return;
+  tor_mutex_acquire(answer_lock);
+  job = answered_jobs.head;
+  answered_jobs.head = answered_jobs.tail = NULL;
+  tor_mutex_release(answer_lock);
+
+  for ( ; job; job = next) {
+    next = job->next;
+    relaycrypt_handle_answer(job);
+    tor_free(job);
+  }
+  relay_flush_pending_sendmes();
+
+  /* The threads have made room on their rings. */
+  for (i = 0; i < n_shards; ++i) {
+    if (shards[i].backlog.head)
+      relaycrypt_flush_backlog(&shards[i]);
+  }
+}
+
+/** Return the number of cells we've handed to the relay crypto threads
+ * without handling them since. */
+int
+relaycrypt_get_n_pending(void)
+{
+  return n_pending;
+}
+
+/** Log the relay crypto threads' statistics at log level
+ * <b>severity</b>. */
+void
+relaycrypt_log_stats(int severity)
+{
+  if (!n_shards)
+    return;
+  log(severity, LD_OR,
+      "Relay crypto threads: %d running, %d cells outstanding (at most %d); "
+      U64_FORMAT" cells crypted, "U64_FORMAT" had to wait for a full ring.",
+      n_shards, n_pending, stats_max_pending,
+      U64_PRINTF_ARG(stats_n_cells_crypted),
+      U64_PRINTF_ARG(stats_n_cells_backlogged));
+}
+
+/** Stop the relay crypto threads, and release all storage held by them.
+ * Cells they hadn't handed back are dropped, so this must happen before we
+ * free any circuits. */
+void
+relaycrypt_free_all(void)
+{
+  int i;
+  for (i = 0; i < n_shards; ++i) {
+    relaycrypt_shard_t *shard = &shards[i];
+    relaycrypt_job_t *job;
+    tor_mutex_acquire(shard->lock);
+    shard->exiting = 1;
+    tor_cond_signal_all(shard->cond);
+    while (shard->running)
+      tor_cond_wait(shard->cond, shard->lock);
+    tor_mutex_release(shard->lock);
+    /* The thread is gone, so we can take its end of the ring. */
+    while ((job = spsc_ring_pop(shard->jobs)))
+      relaycrypt_drop_job(job);
+    spsc_ring_free(shard->jobs);
+    jobqueue_clear(&shard->backlog);
+    tor_mutex_free(shard->lock);
+    tor_cond_free(shard->cond);
+  }
+  tor_free(shards);
+  n_shards = 0;
+
+  jobqueue_clear(&answered_jobs);
+  if (notify_event) {
+    tor_event_free(notify_event);
+    notify_event = NULL;
+  }
+  if (notify_read_fd >= 0) {
+    tor_close_socket(notify_read_fd);
+    notify_read_fd = -1;
+  }
+  if (notify_fd >= 0) {
+    tor_close_socket(notify_fd);
+    notify_fd = -1;
+  }
+  if (answer_lock) {
+    tor_mutex_free(answer_lock);
+    answer_lock = NULL;
+  }
+  relaycrypt_broken = 0;
+}
+
+#else
+
+/** Without threads, we always crypt relay cells in the main thread. */
+int
+relaycrypt_enabled(void)
+{
+  return 0;
+}
+
+/** Unreachable without threads: relaycrypt_enabled() never says yes. */
+void
+relaycrypt_queue_cell(or_circuit_t *circ, const cell_t *cell,
+                      cell_direction_t cell_direction, int originated)
+{
+  (void)circ;
+  (void)cell;
+  (void)cell_direction;
+  (void)originated;
+  tor_assert(0);
+}
+
+/** Without threads, there are never any answers to process. */
+void
+relaycrypt_process_answers(void)
+{
+}
+
+/** Without threads, no cells are ever pending. */
+int
+relaycrypt_get_n_pending(void)
+{
+  return 0;
+}
+
+/** Without threads, there are no statistics to log. */
+void
+relaycrypt_log_stats(int severity)
+{
+  (void)severity;
+}
+
+/** Without threads, there's nothing to free. */
+void
+relaycrypt_free_all(void)
+{
+}
+
+#endif
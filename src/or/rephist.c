@@ -2651,16 +2651,19 @@ rep_hist_buffer_stats_add_circ(circuit_t *circ, time_t end_of_interval)
   interval_length = (int) (end_of_interval - start_of_interval);
   stat = tor_malloc_zero(sizeof(circ_buffer_stats_t));
   stat->processed_cells = orcirc->processed_cells;
-  /* 1000.0 for s -> ms; 2.0 because of app-ward and exit-ward queues */
+  /* 1000000.0 for s -> usec; 2.0 because of app-ward and exit-ward
+   * queues */
   stat->mean_num_cells_in_queue = interval_length == 0 ? 0.0 :
       (double) orcirc->total_cell_waiting_time /
-      (double) interval_length / 1000.0 / 2.0;
+      (double) interval_length / 1000000.0 / 2.0;
+  /* 1000.0 for usec -> ms */
   stat->mean_time_cells_in_queue =
       (double) orcirc->total_cell_waiting_time /
-      (double) orcirc->processed_cells;
+      (double) orcirc->processed_cells / 1000.0;
   smartlist_add(circuits_for_buffer_stats, stat);
   orcirc->total_cell_waiting_time = 0;
   orcirc->processed_cells = 0;
+  memset(orcirc->cell_wait_hist, 0, sizeof(orcirc->cell_wait_hist));
 }
 
 /** Sorting helper: return -1, 1, or 0 based on comparison of two
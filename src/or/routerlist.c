@@ -34,6 +34,14 @@ static const char *signed_descriptor_get_body_impl(signed_descriptor_t *desc,
                                                    int with_annotations);
 static void list_pending_downloads(digestmap_t *result,
                                    int purpose, const char *prefix);
+static int routerlist_add_parsed_routers(smartlist_t *routers,
+                                         int from_cache,
+                                         smartlist_t *requested_fingerprints,
+                                         int descriptor_digests);
+static int routerlist_add_parsed_extrainfo(smartlist_t *extrainfo_list,
+                                          int from_cache,
+                                          smartlist_t *requested_fingerprints,
+                                          int descriptor_digests);
 
 DECLARE_TYPED_DIGESTMAP_FNS(sdmap_, digest_sd_map_t, signed_descriptor_t)
 DECLARE_TYPED_DIGESTMAP_FNS(rimap_, digest_ri_map_t, routerinfo_t)
@@ -3504,15 +3512,35 @@ router_load_routers_from_string(const char *s, const char *eos,
                                 int descriptor_digests,
                                 const char *prepend_annotations)
 {
-  smartlist_t *routers = smartlist_create(), *changed = smartlist_create();
-  char fp[HEX_DIGEST_LEN+1];
-  const char *msg;
+  smartlist_t *routers = smartlist_create();
   int from_cache = (saved_location != SAVED_NOWHERE);
   int allow_annotations = (saved_location != SAVED_NOWHERE);
-  int any_changed = 0;
+  int any_changed;
 
   router_parse_list_from_string(&s, eos, routers, saved_location, 0,
                                 allow_annotations, prepend_annotations);
+  any_changed = routerlist_add_parsed_routers(routers, from_cache,
+                                              requested_fingerprints,
+                                              descriptor_digests);
+  smartlist_free(routers);
+  return any_changed;
+}
+
+/** Helper for router_load_routers_from_string() and
+ * router_load_downloaded_descriptors(): add the freshly parsed routers in
+ * <b>routers</b> to our directory, freeing the ones we don't keep, and
+ * return the number we added.  Other arguments are as for
+ * router_load_routers_from_string().  Leaves <b>routers</b> itself for the
+ * caller to free. */
+static int
+routerlist_add_parsed_routers(smartlist_t *routers, int from_cache,
+                              smartlist_t *requested_fingerprints,
+                              int descriptor_digests)
+{
+  smartlist_t *changed = smartlist_create();
+  char fp[HEX_DIGEST_LEN+1];
+  const char *msg;
+  int any_changed = 0;
 
   routers_update_status_from_consensus_networkstatus(routers, !from_cache);
 
@@ -3564,7 +3592,6 @@ router_load_routers_from_string(const char *s, const char *eos,
   if (any_changed)
     router_rebuild_store(0, &routerlist->desc_store);
 
-  smartlist_free(routers);
   smartlist_free(changed);
 
   return any_changed;
@@ -3580,17 +3607,36 @@ router_load_extrainfo_from_string(const char *s, const char *eos,
                                   int descriptor_digests)
 {
   smartlist_t *extrainfo_list = smartlist_create();
-  const char *msg;
   int from_cache = (saved_location != SAVED_NOWHERE);
 
   router_parse_list_from_string(&s, eos, extrainfo_list, saved_location, 1, 0,
                                 NULL);
+  routerlist_add_parsed_extrainfo(extrainfo_list, from_cache,
+                                  requested_fingerprints, descriptor_digests);
+  smartlist_free(extrainfo_list);
+}
+
+/** Helper for router_load_extrainfo_from_string() and
+ * router_load_downloaded_descriptors(): add the freshly parsed extra-info
+ * documents in <b>extrainfo_list</b> to our directory, and return the
+ * number we added.  Other arguments are as for
+ * router_load_extrainfo_from_string().  Leaves <b>extrainfo_list</b>
+ * itself for the caller to free. */
+static int
+routerlist_add_parsed_extrainfo(smartlist_t *extrainfo_list, int from_cache,
+                                smartlist_t *requested_fingerprints,
+                                int descriptor_digests)
+{
+  const char *msg;
+  int n_added = 0;
 
   log_info(LD_DIR, "%d elements to add", smartlist_len(extrainfo_list));
 
   SMARTLIST_FOREACH(extrainfo_list, extrainfo_t *, ei, {
       was_router_added_t added =
         router_add_extrainfo_to_routerlist(ei, &msg, from_cache, !from_cache);
+      if (WRA_WAS_ADDED(added))
+        ++n_added;
       if (WRA_WAS_ADDED(added) && requested_fingerprints) {
         char fp[HEX_DIGEST_LEN+1];
         base16_encode(fp, sizeof(fp), descriptor_digests ?
@@ -3608,7 +3654,109 @@ router_load_extrainfo_from_string(const char *s, const char *eos,
   routerlist_assert_ok(routerlist);
   router_rebuild_store(0, &router_get_routerlist()->extrainfo_store);
 
-  smartlist_free(extrainfo_list);
+  return n_added;
+}
+
+/** A batch of router descriptors or extra-info documents from a directory
+ * fetch, parsed and waiting for the signature checking threads.  See
+ * router_load_downloaded_descriptors(). */
+typedef struct pending_desc_load_t {
+  /** The routerinfo_t or extrainfo_t objects we parsed. */
+  smartlist_t *elts;
+  /** True iff <b>elts</b> holds extra-info documents. */
+  int is_extrainfo;
+  /** As for router_load_routers_from_string(). */
+  smartlist_t *requested_fingerprints;
+  /** As for router_load_routers_from_string(). */
+  int descriptor_digests;
+  /** The function to call once we've added them, and its argument. */
+  router_load_done_fn done;
+  void *done_arg;
+} pending_desc_load_t;
+
+/** Add the entries of <b>load</b> to our directory, call its function with
+ * the number we added, and free it. */
+static void
+pending_desc_load_finish(pending_desc_load_t *load)
+{
+  int n_added;
+  if (load->is_extrainfo)
+    n_added = routerlist_add_parsed_extrainfo(load->elts, 0,
+                                              load->requested_fingerprints,
+                                              load->descriptor_digests);
+  else
+    n_added = routerlist_add_parsed_routers(load->elts, 0,
+                                            load->requested_fingerprints,
+                                            load->descriptor_digests);
+  load->done(n_added, load->done_arg);
+  smartlist_free(load->elts);
+  tor_free(load);
+}
+
+/** Called from the main loop once the signature checking threads have
+ * checked the batch for the pending_desc_load_t <b>arg</b>: drop the
+ * entries with bad signatures, and add the rest to our directory.  If
+ * <b>cancelled</b>, we're shutting down; just free everything. */
+static void
+pending_desc_load_sigs_checked(sigcheck_batch_t *batch, void *arg,
+                               int cancelled)
+{
+  pending_desc_load_t *load = arg;
+  if (cancelled) {
+    if (load->is_extrainfo)
+      SMARTLIST_FOREACH(load->elts, extrainfo_t *, ei, extrainfo_free(ei));
+    else
+      SMARTLIST_FOREACH(load->elts, routerinfo_t *, ri, routerinfo_free(ri));
+    load->done(-1, load->done_arg);
+    smartlist_free(load->elts);
+    tor_free(load);
+    return;
+  }
+  router_parse_list_remove_bad_signatures(load->elts, batch,
+                                          load->is_extrainfo);
+  pending_desc_load_finish(load);
+}
+
+/** Parse the router descriptors (or extra-info documents, if
+ * <b>is_extrainfo</b>) in <b>s</b>, which we just downloaded, and add them
+ * to our directory as router_load_routers_from_string() or
+ * router_load_extrainfo_from_string() would; then call <b>done</b> with
+ * the number we added and <b>arg</b>.
+ *
+ * If the signature checking threads are running, hand the signatures to
+ * them and return without adding anything: we add the entries with good
+ * signatures, and call <b>done</b>, from the main loop once the threads
+ * are finished.  Until then, <b>requested_fingerprints</b> must stay
+ * around, untouched.  If we shut down before then, we call <b>done</b>
+ * with -1 instead.  Otherwise, do it all before returning. */
+void
+router_load_downloaded_descriptors(const char *s, int is_extrainfo,
+                                   smartlist_t *requested_fingerprints,
+                                   int descriptor_digests,
+                                   const char *prepend_annotations,
+                                   router_load_done_fn done, void *arg)
+{
+  pending_desc_load_t *load = tor_malloc_zero(sizeof(pending_desc_load_t));
+  sigcheck_batch_t *batch = NULL;
+
+  load->elts = smartlist_create();
+  load->is_extrainfo = is_extrainfo;
+  load->requested_fingerprints = requested_fingerprints;
+  load->descriptor_digests = descriptor_digests;
+  load->done = done;
+  load->done_arg = arg;
+
+  if (sigcheck_enabled())
+    batch = sigcheck_batch_new();
+  router_parse_list_from_string_batched(&s, NULL, load->elts, SAVED_NOWHERE,
+                                        is_extrainfo, 0,
+                                        is_extrainfo ? NULL :
+                                          prepend_annotations,
+                                        batch);
+  if (batch)
+    sigcheck_batch_queue(batch, pending_desc_load_sigs_checked, load);
+  else
+    pending_desc_load_finish(load);
 }
 
 /** Return true iff any networkstatus includes a descriptor whose digest
@@ -9,6 +9,7 @@
  * \brief Code to parse and validate router descriptors and directories.
  **/
 
+#define ROUTERPARSE_PRIVATE
 #include "or.h"
 #include "memarea.h"
 
@@ -511,6 +512,57 @@ static token_rule_t microdesc_token_table[] = {
 
 #undef T
 
+/** Every token table we know about.  Any table passed to tokenize_string()
+ * or get_next_token() must be listed here, so that we can build a keyword
+ * index for it. */
+static token_rule_t *all_token_tables[] = {
+  routerdesc_token_table,
+  extrainfo_token_table,
+  rtrstatus_token_table,
+  netstatus_token_table,
+  dir_footer_token_table,
+  dir_token_table,
+  dir_key_certificate_table,
+  desc_token_table,
+  ipo_token_table,
+  client_keys_token_table,
+  networkstatus_token_table,
+  networkstatus_consensus_token_table,
+  networkstatus_vote_footer_token_table,
+  networkstatus_detached_signature_token_table,
+  microdesc_token_table,
+  NULL
+};
+
+/** One slot in a token_table_index_t. */
+typedef struct token_index_slot_t {
+  /** Position in the table of the rule whose keyword is stored in this slot,
+   * or -1 if the slot is empty. */
+  int16_t rule;
+  /** Length of that rule's keyword. */
+  uint16_t len;
+} token_index_slot_t;
+
+/** A hash index over the keywords of a single token table, so that
+ * get_next_token() can find the rule for a keyword with one or two
+ * comparisons, rather than comparing the keyword against every entry in the
+ * table.  The index is an open-addressed hash table, with at most one entry
+ * in four slots full. */
+typedef struct token_table_index_t {
+  /** The table that this index covers. */
+  token_rule_t *table;
+  /** The number of slots, minus one.  The number of slots is a power of
+   * two. */
+  unsigned mask;
+  /** The slots themselves. */
+  token_index_slot_t *slots;
+} token_table_index_t;
+
+/** Indices for each table in all_token_tables, in the same order; built the
+ * first time we need them. */
+static token_table_index_t *all_token_table_indices[
+                       sizeof(all_token_tables)/sizeof(all_token_tables[0])];
+
 /* static function prototypes */
 static int router_add_exit_policy(routerinfo_t *router,directory_token_t *tok);
 static addr_policy_t *router_parse_addr_policy(directory_token_t *tok);
@@ -540,10 +592,11 @@ static int tokenize_string(memarea_t *area,
                            smartlist_t *out,
                            token_rule_t *table,
                            int flags);
+static const token_table_index_t *token_table_get_index(token_rule_t *table);
 static directory_token_t *get_next_token(memarea_t *area,
                                          const char **s,
                                          const char *eos,
-                                         token_rule_t *table);
+                                         const token_table_index_t *index);
 #define CST_CHECK_AUTHORITY   (1<<0)
 #define CST_NO_CHECK_OBJTYPE  (1<<1)
 static int check_signature_token(const char *digest,
@@ -552,6 +605,23 @@ static int check_signature_token(const char *digest,
                                  crypto_pk_env_t *pkey,
                                  int flags,
                                  const char *doctype);
+static int queue_signature_token(sigcheck_batch_t *batch,
+                                 const char *digest,
+                                 ssize_t digest_len,
+                                 directory_token_t *tok,
+                                 crypto_pk_env_t *pkey,
+                                 int flags,
+                                 const char *doctype,
+                                 void *arg);
+static routerinfo_t *router_parse_entry_impl(const char *s, const char *end,
+                                          int cache_copy,
+                                          int allow_annotations,
+                                          const char *prepend_annotations,
+                                          sigcheck_batch_t *batch);
+static extrainfo_t *extrainfo_parse_entry_impl(const char *s,
+                                          const char *end, int cache_copy,
+                                          struct digest_ri_map_t *routermap,
+                                          sigcheck_batch_t *batch);
 static crypto_pk_env_t *find_dir_signing_key(const char *str, const char *eos);
 static int tor_version_same_series(tor_version_t *a, tor_version_t *b);
 
@@ -980,7 +1050,8 @@ find_dir_signing_key(const char *str, const char *eos)
   ++cp; /* Now cp points to the start of the token. */
 
   area = memarea_new();
-  tok = get_next_token(area, &cp, eos, dir_token_table);
+  tok = get_next_token(area, &cp, eos,
+                       token_table_get_index(dir_token_table));
   if (!tok) {
     log_warn(LD_DIR, "Unparseable dir-signing-key token");
     goto done;
@@ -1024,29 +1095,21 @@ dir_signing_key_is_trusted(crypto_pk_env_t *key)
   return 1;
 }
 
-/** Check whether the object body of the token in <b>tok</b> has a good
- * signature for <b>digest</b> using key <b>pkey</b>.  If
- * <b>CST_CHECK_AUTHORITY</b> is set, make sure that <b>pkey</b> is the key of
- * a directory authority.  If <b>CST_NO_CHECK_OBJTYPE</b> is set, do not check
- * the object type of the signature object. Use <b>doctype</b> as the type of
- * the document when generating log messages.  Return 0 on success, negative
- * on failure.
- */
+/** Helper for check_signature_token() and queue_signature_token(): do
+ * every check on the signature in <b>tok</b> that doesn't need the
+ * signature itself, as described for check_signature_token().  Return 0 if
+ * they all pass, negative otherwise. */
 static int
-check_signature_token(const char *digest,
-                      ssize_t digest_len,
-                      directory_token_t *tok,
-                      crypto_pk_env_t *pkey,
-                      int flags,
-                      const char *doctype)
+signature_token_precheck(directory_token_t *tok,
+                         crypto_pk_env_t *pkey,
+                         int flags,
+                         const char *doctype)
 {
-  char *signed_digest;
   const int check_authority = (flags & CST_CHECK_AUTHORITY);
   const int check_objtype = ! (flags & CST_NO_CHECK_OBJTYPE);
 
   tor_assert(pkey);
   tor_assert(tok);
-  tor_assert(digest);
   tor_assert(doctype);
 
   if (check_authority && !dir_signing_key_is_trusted(pkey)) {
@@ -1061,6 +1124,30 @@ check_signature_token(const char *digest,
       return -1;
     }
   }
+  return 0;
+}
+
+/** Check whether the object body of the token in <b>tok</b> has a good
+ * signature for <b>digest</b> using key <b>pkey</b>.  If
+ * <b>CST_CHECK_AUTHORITY</b> is set, make sure that <b>pkey</b> is the key of
+ * a directory authority.  If <b>CST_NO_CHECK_OBJTYPE</b> is set, do not check
+ * the object type of the signature object. Use <b>doctype</b> as the type of
+ * the document when generating log messages.  Return 0 on success, negative
+ * on failure.
+ */
+static int
+check_signature_token(const char *digest,
+                      ssize_t digest_len,
+                      directory_token_t *tok,
+                      crypto_pk_env_t *pkey,
+                      int flags,
+                      const char *doctype)
+{
+  char *signed_digest;
+
+  tor_assert(digest);
+  if (signature_token_precheck(tok, pkey, flags, doctype) < 0)
+    return -1;
 
   signed_digest = tor_malloc(tok->object_size);
   if (crypto_pk_public_checksig(pkey, signed_digest, tok->object_body,
@@ -1081,6 +1168,41 @@ check_signature_token(const char *digest,
   return 0;
 }
 
+/** As check_signature_token(), but rather than checking the signature in
+ * <b>tok</b> now, add it to <b>batch</b> along with <b>arg</b>, for the
+ * caller to check later with sigcheck_batch_run().  Return 0 if the
+ * signature is queued, negative if it already fails a check that doesn't
+ * need the signature itself. */
+static int
+queue_signature_token(sigcheck_batch_t *batch,
+                      const char *digest,
+                      ssize_t digest_len,
+                      directory_token_t *tok,
+                      crypto_pk_env_t *pkey,
+                      int flags,
+                      const char *doctype,
+                      void *arg)
+{
+  tor_assert(digest);
+  if (signature_token_precheck(tok, pkey, flags, doctype) < 0)
+    return -1;
+  sigcheck_batch_add(batch, pkey, digest, digest_len,
+                     tok->object_body, tok->object_size, arg);
+  return 0;
+}
+
+/** Log the outcome of a failed signature check whose result was
+ * <b>result</b>, one of the SIGCHECK_* values, just as
+ * check_signature_token() would for a document of type <b>doctype</b>. */
+static void
+log_signature_failure(int result, const char *doctype)
+{
+  if (result == SIGCHECK_INVALID)
+    log_warn(LD_DIR, "Error reading %s: invalid signature.", doctype);
+  else
+    log_warn(LD_DIR, "Error reading %s: signature does not match.", doctype);
+}
+
 /** Helper: move *<b>s_ptr</b> ahead to the next router, the next extra-info,
  * or to the first of the annotations proceeding the next router or
  * extra-info---whichever comes first.  Set <b>is_extrainfo_out</b> to true if
@@ -1138,6 +1260,27 @@ router_parse_list_from_string(const char **s, const char *eos,
                               int want_extrainfo,
                               int allow_annotations,
                               const char *prepend_annotations)
+{
+  return router_parse_list_from_string_batched(s, eos, dest, saved_location,
+                                               want_extrainfo,
+                                               allow_annotations,
+                                               prepend_annotations, NULL);
+}
+
+/** As router_parse_list_from_string(), but if <b>batch</b> is provided,
+ * don't check the signatures on the entries: add each one to <b>batch</b>
+ * instead, with the new entry as its argument, for the caller to check
+ * with sigcheck_batch_queue().  Once the batch is checked, the caller must
+ * call router_parse_list_remove_bad_signatures() before using
+ * <b>dest</b>. */
+int
+router_parse_list_from_string_batched(const char **s, const char *eos,
+                                      smartlist_t *dest,
+                                      saved_location_t saved_location,
+                                      int want_extrainfo,
+                                      int allow_annotations,
+                                      const char *prepend_annotations,
+                                      sigcheck_batch_t *batch)
 {
   routerinfo_t *router;
   extrainfo_t *extrainfo;
@@ -1173,18 +1316,18 @@ router_parse_list_from_string(const char **s, const char *eos,
 
     if (have_extrainfo && want_extrainfo) {
       routerlist_t *rl = router_get_routerlist();
-      extrainfo = extrainfo_parse_entry_from_string(*s, end,
+      extrainfo = extrainfo_parse_entry_impl(*s, end,
                                        saved_location != SAVED_IN_CACHE,
-                                       rl->identity_map);
+                                       rl->identity_map, batch);
       if (extrainfo) {
         signed_desc = &extrainfo->cache_info;
         elt = extrainfo;
       }
     } else if (!have_extrainfo && !want_extrainfo) {
-      router = router_parse_entry_from_string(*s, end,
-                                              saved_location != SAVED_IN_CACHE,
-                                              allow_annotations,
-                                              prepend_annotations);
+      router = router_parse_entry_impl(*s, end,
+                                       saved_location != SAVED_IN_CACHE,
+                                       allow_annotations,
+                                       prepend_annotations, batch);
       if (router) {
         log_debug(LD_DIR, "Read router '%s', purpose '%s'",
                   router->nickname, router_purpose_to_string(router->purpose));
@@ -1207,6 +1350,46 @@ router_parse_list_from_string(const char **s, const char *eos,
   return 0;
 }
 
+/** Given a list <b>list</b> of router descriptors (or extra-info documents
+ * if <b>is_extrainfo</b> is set) from
+ * router_parse_list_from_string_batched(), and the <b>batch</b> that holds
+ * their signatures, now checked, remove
+ * and free every entry whose signature is bad, with the same complaints we
+ * would have made if we'd checked it while parsing.  The other entries
+ * stay in the same order. */
+void
+router_parse_list_remove_bad_signatures(smartlist_t *list,
+                                        const sigcheck_batch_t *batch,
+                                        int is_extrainfo)
+{
+  /* Every entry we queued a signature for is in list, in the same order as
+   * its job. */
+  int i, j = 0, n = sigcheck_batch_len(batch);
+  const char *doctype = is_extrainfo ? "extra-info" : "router descriptor";
+  for (i = 0; i < n; ++i) {
+    int r = sigcheck_batch_get_result(batch, i);
+    void *elt = sigcheck_batch_get_arg(batch, i);
+    signed_descriptor_t *sd;
+    while (smartlist_get(list, j) != elt)
+      ++j;
+    if (r == SIGCHECK_OK)
+      continue;
+    log_signature_failure(r, doctype);
+    if (is_extrainfo) {
+      sd = &((extrainfo_t*)elt)->cache_info;
+      if (sd->signed_descriptor_body)
+        dump_desc(sd->signed_descriptor_body, "extra-info descriptor");
+      extrainfo_free(elt);
+    } else {
+      sd = &((routerinfo_t*)elt)->cache_info;
+      if (sd->signed_descriptor_body)
+        dump_desc(sd->signed_descriptor_body, "router descriptor");
+      routerinfo_free(elt);
+    }
+    smartlist_del_keeporder(list, j);
+  }
+}
+
 /* For debugging: define to count every descriptor digest we've seen so we
  * know if we need to try harder to avoid duplicate verifies. */
 #undef COUNT_DISTINCT_DIGESTS
@@ -1250,6 +1433,19 @@ routerinfo_t *
 router_parse_entry_from_string(const char *s, const char *end,
                                int cache_copy, int allow_annotations,
                                const char *prepend_annotations)
+{
+  return router_parse_entry_impl(s, end, cache_copy, allow_annotations,
+                                 prepend_annotations, NULL);
+}
+
+/** Helper: as router_parse_entry_from_string(), but if <b>batch</b> is
+ * provided, don't check the router's signature: add it to <b>batch</b>
+ * instead, with the new router as its argument. */
+static routerinfo_t *
+router_parse_entry_impl(const char *s, const char *end,
+                        int cache_copy, int allow_annotations,
+                        const char *prepend_annotations,
+                        sigcheck_batch_t *batch)
 {
   routerinfo_t *router = NULL;
   char digest[128];
@@ -1528,17 +1724,26 @@ router_parse_entry_from_string(const char *s, const char *end,
     verified_digests = digestmap_new();
   digestmap_set(verified_digests, signed_digest, (void*)(uintptr_t)1);
 #endif
-  if (check_signature_token(digest, DIGEST_LEN, tok, router->identity_pkey, 0,
-                            "router descriptor") < 0)
-    goto err;
-
-  routerinfo_set_country(router);
-
   if (!router->or_port) {
     log_warn(LD_DIR,"or_port unreadable or 0. Failing.");
     goto err;
   }
 
+  /* Nothing may fail after we queue the signature: the batch would be left
+   * pointing at a freed router. */
+  if (batch) {
+    if (queue_signature_token(batch, digest, DIGEST_LEN, tok,
+                              router->identity_pkey, 0,
+                              "router descriptor", router) < 0)
+      goto err;
+  } else if (check_signature_token(digest, DIGEST_LEN, tok,
+                                   router->identity_pkey, 0,
+                                   "router descriptor") < 0) {
+    goto err;
+  }
+
+  routerinfo_set_country(router);
+
   if (!router->platform) {
     router->platform = tor_strdup("<unknown>");
   }
@@ -1573,6 +1778,17 @@ router_parse_entry_from_string(const char *s, const char *end,
 extrainfo_t *
 extrainfo_parse_entry_from_string(const char *s, const char *end,
                            int cache_copy, struct digest_ri_map_t *routermap)
+{
+  return extrainfo_parse_entry_impl(s, end, cache_copy, routermap, NULL);
+}
+
+/** Helper: as extrainfo_parse_entry_from_string(), but if <b>batch</b> is
+ * provided and we know the signing key, don't check the signature: add it
+ * to <b>batch</b> instead, with the new extrainfo as its argument. */
+static extrainfo_t *
+extrainfo_parse_entry_impl(const char *s, const char *end,
+                           int cache_copy, struct digest_ri_map_t *routermap,
+                           sigcheck_batch_t *batch)
 {
   extrainfo_t *extrainfo = NULL;
   char digest[128];
@@ -1656,9 +1872,14 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
 
   if (key) {
     note_crypto_pk_op(VERIFY_RTR);
-    if (check_signature_token(digest, DIGEST_LEN, tok, key, 0,
-                              "extra-info") < 0)
+    if (batch) {
+      if (queue_signature_token(batch, digest, DIGEST_LEN, tok, key, 0,
+                                "extra-info", extrainfo) < 0)
+        goto err;
+    } else if (check_signature_token(digest, DIGEST_LEN, tok, key, 0,
+                                     "extra-info") < 0) {
       goto err;
+    }
 
     if (router)
       extrainfo->cache_info.send_unencrypted =
@@ -2331,11 +2552,72 @@ networkstatus_v2_parse_from_string(const char *s)
   return ns;
 }
 
+/** Helper for networkstatus_parse_vote_impl(): given a consensus <b>ns</b>
+ * whose routerstatus entries start at *<b>s</b>, note where each entry
+ * starts and what its identity digest is, without decoding the rest of it,
+ * and advance *<b>s</b> past the entries.  Skip any entry whose identity we
+ * can't decode, since we'd never be able to decode the entry anyway.
+ * Return 0 if the entries we noted are sorted by identity digest, or 1 if
+ * they aren't. */
+static int
+consensus_index_deferred_entries(networkstatus_t *ns, const char **s)
+{
+  const char *start = *s, *cp = *s, *next;
+  deferred_routerstatus_t *prev = NULL;
+  int unsorted = 0;
+
+  ns->deferred_entries = smartlist_create();
+  while (!strcmpstart(cp, "r ")) {
+    const char *eol, *id, *id_end;
+    char id64[BASE64_DIGEST_LEN+1];
+    deferred_routerstatus_t *dr;
+
+    next = find_start_of_next_routerstatus(cp);
+    eol = memchr(cp, '\n', next-cp);
+    if (!eol)
+      eol = next;
+    /* The identity is the second argument on the "r" line, after the
+     * nickname. */
+    id = eat_whitespace_eos_no_nl(cp+1, eol);
+    id = eat_whitespace_eos_no_nl(find_whitespace_eos(id, eol), eol);
+    id_end = find_whitespace_eos(id, eol);
+    if (id_end - id != BASE64_DIGEST_LEN) {
+      log_warn(LD_DIR, "Bad identity digest in router status; skipping.");
+      cp = next;
+      continue;
+    }
+    memcpy(id64, id, BASE64_DIGEST_LEN);
+    id64[BASE64_DIGEST_LEN] = '\0';
+    dr = tor_malloc_zero(sizeof(deferred_routerstatus_t));
+    if (digest_from_base64(dr->identity_digest, id64)) {
+      log_warn(LD_DIR, "Error decoding identity digest %s; skipping.",
+               escaped(id64));
+      tor_free(dr);
+      cp = next;
+      continue;
+    }
+    if (prev && memcmp(prev->identity_digest, dr->identity_digest,
+                       DIGEST_LEN) >= 0)
+      unsorted = 1;
+    dr->offset = cp - start;
+    smartlist_add(ns->deferred_entries, dr);
+    prev = dr;
+    cp = next;
+  }
+  ns->deferred_body = tor_strndup(start, cp-start);
+  *s = cp;
+  return unsorted;
+}
+
 /** Parse a v3 networkstatus vote, opinion, or consensus (depending on
- * ns_type), from <b>s</b>, and return the result.  Return NULL on failure. */
-networkstatus_t *
-networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
-                                     networkstatus_type_t ns_type)
+ * ns_type), from <b>s</b>, and return the result.  Return NULL on failure.
+ * If <b>defer_entries</b> is true, <b>ns_type</b> must be
+ * NS_TYPE_CONSENSUS, and we only note where each routerstatus entry is
+ * rather than decoding it. */
+static networkstatus_t *
+networkstatus_parse_vote_impl(const char *s, const char **eos_out,
+                              networkstatus_type_t ns_type,
+                              int defer_entries)
 {
   smartlist_t *tokens = smartlist_create();
   smartlist_t *rs_tokens = NULL, *footer_tokens = NULL;
@@ -2631,6 +2913,14 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   s = end_of_header;
   ns->routerstatus_list = smartlist_create();
 
+  if (defer_entries) {
+    tor_assert(ns->type == NS_TYPE_CONSENSUS);
+    /* An entry out of order might be one we'd fail to decode and drop, so
+     * we can't reject the consensus yet: decode everything now, and check
+     * the order of what's left below, just as the full parser would. */
+    if (consensus_index_deferred_entries(ns, &s))
+      networkstatus_decode_deferred_entries(ns);
+  }
   while (!strcmpstart(s, "r ")) {
     if (ns->type != NS_TYPE_CONSENSUS) {
       vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
@@ -2831,6 +3121,119 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   return ns;
 }
 
+/** Parse a v3 networkstatus vote, opinion, or consensus (depending on
+ * ns_type), from <b>s</b>, and return the result.  Return NULL on failure. */
+networkstatus_t *
+networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
+                                     networkstatus_type_t ns_type)
+{
+  return networkstatus_parse_vote_impl(s, eos_out, ns_type, 0);
+}
+
+/** Parse a v3 networkstatus consensus from <b>s</b>, and return the result,
+ * or NULL on failure.  Parse and check everything but the routerstatus
+ * entries: for those, just note where each one is and its identity digest,
+ * and leave routerstatus_list empty.  Use
+ * networkstatus_decode_deferred_entry() or
+ * networkstatus_decode_deferred_entries() to decode them later.
+ *
+ * Most of the work of parsing a consensus is in its entries, so this is
+ * much cheaper when we might throw the consensus away unused. */
+networkstatus_t *
+networkstatus_parse_consensus_lazily(const char *s)
+{
+  return networkstatus_parse_vote_impl(s, NULL, NS_TYPE_CONSENSUS, 1);
+}
+
+/** Helper for bsearching a list of deferred_routerstatus_t by identity
+ * digest. */
+static int
+compare_digest_to_deferred_entry(const void *_key, const void **_member)
+{
+  const char *key = _key;
+  const deferred_routerstatus_t *dr = *_member;
+  return memcmp(key, dr->identity_digest, DIGEST_LEN);
+}
+
+/** Decode the deferred entry <b>dr</b> from the consensus <b>ns</b>, if we
+ * haven't tried to already.  Return the decoded entry, or NULL if it can't
+ * be decoded. */
+static routerstatus_t *
+decode_deferred_entry(networkstatus_t *ns, deferred_routerstatus_t *dr,
+                      memarea_t *area, smartlist_t *tokens)
+{
+  if (!dr->rs && !dr->failed) {
+    const char *s = ns->deferred_body + dr->offset;
+    dr->rs = routerstatus_parse_entry_from_string(area, &s, tokens,
+                                                  NULL, NULL,
+                                                  ns->consensus_method,
+                                                  ns->flavor);
+    if (!dr->rs)
+      dr->failed = 1;
+  }
+  return dr->rs;
+}
+
+/** Return the entry in the lazily parsed consensus <b>ns</b> for the
+ * identity digest <b>digest</b>, decoding it if we haven't already; or NULL
+ * if there is no such entry, or it can't be decoded.  The entry still
+ * belongs to <b>ns</b>. */
+routerstatus_t *
+networkstatus_decode_deferred_entry(networkstatus_t *ns, const char *digest)
+{
+  deferred_routerstatus_t *dr;
+  routerstatus_t *rs;
+  memarea_t *area;
+  smartlist_t *tokens;
+
+  tor_assert(ns->deferred_entries);
+  dr = smartlist_bsearch(ns->deferred_entries, digest,
+                         compare_digest_to_deferred_entry);
+  if (!dr)
+    return NULL;
+  if (dr->rs || dr->failed)
+    return dr->rs;
+
+  area = memarea_new();
+  tokens = smartlist_create();
+  rs = decode_deferred_entry(ns, dr, area, tokens);
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+  return rs;
+}
+
+/** Decode every entry of the lazily parsed consensus <b>ns</b> that we
+ * haven't decoded yet, and put all the entries we could decode into its
+ * routerstatus_list, so that it looks just as if we had parsed it with
+ * networkstatus_parse_vote_from_string().  Do nothing if <b>ns</b> has
+ * no deferred entries. */
+void
+networkstatus_decode_deferred_entries(networkstatus_t *ns)
+{
+  memarea_t *area;
+  smartlist_t *tokens;
+
+  if (!ns->deferred_entries)
+    return;
+  tor_assert(smartlist_len(ns->routerstatus_list) == 0);
+
+  area = memarea_new();
+  tokens = smartlist_create();
+  SMARTLIST_FOREACH_BEGIN(ns->deferred_entries,
+                          deferred_routerstatus_t *, dr) {
+    routerstatus_t *rs = decode_deferred_entry(ns, dr, area, tokens);
+    if (rs)
+      smartlist_add(ns->routerstatus_list, rs);
+    tor_free(dr);
+  } SMARTLIST_FOREACH_END(dr);
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+
+  smartlist_free(ns->deferred_entries);
+  ns->deferred_entries = NULL;
+  tor_free(ns->deferred_body);
+}
+
 /** Return the digests_t that holds the digests of the
  * <b>flavor_name</b>-flavored networkstatus according to the detached
  * signatures document <b>sigs</b>, allocating a new digests_t as neeeded. */
@@ -3092,7 +3495,8 @@ router_parse_addr_policy_item_from_string(const char *s, int assume_action)
 
   eos = cp + strlen(cp);
   area = memarea_new();
-  tok = get_next_token(area, &cp, eos, routerdesc_token_table);
+  tok = get_next_token(area, &cp, eos,
+                       token_table_get_index(routerdesc_token_table));
   if (tok->tp == _ERR) {
     log_warn(LD_DIR, "Error reading address policy: %s", tok->error);
     goto err;
@@ -3348,17 +3752,172 @@ get_token_arguments(memarea_t *area, directory_token_t *tok,
 #undef MAX_ARGS
 }
 
+/** Return a hash of the <b>len</b>-byte keyword at <b>s</b>, for use in a
+ * token_table_index_t. */
+static INLINE unsigned
+token_keyword_hash(const char *s, size_t len)
+{
+  unsigned h = (unsigned)len;
+  while (len--)
+    h = h*33 + (unsigned char)*s++;
+  return h;
+}
+
+/** Build and return a new keyword index for <b>table</b>.  If a keyword
+ * appears more than once in the table, the index finds its first rule, just
+ * as a linear search would. */
+static token_table_index_t *
+token_table_index_new(token_rule_t *table)
+{
+  token_table_index_t *index = tor_malloc_zero(sizeof(token_table_index_t));
+  unsigned n_slots = 4, j;
+  int n_rules, i;
+
+  for (n_rules = 0; table[n_rules].t; ++n_rules)
+    ;
+  tor_assert(n_rules < INT16_MAX);
+  while (n_slots < 4*(unsigned)n_rules)
+    n_slots <<= 1;
+
+  index->table = table;
+  index->mask = n_slots - 1;
+  index->slots = tor_malloc(sizeof(token_index_slot_t)*n_slots);
+  for (j = 0; j < n_slots; ++j)
+    index->slots[j].rule = -1;
+
+  for (i = 0; i < n_rules; ++i) {
+    size_t len = strlen(table[i].t);
+    tor_assert(len <= UINT16_MAX);
+    j = token_keyword_hash(table[i].t, len) & index->mask;
+    while (index->slots[j].rule >= 0) {
+      if (index->slots[j].len == len &&
+          !memcmp(table[index->slots[j].rule].t, table[i].t, len))
+        break; /* A duplicate; keep the first one. */
+      j = (j+1) & index->mask;
+    }
+    if (index->slots[j].rule < 0) {
+      index->slots[j].rule = (int16_t)i;
+      index->slots[j].len = (uint16_t)len;
+    }
+  }
+  return index;
+}
+
+/** Release all storage held by <b>index</b>. */
+static void
+token_table_index_free(token_table_index_t *index)
+{
+  if (!index)
+    return;
+  tor_free(index->slots);
+  tor_free(index);
+}
+
+/** Return the keyword index for <b>table</b>, which must be listed in
+ * all_token_tables, building it if we haven't already. */
+static const token_table_index_t *
+token_table_get_index(token_rule_t *table)
+{
+  int i;
+  for (i = 0; all_token_tables[i]; ++i) {
+    if (all_token_tables[i] == table) {
+      if (PREDICT_UNLIKELY(!all_token_table_indices[i]))
+        all_token_table_indices[i] = token_table_index_new(table);
+      return all_token_table_indices[i];
+    }
+  }
+  log_err(LD_BUG, "Tried to tokenize with a table not in all_token_tables.");
+  tor_assert(0);
+  return NULL;
+}
+
+/** Return the first rule in <b>index</b>'s table whose keyword is the
+ * <b>len</b> bytes at <b>s</b>, or NULL if there is no such rule. */
+static INLINE const token_rule_t *
+token_table_index_lookup(const token_table_index_t *index,
+                         const char *s, size_t len)
+{
+  unsigned j = token_keyword_hash(s, len) & index->mask;
+  const token_index_slot_t *slot;
+  while ((slot = &index->slots[j])->rule >= 0) {
+    if (slot->len == len && !memcmp(index->table[slot->rule].t, s, len))
+      return &index->table[slot->rule];
+    j = (j+1) & index->mask;
+  }
+  return NULL;
+}
+
+/** Return the first rule in <b>table</b> whose keyword is the <b>len</b>
+ * bytes at <b>s</b>, or NULL if there is no such rule.  This is how we
+ * found keywords before we had token_table_index_t. */
+static const token_rule_t *
+token_table_linear_lookup(const token_rule_t *table,
+                          const char *s, size_t len)
+{
+  int i;
+  for (i = 0; table[i].t; ++i) {
+    if (!strcmp_len(s, table[i].t, len))
+      return &table[i];
+  }
+  return NULL;
+}
+
+/** Check that the keyword index for every token table finds the same rule
+ * as a linear search of the table would, for every keyword, every keyword
+ * with its last character removed, and a few strings that are not
+ * keywords.  Return the number of keywords checked on success, or -1 on
+ * failure.  Used by the unit tests. */
+int
+routerparse_check_token_indices(void)
+{
+  static const char *not_keywords[] = { "", "no-such-keyword", "@", NULL };
+  int n_checked = 0, i, j;
+  for (i = 0; all_token_tables[i]; ++i) {
+    token_rule_t *table = all_token_tables[i];
+    const token_table_index_t *index = token_table_get_index(table);
+    for (j = 0; table[j].t; ++j) {
+      const char *kwd = table[j].t;
+      size_t len = strlen(kwd);
+      if (token_table_index_lookup(index, kwd, len) !=
+          token_table_linear_lookup(table, kwd, len) ||
+          token_table_index_lookup(index, kwd, len-1) !=
+          token_table_linear_lookup(table, kwd, len-1))
+        return -1;
+      ++n_checked;
+    }
+    for (j = 0; not_keywords[j]; ++j) {
+      size_t len = strlen(not_keywords[j]);
+      if (token_table_index_lookup(index, not_keywords[j], len) !=
+          token_table_linear_lookup(table, not_keywords[j], len))
+        return -1;
+    }
+  }
+  return n_checked;
+}
+
+/** Free all storage held by the tokenizer's keyword indices. */
+void
+routerparse_free_all(void)
+{
+  int i;
+  for (i = 0; all_token_tables[i]; ++i) {
+    token_table_index_free(all_token_table_indices[i]);
+    all_token_table_indices[i] = NULL;
+  }
+}
+
 /** Helper function: read the next token from *s, advance *s to the end of the
  * token, and return the parsed token.  Parse *<b>s</b> according to the list
- * of tokens in <b>table</b>.
+ * of tokens in the table that <b>index</b> covers.
  */
 static directory_token_t *
 get_next_token(memarea_t *area,
-               const char **s, const char *eos, token_rule_t *table)
+               const char **s, const char *eos,
+               const token_table_index_t *index)
 {
   const char *next, *eol, *obstart;
   size_t obname_len;
-  int i;
+  const token_rule_t *rule;
   directory_token_t *tok;
   obj_syntax o_syn = NO_OBJ;
   char ebuf[128];
@@ -3384,38 +3943,35 @@ get_next_token(memarea_t *area,
     RET_ERR("Unexpected EOF");
   }
 
-  /* Search the table for the appropriate entry.  (I tried a binary search
-   * instead, but it wasn't any faster.) */
-  for (i = 0; table[i].t ; ++i) {
-    if (!strcmp_len(*s, table[i].t, next-*s)) {
-      /* We've found the keyword. */
-      kwd = table[i].t;
-      tok->tp = table[i].v;
-      o_syn = table[i].os;
-      *s = eat_whitespace_eos_no_nl(next, eol);
-      /* We go ahead whether there are arguments or not, so that tok->args is
-       * always set if we want arguments. */
-      if (table[i].concat_args) {
-        /* The keyword takes the line as a single argument */
-        tok->args = ALLOC(sizeof(char*));
-        tok->args[0] = STRNDUP(*s,eol-*s); /* Grab everything on line */
-        tok->n_args = 1;
-      } else {
-        /* This keyword takes multiple arguments. */
-        if (get_token_arguments(area, tok, *s, eol)<0) {
-          tor_snprintf(ebuf, sizeof(ebuf),"Far too many arguments to %s", kwd);
-          RET_ERR(ebuf);
-        }
-        *s = eol;
-      }
-      if (tok->n_args < table[i].min_args) {
-        tor_snprintf(ebuf, sizeof(ebuf), "Too few arguments to %s", kwd);
-        RET_ERR(ebuf);
-      } else if (tok->n_args > table[i].max_args) {
-        tor_snprintf(ebuf, sizeof(ebuf), "Too many arguments to %s", kwd);
+  /* Look up the keyword in the table's index. */
+  rule = token_table_index_lookup(index, *s, next-*s);
+  if (rule) {
+    /* We've found the keyword. */
+    kwd = rule->t;
+    tok->tp = rule->v;
+    o_syn = rule->os;
+    *s = eat_whitespace_eos_no_nl(next, eol);
+    /* We go ahead whether there are arguments or not, so that tok->args is
+     * always set if we want arguments. */
+    if (rule->concat_args) {
+      /* The keyword takes the line as a single argument */
+      tok->args = ALLOC(sizeof(char*));
+      tok->args[0] = STRNDUP(*s,eol-*s); /* Grab everything on line */
+      tok->n_args = 1;
+    } else {
+      /* This keyword takes multiple arguments. */
+      if (get_token_arguments(area, tok, *s, eol)<0) {
+        tor_snprintf(ebuf, sizeof(ebuf),"Far too many arguments to %s", kwd);
         RET_ERR(ebuf);
       }
-      break;
+      *s = eol;
+    }
+    if (tok->n_args < rule->min_args) {
+      tor_snprintf(ebuf, sizeof(ebuf), "Too few arguments to %s", kwd);
+      RET_ERR(ebuf);
+    } else if (tok->n_args > rule->max_args) {
+      tor_snprintf(ebuf, sizeof(ebuf), "Too many arguments to %s", kwd);
+      RET_ERR(ebuf);
     }
   }
 
@@ -3508,6 +4064,7 @@ tokenize_string(memarea_t *area,
 {
   const char **s;
   directory_token_t *tok = NULL;
+  const token_table_index_t *index = token_table_get_index(table);
   int counts[_NIL];
   int i;
   int first_nonannotation;
@@ -3520,7 +4077,7 @@ tokenize_string(memarea_t *area,
   for (i = 0; i < _NIL; ++i)
     counts[i] = 0;
   while (*s < end && (!tok || tok->tp != _EOF)) {
-    tok = get_next_token(area, s, end, table);
+    tok = get_next_token(area, s, end, index);
     if (tok->tp == _ERR) {
       log_warn(LD_DIR, "parse error: %s", tok->error);
       token_free(tok);
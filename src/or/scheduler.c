@@ -0,0 +1,255 @@
+/* Copyright (c) 2009, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file scheduler.c
+ * \brief Decide, across all OR connections at once, which circuit gets to
+ * put its next cell onto an outbuf.
+ *
+ * Cells stay on their circuits' queues until an OR connection can actually
+ * send them.  Whenever a connection gets new cells to send, or drains its
+ * outbuf, we add it to a list of pending connections; once per trip
+ * through the event loop, scheduler_run() works out how many cells each
+ * pending connection's socket can take right now, and hands out those
+ * slots one cell at a time, always to the connection whose next circuit has
+ * the lowest cell_ewma count (or round-robin, when cell_ewma is off).  That
+ * way a busy circuit on one connection can't fill an outbuf that the
+ * kernel won't drain for a while, and we keep the choice of what to send
+ * next for as long as we can.
+ **/
+
+#include "or.h"
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+/** If we couldn't put any cells on a connection because its socket buffer
+ * was full, how long do we wait before trying again, in msec? */
+#define SCHEDULER_RETRY_MSEC 10
+
+/** List of or_connection_t that have cells waiting on their circuits and
+ * may have room to send them. */
+static smartlist_t *pending_conns = NULL;
+/** Event to call scheduler_run(). */
+static struct event *run_scheduler_ev = NULL;
+/** How long from when we scheduled it will run_scheduler_ev fire, in msec,
+ * or -1 if it isn't scheduled. */
+static int run_scheduler_msec = -1;
+
+/** How many times have we run the scheduler with pending connections? */
+static uint64_t stats_n_scheduler_runs = 0;
+/** How many cells has the scheduler moved onto outbufs? */
+static uint64_t stats_n_cells_scheduled = 0;
+/** How many times did we find a pending connection with no room for cells?*/
+static uint64_t stats_n_conns_blocked = 0;
+/** Histogram of how long cells wait on circuit queues, on all circuits.
+ * See CELL_WAIT_HIST_BUCKETS for the bucket sizes. */
+static uint64_t cell_latency_hist[CELL_WAIT_HIST_BUCKETS];
+
+static void scheduler_schedule(int msec);
+
+/** Helper for the priority queue in scheduler_run(): order connections by
+ * the priority of the next cell they would send. */
+static int
+compare_conns_by_sched_priority(const void *p1, const void *p2)
+{
+  const or_connection_t *c1 = p1, *c2 = p2;
+  if (c1->sched_priority < c2->sched_priority)
+    return -1;
+  else if (c1->sched_priority > c2->sched_priority)
+    return 1;
+  else
+    return 0;
+}
+
+/** Add <b>conn</b> to the list of connections to consider the next time we
+ * run the scheduler. */
+static void
+scheduler_add_pending(or_connection_t *conn)
+{
+  if (conn->scheduler_pending)
+    return;
+  if (!pending_conns)
+    pending_conns = smartlist_create();
+  smartlist_add(pending_conns, conn);
+  conn->scheduler_pending = 1;
+}
+
+/** Libevent callback: run the scheduler. */
+static void
+scheduler_evt_callback(evutil_socket_t fd, short events, void *arg)
+{
+  (void)fd;
+  (void)events;
+  (void)arg;
+  /* If we were activated directly, a retry might still be pending. */
+  event_del(run_scheduler_ev);
+  run_scheduler_msec = -1;
+  scheduler_run();
+}
+
+/** Make sure that the scheduler will run within <b>msec</b> msec. */
+static void
+scheduler_schedule(int msec)
+{
+  struct timeval tv;
+  if (run_scheduler_msec >= 0 && run_scheduler_msec <= msec)
+    return;
+  if (!run_scheduler_ev) {
+    run_scheduler_ev = tor_evtimer_new(tor_libevent_get_base(),
+                                       scheduler_evt_callback, NULL);
+  }
+  if (msec == 0) {
+    /* No need to go through libevent's timers to run as soon as we get
+     * back to the event loop. */
+    event_active(run_scheduler_ev, EV_TIMEOUT, 1);
+  } else {
+    tv.tv_sec = msec / 1000;
+    tv.tv_usec = (msec % 1000) * 1000;
+    if (event_add(run_scheduler_ev, &tv) < 0) {
+      log_warn(LD_BUG, "Couldn't schedule cell scheduler event.");
+      return;
+    }
+  }
+  run_scheduler_msec = msec;
+}
+
+/** Called when <b>conn</b> may have room for more cells: either one of its
+ * circuits just got its first cell, or it just flushed some data. */
+void
+scheduler_conn_wants_to_write(or_connection_t *conn)
+{
+  if (!conn->active_circuits || conn->_base.marked_for_close)
+    return;
+  scheduler_add_pending(conn);
+  scheduler_schedule(0);
+}
+
+/** Called when we're about to free <b>conn</b>: stop tracking it. */
+void
+scheduler_forget_conn(or_connection_t *conn)
+{
+  if (conn->scheduler_pending) {
+    smartlist_remove(pending_conns, conn);
+    conn->scheduler_pending = 0;
+  }
+}
+
+/** Move cells from circuit queues onto the outbufs of every pending
+ * connection, as far as their sockets have room, always choosing next the
+ * connection whose next cell has the best priority. */
+void
+scheduler_run(void)
+{
+  smartlist_t *conns, *heap;
+  cell_flush_time_t ft;
+  int n_waiting = 0;
+  const int idx_offset = STRUCT_OFFSET(or_connection_t, sched_heap_idx);
+
+  if (!pending_conns || !smartlist_len(pending_conns))
+    return;
+  ++stats_n_scheduler_runs;
+  /* Look at the clock once for the whole pass, not once per cell. */
+  cell_flush_time_init(&ft);
+
+  conns = pending_conns;
+  pending_conns = smartlist_create();
+  heap = smartlist_create();
+
+  SMARTLIST_FOREACH_BEGIN(conns, or_connection_t *, conn) {
+    conn->scheduler_pending = 0;
+    if (conn->_base.marked_for_close || !conn->active_circuits)
+      continue;
+    conn->sched_cells_allowed =
+      connection_or_get_cell_allowance(conn, ft.now);
+    if (conn->sched_cells_allowed <= 0) {
+      ++stats_n_conns_blocked;
+      /* If there's nothing on the outbuf, no write event will tell us
+       * when the kernel has room again; we'll have to check back. */
+      if (!buf_datalen(conn->_base.outbuf)) {
+        scheduler_add_pending(conn);
+        ++n_waiting;
+      }
+      continue;
+    }
+    conn->sched_priority = connection_or_next_circuit_ewma(conn, &ft);
+    if (conn->sched_priority < 0)
+      conn->sched_priority = 0.0; /* round-robin */
+    smartlist_pqueue_add(heap, compare_conns_by_sched_priority, idx_offset,
+                         conn);
+  } SMARTLIST_FOREACH_END(conn);
+  smartlist_free(conns);
+
+  while (smartlist_len(heap)) {
+    or_connection_t *conn = smartlist_pqueue_pop(heap,
+                                   compare_conns_by_sched_priority,
+                                   idx_offset);
+    int n = connection_or_flush_from_first_active_circuit(conn, 1, &ft);
+    stats_n_cells_scheduled += n;
+    if (!n || conn->_base.marked_for_close || !conn->active_circuits)
+      continue;
+    if (--conn->sched_cells_allowed > 0) {
+      double ewma = connection_or_next_circuit_ewma(conn, &ft);
+      if (ewma < 0)
+        conn->sched_priority += 1.0; /* round-robin */
+      else
+        conn->sched_priority = ewma;
+      smartlist_pqueue_add(heap, compare_conns_by_sched_priority, idx_offset,
+                           conn);
+    } else if (!buf_datalen(conn->_base.outbuf)) {
+      scheduler_add_pending(conn);
+      ++n_waiting;
+    }
+  }
+  smartlist_free(heap);
+
+  if (n_waiting)
+    scheduler_schedule(SCHEDULER_RETRY_MSEC);
+}
+
+/** Note that a cell has just left a circuit queue after waiting there for
+ * a time that falls in histogram bucket <b>bucket</b>. */
+void
+scheduler_note_cell_latency(int bucket)
+{
+  ++cell_latency_hist[bucket];
+}
+
+/** Log the scheduler's statistics and the cell queue latency histogram at
+ * log level <b>severity</b>. */
+void
+scheduler_log_stats(int severity)
+{
+  char *hist;
+
+  log(severity, LD_OR,
+      "Cell scheduler: "U64_FORMAT" runs, "U64_FORMAT" cells scheduled; "
+      "found a connection with a full socket buffer "U64_FORMAT" times.",
+      U64_PRINTF_ARG(stats_n_scheduler_runs),
+      U64_PRINTF_ARG(stats_n_cells_scheduled),
+      U64_PRINTF_ARG(stats_n_conns_blocked));
+
+  hist = cell_wait_hist_to_string(cell_latency_hist);
+  log(severity, LD_OR, "Cell queue latency: %s", hist);
+  tor_free(hist);
+}
+
+/** Release all storage held by the scheduler. */
+void
+scheduler_free_all(void)
+{
+  if (pending_conns) {
+    SMARTLIST_FOREACH(pending_conns, or_connection_t *, conn,
+                      conn->scheduler_pending = 0);
+    smartlist_free(pending_conns);
+    pending_conns = NULL;
+  }
+  if (run_scheduler_ev) {
+    tor_event_free(run_scheduler_ev);
+    run_scheduler_ev = NULL;
+  }
+  run_scheduler_msec = -1;
+}
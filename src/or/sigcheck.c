@@ -0,0 +1,551 @@
+/* Copyright (c) 2009, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file sigcheck.c
+ * \brief Check batches of RSA signatures on directory objects in a set of
+ * worker threads.
+ *
+ * When SignatureCheckThreads is set, code that is about to check a lot of
+ * signatures at once -- such as router_load_downloaded_descriptors(),
+ * handed a few thousand descriptors by a directory fetch -- parses
+ * everything first, puts the signatures in a sigcheck_batch_t instead of
+ * checking each one as it goes, and hands the batch to
+ * sigcheck_batch_queue().  That returns at once, and the main thread goes
+ * back to the event loop while the signature checking threads take a few
+ * jobs at a time from the queued batches.  Whichever thread finishes the
+ * last job in a batch posts the batch to an answer queue and wakes up the
+ * main thread, which hands the batch back to the function the caller gave
+ * us.  So the main thread never waits on the threads.
+ *
+ * A job holds its own copies of the digest and the signature, and a
+ * reference to the key, so the caller can free the object it came from
+ * before the batch is checked.  The threads only ever compute: logging
+ * about bad signatures, and everything else, is up to the caller.
+ **/
+
+#include "or.h"
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+/** One signature to check. */
+typedef struct sigcheck_job_t {
+  /** The key that should have made the signature. */
+  crypto_pk_env_t *key;
+  /** The digest that should be signed. */
+  char digest[DIGEST256_LEN];
+  /** How many bytes of <b>digest</b> are used? */
+  size_t digest_len;
+  /** The signature itself. */
+  char *sig;
+  /** How long is <b>sig</b>? */
+  size_t sig_len;
+  /** The caller's pointer for this job. */
+  void *arg;
+  /** One of the SIGCHECK_* values; SIGCHECK_PENDING until we check it. */
+  int result;
+} sigcheck_job_t;
+
+/** A batch of signatures to check together. */
+struct sigcheck_batch_t {
+  /** The jobs, in the order they were added. */
+  sigcheck_job_t *jobs;
+  /** How many jobs are there? */
+  int n_jobs;
+  /** How many jobs is there room for in <b>jobs</b>? */
+  int capacity;
+  /** Once the batch is queued, the function to hand it back to, and the
+   * argument to give that function. */
+  sigcheck_done_fn done;
+  void *done_arg;
+  /** Once the batch is queued, the index of the next job that no thread has
+   * taken.  Protected by sigcheck_lock. */
+  int next_job;
+  /** Once the batch is queued, how many jobs are not yet checked?
+   * Protected by sigcheck_lock. */
+  int n_unfinished;
+  /** The next batch on the same queue. */
+  struct sigcheck_batch_t *next;
+};
+
+/** A first-in-first-out list of sigcheck_batch_t. */
+typedef struct sigcheck_batchqueue_t {
+  sigcheck_batch_t *head; /**< Oldest batch, or NULL if empty. */
+  sigcheck_batch_t *tail; /**< Newest batch, or NULL if empty. */
+} sigcheck_batchqueue_t;
+
+/** Check the signature in <b>job</b>, and set its result. */
+static void
+sigcheck_job_run(sigcheck_job_t *job)
+{
+  char *signed_digest = tor_malloc(job->sig_len);
+  int r = crypto_pk_public_checksig(job->key, signed_digest,
+                                    job->sig, job->sig_len);
+  if (r < (int)job->digest_len)
+    job->result = SIGCHECK_INVALID;
+  else if (memcmp(signed_digest, job->digest, job->digest_len))
+    job->result = SIGCHECK_MISMATCH;
+  else
+    job->result = SIGCHECK_OK;
+  tor_free(signed_digest);
+}
+
+/** Check every signature in <b>batch</b> in this thread, and hand the batch
+ * back to the function it was queued with. */
+static void
+sigcheck_batch_run_here(sigcheck_batch_t *batch)
+{
+  int i;
+  for (i = 0; i < batch->n_jobs; ++i)
+    sigcheck_job_run(&batch->jobs[i]);
+  batch->done(batch, batch->done_arg, 0);
+  sigcheck_batch_free(batch);
+}
+
+/** Return a new, empty batch of signatures to check. */
+sigcheck_batch_t *
+sigcheck_batch_new(void)
+{
+  return tor_malloc_zero(sizeof(sigcheck_batch_t));
+}
+
+/** Release all storage held by <b>batch</b>. */
+void
+sigcheck_batch_free(sigcheck_batch_t *batch)
+{
+  int i;
+  if (!batch)
+    return;
+  for (i = 0; i < batch->n_jobs; ++i) {
+    crypto_free_pk_env(batch->jobs[i].key);
+    tor_free(batch->jobs[i].sig);
+  }
+  tor_free(batch->jobs);
+  tor_free(batch);
+}
+
+/** Add a job to <b>batch</b>: to check that the <b>sig_len</b>-byte
+ * signature at <b>sig</b> is a signature made with <b>key</b> of the
+ * <b>digest_len</b>-byte digest at <b>digest</b>.  <b>arg</b> is for the
+ * caller to use as it likes.  Return the index of the new job. */
+int
+sigcheck_batch_add(sigcheck_batch_t *batch, crypto_pk_env_t *key,
+                   const char *digest, size_t digest_len,
+                   const char *sig, size_t sig_len, void *arg)
+{
+  sigcheck_job_t *job;
+  tor_assert(digest_len <= DIGEST256_LEN);
+  if (batch->n_jobs == batch->capacity) {
+    batch->capacity = batch->capacity ? batch->capacity*2 : 16;
+    batch->jobs = tor_realloc(batch->jobs,
+                              sizeof(sigcheck_job_t)*batch->capacity);
+  }
+  job = &batch->jobs[batch->n_jobs];
+  memset(job, 0, sizeof(sigcheck_job_t));
+  job->key = crypto_pk_dup_key(key);
+  memcpy(job->digest, digest, digest_len);
+  job->digest_len = digest_len;
+  job->sig = tor_memdup(sig, sig_len);
+  job->sig_len = sig_len;
+  job->arg = arg;
+  job->result = SIGCHECK_PENDING;
+  return batch->n_jobs++;
+}
+
+/** Return the number of jobs in <b>batch</b>. */
+int
+sigcheck_batch_len(const sigcheck_batch_t *batch)
+{
+  return batch->n_jobs;
+}
+
+/** Return the caller's pointer for the <b>idx</b>th job in <b>batch</b>. */
+void *
+sigcheck_batch_get_arg(const sigcheck_batch_t *batch, int idx)
+{
+  tor_assert(idx >= 0 && idx < batch->n_jobs);
+  return batch->jobs[idx].arg;
+}
+
+/** Return the result of the <b>idx</b>th job in <b>batch</b>: one of the
+ * SIGCHECK_* values. */
+int
+sigcheck_batch_get_result(const sigcheck_batch_t *batch, int idx)
+{
+  tor_assert(idx >= 0 && idx < batch->n_jobs);
+  return batch->jobs[idx].result;
+}
+
+#ifdef TOR_IS_MULTITHREADED
+
+/** How many jobs does a thread take from a batch at once? */
+#define SIGCHECK_CHUNK_SIZE 4
+
+/** Protects every variable below, up to notify_fd. */
+static tor_mutex_t *sigcheck_lock = NULL;
+/** Signalled when there's a new batch to work on, and when the threads
+ * should exit. */
+static tor_cond_t *work_cond = NULL;
+/** Signalled when a thread exits. */
+static tor_cond_t *done_cond = NULL;
+/** Batches that still have jobs nobody has taken. */
+static sigcheck_batchqueue_t queued_batches = { NULL, NULL };
+/** Batches whose every job is checked, waiting for the main thread. */
+static sigcheck_batchqueue_t answered_batches = { NULL, NULL };
+/** How many signature checking threads are running? */
+static int n_threads = 0;
+/** True iff the threads should exit. */
+static int exiting = 0;
+/** The threads' end of the socketpair they use to wake the main thread. */
+static int notify_fd = -1;
+/** The main thread's end of that socketpair. */
+static int notify_read_fd = -1;
+/** Event to read from notify_read_fd. */
+static struct event *notify_event = NULL;
+/** How many batches have we queued and not yet handed back?  Only the main
+ * thread touches this. */
+static int n_pending = 0;
+/** True iff we tried to start the threads and couldn't; we check
+ * signatures in the main thread instead. */
+static int sigcheck_broken = 0;
+
+/** How many batches have the threads checked? */
+static uint64_t stats_n_batches = 0;
+/** How many signatures were in those batches? */
+static uint64_t stats_n_sigs = 0;
+
+/** Add <b>batch</b> to the end of <b>q</b>. */
+static void
+batchqueue_push(sigcheck_batchqueue_t *q, sigcheck_batch_t *batch)
+{
+  batch->next = NULL;
+  if (q->tail)
+    q->tail->next = batch;
+  else
+    q->head = batch;
+  q->tail = batch;
+}
+
+/** Remove and return the first batch on <b>q</b>, or NULL if it's
+ * empty. */
+static sigcheck_batch_t *
+batchqueue_pop(sigcheck_batchqueue_t *q)
+{
+  sigcheck_batch_t *batch = q->head;
+  if (batch) {
+    q->head = batch->next;
+    if (!q->head)
+      q->tail = NULL;
+    batch->next = NULL;
+  }
+  return batch;
+}
+
+/** Body of a signature checking thread: take jobs from the queued batches,
+ * SIGCHECK_CHUNK_SIZE at a time, and post each batch to answered_batches
+ * once its last job is checked, until the main thread tells us to exit. */
+static void
+sigcheck_thread_main(void *data)
+{
+  (void)data;
+
+  tor_mutex_acquire(sigcheck_lock);
+  for (;;) {
+    sigcheck_batch_t *batch;
+    int first, n, i;
+    while (!exiting && !queued_batches.head)
+      tor_cond_wait(work_cond, sigcheck_lock);
+    if (exiting)
+      break;
+
+    batch = queued_batches.head;
+    first = batch->next_job;
+    n = batch->n_jobs - first;
+    if (n > SIGCHECK_CHUNK_SIZE)
+      n = SIGCHECK_CHUNK_SIZE;
+    batch->next_job += n;
+    /* Once every job is taken, the batch is off the queue; whoever
+     * finishes its last job posts it. */
+    if (batch->next_job == batch->n_jobs)
+      batchqueue_pop(&queued_batches);
+    tor_mutex_release(sigcheck_lock);
+
+    for (i = first; i < first+n; ++i)
+      sigcheck_job_run(&batch->jobs[i]);
+
+    tor_mutex_acquire(sigcheck_lock);
+    batch->n_unfinished -= n;
+    if (!batch->n_unfinished) {
+      if (!answered_batches.head) {
+        /* The main thread has already collected everything we told it
+         * about before, so it needs a fresh wakeup. */
+        char b = 0;
+        if (send(notify_fd, &b, 1, 0) != 1)
+          log_warn(LD_BUG, "Couldn't wake up main thread from signature "
+                   "checking thread: %s",
+                   tor_socket_strerror(tor_socket_errno(notify_fd)));
+      }
+      batchqueue_push(&answered_batches, batch);
+    }
+  }
+  --n_threads;
+  tor_cond_signal_all(done_cond);
+  tor_mutex_release(sigcheck_lock);
+
+  crypto_thread_cleanup();
+  spawn_exit();
+}
+
+/** Libevent callback: a signature checking thread has woken us up.  Hand
+ * back every batch the threads have finished. */
+static void
+sigcheck_notify_cb(evutil_socket_t fd, short events, void *arg)
+{
+  char buf[256];
+  (void)events;
+  (void)arg;
+
+  /* The bytes themselves mean nothing; they're just wakeups. */
+  while (recv(fd, buf, sizeof(buf), 0) > 0)
+    ;
+  sigcheck_process_answers();
+}
+
+/** Start the signature checking threads.  Return 0 on success, -1 on
+ * failure. */
+static int
+sigcheck_start(void)
+{
+  int fds[2];
+  int err, i, n_wanted = get_options()->SignatureCheckThreads;
+
+  if ((err = tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) < 0) {
+    log_warn(LD_NET, "Couldn't construct socketpair for signature checking "
+             "threads: %s", tor_socket_strerror(-err));
+    return -1;
+  }
+  set_socket_nonblocking(fds[0]);
+  notify_event = tor_event_new(tor_libevent_get_base(), fds[0],
+                               EV_READ|EV_PERSIST, sigcheck_notify_cb,
+                               NULL);
+  if (event_add(notify_event, NULL) < 0) {
+    log_warn(LD_BUG, "Couldn't add event for signature checking threads.");
+    tor_event_free(notify_event);
+    notify_event = NULL;
+    tor_close_socket(fds[0]);
+    tor_close_socket(fds[1]);
+    return -1;
+  }
+  notify_read_fd = fds[0];
+  notify_fd = fds[1];
+
+  sigcheck_lock = tor_mutex_new();
+  work_cond = tor_cond_new();
+  done_cond = tor_cond_new();
+  exiting = 0;
+
+  tor_mutex_acquire(sigcheck_lock);
+  for (i = 0; i < n_wanted; ++i) {
+    if (spawn_func(sigcheck_thread_main, NULL) < 0) {
+      log_warn(LD_GENERAL, "Couldn't spawn signature checking thread.");
+      break;
+    }
+    ++n_threads;
+  }
+  tor_mutex_release(sigcheck_lock);
+
+  if (!n_threads) {
+    sigcheck_free_all();
+    return -1;
+  }
+  log_info(LD_DIR, "Started %d signature checking thread(s).", n_threads);
+  return 0;
+}
+
+/** Return true iff we should check big batches of signatures in the
+ * signature checking threads.  Start the threads if we need them and they
+ * aren't running yet. */
+int
+sigcheck_enabled(void)
+{
+  if (n_threads)
+    return 1;
+  if (sigcheck_broken || get_options()->SignatureCheckThreads == 0)
+    return 0;
+  if (sigcheck_start() < 0) {
+    log_warn(LD_DIR, "Couldn't start signature checking threads; checking "
+             "signatures in the main thread instead.");
+    sigcheck_broken = 1;
+    return 0;
+  }
+  return 1;
+}
+
+/** Check every signature in <b>batch</b>, set each job's result, and then
+ * call <b>done</b> with <b>batch</b> and <b>arg</b> in the main thread.
+ * If the signature checking threads are running, hand the batch to them
+ * and return at once: <b>done</b> gets called from the event loop once
+ * they've checked it all.  Otherwise, check it right away, and call
+ * <b>done</b> before returning.  Either way, the batch belongs to us now,
+ * and we free it once <b>done</b> returns. */
+void
+sigcheck_batch_queue(sigcheck_batch_t *batch, sigcheck_done_fn done,
+                     void *arg)
+{
+  batch->done = done;
+  batch->done_arg = arg;
+  if (!n_threads || !batch->n_jobs) {
+    sigcheck_batch_run_here(batch);
+    return;
+  }
+
+  ++n_pending;
+  tor_mutex_acquire(sigcheck_lock);
+  batch->next_job = 0;
+  batch->n_unfinished = batch->n_jobs;
+  batchqueue_push(&queued_batches, batch);
+  tor_cond_signal_all(work_cond);
+  tor_mutex_release(sigcheck_lock);
+}
+
+/** Hand back every batch the signature checking threads have finished to
+ * the function it was queued with. */
+void
+sigcheck_process_answers(void)
+{
+  sigcheck_batch_t *batch, *next;
+
+  if (!sigcheck_lock)
+    return;
+  tor_mutex_acquire(sigcheck_lock);
+  batch = answered_batches.head;
+  answered_batches.head = answered_batches.tail = NULL;
+  tor_mutex_release(sigcheck_lock);
+
+  for ( ; batch; batch = next) {
+    next = batch->next;
+    --n_pending;
+    ++stats_n_batches;
+    stats_n_sigs += batch->n_jobs;
+    batch->done(batch, batch->done_arg, 0);
+    sigcheck_batch_free(batch);
+  }
+}
+
+/** Return the number of batches we've handed to the signature checking
+ * threads without handing them back since. */
+int
+sigcheck_get_n_pending(void)
+{
+  return n_pending;
+}
+
+/** Log how much work the signature checking threads have done, at log
+ * level <b>severity</b>. */
+void
+sigcheck_log_stats(int severity)
+{
+  if (!n_threads)
+    return;
+  log(severity, LD_DIR, "Signature checking threads: %d running, %d "
+      "batches outstanding; checked "U64_FORMAT" signatures in "U64_FORMAT
+      " batches.", n_threads, n_pending,
+      U64_PRINTF_ARG(stats_n_sigs), U64_PRINTF_ARG(stats_n_batches));
+}
+
+/** Stop the signature checking threads, and release all storage they
+ * use.  Batches they hadn't handed back go to their functions anyway, but
+ * marked as cancelled. */
+void
+sigcheck_free_all(void)
+{
+  sigcheck_batch_t *batch;
+  if (sigcheck_lock) {
+    tor_mutex_acquire(sigcheck_lock);
+    exiting = 1;
+    tor_cond_signal_all(work_cond);
+    while (n_threads)
+      tor_cond_wait(done_cond, sigcheck_lock);
+    tor_mutex_release(sigcheck_lock);
+
+    /* The threads are gone, and finished every job they took, so each
+     * batch is on one queue or the other. */
+    while ((batch = batchqueue_pop(&answered_batches)) ||
+           (batch = batchqueue_pop(&queued_batches))) {
+      --n_pending;
+      batch->done(batch, batch->done_arg, 1);
+      sigcheck_batch_free(batch);
+    }
+
+    tor_mutex_free(sigcheck_lock);
+    tor_cond_free(work_cond);
+    tor_cond_free(done_cond);
+    sigcheck_lock = NULL;
+    work_cond = done_cond = NULL;
+  }
+  if (notify_event) {
+    tor_event_free(notify_event);
+    notify_event = NULL;
+  }
+  if (notify_read_fd >= 0) {
+    tor_close_socket(notify_read_fd);
+    notify_read_fd = -1;
+  }
+  if (notify_fd >= 0) {
+    tor_close_socket(notify_fd);
+    notify_fd = -1;
+  }
+  sigcheck_broken = 0;
+}
+
+#else
+
+/** Without threads, we always check signatures in the main thread. */
+int
+sigcheck_enabled(void)
+{
+  return 0;
+}
+
+/** Without threads, check every signature in <b>batch</b> ourselves, and
+ * call <b>done</b> right away. */
+void
+sigcheck_batch_queue(sigcheck_batch_t *batch, sigcheck_done_fn done,
+                     void *arg)
+{
+  batch->done = done;
+  batch->done_arg = arg;
+  sigcheck_batch_run_here(batch);
+}
+
+/** Without threads, there are never any answers to process. */
+void
+sigcheck_process_answers(void)
+{
+}
+
+/** Without threads, no batches are ever pending. */
+int
+sigcheck_get_n_pending(void)
+{
+  return 0;
+}
+
+/** Without threads, there are no statistics to log. */
+void
+sigcheck_log_stats(int severity)
+{
+  (void)severity;
+}
+
+/** Without threads, there's nothing to free. */
+void
+sigcheck_free_all(void)
+{
+}
+
+#endif
@@ -47,6 +47,13 @@ double fabs(double x);
 #include "torgzip.h"
 #include "mempool.h"
 #include "memarea.h"
+#include "ring.h"
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
 
 #ifdef USE_DMALLOC
 #include <dmalloc.h>
@@ -327,6 +334,90 @@ test_buffers(void)
   buf_free(buf);
   buf = NULL;
 
+  /* Batched cell extraction, including cells that straddle chunks. */
+  {
+    char cellbuf[CELL_NETWORK_SIZE];
+    cell_t cells[4];
+    buf = buf_new_with_capacity(1000);
+    for (j = 0; j < 5; ++j) {
+      memset(cellbuf, 'a'+j, sizeof(cellbuf));
+      set_uint16(cellbuf, htons(100+j));
+      set_uint8(cellbuf+2, CELL_RELAY);
+      write_to_buf(cellbuf, sizeof(cellbuf), buf);
+    }
+    write_to_buf(cellbuf, 10, buf);
+    test_eq(4, fetch_cells_from_buf(buf, cells, 4, 2));
+    for (j = 0; j < 4; ++j) {
+      test_eq(cells[j].circ_id, 100+j);
+      test_eq(cells[j].command, CELL_RELAY);
+      test_eq(cells[j].payload[0], 'a'+j);
+      test_eq(cells[j].payload[CELL_PAYLOAD_SIZE-1], 'a'+j);
+    }
+    test_eq(buf_datalen(buf), CELL_NETWORK_SIZE+10);
+    test_eq(1, fetch_cells_from_buf(buf, cells, 4, 2));
+    test_eq(cells[0].circ_id, 104);
+    test_eq(0, fetch_cells_from_buf(buf, cells, 4, 2));
+    buf_clear(buf);
+
+    /* Stop at anything that could be a variable-length cell. */
+    set_uint8(cellbuf+2, CELL_VERSIONS);
+    write_to_buf(cellbuf, sizeof(cellbuf), buf);
+    test_eq(0, fetch_cells_from_buf(buf, cells, 4, 2));
+    test_eq(1, fetch_cells_from_buf(buf, cells, 4, 1));
+    test_eq(buf_datalen(buf), 0);
+    buf_free(buf);
+    buf = NULL;
+  }
+
+  /* Flush a buffer made of many small chunks to a socket, and read it back
+   * into another one. */
+  {
+    int sv[2] = { -1, -1 };
+    int eof = 0, err = 0;
+    size_t flushlen;
+    char *big = tor_malloc(8000), *big2 = tor_malloc(8000);
+    for (j = 0; j < 8000; ++j)
+      big[j] = (char)(j*7);
+    test_eq(0, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    buf = buf_new_with_capacity(256);
+    for (j = 0; j < 8000; j += 100)
+      write_to_buf(big+j, 100, buf);
+    test_eq(buf_datalen(buf), 8000);
+    flushlen = 8000;
+    test_eq(3000, flush_buf(sv[0], buf, 3000, &flushlen));
+    test_eq(flushlen, 5000);
+    test_eq(buf_datalen(buf), 5000);
+    test_eq(5000, flush_buf(sv[0], buf, 5000, &flushlen));
+    test_eq(flushlen, 0);
+    test_eq(buf_datalen(buf), 0);
+
+    buf2 = buf_new_with_capacity(256);
+    write_to_buf(big, 10, buf2);
+    test_eq(1000, read_to_buf(sv[1], 1000, buf2, &eof, &err));
+    test_eq(7000, read_to_buf(sv[1], 8000, buf2, &eof, &err));
+    test_eq(eof, 0);
+    test_eq(buf_datalen(buf2), 8010);
+    /* With nothing left to read, we still notice the EOF. */
+    tor_close_socket(sv[0]);
+    test_eq(0, read_to_buf(sv[1], 8000, buf2, &eof, &err));
+    test_eq(eof, 1);
+    test_eq(buf_datalen(buf2), 8010);
+    assert_buf_ok(buf2);
+    fetch_from_buf(big2, 10, buf2);
+    test_memeq(big2, big, 10);
+    fetch_from_buf(big2, 8000, buf2);
+    test_memeq(big2, big, 8000);
+    assert_buf_ok(buf);
+    assert_buf_ok(buf2);
+    tor_close_socket(sv[1]);
+    tor_free(big);
+    tor_free(big2);
+    buf_free(buf);
+    buf = NULL;
+    buf_free(buf2);
+    buf2 = NULL;
+  }
+
 #if 0
   {
   int s;
@@ -801,6 +892,220 @@ test_policies(void)
   }
 }
 
+extern int global_read_bucket, global_write_bucket;
+
+/** Run unit tests for refilling the token buckets in small steps. */
+static void
+test_bucket_refill(void)
+{
+  or_options_t *options = get_options();
+  uint64_t old_rate = options->BandwidthRate;
+  uint64_t old_burst = options->BandwidthBurst;
+  time_t now = time(NULL);
+  int i, j, total = 0;
+
+  /* 3333 bytes a second doesn't divide evenly into 10 msec steps. */
+  options->BandwidthRate = 3333;
+  options->BandwidthBurst = 3333;
+  connection_bucket_init();
+  test_eq(3333, global_read_bucket);
+  global_read_bucket = global_write_bucket = 0;
+
+  /* Refill every 10 msec; every 100 msec window should let through a
+   * tenth of the rate, without losing the fractions of a byte. */
+  for (i = 0; i < 10; ++i) {
+    for (j = 0; j < 10; ++j)
+      connection_bucket_refill(10, now);
+    test_assert(global_read_bucket == 333 || global_read_bucket == 334);
+    test_eq(global_read_bucket, global_write_bucket);
+    total += global_read_bucket;
+    global_read_bucket = global_write_bucket = 0;
+  }
+  test_eq(3333, total);
+
+  /* A long gap fills the buckets up to the burst and no further. */
+  global_read_bucket = 100;
+  connection_bucket_refill(5000, now);
+  test_eq(3333, global_read_bucket);
+
+ done:
+  options->BandwidthRate = old_rate;
+  options->BandwidthBurst = old_burst;
+  connection_bucket_init();
+}
+
+/** Helper for the OR connection and circuit tests: an event callback that
+ * does nothing. */
+static void
+noop_event_cb(evutil_socket_t fd, short events, void *arg)
+{
+  (void)fd;
+  (void)events;
+  (void)arg;
+}
+
+/** Helper for the OR connection and circuit tests: return a new OR
+ * connection with no socket, that we can queue cells on and flush cells
+ * to.  It looks linked (to nothing), so that nobody tries to add its write
+ * event to the event loop.  Free it with fake_or_conns_free_all(). */
+static or_connection_t *
+fake_or_conn_new(void)
+{
+  or_connection_t *conn;
+  if (!tor_libevent_get_base())
+    tor_libevent_initialize();
+  conn = TO_OR_CONN(connection_new(CONN_TYPE_OR, AF_INET));
+  conn->_base.linked = 1;
+  conn->_base.write_event = tor_evtimer_new(tor_libevent_get_base(),
+                                            noop_event_cb, NULL);
+  conn->link_proto = 2;
+  return conn;
+}
+
+/** Helper for the OR connection and circuit tests: return a new relayed
+ * OR circuit with ID <b>id</b> on <b>p_conn</b>. */
+static or_circuit_t *
+fake_or_circ_new(or_connection_t *p_conn, circid_t id)
+{
+  or_circuit_t *circ = or_circuit_new(id, p_conn);
+  circ->_base.purpose = CIRCUIT_PURPOSE_OR;
+  return circ;
+}
+
+/** Helper for the OR connection and circuit tests: free every circuit,
+ * and then the <b>n_conns</b> connections in <b>conns</b>, which came
+ * from fake_or_conn_new().  NULL entries are skipped. */
+static void
+fake_or_conns_free_all(or_connection_t **conns, int n_conns)
+{
+  int i;
+  circuit_free_all();
+  for (i = 0; i < n_conns; ++i) {
+    if (!conns[i])
+      continue;
+    conns[i]->_base.linked = 0;
+    connection_free(TO_CONN(conns[i]));
+  }
+}
+
+/** Make sure that the circuit ID map on an OR connection finds every
+ * circuit on it, across growing, shrinking, and removals from the middle
+ * of a probe sequence. */
+static void
+test_circuit_idmap(void)
+{
+  or_connection_t *conn = fake_or_conn_new();
+  or_circuit_t **circs = tor_malloc_zero(sizeof(or_circuit_t*)*1000);
+  int i;
+
+  for (i = 0; i < 1000; ++i)
+    circs[i] = fake_or_circ_new(conn, (circid_t)(i*37+1));
+  test_eq(1000, conn->n_circuits);
+  for (i = 0; i < 1000; ++i)
+    test_eq_ptr(TO_CIRCUIT(circs[i]),
+                circuit_get_by_circid_orconn((circid_t)(i*37+1), conn));
+  test_assert(!circuit_get_by_circid_orconn(2, conn));
+
+  /* Take away every circuit but one in three, and check the rest. */
+  for (i = 0; i < 1000; ++i) {
+    if (i % 3)
+      circuit_set_p_circid_orconn(circs[i], 0, NULL);
+  }
+  test_eq(334, conn->n_circuits);
+  for (i = 0; i < 1000; ++i) {
+    if (i % 3) {
+      test_assert(!circuit_id_in_use_on_orconn((circid_t)(i*37+1), conn));
+    } else {
+      test_eq_ptr(TO_CIRCUIT(circs[i]),
+                  circuit_get_by_circid_orconn((circid_t)(i*37+1), conn));
+    }
+  }
+
+  /* Moving a circuit to a new ID frees up the old one. */
+  circuit_set_p_circid_orconn(circs[0], 2, conn);
+  test_assert(!circuit_id_in_use_on_orconn(1, conn));
+  test_eq_ptr(TO_CIRCUIT(circs[0]), circuit_get_by_circid_orconn(2, conn));
+
+  for (i = 0; i < 1000; i += 3)
+    circuit_set_p_circid_orconn(circs[i], 0, NULL);
+  test_eq(0, conn->n_circuits);
+  test_assert(!conn->circid_map);
+
+ done:
+  fake_or_conns_free_all(&conn, 1);
+  tor_free(circs);
+}
+
+/** Make sure that we free marked circuits and deferred buffers a bounded
+ * number at a time, and leave everything else alone. */
+static void
+test_close_marked(void)
+{
+  or_connection_t *conn = fake_or_conn_new();
+  or_circuit_t *keep = or_circuit_new(100, NULL);
+  char *junk = tor_malloc_zero(4096);
+  buf_t *buf = buf_new_with_capacity(4096);
+  int i;
+
+  for (i = 0; i < 10; ++i)
+    fake_or_circ_new(conn, (circid_t)(i+1));
+  circuit_unlink_all_from_or_conn(conn, END_CIRC_REASON_OR_CONN_CLOSED);
+  test_eq(6, circuit_close_marked(4));
+  test_eq(0, circuit_close_marked(100));
+  test_eq_ptr(TO_CIRCUIT(keep), _circuit_get_global_list());
+  test_assert(!keep->_base.next);
+
+  for (i = 0; i < 64; ++i)
+    write_to_buf(junk, 4096, buf);
+  buf_free_later(buf);
+  test_eq(1, buf_free_some_deferred(10));
+  test_eq(0, buf_free_some_deferred(1000));
+
+ done:
+  fake_or_conns_free_all(&conn, 1);
+  tor_free(junk);
+}
+
+/** Make sure that a circuit we couldn't send a create cell for doesn't
+ * keep pointing at its next connection once that connection closes, even
+ * when the circuit isn't freed until later. */
+static void
+test_circuit_create_failed(void)
+{
+  or_connection_t *p_conn = fake_or_conn_new();
+  or_connection_t *n_conn = fake_or_conn_new();
+  or_circuit_t *circ = fake_or_circ_new(p_conn, 1);
+  tor_addr_t addr;
+
+  /* We can't pick circuit IDs on a connection from a client with no
+   * identity, so delivering the create cell fails. */
+  crypto_rand(n_conn->identity_digest, DIGEST_LEN);
+  n_conn->circ_id_type = CIRC_ID_TYPE_NEITHER;
+  tor_addr_from_ipv4h(&addr, 0x7f000001);
+  circ->_base.n_hop = extend_info_alloc(NULL, n_conn->identity_digest, NULL,
+                                        &addr, 9001);
+  circ->_base.n_conn_onionskin = tor_malloc_zero(ONIONSKIN_CHALLENGE_LEN);
+  circuit_set_state(TO_CIRCUIT(circ), CIRCUIT_STATE_OR_WAIT);
+  circuit_n_conn_done(n_conn, 1);
+  test_assert(circ->_base.marked_for_close);
+  test_eq_ptr(n_conn, circ->_base.n_conn);
+  test_eq(0, circ->_base.n_circ_id);
+
+  /* The next connection closes and goes away before we free the
+   * circuit. */
+  circuit_unlink_all_from_or_conn(n_conn, END_CIRC_REASON_OR_CONN_CLOSED);
+  test_eq_ptr(NULL, circ->_base.n_conn);
+  n_conn->_base.linked = 0;
+  connection_free(TO_CONN(n_conn));
+  n_conn = NULL;
+  test_eq(0, circuit_close_marked(100));
+  test_assert(!_circuit_get_global_list());
+
+ done:
+  fake_or_conns_free_all(&p_conn, 1);
+  fake_or_conns_free_all(&n_conn, 1);
+}
+
 /** Run AES performance benchmarks. */
 static void
 bench_aes(void)
@@ -833,6 +1138,1167 @@ bench_aes(void)
   crypto_free_cipher_env(c);
 }
 
+/** Run benchmarks for crypting relay cell payloads through 1, 3, and 8
+ * onion layers, as a relay or client would, on one core. */
+static void
+bench_onion_crypt(void)
+{
+  const int n_layers[] = { 1, 3, 8 };
+  const int iters = 100000;
+  crypto_cipher_env_t *layers[8];
+  char payload[CELL_PAYLOAD_SIZE];
+  struct timeval start, end;
+  uint64_t usec;
+  int i, j, k;
+
+  for (j = 0; j < 8; ++j) {
+    layers[j] = crypto_new_cipher_env();
+    crypto_cipher_generate_key(layers[j]);
+    crypto_cipher_encrypt_init_cipher(layers[j]);
+  }
+  memset(payload, 0, sizeof(payload));
+
+  for (k = 0; k < (int)(sizeof(n_layers)/sizeof(int)); ++k) {
+    tor_gettimeofday(&start);
+    for (i = 0; i < iters; ++i) {
+      for (j = 0; j < n_layers[k]; ++j)
+        crypto_cipher_crypt_inplace(layers[j], payload, sizeof(payload));
+    }
+    tor_gettimeofday(&end);
+    usec = tv_udiff(&start, &end);
+    printf("%d layer(s): %.2f MB/sec of cell payload per core\n", n_layers[k],
+           ((double)iters)*sizeof(payload) / (usec?usec:1));
+  }
+
+  for (j = 0; j < 8; ++j)
+    crypto_free_cipher_env(layers[j]);
+}
+
+/** Run benchmarks comparing one-at-a-time cell fetching against batched
+ * cell extraction from a buffer. */
+static void
+bench_cell_fetch(void)
+{
+  const int iters = 2000;
+  const int n_cells = 256;
+  char body[CELL_NETWORK_SIZE];
+  cell_t cells[16];
+  buf_t *buf = buf_new();
+  struct timeval start, end;
+  uint64_t usec;
+  int i, j;
+
+  memset(body, 0, sizeof(body));
+  set_uint8(body+2, CELL_RELAY);
+
+  usec = 0;
+  for (i = 0; i < iters; ++i) {
+    char tmp[CELL_NETWORK_SIZE];
+    for (j = 0; j < n_cells; ++j)
+      write_to_buf(body, sizeof(body), buf);
+    tor_gettimeofday(&start);
+    while (buf_datalen(buf) >= CELL_NETWORK_SIZE) {
+      fetch_from_buf(tmp, CELL_NETWORK_SIZE, buf);
+      cell_unpack(&cells[0], tmp);
+    }
+    tor_gettimeofday(&end);
+    usec += tv_udiff(&start, &end);
+  }
+  printf("fetch+unpack: "U64_FORMAT" cells/sec\n",
+         U64_PRINTF_ARG(((uint64_t)iters)*n_cells*1000000/(usec?usec:1)));
+
+  usec = 0;
+  for (i = 0; i < iters; ++i) {
+    for (j = 0; j < n_cells; ++j)
+      write_to_buf(body, sizeof(body), buf);
+    tor_gettimeofday(&start);
+    while (fetch_cells_from_buf(buf, cells, 16, 2))
+      ;
+    tor_gettimeofday(&end);
+    usec += tv_udiff(&start, &end);
+  }
+  printf("batched:      "U64_FORMAT" cells/sec\n",
+         U64_PRINTF_ARG(((uint64_t)iters)*n_cells*1000000/(usec?usec:1)));
+
+  buf_free(buf);
+}
+
+/** Make sure that when a connection starts or stops reading, we only tell
+ * libevent about it when we apply the changes, and not at all if it has
+ * gone back to what libevent already had. */
+static void
+test_event_changes(void)
+{
+  connection_t *conn = connection_new(CONN_TYPE_OR, AF_INET);
+  int fds[2] = { -1, -1 };
+
+  if (!tor_libevent_get_base())
+    tor_libevent_initialize();
+  test_eq(0, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  conn->s = fds[0];
+  conn->read_event = tor_event_new(tor_libevent_get_base(), conn->s,
+                           EV_READ|EV_PERSIST, noop_event_cb, NULL);
+  conn->write_event = tor_event_new(tor_libevent_get_base(), conn->s,
+                           EV_WRITE|EV_PERSIST, noop_event_cb, NULL);
+
+  connection_start_reading(conn);
+  test_assert(connection_is_reading(conn));
+  test_assert(!event_pending(conn->read_event, EV_READ, NULL));
+  connection_apply_event_changes();
+  test_assert(event_pending(conn->read_event, EV_READ, NULL));
+  test_assert(conn->read_event_added);
+
+  /* Stopping and starting again before we apply changes costs nothing. */
+  connection_stop_reading(conn);
+  test_assert(!connection_is_reading(conn));
+  connection_start_reading(conn);
+  test_assert(conn->event_change_pending);
+  connection_apply_event_changes();
+  test_assert(!conn->event_change_pending);
+  test_assert(event_pending(conn->read_event, EV_READ, NULL));
+
+  connection_stop_reading(conn);
+  connection_start_writing(conn);
+  connection_apply_event_changes();
+  test_assert(!event_pending(conn->read_event, EV_READ, NULL));
+  test_assert(event_pending(conn->write_event, EV_WRITE, NULL));
+
+  /* A connection that goes away with changes pending is forgotten. */
+  connection_stop_writing(conn);
+  test_assert(conn->event_change_pending);
+  connection_unregister_events(conn);
+  test_assert(!conn->event_change_pending);
+  connection_apply_event_changes();
+
+ done:
+  connection_free(conn);
+  if (fds[1] >= 0)
+    tor_close_socket(fds[1]);
+}
+
+/** Helper for test_relaycrypt and bench_relay_crypt: give <b>circ</b> relay
+ * ciphers and digests derived from <b>seed</b>, the same ones every time. */
+static void
+relaycrypt_setup_circ(or_circuit_t *circ, char seed)
+{
+  char key[CIPHER_KEY_LEN];
+  memset(key, seed, sizeof(key));
+  circ->n_crypto = crypto_create_init_cipher(key, 0);
+  circ->n_digest = crypto_new_digest_env();
+  crypto_digest_add_bytes(circ->n_digest, key, sizeof(key));
+  key[0] ^= 1;
+  circ->p_crypto = crypto_create_init_cipher(key, 1);
+  circ->p_digest = crypto_new_digest_env();
+  crypto_digest_add_bytes(circ->p_digest, key, sizeof(key));
+}
+
+/** Return true iff <b>a</b> and <b>b</b> hold the same cells, apart from
+ * their circuit IDs. */
+static int
+relaycrypt_queues_match(const cell_queue_t *a, const cell_queue_t *b)
+{
+  const packed_cell_t *ca = a->head, *cb = b->head;
+  if (a->n != b->n)
+    return 0;
+  for ( ; ca && cb; ca = ca->next, cb = cb->next) {
+    if (memcmp(ca->body+2, cb->body+2, CELL_NETWORK_SIZE-2))
+      return 0;
+  }
+  return !ca && !cb;
+}
+
+/** Make sure that relay cells crypted by the relay crypto threads come out
+ * the same, and in the same order, as relay cells crypted in the main
+ * thread, and that we don't free a circuit while the threads still have
+ * cells for it. */
+static void
+test_relaycrypt(void)
+{
+  or_options_t *options = get_options();
+  or_connection_t *conns[2];
+  or_circuit_t *circs[2];
+  circuit_t *c;
+  cell_t cell;
+  int i, r, found;
+
+  init_cell_pool();
+  conns[0] = fake_or_conn_new();
+  conns[1] = fake_or_conn_new();
+
+  /* Round 0 crypts in the main thread; round 1 uses two threads. */
+  for (r = 0; r < 2; ++r) {
+    options->RelayCryptoThreads = r ? 2 : 0;
+    circs[r] = fake_or_circ_new(conns[0], (circid_t)(r+1));
+    circuit_set_n_circid_orconn(TO_CIRCUIT(circs[r]), (circid_t)(r+1),
+                                conns[1]);
+    relaycrypt_setup_circ(circs[r], 7);
+    for (i = 0; i < 300; ++i) {
+      memset(&cell, 0, sizeof(cell));
+      cell.command = CELL_RELAY;
+      memset(cell.payload, i, sizeof(cell.payload));
+      if (i % 3 == 0) {
+        test_eq(0, circuit_receive_relay_cell(&cell, TO_CIRCUIT(circs[r]),
+                                              CELL_DIRECTION_OUT));
+      } else if (i % 3 == 1) {
+        test_eq(0, circuit_receive_relay_cell(&cell, TO_CIRCUIT(circs[r]),
+                                              CELL_DIRECTION_IN));
+      } else {
+        test_eq(0, relay_send_command_from_edge(0, TO_CIRCUIT(circs[r]),
+                                                RELAY_COMMAND_DROP, NULL, 0,
+                                                NULL));
+      }
+    }
+    if (r) {
+      test_eq(300, relaycrypt_get_n_pending());
+      test_eq(300, circs[r]->relaycrypt_n_pending);
+      test_eq(0, circs[r]->p_conn_cells.n);
+      while (relaycrypt_get_n_pending())
+        relaycrypt_process_answers();
+    }
+    test_eq(0, circs[r]->relaycrypt_n_pending);
+    test_eq(100, circs[r]->_base.n_conn_cells.n);
+    test_eq(200, circs[r]->p_conn_cells.n);
+  }
+  test_assert(relaycrypt_queues_match(&circs[0]->_base.n_conn_cells,
+                                      &circs[1]->_base.n_conn_cells));
+  test_assert(relaycrypt_queues_match(&circs[0]->p_conn_cells,
+                                      &circs[1]->p_conn_cells));
+
+  /* A marked circuit sticks around until its cells come back. */
+  memset(&cell, 0, sizeof(cell));
+  cell.command = CELL_RELAY;
+  for (i = 0; i < 10; ++i)
+    circuit_receive_relay_cell(&cell, TO_CIRCUIT(circs[1]),
+                               CELL_DIRECTION_IN);
+  circuit_mark_for_close(TO_CIRCUIT(circs[1]), END_CIRC_REASON_FINISHED);
+  test_eq(0, circuit_close_marked(100));
+  found = 0;
+  for (c = _circuit_get_global_list(); c; c = c->next)
+    found += (c == TO_CIRCUIT(circs[1]));
+  test_eq(1, found);
+  while (relaycrypt_get_n_pending())
+    relaycrypt_process_answers();
+  test_eq(0, circuit_close_marked(100));
+  for (c = _circuit_get_global_list(); c; c = c->next)
+    test_assert(c != TO_CIRCUIT(circs[1]));
+
+ done:
+  options->RelayCryptoThreads = 0;
+  relaycrypt_free_all();
+  fake_or_conns_free_all(conns, 2);
+  free_cell_pool();
+}
+
+/** Helper for test_relay_sendme and bench_relay_sendme: attach a new open
+ * exit stream with ID <b>stream_id</b>, and no socket, to <b>circ</b>. */
+static edge_connection_t *
+sendme_new_fake_stream(or_circuit_t *circ, streamid_t stream_id)
+{
+  edge_connection_t *conn =
+    TO_EDGE_CONN(connection_new(CONN_TYPE_EXIT, AF_INET));
+  conn->_base.state = EXIT_CONN_STATE_OPEN;
+  conn->_base.purpose = EXIT_PURPOSE_CONNECT;
+  conn->_base.read_event = tor_evtimer_new(tor_libevent_get_base(),
+                                           noop_event_cb, NULL);
+  conn->_base.write_event = tor_evtimer_new(tor_libevent_get_base(),
+                                            noop_event_cb, NULL);
+  conn->stream_id = stream_id;
+  conn->package_window = STREAMWINDOW_START;
+  conn->deliver_window = STREAMWINDOW_START;
+  conn->on_circuit = TO_CIRCUIT(circ);
+  conn->next_stream = circ->n_streams;
+  circ->n_streams = conn;
+  connection_start_reading(TO_CONN(conn));
+  return conn;
+}
+
+/** Helper for test_relay_sendme and bench_relay_sendme: act as if
+ * <b>circ</b> had just received a relay cell with command <b>command</b>
+ * for stream <b>stream_id</b>, carrying <b>len</b> bytes of data, from the
+ * client side.  Return what circuit_receive_crypted_relay_cell() returns. */
+static int
+sendme_deliver_cell(or_circuit_t *circ, uint8_t command,
+                    streamid_t stream_id, size_t len)
+{
+  cell_t cell;
+  relay_header_t rh;
+  memset(&cell, 0, sizeof(cell));
+  memset(&rh, 0, sizeof(rh));
+  cell.command = CELL_RELAY;
+  rh.command = command;
+  rh.stream_id = stream_id;
+  rh.length = len;
+  relay_header_pack(cell.payload, &rh);
+  return circuit_receive_crypted_relay_cell(&cell, TO_CIRCUIT(circ),
+                                            CELL_DIRECTION_OUT, NULL, 1);
+}
+
+/** Make sure that when a circuit's package window empties, only the streams
+ * that actually had something to package stop reading, that a
+ * circuit-level sendme resumes exactly those streams, and that we send
+ * sendmes for delivered data once per batch of cells rather than checking
+ * after every cell. */
+static void
+test_relay_sendme(void)
+{
+  const int n_streams = 100;
+  or_connection_t *p_conn;
+  or_circuit_t *circ;
+  edge_connection_t *streams[100];
+  char data[RELAY_PAYLOAD_SIZE*2];
+  int i, n_queued;
+
+  init_cell_pool();
+  memset(data, 'x', sizeof(data));
+  p_conn = fake_or_conn_new();
+  circ = fake_or_circ_new(p_conn, 1);
+  relaycrypt_setup_circ(circ, 3);
+  for (i = 0; i < n_streams; ++i)
+    streams[i] = sendme_new_fake_stream(circ, (streamid_t)(i+1));
+
+  /* Twenty streams have two cells each, but the window only has room for
+   * ten cells: the first five streams get to send, and the next fifteen
+   * stop reading.  Nobody else is touched. */
+  circ->_base.package_window = 10;
+  for (i = 0; i < 20; ++i) {
+    write_to_buf(data, sizeof(data), TO_CONN(streams[i])->inbuf);
+    test_eq(0, connection_edge_package_raw_inbuf(streams[i], 1));
+  }
+  test_eq(0, circ->_base.package_window);
+  test_eq(10, circ->p_conn_cells.n);
+  test_assert(circ->_base.blocked_streams);
+  test_eq(15, smartlist_len(circ->_base.blocked_streams));
+  for (i = 0; i < n_streams; ++i) {
+    int blocked = (i >= 5 && i < 20);
+    test_eq(blocked, streams[i]->edge_blocked_on_circ_window);
+    test_eq(!blocked, connection_is_reading(TO_CONN(streams[i])));
+  }
+  test_eq_ptr(streams[5], smartlist_get(circ->_base.blocked_streams, 0));
+
+  /* A stream that goes away stops waiting. */
+  circuit_detach_stream(TO_CIRCUIT(circ), streams[19]);
+  test_eq(14, smartlist_len(circ->_base.blocked_streams));
+  test_assert(!streams[19]->edge_blocked_on_circ_window);
+  buf_clear(TO_CONN(streams[19])->inbuf);
+
+  /* A circuit-level sendme resumes the streams that were waiting, in order,
+   * until the window empties again.  Give each of them ten cells' worth,
+   * so that ten of them get to send everything. */
+  for (i = 5; i < 19; ++i) {
+    int j;
+    for (j = 0; j < 4; ++j)
+      write_to_buf(data, sizeof(data), TO_CONN(streams[i])->inbuf);
+  }
+  test_eq(0, sendme_deliver_cell(circ, RELAY_COMMAND_SENDME, 0, 0));
+  test_eq(0, circ->_base.package_window);
+  test_eq(110, circ->p_conn_cells.n);
+  test_eq(4, smartlist_len(circ->_base.blocked_streams));
+  test_eq_ptr(streams[15], smartlist_get(circ->_base.blocked_streams, 0));
+  for (i = 5; i < 15; ++i) {
+    test_assert(!streams[i]->edge_blocked_on_circ_window);
+    test_assert(connection_is_reading(TO_CONN(streams[i])));
+    test_eq(0, buf_datalen(TO_CONN(streams[i])->inbuf));
+  }
+  for (i = 15; i < 19; ++i) {
+    test_assert(streams[i]->edge_blocked_on_circ_window);
+    test_assert(!connection_is_reading(TO_CONN(streams[i])));
+  }
+  /* Streams that never had anything to send kept reading all along. */
+  for (i = 20; i < n_streams; ++i)
+    test_assert(connection_is_reading(TO_CONN(streams[i])));
+
+  /* Data cells only mark the circuit and stream; the sendmes go out when
+   * we flush. */
+  n_queued = circ->p_conn_cells.n;
+  for (i = 0; i < CIRCWINDOW_INCREMENT; ++i)
+    test_eq(0, sendme_deliver_cell(circ, RELAY_COMMAND_DATA,
+                                   streams[0]->stream_id, 1));
+  test_eq(CIRCWINDOW_START - CIRCWINDOW_INCREMENT,
+          circ->_base.deliver_window);
+  test_eq(STREAMWINDOW_START - CIRCWINDOW_INCREMENT,
+          streams[0]->deliver_window);
+  test_assert(circ->_base.sendme_pending);
+  test_assert(streams[0]->sendme_pending);
+  test_eq(n_queued, circ->p_conn_cells.n);
+  relay_flush_pending_sendmes();
+  test_assert(!circ->_base.sendme_pending);
+  test_assert(!streams[0]->sendme_pending);
+  test_eq(CIRCWINDOW_START, circ->_base.deliver_window);
+  test_eq(STREAMWINDOW_START, streams[0]->deliver_window);
+  /* One circuit-level sendme, and two stream-level ones. */
+  test_eq(n_queued + 3, circ->p_conn_cells.n);
+
+  /* Circuits and streams that go away with sendmes pending are forgotten
+   * when they're freed. */
+  test_eq(0, sendme_deliver_cell(circ, RELAY_COMMAND_DATA,
+                                 streams[1]->stream_id, 1));
+  test_assert(circ->_base.sendme_pending);
+  test_assert(streams[1]->sendme_pending);
+
+ done:
+  fake_or_conns_free_all(&p_conn, 1);
+  for (i = 0; i < n_streams; ++i)
+    connection_free(TO_CONN(streams[i]));
+  relay_free_all();
+  free_cell_pool();
+}
+
+/** Make sure that when the connection toward the origin closes while
+ * streams are waiting on the circuit's window, including streams that a
+ * circuit-level sendme resumed and that blocked again, none of them is left
+ * waiting on the closed circuit. */
+static void
+test_relay_sendme_close(void)
+{
+  const int n_streams = 10, cells_per_stream = 20;
+  or_connection_t *p_conn;
+  or_circuit_t *circ;
+  edge_connection_t *streams[10];
+  char data[RELAY_PAYLOAD_SIZE];
+  int i, j;
+
+  init_cell_pool();
+  memset(data, 'x', sizeof(data));
+  p_conn = fake_or_conn_new();
+  circ = fake_or_circ_new(p_conn, 1);
+  relaycrypt_setup_circ(circ, 3);
+  for (i = 0; i < n_streams; ++i)
+    streams[i] = sendme_new_fake_stream(circ, (streamid_t)(i+1));
+  /* There's no main loop here to close streams that get marked, so keep
+   * circuit_mark_for_close() from trying. */
+  circ->n_streams = NULL;
+
+  /* Every stream has cells to send, but the window is empty. */
+  circ->_base.package_window = 0;
+  for (i = 0; i < n_streams; ++i) {
+    for (j = 0; j < cells_per_stream; ++j)
+      write_to_buf(data, sizeof(data), TO_CONN(streams[i])->inbuf);
+    test_eq(0, connection_edge_package_raw_inbuf(streams[i], 1));
+  }
+  test_eq(n_streams, smartlist_len(circ->_base.blocked_streams));
+
+  /* A sendme lets the first half of the streams drain the window. */
+  test_eq(0, sendme_deliver_cell(circ, RELAY_COMMAND_SENDME, 0, 0));
+  test_eq(0, circ->_base.package_window);
+  test_eq(n_streams/2, smartlist_len(circ->_base.blocked_streams));
+
+  /* Then the connection closes, and takes the circuit with it. */
+  circuit_unlink_all_from_or_conn(p_conn, END_CIRC_REASON_OR_CONN_CLOSED);
+  test_assert(circ->_base.marked_for_close);
+  test_assert(!circ->_base.blocked_streams);
+  for (i = 0; i < n_streams; ++i)
+    test_assert(!streams[i]->edge_blocked_on_circ_window);
+
+ done:
+  fake_or_conns_free_all(&p_conn, 1);
+  for (i = 0; i < n_streams; ++i)
+    connection_free(TO_CONN(streams[i]));
+  relay_free_all();
+  free_cell_pool();
+}
+
+/** Helper for test_relay_package_data: return a new origin circuit with
+ * three hops, whose keys are derived from <b>seed</b>, the same ones every
+ * time, writing to <b>n_conn</b> with circuit ID <b>id</b>. */
+static origin_circuit_t *
+package_new_origin_circ(char seed, or_connection_t *n_conn, circid_t id)
+{
+  origin_circuit_t *circ = origin_circuit_new();
+  char keys[CPATH_KEY_MATERIAL_LEN];
+  int i;
+  circ->_base.purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  circ->remaining_relay_early_cells = MAX_RELAY_EARLY_CELLS_PER_CIRCUIT;
+  for (i = 0; i < 3; ++i) {
+    crypt_path_t *hop = tor_malloc_zero(sizeof(crypt_path_t));
+    hop->magic = CRYPT_PATH_MAGIC;
+    hop->state = CPATH_STATE_OPEN;
+    hop->package_window = CIRCWINDOW_START;
+    hop->deliver_window = CIRCWINDOW_START;
+    memset(keys, seed+i, sizeof(keys));
+    circuit_init_cpath_crypto(hop, keys, 0);
+    onion_append_to_cpath(&circ->cpath, hop);
+  }
+  circuit_set_n_circid_orconn(TO_CIRCUIT(circ), id, n_conn);
+  return circ;
+}
+
+/** Make sure that the data cells we build straight from an edge
+ * connection's inbuf come out just like the ones we build by fetching the
+ * data and calling relay_send_command_from_edge(), both at an exit and at
+ * the origin. */
+static void
+test_relay_package_data(void)
+{
+  or_connection_t *or_conn;
+  or_circuit_t *or_circs[2];
+  origin_circuit_t *origin_circs[2];
+  edge_connection_t *exit_conn = NULL, *ap_conn = NULL;
+  char data[RELAY_PAYLOAD_SIZE*3+100], *cp;
+  size_t n;
+
+  if (!tor_libevent_get_base())
+    tor_libevent_initialize();
+  init_cell_pool();
+  crypto_rand(data, sizeof(data));
+  or_conn = fake_or_conn_new();
+
+  /* At an exit, toward the origin. */
+  or_circs[0] = or_circuit_new(1, or_conn);
+  or_circs[1] = or_circuit_new(2, or_conn);
+  or_circs[0]->_base.purpose = or_circs[1]->_base.purpose = CIRCUIT_PURPOSE_OR;
+  relaycrypt_setup_circ(or_circs[0], 5);
+  relaycrypt_setup_circ(or_circs[1], 5);
+  exit_conn = sendme_new_fake_stream(or_circs[0], 7);
+  write_to_buf(data, sizeof(data), TO_CONN(exit_conn)->inbuf);
+  test_eq(0, connection_edge_package_raw_inbuf(exit_conn, 1));
+  test_eq(0, buf_datalen(TO_CONN(exit_conn)->inbuf));
+  for (cp = data; cp < data+sizeof(data); cp += n) {
+    n = data+sizeof(data)-cp;
+    if (n > RELAY_PAYLOAD_SIZE)
+      n = RELAY_PAYLOAD_SIZE;
+    test_eq(0, relay_send_command_from_edge(7, TO_CIRCUIT(or_circs[1]),
+                                            RELAY_COMMAND_DATA, cp, n,
+                                            NULL));
+  }
+  test_eq(4, or_circs[0]->p_conn_cells.n);
+  test_assert(relaycrypt_queues_match(&or_circs[0]->p_conn_cells,
+                                      &or_circs[1]->p_conn_cells));
+
+  /* At the origin, through three hops. */
+  origin_circs[0] = package_new_origin_circ(9, or_conn, 3);
+  origin_circs[1] = package_new_origin_circ(9, or_conn, 4);
+  ap_conn = TO_EDGE_CONN(connection_new(CONN_TYPE_AP, AF_INET));
+  ap_conn->_base.state = AP_CONN_STATE_OPEN;
+  ap_conn->_base.read_event = tor_evtimer_new(tor_libevent_get_base(),
+                                              noop_event_cb, NULL);
+  ap_conn->stream_id = 7;
+  ap_conn->package_window = STREAMWINDOW_START;
+  ap_conn->cpath_layer = origin_circs[0]->cpath->prev;
+  ap_conn->on_circuit = TO_CIRCUIT(origin_circs[0]);
+  origin_circs[0]->p_streams = ap_conn;
+  write_to_buf(data, sizeof(data), TO_CONN(ap_conn)->inbuf);
+  test_eq(0, connection_edge_package_raw_inbuf(ap_conn, 1));
+  test_eq(0, buf_datalen(TO_CONN(ap_conn)->inbuf));
+  for (cp = data; cp < data+sizeof(data); cp += n) {
+    n = data+sizeof(data)-cp;
+    if (n > RELAY_PAYLOAD_SIZE)
+      n = RELAY_PAYLOAD_SIZE;
+    test_eq(0, relay_send_command_from_edge(7, TO_CIRCUIT(origin_circs[1]),
+                                            RELAY_COMMAND_DATA, cp, n,
+                                            origin_circs[1]->cpath->prev));
+  }
+  test_eq(4, origin_circs[0]->_base.n_conn_cells.n);
+  test_assert(relaycrypt_queues_match(&origin_circs[0]->_base.n_conn_cells,
+                                      &origin_circs[1]->_base.n_conn_cells));
+  /* Data to the last hop goes in relay_early cells while they last. */
+  test_eq(CELL_RELAY_EARLY,
+          (uint8_t)origin_circs[0]->_base.n_conn_cells.head->body[2]);
+  test_eq(MAX_RELAY_EARLY_CELLS_PER_CIRCUIT - 4,
+          origin_circs[0]->remaining_relay_early_cells);
+
+ done:
+  circuit_free_all();
+  if (exit_conn)
+    connection_free(TO_CONN(exit_conn));
+  if (ap_conn)
+    connection_free(TO_CONN(ap_conn));
+  or_conn->_base.linked = 0;
+  connection_free(TO_CONN(or_conn));
+  free_cell_pool();
+}
+
+/** Helper for test_cell_scheduler: return how many cells are waiting on
+ * <b>circ</b>'s queue toward its previous hop. */
+static int
+sched_queued(or_circuit_t *circ)
+{
+  return circ->p_conn_cells.n;
+}
+
+/** Make sure that the cell scheduler fills each connection's outbuf as far
+ * as its allowance goes and no further; that with cell_ewma it serves the
+ * circuit that has sent the fewest cells lately first, and shares the
+ * cells out evenly among circuits that are equally busy; and that it
+ * shares them out round-robin when cell_ewma is off. */
+static void
+test_cell_scheduler(void)
+{
+  or_options_t *options = get_options();
+  double old_halflife = options->CircuitPriorityHalflife;
+  or_connection_t *conns[3];
+  or_circuit_t *circs[3][4];
+  cell_flush_time_t ft;
+  cell_t cell;
+  char *full = NULL;
+  int i, j, n, allowance;
+
+  init_cell_pool();
+  options->CircuitPriorityHalflife = 30;
+  cell_ewma_set_scale_factor(options, NULL);
+  memset(&cell, 0, sizeof(cell));
+  cell.command = CELL_RELAY;
+
+  for (i = 0; i < 3; ++i) {
+    conns[i] = fake_or_conn_new();
+    for (j = 0; j < 4; ++j) {
+      circs[i][j] = fake_or_circ_new(conns[i], (circid_t)(j+1));
+      if (i == 0 && j == 0) {
+        /* This one has been busy lately. */
+        circs[i][j]->p_cell_ewma.cell_count = 1000.0;
+      }
+      for (n = 0; n < 100; ++n)
+        append_cell_to_circuit_queue(TO_CIRCUIT(circs[i][j]), conns[i],
+                                     &cell, CELL_DIRECTION_IN);
+    }
+  }
+  /* With no socket to ask, each connection gets one outbuf's worth; the
+   * last connection's outbuf is already full. */
+  allowance = connection_or_get_cell_allowance(conns[0], time(NULL));
+  test_assert(allowance >= 12);
+  full = tor_malloc_zero(allowance*CELL_NETWORK_SIZE);
+  write_to_buf(full, allowance*CELL_NETWORK_SIZE, conns[2]->_base.outbuf);
+  test_eq(0, connection_or_get_cell_allowance(conns[2], time(NULL)));
+
+  scheduler_run();
+  for (i = 0; i < 2; ++i)
+    test_eq(allowance*CELL_NETWORK_SIZE,
+            buf_datalen(conns[i]->_base.outbuf));
+  test_eq(allowance*CELL_NETWORK_SIZE, buf_datalen(conns[2]->_base.outbuf));
+  for (j = 0; j < 4; ++j)
+    test_eq(100, sched_queued(circs[2][j]));
+  /* The busy circuit waits while the others catch up... */
+  test_eq(100, sched_queued(circs[0][0]));
+  n = 0;
+  for (j = 1; j < 4; ++j) {
+    int sent = 100 - sched_queued(circs[0][j]);
+    test_assert(sent == allowance/3 || sent == allowance/3 + 1);
+    n += sent;
+  }
+  test_eq(allowance, n);
+  cell_flush_time_init(&ft);
+  test_assert(connection_or_next_circuit_ewma(conns[0], &ft) < 1000.0);
+  /* ... and circuits that are equally busy take turns. */
+  for (j = 0; j < 4; ++j)
+    test_eq(100 - allowance/4, sched_queued(circs[1][j]));
+
+  /* Without cell_ewma, every circuit takes its turn. */
+  options->CircuitPriorityHalflife = 0;
+  cell_ewma_set_scale_factor(options, NULL);
+  cell_flush_time_init(&ft);
+  test_eq(-1.0, connection_or_next_circuit_ewma(conns[0], &ft));
+  for (i = 0; i < 3; ++i) {
+    buf_clear(conns[i]->_base.outbuf);
+    conns[i]->_base.outbuf_flushlen = 0;
+    connection_or_flushed_some(conns[i]);
+  }
+  scheduler_run();
+  test_eq(100 - allowance/4, sched_queued(circs[0][0]));
+  for (j = 0; j < 4; ++j)
+    test_eq(100 - allowance/4, sched_queued(circs[2][j]));
+
+ done:
+  options->CircuitPriorityHalflife = old_halflife;
+  cell_ewma_set_scale_factor(options, NULL);
+  scheduler_free_all();
+  fake_or_conns_free_all(conns, 3);
+  tor_free(full);
+  free_cell_pool();
+}
+
+/** Run a benchmark of the cell scheduler: many OR connections, each with
+ * several busy circuits, whose outbufs drain at different speeds as if
+ * their peers were on links of different speeds.  (Run with --notice to
+ * see the cell queue latency histogram.) */
+static void
+bench_cell_scheduler(void)
+{
+  const int n_conns = 200;
+  const int circs_per_conn = 8;
+  const int rounds = 500;
+  or_connection_t **conns;
+  or_circuit_t **circs;
+  char *drainbuf;
+  cell_t cell;
+  struct timeval start, end;
+  uint64_t usec = 0, n_sent = 0;
+  int i, j, r;
+
+  init_cell_pool();
+  memset(&cell, 0, sizeof(cell));
+  cell.command = CELL_RELAY;
+  drainbuf = tor_malloc(64*CELL_NETWORK_SIZE);
+
+  conns = tor_malloc_zero(sizeof(or_connection_t*)*n_conns);
+  circs = tor_malloc_zero(sizeof(or_circuit_t*)*n_conns*circs_per_conn);
+  for (i = 0; i < n_conns; ++i) {
+    conns[i] = fake_or_conn_new();
+    for (j = 0; j < circs_per_conn; ++j)
+      circs[i*circs_per_conn+j] = fake_or_circ_new(conns[i], (circid_t)(j+1));
+  }
+
+  for (r = 0; r < rounds; ++r) {
+    /* Top up every circuit's queue, as edge streams would. */
+    for (i = 0; i < n_conns*circs_per_conn; ++i) {
+      while (circs[i]->p_conn_cells.n < 32)
+        append_cell_to_circuit_queue(TO_CIRCUIT(circs[i]), circs[i]->p_conn,
+                                     &cell, CELL_DIRECTION_IN);
+    }
+    /* Peer i takes 64, 32, 16, or 8 cells per round. */
+    for (i = 0; i < n_conns; ++i) {
+      buf_t *outbuf = conns[i]->_base.outbuf;
+      size_t n = (64 >> (i%4)) * CELL_NETWORK_SIZE;
+      if (n > buf_datalen(outbuf))
+        n = buf_datalen(outbuf);
+      fetch_from_buf(drainbuf, n, outbuf);
+      conns[i]->_base.outbuf_flushlen = 0;
+      n_sent += n / CELL_NETWORK_SIZE;
+      connection_or_flushed_some(conns[i]);
+    }
+    tor_gettimeofday(&start);
+    scheduler_run();
+    tor_gettimeofday(&end);
+    usec += tv_udiff(&start, &end);
+  }
+  printf("%d conns, %d circuits each: "U64_FORMAT" cells sent; "
+         "scheduled "U64_FORMAT" cells/sec\n", n_conns, circs_per_conn,
+         U64_PRINTF_ARG(n_sent),
+         U64_PRINTF_ARG(n_sent*1000000/(usec?usec:1)));
+  scheduler_log_stats(LOG_NOTICE);
+
+  scheduler_free_all();
+  fake_or_conns_free_all(conns, n_conns);
+  tor_free(conns);
+  tor_free(circs);
+  tor_free(drainbuf);
+  free_cell_pool();
+}
+
+/** Run a benchmark of closing OR connections while many other circuits
+ * exist.  Each closing connection has the same number of circuits; only the
+ * number of circuits on other connections grows. */
+static void
+bench_orconn_close(void)
+{
+  const int n_closing = 200;
+  const int circs_per_conn = 10;
+  const int n_other_conns = 100;
+  or_connection_t **conns;
+  struct timeval start, end;
+  int n_other, i, j;
+
+  conns = tor_malloc_zero(sizeof(or_connection_t*)*(n_closing+n_other_conns));
+  for (n_other = 1000; n_other <= 100000; n_other *= 10) {
+    for (i = 0; i < n_closing+n_other_conns; ++i)
+      conns[i] = fake_or_conn_new();
+    for (i = 0; i < n_other_conns; ++i) {
+      for (j = 0; j < n_other/n_other_conns; ++j)
+        fake_or_circ_new(conns[n_closing+i], j+1);
+    }
+    for (i = 0; i < n_closing; ++i) {
+      for (j = 0; j < circs_per_conn; ++j)
+        fake_or_circ_new(conns[i], j+1);
+    }
+
+    tor_gettimeofday(&start);
+    for (i = 0; i < n_closing; ++i)
+      circuit_unlink_all_from_or_conn(conns[i],
+                                      END_CIRC_REASON_OR_CONN_CLOSED);
+    tor_gettimeofday(&end);
+    printf("%d other circuits: closing a connection with %d circuits "
+           "takes %.2f usec\n", n_other, circs_per_conn,
+           tv_udiff(&start, &end) / (double)n_closing);
+
+    fake_or_conns_free_all(conns, n_closing+n_other_conns);
+  }
+  tor_free(conns);
+}
+
+/** Run a benchmark of looking up circuits by circuit ID and connection, the
+ * way we do for every cell that arrives, with cells arriving on circuits
+ * chosen at random. */
+static void
+bench_circid_lookup(void)
+{
+  const int n_conns = 100, iters = 10000000;
+  or_connection_t *conns[100];
+  struct timeval start, end;
+  uint32_t x = 1;
+  int n_circs, i, n_found;
+  uint64_t usec;
+
+  for (i = 0; i < n_conns; ++i)
+    conns[i] = fake_or_conn_new();
+  for (n_circs = 10000; n_circs <= 100000; n_circs *= 10) {
+    /* Circuit k on each connection gets an ID of (k+1)*40503 mod 2^16, so
+     * that the IDs are spread out and distinct. */
+    for (i = 0; i < n_circs; ++i)
+      fake_or_circ_new(conns[i%n_conns], (circid_t)((i/n_conns+1)*40503));
+
+    n_found = 0;
+    tor_gettimeofday(&start);
+    for (i = 0; i < iters; ++i) {
+      int c;
+      x = x*1103515245 + 12345;
+      c = (int)((x >> 8) % n_circs);
+      if (circuit_get_by_circid_orconn((circid_t)((c/n_conns+1)*40503),
+                                       conns[c%n_conns]))
+        ++n_found;
+    }
+    tor_gettimeofday(&end);
+    usec = tv_udiff(&start, &end);
+    printf("%d circuits: "U64_FORMAT" lookups/sec (%d found)\n", n_circs,
+           U64_PRINTF_ARG(((uint64_t)iters)*1000000/(usec?usec:1)), n_found);
+
+    circuit_free_all();
+  }
+  fake_or_conns_free_all(conns, n_conns);
+}
+
+/** Run a benchmark of relaying cells through many circuits, with their
+ * relay crypto done in the main thread, and in 1, 2, and 4 relay crypto
+ * threads.  The main thread keeps feeding cells and flushing the crypted
+ * ones onto outbufs, as it would for a busy relay. */
+static void
+bench_relay_crypt(void)
+{
+  const int n_conns = 10, circs_per_conn = 100, n_cells = 200000;
+  const int n_threads[] = { 0, 1, 2, 4 };
+  or_options_t *options = get_options();
+  or_connection_t *conns[10];
+  or_circuit_t **circs;
+  cell_t cell;
+  struct timeval start, end;
+  cell_flush_time_t ft;
+  uint64_t usec;
+  int i, j, k;
+
+  init_cell_pool();
+  for (i = 0; i < n_conns; ++i)
+    conns[i] = fake_or_conn_new();
+  circs = tor_malloc_zero(sizeof(or_circuit_t*)*n_conns*circs_per_conn);
+  memset(&cell, 0, sizeof(cell));
+  cell.command = CELL_RELAY;
+  memset(cell.payload, 0xff, sizeof(cell.payload));
+
+  for (k = 0; k < (int)(sizeof(n_threads)/sizeof(int)); ++k) {
+    options->RelayCryptoThreads = n_threads[k];
+    for (i = 0; i < n_conns*circs_per_conn; ++i) {
+      circid_t id = (circid_t)(i/n_conns+1);
+      circs[i] = fake_or_circ_new(conns[i%n_conns], id);
+      circuit_set_n_circid_orconn(TO_CIRCUIT(circs[i]), id,
+                                  conns[(i+1)%n_conns]);
+      relaycrypt_setup_circ(circs[i], (char)i);
+    }
+
+    tor_gettimeofday(&start);
+    for (i = 0; i < n_cells; ++i) {
+      cell_t c = cell;
+      circuit_receive_relay_cell(&c,
+                     TO_CIRCUIT(circs[i % (n_conns*circs_per_conn)]),
+                     CELL_DIRECTION_OUT);
+      if (i % 1000 == 999 || i == n_cells-1) {
+        if (i == n_cells-1) {
+          while (relaycrypt_get_n_pending())
+            relaycrypt_process_answers();
+        } else {
+          relaycrypt_process_answers();
+        }
+        for (j = 0; j < n_conns; ++j) {
+          cell_flush_time_init(&ft);
+          while (connection_or_flush_from_first_active_circuit(conns[j],
+                                                               1000, &ft))
+            ;
+          buf_clear(conns[j]->_base.outbuf);
+        }
+      }
+    }
+    tor_gettimeofday(&end);
+    usec = tv_udiff(&start, &end);
+    printf("%d relay crypto thread(s): "U64_FORMAT" cells/sec\n",
+           n_threads[k],
+           U64_PRINTF_ARG(((uint64_t)n_cells)*1000000/(usec?usec:1)));
+
+    relaycrypt_free_all();
+    circuit_free_all();
+  }
+  options->RelayCryptoThreads = 0;
+
+  fake_or_conns_free_all(conns, n_conns);
+  tor_free(circs);
+  free_cell_pool();
+}
+
+/** Run a benchmark of window bookkeeping on a circuit with 100 streams, of
+ * which only a few are busy: the busy streams keep running the circuit's
+ * package window dry, and a circuit-level sendme keeps opening it again,
+ * while data cells arrive for all the streams.  Report how many streams
+ * stop reading each time the window empties, how long handling each sendme
+ * takes (including packaging the cells it lets through), and how long each
+ * delivered data cell takes. */
+static void
+bench_relay_sendme(void)
+{
+  const int n_streams = 100, n_busy = 4, rounds = 20000;
+  or_connection_t *p_conn;
+  or_circuit_t *circ;
+  edge_connection_t *streams[100];
+  char data[RELAY_PAYLOAD_SIZE];
+  struct timeval start, end;
+  cell_flush_time_t ft;
+  uint64_t sendme_usec = 0, data_usec = 0, n_stopped = 0;
+  int i, j, r;
+
+  init_cell_pool();
+  memset(data, 'x', sizeof(data));
+  p_conn = fake_or_conn_new();
+  circ = fake_or_circ_new(p_conn, 1);
+  relaycrypt_setup_circ(circ, 3);
+  for (i = 0; i < n_streams; ++i)
+    streams[i] = sendme_new_fake_stream(circ, (streamid_t)(i+1));
+
+  /* Every round, the busy streams read one window's worth of cells, but
+   * the window is always one cell short, so the last of them has to wait
+   * for the sendme. */
+  circ->_base.package_window = CIRCWINDOW_INCREMENT - 1;
+  for (r = 0; r < rounds; ++r) {
+    for (i = 0; i < n_busy; ++i) {
+      edge_connection_t *conn = streams[(r*n_busy+i) % n_streams];
+      for (j = 0; j < CIRCWINDOW_INCREMENT/n_busy; ++j)
+        write_to_buf(data, sizeof(data), TO_CONN(conn)->inbuf);
+      conn->package_window = STREAMWINDOW_START;
+      connection_edge_package_raw_inbuf(conn, 1);
+    }
+    for (i = 0; i < n_streams; ++i)
+      n_stopped += !connection_is_reading(TO_CONN(streams[i]));
+    tor_gettimeofday(&start);
+    sendme_deliver_cell(circ, RELAY_COMMAND_SENDME, 0, 0);
+    tor_gettimeofday(&end);
+    sendme_usec += tv_udiff(&start, &end);
+
+    /* And a window's worth of data comes back, spread over every stream. */
+    tor_gettimeofday(&start);
+    for (i = 0; i < CIRCWINDOW_INCREMENT; ++i)
+      sendme_deliver_cell(circ, RELAY_COMMAND_DATA,
+                          streams[i % n_streams]->stream_id, 1);
+    relay_flush_pending_sendmes();
+    tor_gettimeofday(&end);
+    data_usec += tv_udiff(&start, &end);
+
+    cell_flush_time_init(&ft);
+    while (connection_or_flush_from_first_active_circuit(p_conn, 1000, &ft))
+      ;
+    buf_clear(p_conn->_base.outbuf);
+    for (i = 0; i < n_streams; ++i) {
+      buf_clear(TO_CONN(streams[i])->outbuf);
+      TO_CONN(streams[i])->outbuf_flushlen = 0;
+    }
+  }
+  printf("%d streams, %d busy: %.1f streams stopped per empty window, "
+         "%.2f usec per circuit sendme, %.0f nsec per data cell\n",
+         n_streams, n_busy, ((double)n_stopped)/rounds,
+         ((double)sendme_usec)/rounds,
+         ((double)data_usec)*1000/rounds/CIRCWINDOW_INCREMENT);
+
+  fake_or_conns_free_all(&p_conn, 1);
+  for (i = 0; i < n_streams; ++i)
+    connection_free(TO_CONN(streams[i]));
+  relay_free_all();
+  free_cell_pool();
+}
+
+/** Run a benchmark of packaging data from an exit stream's inbuf into
+ * relay cells: once by fetching each cell's worth of data and calling
+ * connection_edge_send_command(), as we used to, and once with
+ * connection_edge_package_raw_inbuf(), which builds the cells right in the
+ * packed cells we queue. */
+static void
+bench_edge_package(void)
+{
+  const int n_cells = 200000, cells_per_round = 100;
+  or_connection_t *p_conn;
+  or_circuit_t *circ;
+  edge_connection_t *conn;
+  char data[RELAY_PAYLOAD_SIZE*100];
+  char payload[RELAY_PAYLOAD_SIZE];
+  cell_flush_time_t ft;
+  struct timeval start, end;
+  uint64_t usec;
+  int i, r, direct;
+
+  if (!tor_libevent_get_base())
+    tor_libevent_initialize();
+  init_cell_pool();
+  memset(data, 'x', sizeof(data));
+  p_conn = fake_or_conn_new();
+  circ = or_circuit_new(1, p_conn);
+  circ->_base.purpose = CIRCUIT_PURPOSE_OR;
+  relaycrypt_setup_circ(circ, 3);
+  conn = sendme_new_fake_stream(circ, 1);
+
+  for (direct = 0; direct < 2; ++direct) {
+    tor_gettimeofday(&start);
+    for (r = 0; r < n_cells / cells_per_round; ++r) {
+      write_to_buf(data, sizeof(data), TO_CONN(conn)->inbuf);
+      circ->_base.package_window = CIRCWINDOW_START;
+      conn->package_window = STREAMWINDOW_START;
+      if (direct) {
+        connection_edge_package_raw_inbuf(conn, 1);
+      } else {
+        for (i = 0; i < cells_per_round; ++i) {
+          connection_fetch_from_buf(payload, sizeof(payload), TO_CONN(conn));
+          connection_edge_send_command(conn, RELAY_COMMAND_DATA,
+                                       payload, sizeof(payload));
+        }
+      }
+      cell_flush_time_init(&ft);
+      while (connection_or_flush_from_first_active_circuit(p_conn, 1000, &ft))
+        ;
+      buf_clear(p_conn->_base.outbuf);
+    }
+    tor_gettimeofday(&end);
+    usec = tv_udiff(&start, &end);
+    printf("%s: "U64_FORMAT" cells/sec\n",
+           direct ? "into packed cells" : "fetch and send",
+           U64_PRINTF_ARG(((uint64_t)n_cells)*1000000/(usec?usec:1)));
+  }
+
+  circuit_free_all();
+  connection_free(TO_CONN(conn));
+  p_conn->_base.linked = 0;
+  connection_free(TO_CONN(p_conn));
+  free_cell_pool();
+}
+
+#ifdef TOR_IS_MULTITHREADED
+/** State shared by bench_spsc_ring and its producer thread. */
+typedef struct bench_ring_state_t {
+  spsc_ring_t *ring; /**< The ring under test. */
+  uint64_t *stamps; /**< When did the producer push each item? */
+  int n_items; /**< How many items to push. */
+  int batch_size; /**< How many items to push at once. */
+} bench_ring_state_t;
+
+/** Helper for bench_spsc_ring: push every item in <b>arg</b>'s stamps
+ * array onto its ring, noting the time as we go. */
+static void
+bench_spsc_ring_producer(void *arg)
+{
+  bench_ring_state_t *st = arg;
+  void *batch[64];
+  int i, j, n;
+
+  for (i = 0; i < st->n_items; i += n) {
+    uint64_t now = tor_gettime_monotonic_usec();
+    n = st->batch_size;
+    if (n > st->n_items - i)
+      n = st->n_items - i;
+    for (j = 0; j < n; ++j) {
+      st->stamps[i+j] = now;
+      batch[j] = &st->stamps[i+j];
+    }
+    j = 0;
+    while (j < n)
+      j += spsc_ring_push_batch(st->ring, batch+j, n-j);
+  }
+  spawn_exit();
+}
+#endif
+
+/** Run a benchmark of handing items from one thread to another over an
+ * spsc_ring_t, one at a time and in batches, and report the throughput and
+ * how long items sat on the ring.  (On a machine with a single CPU, the
+ * latency mostly measures the scheduler's time slice.) */
+static void
+bench_spsc_ring(void)
+{
+#ifdef TOR_IS_MULTITHREADED
+  const int n_items = 200000;
+  const int batch_sizes[] = { 1, 8, 64 };
+  bench_ring_state_t st;
+  void *items[64];
+  struct timeval start, end;
+  uint64_t usec, wait, wait_total, wait_max;
+  int k, i, n, got;
+
+  st.ring = spsc_ring_new(1024);
+  st.stamps = tor_malloc(sizeof(uint64_t)*n_items);
+  st.n_items = n_items;
+  for (k = 0; k < (int)(sizeof(batch_sizes)/sizeof(int)); ++k) {
+    st.batch_size = batch_sizes[k];
+    wait_total = wait_max = 0;
+    got = 0;
+    tor_gettimeofday(&start);
+    spawn_func(bench_spsc_ring_producer, &st);
+    while (got < n_items) {
+      n = spsc_ring_pop_batch(st.ring, items, batch_sizes[k]);
+      if (!n)
+        continue;
+      usec = tor_gettime_monotonic_usec();
+      for (i = 0; i < n; ++i) {
+        wait = usec - *(uint64_t*)items[i];
+        wait_total += wait;
+        if (wait > wait_max)
+          wait_max = wait;
+      }
+      got += n;
+    }
+    tor_gettimeofday(&end);
+    usec = tv_udiff(&start, &end);
+    printf("batches of %d: "U64_FORMAT" items/sec; waited %.2f usec on "
+           "average, "U64_FORMAT" usec at most\n", batch_sizes[k],
+           U64_PRINTF_ARG(((uint64_t)n_items)*1000000/(usec?usec:1)),
+           ((double)wait_total)/n_items, U64_PRINTF_ARG(wait_max));
+  }
+  spsc_ring_free(st.ring);
+  tor_free(st.stamps);
+#endif
+}
+
+/** Run benchmarks comparing malloc, mp_pool_t, and mp_magazine_t for
+ * allocating and releasing cell-sized objects a few at a time, the way
+ * cells are queued on a circuit and flushed again. */
+static void
+bench_mempool(void)
+{
+  const int iters = 1000000, batch = 8;
+  const char *names[] = { "malloc", "mp_pool", "mp_magazine" };
+  mp_pool_t *pool = mp_pool_new(sizeof(packed_cell_t), 128*1024);
+  mp_magazine_t *mag = mp_magazine_new(pool);
+  void *items[8];
+  struct timeval start, end;
+  uint64_t nsec;
+  int how, i, j;
+
+  for (how = 0; how < 3; ++how) {
+    tor_gettimeofday(&start);
+    for (i = 0; i < iters; ++i) {
+      for (j = 0; j < batch; ++j) {
+        if (how == 0)
+          items[j] = tor_malloc(sizeof(packed_cell_t));
+        else if (how == 1)
+          items[j] = mp_pool_get(pool);
+        else
+          items[j] = mp_magazine_get(mag);
+      }
+      for (j = 0; j < batch; ++j) {
+        if (how == 0)
+          tor_free(items[j]);
+        else if (how == 1)
+          mp_pool_release(items[j]);
+        else
+          mp_magazine_release(mag, items[j]);
+      }
+    }
+    tor_gettimeofday(&end);
+    nsec = ((uint64_t)tv_udiff(&start, &end)) * 1000 / (iters*batch);
+    printf("%s: "U64_FORMAT" nsec per allocation and release\n", names[how],
+           U64_PRINTF_ARG(nsec));
+  }
+
+  mp_magazine_free(mag);
+  mp_pool_destroy(pool);
+}
+
 /** Run digestmap_t performance benchmarks. */
 static void
 bench_dmap(void)
@@ -1112,9 +2578,29 @@ static struct testcase_t test_array[] = {
   ENT(policies),
   ENT(rend_fns),
   ENT(geoip),
+  ENT(bucket_refill),
+  ENT(circuit_idmap),
+  ENT(close_marked),
+  ENT(circuit_create_failed),
+  ENT(event_changes),
+  ENT(relaycrypt),
+  ENT(cell_scheduler),
+  ENT(relay_sendme),
+  ENT(relay_sendme_close),
+  ENT(relay_package_data),
 
   DISABLED(bench_aes),
   DISABLED(bench_dmap),
+  DISABLED(bench_cell_fetch),
+  DISABLED(bench_onion_crypt),
+  DISABLED(bench_cell_scheduler),
+  DISABLED(bench_mempool),
+  DISABLED(bench_orconn_close),
+  DISABLED(bench_circid_lookup),
+  DISABLED(bench_relay_crypt),
+  DISABLED(bench_relay_sendme),
+  DISABLED(bench_edge_package),
+  DISABLED(bench_spsc_ring),
   END_OF_TESTCASES
 };
 
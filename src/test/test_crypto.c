@@ -159,6 +159,17 @@ test_crypto_aes(void)
     }
   }
   test_memeq(data2, data3, 1024-16);
+
+  /* Long runs that start partway through a block should match too. */
+  crypto_free_cipher_env(env2);
+  memset(data3, 0, 1024);
+  env2 = crypto_new_cipher_env();
+  crypto_cipher_set_key(env2, crypto_cipher_get_key(env1));
+  crypto_cipher_encrypt_init_cipher(env2);
+  crypto_cipher_encrypt(env2, data3, data1, 5);
+  crypto_cipher_encrypt(env2, data3+5, data1+5, 1000);
+  test_memeq(data2, data3, 1005);
+
   crypto_free_cipher_env(env1);
   env1 = NULL;
   crypto_free_cipher_env(env2);
@@ -7,9 +7,16 @@
 #define DIRSERV_PRIVATE
 #define DIRVOTE_PRIVATE
 #define ROUTER_PRIVATE
+#define ROUTERPARSE_PRIVATE
 #include "or.h"
 #include "test.h"
 
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
 static void
 test_dir_nicknames(void)
 {
@@ -577,6 +584,191 @@ done:
   return;
 }
 
+static void
+test_dir_token_index(void)
+{
+  addr_policy_t *p = NULL;
+
+  /* Every keyword in every table should find the same rule through the
+   * keyword index that a linear search would. */
+  test_assert(routerparse_check_token_indices() > 100);
+  /* Doing it again uses the indices we already built. */
+  test_assert(routerparse_check_token_indices() > 100);
+
+  /* Keywords are found by length as well as by content. */
+  p = router_parse_addr_policy_item_from_string("reject 18.0.0.0/8:*", -1);
+  test_assert(p);
+  test_eq(ADDR_POLICY_REJECT, p->policy_type);
+  addr_policy_free(p);
+  p = router_parse_addr_policy_item_from_string("opt accept 18.0.0.0/8:*",
+                                                -1);
+  test_assert(p);
+  test_eq(ADDR_POLICY_ACCEPT, p->policy_type);
+  addr_policy_free(p);
+  p = router_parse_addr_policy_item_from_string("acceptt 18.0.0.0/8:*", -1);
+  test_assert(!p);
+  p = router_parse_addr_policy_item_from_string("accep 18.0.0.0/8:*", -1);
+  test_assert(!p);
+
+ done:
+  ;
+}
+
+static void
+test_dir_compressed_body_cache(void)
+{
+  char d1[DIGEST_LEN], d2[DIGEST_LEN], digest[DIGEST_LEN];
+  const char *body1 = "router alice 10.0.0.1 9001 0 0\n";
+  const char *body2 = "router bob 10.0.0.2 9001 0 0\nplatform Tor\n";
+  const char *z;
+  char *joined = NULL, *out = NULL, *big = NULL;
+  size_t z_len, z1_len, out_len;
+  smartlist_t *chunks = smartlist_create();
+  int i;
+
+  crypto_digest(d1, body1, strlen(body1));
+  crypto_digest(d2, body2, strlen(body2));
+
+  /* Each body comes back as its own zlib stream; asking again gives the
+   * copy we already made. */
+  z = dirserv_get_compressed_body(d1, body1, strlen(body1), &z1_len);
+  test_assert(z);
+  test_eq(ZLIB_METHOD, detect_compression_method(z, z1_len));
+  smartlist_add(chunks, tor_memdup(z, z1_len));
+  test_eq_ptr(z, dirserv_get_compressed_body(d1, body1, strlen(body1),
+                                             &z_len));
+  test_eq(z1_len, z_len);
+  z = dirserv_get_compressed_body(d2, body2, strlen(body2), &z_len);
+  test_assert(z);
+  smartlist_add(chunks, tor_memdup(z, z_len));
+
+  /* Back to back, they decompress to both bodies, back to back. */
+  joined = tor_malloc(z1_len + z_len);
+  memcpy(joined, smartlist_get(chunks, 0), z1_len);
+  memcpy(joined+z1_len, smartlist_get(chunks, 1), z_len);
+  test_eq(0, tor_gzip_uncompress(&out, &out_len, joined, z1_len+z_len,
+                                 ZLIB_METHOD, 1, LOG_WARN));
+  test_eq(strlen(body1)+strlen(body2), out_len);
+  test_memeq(out, body1, strlen(body1));
+  test_memeq(out+strlen(body1), body2, strlen(body2));
+  tor_free(out);
+
+  /* A body of a different length under the same digest isn't taken for
+   * the one we have. */
+  z = dirserv_get_compressed_body(d1, body2, strlen(body2), &z_len);
+  test_eq(0, tor_gzip_uncompress(&out, &out_len, z, z_len, ZLIB_METHOD, 1,
+                                 LOG_WARN));
+  test_eq(strlen(body2), out_len);
+  test_memeq(out, body2, out_len);
+  tor_free(out);
+
+  /* Fill the cache well past its limit with bodies that won't compress;
+   * the newest ones must still be good. */
+  big = tor_malloc(65536);
+  for (i = 0; i < 300; ++i) {
+    crypto_rand(big, 65536);
+    crypto_digest(digest, big, 65536);
+    z = dirserv_get_compressed_body(digest, big, 65536, &z_len);
+    test_assert(z);
+  }
+  test_eq(0, tor_gzip_uncompress(&out, &out_len, z, z_len, ZLIB_METHOD, 1,
+                                 LOG_WARN));
+  test_eq(65536, out_len);
+  test_memeq(out, big, 65536);
+
+ done:
+  dirserv_compressed_body_cache_free_all();
+  SMARTLIST_FOREACH(chunks, char *, c, tor_free(c));
+  smartlist_free(chunks);
+  tor_free(joined);
+  tor_free(out);
+  tor_free(big);
+}
+
+/** Helper for test_dir_spool_compressed_empty: an event callback that does
+ * nothing. */
+static void
+spool_noop_event_cb(evutil_socket_t fd, short events, void *arg)
+{
+  (void)fd;
+  (void)events;
+  (void)arg;
+}
+
+/** Helper for test_dir_spool_compressed_empty: return a new directory
+ * connection with no socket, answering a compressed request for two
+ * descriptors we don't have, with precompressed bodies if
+ * <b>precompressed</b> is true and through a zlib stream otherwise. */
+static dir_connection_t *
+spool_conn_new(int precompressed)
+{
+  dir_connection_t *conn;
+  int i;
+
+  if (!tor_libevent_get_base())
+    tor_libevent_initialize();
+  conn = TO_DIR_CONN(connection_new(CONN_TYPE_DIR, AF_INET));
+  /* Look linked (to nothing), so that nobody tries to add the write event
+   * to the event loop. */
+  conn->_base.linked = 1;
+  conn->_base.write_event = tor_evtimer_new(tor_libevent_get_base(),
+                                            spool_noop_event_cb, NULL);
+  conn->_base.state = DIR_CONN_STATE_SERVER_WRITING;
+  conn->dir_spool_src = DIR_SPOOL_SERVER_BY_DIGEST;
+  conn->fingerprint_stack = smartlist_create();
+  for (i = 0; i < 2; ++i) {
+    char *fp = tor_malloc(DIGEST_LEN);
+    memset(fp, 0x11*(i+1), DIGEST_LEN);
+    smartlist_add(conn->fingerprint_stack, fp);
+  }
+  if (precompressed)
+    conn->spool_compressed = 1;
+  else
+    conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD);
+  return conn;
+}
+
+/** Make sure that when we have none of the descriptors asked for, a
+ * compressed answer is an empty zlib stream, whether we send precompressed
+ * bodies or run them through a zlib stream. */
+static void
+test_dir_spool_compressed_empty(void)
+{
+  dir_connection_t *conns[2] = { NULL, NULL };
+  char *answers[2] = { NULL, NULL };
+  size_t lens[2];
+  char *out = NULL;
+  size_t out_len;
+  int i;
+
+  for (i = 0; i < 2; ++i) {
+    conns[i] = spool_conn_new(i);
+    test_eq(0, connection_dirserv_flushed_some(conns[i]));
+    test_eq(DIR_SPOOL_NONE, conns[i]->dir_spool_src);
+    test_assert(!conns[i]->zlib_state);
+    lens[i] = buf_datalen(conns[i]->_base.outbuf);
+    test_assert(lens[i] > 0);
+    answers[i] = tor_malloc(lens[i]);
+    fetch_from_buf(answers[i], lens[i], conns[i]->_base.outbuf);
+  }
+  test_eq(lens[0], lens[1]);
+  test_memeq(answers[0], answers[1], lens[0]);
+  test_eq(ZLIB_METHOD, detect_compression_method(answers[1], lens[1]));
+  test_eq(0, tor_gzip_uncompress(&out, &out_len, answers[1], lens[1],
+                                 ZLIB_METHOD, 1, LOG_WARN));
+  test_eq(0, out_len);
+
+ done:
+  for (i = 0; i < 2; ++i) {
+    if (conns[i]) {
+      conns[i]->_base.linked = 0;
+      connection_free(TO_CONN(conns[i]));
+    }
+    tor_free(answers[i]);
+  }
+  tor_free(out);
+}
+
 static void
 test_dir_param_voting(void)
 {
@@ -1291,12 +1483,934 @@ test_dir_v3_networkstatus(void)
     ns_detached_signatures_free(dsig2);
 }
 
+/** Helper for bench_dir_tokenize: return a newly allocated consensus
+ * listing <b>n_routers</b> made-up routers, in the form that authorities
+ * serve.  The signature is garbage, but we don't check consensus
+ * signatures while parsing. */
+static char *
+bench_make_consensus(int n_routers)
+{
+  smartlist_t *chunks = smartlist_create();
+  char digest[DIGEST_LEN], d64[BASE64_DIGEST_LEN+1];
+  char sig[128], sig64[256];
+  char *result;
+  int i;
+
+  smartlist_add(chunks, tor_strdup(
+    "network-status-version 3\n"
+    "vote-status consensus\n"
+    "consensus-method 8\n"
+    "valid-after 2009-10-01 00:00:00\n"
+    "fresh-until 2009-10-01 01:00:00\n"
+    "valid-until 2009-10-01 03:00:00\n"
+    "voting-delay 300 300\n"
+    "client-versions 0.2.1.19,0.2.2.5-alpha\n"
+    "server-versions 0.2.1.19,0.2.2.5-alpha\n"
+    "known-flags Exit Fast Guard Running Stable Valid\n"
+    "params circwindow=1000\n"
+    "dir-source auth1 D867ACF56A9D229B35C25F0090BC9867E906BE69 "
+      "auth1.example.com 10.1.1.1 80 443\n"
+    "contact Someone <someone@example.com>\n"
+    "vote-digest 0123456789ABCDEF0123456789ABCDEF01234567\n"));
+  for (i = 0; i < n_routers; ++i) {
+    char id64[BASE64_DIGEST_LEN+1], line[512];
+    /* Keep the identities in order, as the parser insists. */
+    crypto_rand(digest, DIGEST_LEN);
+    set_uint32(digest, htonl(i));
+    digest_to_base64(id64, digest);
+    crypto_rand(digest, DIGEST_LEN);
+    digest_to_base64(d64, digest);
+    tor_snprintf(line, sizeof(line),
+                 "r router%d %s %s 2009-09-30 23:%02d:%02d "
+                 "10.%d.%d.%d 9001 9030\n"
+                 "s Fast Running%s Stable Valid\n"
+                 "v Tor 0.2.1.19\n"
+                 "w Bandwidth=%d\n"
+                 "p %s\n",
+                 i, id64, d64, (i/60)%60, i%60,
+                 (i>>16)&255, (i>>8)&255, i&255,
+                 (i%4) ? "" : " Guard", 20+i%5000,
+                 (i%3) ? "reject 1-65535" : "accept 80,443");
+    smartlist_add(chunks, tor_strdup(line));
+  }
+  crypto_rand(sig, sizeof(sig));
+  base64_encode(sig64, sizeof(sig64), sig, sizeof(sig));
+  smartlist_add(chunks, tor_strdup(
+    "directory-signature D867ACF56A9D229B35C25F0090BC9867E906BE69 "
+      "0123456789ABCDEF0123456789ABCDEF01234567\n"
+    "-----BEGIN SIGNATURE-----\n"));
+  smartlist_add(chunks, tor_strdup(sig64));
+  smartlist_add(chunks, tor_strdup("-----END SIGNATURE-----\n"));
+
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Run a benchmark of the directory parser on a made-up consensus: most
+ * of what we parse is routerstatus entries, so this mostly measures how
+ * fast we can tokenize short lines. */
+static void
+bench_dir_tokenize(void)
+{
+  const int n_routers = 2000, n_rounds = 50;
+  char *consensus = bench_make_consensus(n_routers);
+  networkstatus_t *ns;
+  struct timeval start, end;
+  uint64_t usec;
+  int i;
+
+  tor_gettimeofday(&start);
+  for (i = 0; i < n_rounds; ++i) {
+    ns = networkstatus_parse_vote_from_string(consensus, NULL,
+                                              NS_TYPE_CONSENSUS);
+    test_assert(ns);
+    test_eq(n_routers, smartlist_len(ns->routerstatus_list));
+    networkstatus_vote_free(ns);
+  }
+  tor_gettimeofday(&end);
+  usec = tv_udiff(&start, &end);
+  printf("%d-entry consensus: "U64_FORMAT" usec to parse; "
+         U64_FORMAT" entries/sec\n", n_routers,
+         U64_PRINTF_ARG(usec/n_rounds),
+         U64_PRINTF_ARG(((uint64_t)n_routers)*n_rounds*1000000/
+                        (usec?usec:1)));
+
+ done:
+  tor_free(consensus);
+}
+
+/** Helper for test_dir_consensus_lazy_parse: return true iff <b>a</b> and
+ * <b>b</b> hold the same routerstatus. */
+static int
+routerstatus_same(const routerstatus_t *a, const routerstatus_t *b)
+{
+  routerstatus_t a_copy, b_copy;
+  memcpy(&a_copy, a, sizeof(routerstatus_t));
+  memcpy(&b_copy, b, sizeof(routerstatus_t));
+  a_copy.exitsummary = b_copy.exitsummary = NULL;
+  return !memcmp(&a_copy, &b_copy, sizeof(routerstatus_t)) &&
+    !strcmp(a->exitsummary ? a->exitsummary : "",
+            b->exitsummary ? b->exitsummary : "");
+}
+
+/** Make sure that a consensus whose entries we decode only when we need
+ * them ends up just the same as one we parse all at once. */
+static void
+test_dir_consensus_lazy_parse(void)
+{
+  const int n_routers = 50;
+  char *consensus = bench_make_consensus(n_routers);
+  networkstatus_t *full = NULL, *lazy = NULL;
+  routerstatus_t *rs, *rs2;
+  char *cp;
+  char digest[DIGEST_LEN];
+  int i, n_decoded;
+
+  /* Break the published time on one entry, so that we can't decode it. */
+  cp = strstr(consensus, "\nr router7 ");
+  test_assert(cp);
+  cp = strstr(cp, " 2009-09-30 ");
+  test_assert(cp);
+  memcpy(cp, " 2009-99-30 ", 12);
+
+  full = networkstatus_parse_vote_from_string(consensus, NULL,
+                                              NS_TYPE_CONSENSUS);
+  lazy = networkstatus_parse_consensus_lazily(consensus);
+  test_assert(full);
+  test_assert(lazy);
+  test_eq(n_routers-1, smartlist_len(full->routerstatus_list));
+  test_memeq(&full->digests, &lazy->digests, sizeof(digests_t));
+  test_eq(full->valid_after, lazy->valid_after);
+
+  /* Nothing is decoded yet, but we know where every entry is. */
+  test_eq(0, smartlist_len(lazy->routerstatus_list));
+  test_assert(lazy->deferred_entries);
+  test_eq(n_routers, smartlist_len(lazy->deferred_entries));
+
+  /* Looking up one entry decodes just that one. */
+  rs = smartlist_get(full->routerstatus_list, 17);
+  rs2 = networkstatus_vote_find_entry(lazy, rs->identity_digest);
+  test_assert(rs2);
+  test_assert(routerstatus_same(rs, rs2));
+  test_eq_ptr(rs2, networkstatus_vote_find_entry(lazy, rs->identity_digest));
+  n_decoded = 0;
+  SMARTLIST_FOREACH(lazy->deferred_entries, deferred_routerstatus_t *, dr,
+                    if (dr->rs) ++n_decoded);
+  test_eq(1, n_decoded);
+
+  /* Unknown routers and broken entries aren't found. */
+  memset(digest, 0xff, sizeof(digest));
+  test_eq_ptr(NULL, networkstatus_vote_find_entry(lazy, digest));
+  memcpy(digest, ((deferred_routerstatus_t *)
+                  smartlist_get(lazy->deferred_entries, 7))->identity_digest,
+         DIGEST_LEN);
+  test_eq_ptr(NULL, networkstatus_vote_find_entry(lazy, digest));
+  test_assert(((deferred_routerstatus_t *)
+               smartlist_get(lazy->deferred_entries, 7))->failed);
+
+  /* Decoding the rest gives us what a full parse would have. */
+  networkstatus_decode_deferred_entries(lazy);
+  test_assert(!lazy->deferred_entries);
+  test_assert(!lazy->deferred_body);
+  test_eq(n_routers-1, smartlist_len(lazy->routerstatus_list));
+  for (i = 0; i < n_routers-1; ++i) {
+    test_assert(routerstatus_same(smartlist_get(full->routerstatus_list, i),
+                                  smartlist_get(lazy->routerstatus_list, i)));
+  }
+  test_eq_ptr(rs2, smartlist_get(lazy->routerstatus_list, 17));
+  test_eq_ptr(rs2, networkstatus_vote_find_entry(lazy, rs->identity_digest));
+
+  /* An entry out of order that we can't decode anyway doesn't make the
+   * consensus unparseable, lazily or not... */
+  networkstatus_vote_free(lazy);
+  networkstatus_vote_free(full);
+  lazy = full = NULL;
+  cp = strstr(consensus, "\nr router7 ");
+  test_assert(cp);
+  cp = strchr(cp+3, ' ');
+  memcpy(cp+1, "/////", 5);
+  full = networkstatus_parse_vote_from_string(consensus, NULL,
+                                              NS_TYPE_CONSENSUS);
+  lazy = networkstatus_parse_consensus_lazily(consensus);
+  test_assert(full);
+  test_assert(lazy);
+  test_eq(n_routers-1, smartlist_len(full->routerstatus_list));
+  test_eq(n_routers-1, smartlist_len(lazy->routerstatus_list));
+  test_assert(!lazy->deferred_entries);
+
+  /* ...but entries out of order that we can decode do. */
+  networkstatus_vote_free(lazy);
+  lazy = NULL;
+  cp = strstr(consensus, "\nr router3 ");
+  test_assert(cp);
+  cp = strchr(cp+3, ' ');
+  memcpy(cp+1, "/////", 5);
+  test_assert(!networkstatus_parse_consensus_lazily(consensus));
+  test_assert(!networkstatus_parse_vote_from_string(consensus, NULL,
+                                                    NS_TYPE_CONSENSUS));
+
+ done:
+  if (full)
+    networkstatus_vote_free(full);
+  if (lazy)
+    networkstatus_vote_free(lazy);
+  tor_free(consensus);
+}
+
+/** Run a benchmark of parsing a made-up consensus all at once, and lazily:
+ * both when we only look at a few entries, and when we end up decoding
+ * them all. */
+static void
+bench_consensus_lazy_parse(void)
+{
+  const int n_routers = 2000, n_rounds = 50, n_lookups = 10;
+  char *consensus = bench_make_consensus(n_routers);
+  networkstatus_t *ns;
+  struct timeval start, end;
+  char digest[DIGEST_LEN];
+  int i, j, mode;
+  static const char *modes[] = {
+    "full parse", "lazy parse, 10 lookups", "lazy parse, decode all",
+  };
+
+  for (mode = 0; mode < 3; ++mode) {
+    tor_gettimeofday(&start);
+    for (i = 0; i < n_rounds; ++i) {
+      if (mode == 0) {
+        ns = networkstatus_parse_vote_from_string(consensus, NULL,
+                                                  NS_TYPE_CONSENSUS);
+      } else {
+        ns = networkstatus_parse_consensus_lazily(consensus);
+      }
+      test_assert(ns);
+      if (mode == 1) {
+        for (j = 0; j < n_lookups; ++j) {
+          deferred_routerstatus_t *dr =
+            smartlist_get(ns->deferred_entries, j*(n_routers/n_lookups));
+          memcpy(digest, dr->identity_digest, DIGEST_LEN);
+          test_assert(networkstatus_vote_find_entry(ns, digest));
+        }
+      } else if (mode == 2) {
+        networkstatus_decode_deferred_entries(ns);
+        test_eq(n_routers, smartlist_len(ns->routerstatus_list));
+      }
+      networkstatus_vote_free(ns);
+    }
+    tor_gettimeofday(&end);
+    printf("%s: "U64_FORMAT" usec per %d-entry consensus\n", modes[mode],
+           U64_PRINTF_ARG(tv_udiff(&start, &end)/n_rounds), n_routers);
+  }
+
+ done:
+  tor_free(consensus);
+}
+
+/** Helper for test_dir_consensus_diff: return a newly allocated copy of the
+ * consensus <b>consensus</b>, made by bench_make_consensus(), without the
+ * entry for router number <b>idx</b>. */
+static char *
+consdiff_remove_entry(const char *consensus, int idx)
+{
+  char needle[64];
+  const char *start, *end;
+  char *result;
+
+  tor_snprintf(needle, sizeof(needle), "\nr router%d ", idx);
+  start = strstr(consensus, needle);
+  tor_assert(start);
+  ++start;
+  if (!(end = strstr(start, "\nr ")))
+    end = strstr(start, "\ndirectory-signature ");
+  tor_assert(end);
+  ++end;
+  result = tor_malloc(strlen(consensus) - (end-start) + 1);
+  memcpy(result, consensus, start-consensus);
+  strlcpy(result+(start-consensus), end, strlen(end)+1);
+  return result;
+}
+
+/** Make sure that consensus diffs take us from one consensus to the next,
+ * and that we won't believe a diff that doesn't. */
+static void
+test_dir_consensus_diff(void)
+{
+  char *all = bench_make_consensus(50);
+  char *base = NULL, *target = NULL, *diff = NULL, *out = NULL;
+  char *bad = NULL, *cp;
+  char digest[DIGEST256_LEN], hex[HEX_DIGEST256_LEN+1], buf[256];
+  digests_t digests;
+  cached_dir_t *d;
+
+  /* Router 20 joins, router 10 leaves, router 3's bandwidth changes, and
+   * so does the header. */
+  base = consdiff_remove_entry(all, 20);
+  target = consdiff_remove_entry(all, 10);
+  cp = strstr(target, "valid-after 2009-10-01 00:");
+  test_assert(cp);
+  memcpy(cp, "valid-after 2009-10-01 01:", 26);
+  cp = strstr(target, "\nw Bandwidth=23\n");
+  test_assert(cp);
+  memcpy(cp, "\nw Bandwidth=99\n", 16);
+
+  diff = consdiff_generate(base, target);
+  test_assert(diff);
+  test_assert(consdiff_looks_like_diff(diff));
+  test_assert(strlen(diff) < strlen(target)/4);
+  out = consdiff_apply(base, diff);
+  test_assert(out);
+  test_streq(out, target);
+  tor_free(out);
+
+  /* A diff doesn't apply to any other consensus. */
+  test_assert(!consdiff_apply(target, diff));
+  test_assert(!consdiff_apply(all, diff));
+
+  /* A diff that doesn't give us the promised consensus is no good. */
+  bad = tor_strdup(diff);
+  cp = strstr(bad, "w Bandwidth=99\n");
+  test_assert(cp);
+  cp[13] = '8';
+  test_assert(!consdiff_apply(base, bad));
+  tor_free(bad);
+
+  /* Nor is one with commands we can't follow. */
+  cp = strchr(diff, '\n');
+  cp = strchr(cp+1, '\n');
+  test_assert(cp);
+  test_assert(cp+2-diff < (int)sizeof(buf));
+  strlcpy(buf, diff, cp+2-diff);
+  strlcat(buf, "99999d\n", sizeof(buf));
+  test_assert(!consdiff_apply(base, buf));
+  strlcpy(buf, diff, cp+2-diff);
+  strlcat(buf, "3a\nfoo\n", sizeof(buf));
+  test_assert(!consdiff_apply(base, buf));
+  test_assert(!consdiff_looks_like_diff(target));
+
+  /* We can't diff to a consensus with a "." line. */
+  tor_free(diff);
+  tor_free(out);
+  out = tor_malloc(strlen(target)+3);
+  tor_snprintf(out, strlen(target)+3, "%s.\n", target);
+  test_assert(!consdiff_generate(base, out));
+  tor_free(out);
+
+  /* A cache remembers the consensus it served before, and serves a diff
+   * from it. */
+  memset(&digests, 0, sizeof(digests));
+  dirserv_set_cached_consensus_networkstatus(base, "ns", &digests, 1000);
+  dirserv_set_cached_consensus_networkstatus(target, "ns", &digests, 2000);
+  crypto_digest256(digest, base, strlen(base), DIGEST_SHA256);
+  base16_encode(hex, sizeof(hex), digest, DIGEST256_LEN);
+  tor_snprintf(buf, sizeof(buf), "%064d, %s", 0, hex);
+  d = dirserv_find_consensus_diff("ns", buf);
+  test_assert(d);
+  out = consdiff_apply(base, d->dir);
+  test_assert(out);
+  test_streq(out, target);
+  test_assert(!dirserv_find_consensus_diff("microdesc", hex));
+  crypto_digest256(digest, target, strlen(target), DIGEST_SHA256);
+  base16_encode(hex, sizeof(hex), digest, DIGEST256_LEN);
+  test_assert(!dirserv_find_consensus_diff("ns", hex));
+
+ done:
+  dirserv_free_all();
+  tor_free(all);
+  tor_free(base);
+  tor_free(target);
+  tor_free(diff);
+  tor_free(out);
+  tor_free(bad);
+}
+
+/** One made-up router for bench_consensus_diff. */
+typedef struct bench_cd_router_t {
+  char identity[DIGEST_LEN]; /**< Its identity digest. */
+  char descriptor[DIGEST_LEN]; /**< Its descriptor digest. */
+  int id; /**< A number to make its nickname and address from. */
+  int published; /**< When it last published, in seconds before the hour. */
+  int bandwidth; /**< Its bandwidth. */
+  int flags; /**< Bit 0: Guard; bit 1: Stable; bit 2: Exit. */
+} bench_cd_router_t;
+
+/** Helper for bench_consensus_diff: sort routers by identity digest. */
+static int
+_compare_bench_cd_routers(const void **a, const void **b)
+{
+  const bench_cd_router_t *r1 = *a, *r2 = *b;
+  return memcmp(r1->identity, r2->identity, DIGEST_LEN);
+}
+
+/** Helper for bench_consensus_diff: return a newly allocated consensus,
+ * valid after hour <b>hour</b>, listing the routers in <b>routers</b>. */
+static char *
+bench_cd_render(smartlist_t *routers, int hour)
+{
+  smartlist_t *chunks = smartlist_create();
+  char id64[BASE64_DIGEST_LEN+1], d64[BASE64_DIGEST_LEN+1];
+  char sig[128], sig64[256], line[512];
+  char *result;
+
+  tor_snprintf(line, sizeof(line),
+    "network-status-version 3\n"
+    "vote-status consensus\n"
+    "consensus-method 8\n"
+    "valid-after 2009-10-%02d %02d:00:00\n"
+    "fresh-until 2009-10-%02d %02d:00:00\n"
+    "valid-until 2009-10-%02d %02d:00:00\n"
+    "voting-delay 300 300\n"
+    "client-versions 0.2.1.19,0.2.2.5-alpha\n"
+    "server-versions 0.2.1.19,0.2.2.5-alpha\n"
+    "known-flags Exit Fast Guard Running Stable Valid\n"
+    "params circwindow=1000\n",
+    1+hour/24, hour%24, 1+(hour+1)/24, (hour+1)%24,
+    1+(hour+3)/24, (hour+3)%24);
+  smartlist_add(chunks, tor_strdup(line));
+  smartlist_add(chunks, tor_strdup(
+    "dir-source auth1 D867ACF56A9D229B35C25F0090BC9867E906BE69 "
+      "auth1.example.com 10.1.1.1 80 443\n"
+    "contact Someone <someone@example.com>\n"));
+  crypto_rand(sig, DIGEST_LEN);
+  base16_encode(line, sizeof(line), sig, DIGEST_LEN);
+  smartlist_add(chunks, tor_strdup("vote-digest "));
+  smartlist_add(chunks, tor_strdup(line));
+  smartlist_add(chunks, tor_strdup("\n"));
+
+  SMARTLIST_FOREACH_BEGIN(routers, bench_cd_router_t *, r) {
+    int pub = hour*3600 - r->published;
+    digest_to_base64(id64, r->identity);
+    digest_to_base64(d64, r->descriptor);
+    tor_snprintf(line, sizeof(line),
+                 "r router%d %s %s 2009-10-%02d %02d:%02d:%02d "
+                 "10.%d.%d.%d 9001 9030\n"
+                 "s%s Fast%s Running%s Valid\n"
+                 "v Tor 0.2.1.19\n"
+                 "w Bandwidth=%d\n"
+                 "p %s\n",
+                 r->id, id64, d64, 1+pub/86400, (pub/3600)%24,
+                 (pub/60)%60, pub%60,
+                 (r->id>>16)&255, (r->id>>8)&255, r->id&255,
+                 (r->flags&4) ? " Exit" : "", (r->flags&1) ? " Guard" : "",
+                 (r->flags&2) ? " Stable" : "", r->bandwidth,
+                 (r->flags&4) ? "accept 80,443" : "reject 1-65535");
+    smartlist_add(chunks, tor_strdup(line));
+  } SMARTLIST_FOREACH_END(r);
+
+  crypto_rand(sig, sizeof(sig));
+  base64_encode(sig64, sizeof(sig64), sig, sizeof(sig));
+  smartlist_add(chunks, tor_strdup(
+    "directory-signature D867ACF56A9D229B35C25F0090BC9867E906BE69 "
+      "0123456789ABCDEF0123456789ABCDEF01234567\n"
+    "-----BEGIN SIGNATURE-----\n"));
+  smartlist_add(chunks, tor_strdup(sig64));
+  smartlist_add(chunks, tor_strdup("-----END SIGNATURE-----\n"));
+
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Helper for bench_consensus_diff: add a new made-up router to
+ * <b>routers</b>. */
+static void
+bench_cd_add_router(smartlist_t *routers, int id)
+{
+  bench_cd_router_t *r = tor_malloc_zero(sizeof(bench_cd_router_t));
+  crypto_rand(r->identity, DIGEST_LEN);
+  crypto_rand(r->descriptor, DIGEST_LEN);
+  r->id = id;
+  r->published = crypto_rand_int(18*3600);
+  r->bandwidth = 20 + crypto_rand_int(5000);
+  r->flags = crypto_rand_int(8);
+  smartlist_add(routers, r);
+}
+
+/** Run a benchmark of fetching a day's worth of hourly consensuses, in
+ * which routers come and go and change their bandwidths and flags, as
+ * whole compressed consensuses and as compressed diffs from the one
+ * before. */
+static void
+bench_consensus_diff(void)
+{
+  const int n_routers = 2000, n_hours = 24;
+  smartlist_t *routers = smartlist_create();
+  char *prev = NULL, *cur = NULL, *diff = NULL, *out = NULL, *z = NULL;
+  struct timeval start, end;
+  uint64_t full_bytes = 0, diff_bytes = 0, gen_usec = 0, apply_usec = 0;
+  size_t z_len;
+  int i, hour, next_id = 0;
+
+  for (i = 0; i < n_routers; ++i)
+    bench_cd_add_router(routers, next_id++);
+  smartlist_sort(routers, _compare_bench_cd_routers);
+  prev = bench_cd_render(routers, 24);
+
+  for (hour = 25; hour < 25+n_hours; ++hour) {
+    /* Each hour, about 2% of routers leave and as many join; about 20%
+     * report a new bandwidth; about 3% change flags; and about 5% publish
+     * a new descriptor. */
+    SMARTLIST_FOREACH_BEGIN(routers, bench_cd_router_t *, r) {
+      int x = crypto_rand_int(100);
+      if (x < 2) {
+        tor_free(r);
+        SMARTLIST_DEL_CURRENT(routers, r);
+        continue;
+      }
+      r->published += 3600;
+      if (x < 22)
+        r->bandwidth = 20 + crypto_rand_int(5000);
+      if (x >= 22 && x < 25)
+        r->flags = crypto_rand_int(8);
+      if ((x >= 25 && x < 30) || r->published > 18*3600) {
+        crypto_rand(r->descriptor, DIGEST_LEN);
+        r->published = crypto_rand_int(600);
+      }
+    } SMARTLIST_FOREACH_END(r);
+    while (smartlist_len(routers) < n_routers)
+      bench_cd_add_router(routers, next_id++);
+    smartlist_sort(routers, _compare_bench_cd_routers);
+    cur = bench_cd_render(routers, hour);
+
+    tor_gettimeofday(&start);
+    diff = consdiff_generate(prev, cur);
+    tor_gettimeofday(&end);
+    gen_usec += tv_udiff(&start, &end);
+    test_assert(diff);
+
+    tor_gettimeofday(&start);
+    out = consdiff_apply(prev, diff);
+    tor_gettimeofday(&end);
+    apply_usec += tv_udiff(&start, &end);
+    test_assert(out);
+    test_streq(out, cur);
+
+    test_eq(0, tor_gzip_compress(&z, &z_len, cur, strlen(cur),
+                                 ZLIB_METHOD));
+    full_bytes += z_len;
+    tor_free(z);
+    test_eq(0, tor_gzip_compress(&z, &z_len, diff, strlen(diff),
+                                 ZLIB_METHOD));
+    diff_bytes += z_len;
+    tor_free(z);
+
+    tor_free(out);
+    tor_free(diff);
+    tor_free(prev);
+    prev = cur;
+    cur = NULL;
+  }
+
+  printf("%d-entry consensus, hourly for %d hours:\n"
+         "  whole consensus: "U64_FORMAT" compressed bytes per hour\n"
+         "  diff:            "U64_FORMAT" compressed bytes per hour\n"
+         "  "U64_FORMAT" usec to generate a diff, "U64_FORMAT
+         " usec to apply one\n",
+         n_routers, n_hours,
+         U64_PRINTF_ARG(full_bytes/n_hours),
+         U64_PRINTF_ARG(diff_bytes/n_hours),
+         U64_PRINTF_ARG(gen_usec/n_hours),
+         U64_PRINTF_ARG(apply_usec/n_hours));
+
+ done:
+  SMARTLIST_FOREACH(routers, bench_cd_router_t *, r, tor_free(r));
+  smartlist_free(routers);
+  tor_free(prev);
+  tor_free(cur);
+  tor_free(diff);
+  tor_free(out);
+  tor_free(z);
+}
+
+/** Helper for test_dir_sigcheck and bench_descriptor_parse: return a newly
+ * allocated string holding <b>n</b> router descriptors, signed in turn by
+ * each of the <b>n_keys</b> keys in <b>keys</b>.  If <b>bad_every</b> is
+ * positive, spoil the signature on every <b>bad_every</b>th descriptor,
+ * starting with the first. */
+static char *
+sigcheck_make_descriptors(int n, crypto_pk_env_t **keys, int n_keys,
+                          int bad_every)
+{
+  smartlist_t *descs = smartlist_create();
+  char buf[8192], nickname[32];
+  char *result, *cp;
+  routerinfo_t *r;
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    r = tor_malloc_zero(sizeof(routerinfo_t));
+    tor_snprintf(nickname, sizeof(nickname), "router%d", i);
+    r->nickname = tor_strdup(nickname);
+    r->address = tor_strdup("10.0.0.1");
+    r->addr = 0x0a000000u + i;
+    r->or_port = 9001;
+    r->platform = tor_strdup("Tor 0.2.2.5-alpha on Linux");
+    r->cache_info.published_on = 1000000000 + i;
+    r->bandwidthrate = r->bandwidthburst = r->bandwidthcapacity = 1000;
+    r->onion_pkey = crypto_pk_dup_key(keys[i % n_keys]);
+    r->identity_pkey = crypto_pk_dup_key(keys[i % n_keys]);
+    tor_assert(router_dump_router_to_string(buf, sizeof(buf), r,
+                                            keys[i % n_keys]) > 0);
+    if (bad_every > 0 && i % bad_every == 0) {
+      cp = strstr(buf, "-----BEGIN SIGNATURE-----\n");
+      tor_assert(cp);
+      cp += strlen("-----BEGIN SIGNATURE-----\n") + 20;
+      *cp = (*cp == 'A') ? 'B' : 'A';
+    }
+    smartlist_add(descs, tor_strdup(buf));
+    routerinfo_free(r);
+  }
+  result = smartlist_join_strings(descs, "", 0, NULL);
+  SMARTLIST_FOREACH(descs, char *, d, tor_free(d));
+  smartlist_free(descs);
+  return result;
+}
+
+/** State for sigcheck_test_done(): what a test learned about a batch
+ * handed to sigcheck_batch_queue(). */
+typedef struct sigcheck_test_state_t {
+  /** If set, the descriptors in the batch; we drop the bad ones. */
+  smartlist_t *parsed;
+  /** How many times have we been called back? */
+  int n_calls;
+  /** Was the last call cancelled? */
+  int cancelled;
+  /** The result of each of the first few jobs in the batch. */
+  int results[3];
+} sigcheck_test_state_t;
+
+/** Helper for test_dir_sigcheck and bench_descriptor_parse: a
+ * sigcheck_done_fn that records what it saw in the sigcheck_test_state_t
+ * <b>arg</b>. */
+static void
+sigcheck_test_done(sigcheck_batch_t *batch, void *arg, int cancelled)
+{
+  sigcheck_test_state_t *st = arg;
+  int i;
+  ++st->n_calls;
+  st->cancelled = cancelled;
+  for (i = 0; i < 3 && i < sigcheck_batch_len(batch); ++i)
+    st->results[i] = sigcheck_batch_get_result(batch, i);
+  if (st->parsed && !cancelled)
+    router_parse_list_remove_bad_signatures(st->parsed, batch, 0);
+}
+
+/** Make sure that parsing a list of router descriptors gives the same
+ * routers, in the same order, whether we check their signatures while we
+ * parse or later in the signature checking threads; that either way we
+ * drop the ones with bad signatures; and that the threads hand the
+ * results back from the main loop, not before sigcheck_batch_queue()
+ * returns. */
+static void
+test_dir_sigcheck(void)
+{
+  or_options_t *options = get_options();
+  const int n = 30, bad_every = 7;
+  crypto_pk_env_t *keys[2] = { NULL, NULL };
+  smartlist_t *parsed[2] = { NULL, NULL };
+  sigcheck_test_state_t st;
+  sigcheck_batch_t *batch;
+  char *descs = NULL;
+  const char *cp;
+  int i, r, idx;
+
+  if (!tor_libevent_get_base())
+    tor_libevent_initialize();
+  keys[0] = pk_generate(0);
+  keys[1] = pk_generate(1);
+  descs = sigcheck_make_descriptors(n, keys, 2, bad_every);
+
+  /* Round 0 checks signatures as it parses; round 1 hands them to two
+   * threads. */
+  for (r = 0; r < 2; ++r) {
+    options->SignatureCheckThreads = r ? 2 : 0;
+    test_eq(r, sigcheck_enabled());
+    parsed[r] = smartlist_create();
+    cp = descs;
+    if (!r) {
+      test_eq(0, router_parse_list_from_string(&cp, NULL, parsed[r],
+                                               SAVED_NOWHERE, 0, 0, NULL));
+    } else {
+      memset(&st, 0, sizeof(st));
+      st.parsed = parsed[r];
+      batch = sigcheck_batch_new();
+      test_eq(0, router_parse_list_from_string_batched(&cp, NULL, parsed[r],
+                                                       SAVED_NOWHERE, 0, 0,
+                                                       NULL, batch));
+      test_eq(n, smartlist_len(parsed[r]));
+      test_eq(n, sigcheck_batch_len(batch));
+      sigcheck_batch_queue(batch, sigcheck_test_done, &st);
+      test_eq(0, st.n_calls);
+      test_eq(1, sigcheck_get_n_pending());
+      while (sigcheck_get_n_pending())
+        sigcheck_process_answers();
+      test_eq(1, st.n_calls);
+      test_eq(0, st.cancelled);
+    }
+    test_eq(n - (n+bad_every-1)/bad_every, smartlist_len(parsed[r]));
+  }
+
+  for (i = 0; i < smartlist_len(parsed[0]); ++i) {
+    routerinfo_t *r0 = smartlist_get(parsed[0], i);
+    routerinfo_t *r1 = smartlist_get(parsed[1], i);
+    test_assert(r0 != r1);
+    test_memeq(r0->cache_info.signed_descriptor_digest,
+               r1->cache_info.signed_descriptor_digest, DIGEST_LEN);
+    test_streq(r0->nickname, r1->nickname);
+    /* None of the spoiled descriptors made it. */
+    idx = atoi(r0->nickname + strlen("router"));
+    test_neq(0, idx % bad_every);
+  }
+
+  /* A batch checks each signature against its own key and digest, in the
+   * threads or, once they're gone, right away. */
+  for (r = 1; r >= 0; --r) {
+    char digest[DIGEST_LEN], sig[128];
+    if (!r) {
+      options->SignatureCheckThreads = 0;
+      sigcheck_free_all();
+    }
+    test_eq(r, sigcheck_enabled());
+    memset(&st, 0, sizeof(st));
+    batch = sigcheck_batch_new();
+    crypto_digest(digest, "sigcheck", 8);
+    test_eq(128, crypto_pk_private_sign(keys[0], sig, digest, DIGEST_LEN));
+    test_eq(0, sigcheck_batch_add(batch, keys[0], digest, DIGEST_LEN,
+                                  sig, 128, keys));
+    test_eq(1, sigcheck_batch_add(batch, keys[1], digest, DIGEST_LEN,
+                                  sig, 128, NULL));
+    digest[0] ^= 1;
+    test_eq(2, sigcheck_batch_add(batch, keys[0], digest, DIGEST_LEN,
+                                  sig, 128, NULL));
+    test_eq(3, sigcheck_batch_len(batch));
+    test_eq_ptr(keys, sigcheck_batch_get_arg(batch, 0));
+    test_eq(SIGCHECK_PENDING, sigcheck_batch_get_result(batch, 0));
+    sigcheck_batch_queue(batch, sigcheck_test_done, &st);
+    test_eq(r ? 0 : 1, st.n_calls);
+    while (sigcheck_get_n_pending())
+      sigcheck_process_answers();
+    test_eq(1, st.n_calls);
+    test_eq(SIGCHECK_OK, st.results[0]);
+    test_eq(SIGCHECK_INVALID, st.results[1]);
+    test_eq(SIGCHECK_MISMATCH, st.results[2]);
+  }
+
+  /* If we shut down before the main loop collects a batch, it gets handed
+   * back anyway, as cancelled. */
+  options->SignatureCheckThreads = 1;
+  test_eq(1, sigcheck_enabled());
+  memset(&st, 0, sizeof(st));
+  batch = sigcheck_batch_new();
+  sigcheck_batch_add(batch, keys[0], "x", 1, "y", 1, NULL);
+  sigcheck_batch_queue(batch, sigcheck_test_done, &st);
+  sigcheck_free_all();
+  test_eq(1, st.n_calls);
+  test_eq(1, st.cancelled);
+  test_eq(0, sigcheck_get_n_pending());
+
+ done:
+  options->SignatureCheckThreads = 0;
+  sigcheck_free_all();
+  for (r = 0; r < 2; ++r) {
+    if (parsed[r]) {
+      SMARTLIST_FOREACH(parsed[r], routerinfo_t *, ri, routerinfo_free(ri));
+      smartlist_free(parsed[r]);
+    }
+  }
+  for (i = 0; i < 2; ++i)
+    if (keys[i])
+      crypto_free_pk_env(keys[i]);
+  tor_free(descs);
+}
+
+/** Run a benchmark of parsing a big batch of router descriptors, as a
+ * directory cache would on fetching them all: with their signatures
+ * checked as we parse, and in 1, 2, and 4 signature checking threads.  For
+ * the threads, report how long the main thread was busy before it could
+ * go back to the event loop, as well as how long it took to check them
+ * all. */
+static void
+bench_descriptor_parse(void)
+{
+  const int n_descs = 2000, n_keys = 5;
+  const int n_threads[] = { 0, 1, 2, 4 };
+  or_options_t *options = get_options();
+  crypto_pk_env_t *keys[5];
+  smartlist_t *parsed = smartlist_create();
+  sigcheck_test_state_t st;
+  sigcheck_batch_t *batch;
+  struct timeval start, queued, end;
+  uint64_t usec;
+  char *descs;
+  const char *cp;
+  int i, k;
+
+  if (!tor_libevent_get_base())
+    tor_libevent_initialize();
+  for (i = 0; i < n_keys; ++i)
+    keys[i] = pk_generate(i);
+  descs = sigcheck_make_descriptors(n_descs, keys, n_keys, 0);
+
+  for (k = 0; k < (int)(sizeof(n_threads)/sizeof(int)); ++k) {
+    options->SignatureCheckThreads = n_threads[k];
+    sigcheck_enabled();
+    tor_gettimeofday(&start);
+    cp = descs;
+    if (n_threads[k]) {
+      memset(&st, 0, sizeof(st));
+      st.parsed = parsed;
+      batch = sigcheck_batch_new();
+      router_parse_list_from_string_batched(&cp, NULL, parsed, SAVED_NOWHERE,
+                                            0, 0, NULL, batch);
+      sigcheck_batch_queue(batch, sigcheck_test_done, &st);
+      tor_gettimeofday(&queued);
+      while (sigcheck_get_n_pending())
+        sigcheck_process_answers();
+    } else {
+      router_parse_list_from_string(&cp, NULL, parsed, SAVED_NOWHERE, 0, 0,
+                                    NULL);
+    }
+    tor_gettimeofday(&end);
+    if (!n_threads[k])
+      queued = end;
+    test_eq(n_descs, smartlist_len(parsed));
+    usec = tv_udiff(&start, &end);
+    printf("%d signature checking thread(s): "U64_FORMAT" descriptors/sec; "
+           "main thread busy for "U64_FORMAT" msec\n",
+           n_threads[k],
+           U64_PRINTF_ARG(((uint64_t)n_descs)*1000000/(usec?usec:1)),
+           U64_PRINTF_ARG(tv_udiff(&start, &queued)/1000));
+    SMARTLIST_FOREACH(parsed, routerinfo_t *, ri, routerinfo_free(ri));
+    smartlist_clear(parsed);
+    sigcheck_free_all();
+  }
+
+ done:
+  options->SignatureCheckThreads = 0;
+  sigcheck_free_all();
+  SMARTLIST_FOREACH(parsed, routerinfo_t *, ri, routerinfo_free(ri));
+  smartlist_free(parsed);
+  for (i = 0; i < n_keys; ++i)
+    crypto_free_pk_env(keys[i]);
+  tor_free(descs);
+}
+
+/** Run a benchmark of answering compressed requests for every one of a
+ * few thousand descriptors: by running them all through a zlib stream for
+ * each request, and by sending each one's body from the compressed
+ * descriptor cache. */
+static void
+bench_dir_spool_compress(void)
+{
+  const int n_descs = 2000, n_keys = 5, n_requests = 20;
+  crypto_pk_env_t *keys[5];
+  smartlist_t *routers = smartlist_create();
+  buf_t *buf = buf_new();
+  tor_zlib_state_t *zlib;
+  struct timeval start, end;
+  size_t z_len, total;
+  const char *cp, *z;
+  char *descs;
+  int i, mode;
+
+  for (i = 0; i < n_keys; ++i)
+    keys[i] = pk_generate(i);
+  descs = sigcheck_make_descriptors(n_descs, keys, n_keys, 0);
+  cp = descs;
+  router_parse_list_from_string(&cp, NULL, routers, SAVED_NOWHERE, 0, 0,
+                                NULL);
+  test_eq(n_descs, smartlist_len(routers));
+
+  for (mode = 0; mode < 2; ++mode) {
+    total = 0;
+    tor_gettimeofday(&start);
+    for (i = 0; i < n_requests; ++i) {
+      zlib = mode ? NULL : tor_zlib_new(1, ZLIB_METHOD);
+      SMARTLIST_FOREACH_BEGIN(routers, routerinfo_t *, ri) {
+        signed_descriptor_t *sd = &ri->cache_info;
+        if (zlib) {
+          write_to_buf_zlib(buf, zlib, signed_descriptor_get_body(sd),
+                            sd->signed_descriptor_len,
+                            ri_sl_idx == smartlist_len(routers)-1);
+        } else {
+          z = dirserv_get_compressed_body(sd->signed_descriptor_digest,
+                                          signed_descriptor_get_body(sd),
+                                          sd->signed_descriptor_len, &z_len);
+          write_to_buf(z, z_len, buf);
+        }
+      } SMARTLIST_FOREACH_END(ri);
+      total += buf_datalen(buf);
+      buf_clear(buf);
+      if (zlib)
+        tor_zlib_free(zlib);
+    }
+    tor_gettimeofday(&end);
+    printf("%s: "U64_FORMAT" usec per %d-descriptor response, %lu bytes\n",
+           mode ? "compressed descriptor cache" : "zlib stream per request",
+           U64_PRINTF_ARG(tv_udiff(&start, &end)/n_requests), n_descs,
+           (unsigned long)(total/n_requests));
+  }
+
+ done:
+  dirserv_compressed_body_cache_free_all();
+  SMARTLIST_FOREACH(routers, routerinfo_t *, ri, routerinfo_free(ri));
+  smartlist_free(routers);
+  buf_free(buf);
+  for (i = 0; i < n_keys; ++i)
+    crypto_free_pk_env(keys[i]);
+  tor_free(descs);
+}
+
 #define DIR_LEGACY(name)                                                   \
   { #name, legacy_test_helper, 0, &legacy_setup, test_dir_ ## name }
 
 #define DIR(name)                               \
   { #name, test_dir_##name, 0, NULL, NULL }
 
+#define DIR_DISABLED(name)                                                 \
+  { #name, legacy_test_helper, TT_SKIP, &legacy_setup, name }
+
 struct testcase_t dir_tests[] = {
   DIR_LEGACY(nicknames),
   DIR_LEGACY(formats),
@@ -1304,8 +2418,20 @@ struct testcase_t dir_tests[] = {
   DIR_LEGACY(fp_pairs),
   DIR(split_fps),
   DIR_LEGACY(measured_bw),
+  DIR_LEGACY(token_index),
+  DIR_LEGACY(compressed_body_cache),
+  DIR_LEGACY(spool_compressed_empty),
   DIR_LEGACY(param_voting),
   DIR_LEGACY(v3_networkstatus),
+  DIR_LEGACY(consensus_lazy_parse),
+  DIR_LEGACY(consensus_diff),
+  DIR_LEGACY(sigcheck),
+
+  DIR_DISABLED(bench_dir_tokenize),
+  DIR_DISABLED(bench_consensus_lazy_parse),
+  DIR_DISABLED(bench_consensus_diff),
+  DIR_DISABLED(bench_descriptor_parse),
+  DIR_DISABLED(bench_dir_spool_compress),
   END_OF_TESTCASES
 };
 
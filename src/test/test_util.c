@@ -10,6 +10,8 @@
 #include "test.h"
 #include "mempool.h"
 #include "memarea.h"
+#include "ring.h"
+#include "timers.h"
 
 static void
 test_util_time(void)
@@ -511,6 +513,104 @@ test_util_threads(void)
     tor_mutex_free(_thread_test_start2);
 }
 
+/** How many items does _spsc_ring_test_producer push? */
+#define SPSC_RING_TEST_N_ITEMS 20000
+
+/** Helper for test_util_spsc_ring: push the integers from 1 through
+ * SPSC_RING_TEST_N_ITEMS onto the ring <b>arg</b>, in batches of varying
+ * size, waiting whenever it's full. */
+static void
+_spsc_ring_test_producer(void *arg)
+{
+  spsc_ring_t *ring = arg;
+  void *batch[7];
+  uintptr_t next = 1;
+  int i, n;
+
+  while (next <= SPSC_RING_TEST_N_ITEMS) {
+    n = (int)(next % 7) + 1;
+    if (next + n > SPSC_RING_TEST_N_ITEMS + 1)
+      n = (int)(SPSC_RING_TEST_N_ITEMS + 1 - next);
+    for (i = 0; i < n; ++i)
+      batch[i] = (void*)(next + i);
+    i = 0;
+    while (i < n)
+      i += spsc_ring_push_batch(ring, batch+i, n-i);
+    next += n;
+  }
+  spawn_exit();
+}
+
+/** Run unit tests for the single-producer, single-consumer ring. */
+static void
+test_util_spsc_ring(void)
+{
+  spsc_ring_t *ring = spsc_ring_new(5);
+  void *items[16];
+  uintptr_t expect;
+  int i, j, n, n_wrong;
+
+  /* Capacity rounds up to a power of two. */
+  test_eq(8, spsc_ring_get_capacity(ring));
+  test_assert(spsc_ring_is_empty(ring));
+  test_eq_ptr(NULL, spsc_ring_pop(ring));
+
+  /* Fill it, watch it refuse more, and empty it in order, a few times
+   * around so that the counters wrap past the end of the slots. */
+  for (j = 0; j < 5; ++j) {
+    for (i = 0; i < 8; ++i)
+      test_eq(0, spsc_ring_push(ring, (void*)(uintptr_t)(i+1)));
+    test_eq(-1, spsc_ring_push(ring, (void*)(uintptr_t)9));
+    test_assert(!spsc_ring_is_empty(ring));
+    test_eq_ptr((void*)(uintptr_t)1, spsc_ring_pop(ring));
+    test_eq(0, spsc_ring_push(ring, (void*)(uintptr_t)9));
+    for (i = 2; i <= 9; ++i)
+      test_eq_ptr((void*)(uintptr_t)i, spsc_ring_pop(ring));
+    test_assert(spsc_ring_is_empty(ring));
+  }
+
+  /* Batches: a push takes only as much as fits, and a pop takes only what
+   * is there. */
+  for (i = 0; i < 16; ++i)
+    items[i] = (void*)(uintptr_t)(i+100);
+  test_eq(3, spsc_ring_push_batch(ring, items, 3));
+  test_eq(5, spsc_ring_push_batch(ring, items+3, 13));
+  test_eq(0, spsc_ring_push_batch(ring, items+8, 8));
+  memset(items, 0, sizeof(items));
+  test_eq(6, spsc_ring_pop_batch(ring, items, 6));
+  test_eq(2, spsc_ring_pop_batch(ring, items+6, 16));
+  for (i = 0; i < 8; ++i)
+    test_eq_ptr((void*)(uintptr_t)(i+100), items[i]);
+  test_eq(0, spsc_ring_pop_batch(ring, items, 16));
+  spsc_ring_free(ring);
+  ring = NULL;
+
+#ifdef TOR_IS_MULTITHREADED
+  /* Now with a real second thread: everything arrives, in order. */
+  ring = spsc_ring_new(1024);
+  spawn_func(_spsc_ring_test_producer, ring);
+  /* Don't bail out early: the producer is still using the ring. */
+  expect = 1;
+  n_wrong = 0;
+  while (expect <= SPSC_RING_TEST_N_ITEMS) {
+    n = spsc_ring_pop_batch(ring, items, 16);
+    for (i = 0; i < n; ++i, ++expect) {
+      if ((uintptr_t)items[i] != expect)
+        ++n_wrong;
+    }
+  }
+  test_eq(0, n_wrong);
+  test_assert(spsc_ring_is_empty(ring));
+#else
+  (void)expect;
+  (void)n;
+  (void)n_wrong;
+#endif
+
+ done:
+  spsc_ring_free(ring);
+}
+
 /** Run unit tests for compression functions */
 static void
 test_util_gzip(void)
@@ -806,6 +906,7 @@ static void
 test_util_mempool(void)
 {
   mp_pool_t *pool = NULL;
+  mp_magazine_t *mag = NULL, *mag2 = NULL;
   smartlist_t *allocated = NULL;
   int i;
 
@@ -846,7 +947,37 @@ test_util_mempool(void)
       mp_pool_assert_ok(pool);
   }
 
+  /* Now do it again with magazines, releasing items to whichever
+   * magazine (or the pool) we feel like. */
+  mag = mp_magazine_new(pool);
+  mag2 = mp_magazine_new(pool);
+  test_eq(mag->n_items, 0);
+  for (i = 0; i < 20000; ++i) {
+    if (smartlist_len(allocated) < 20 || crypto_rand_int(2)) {
+      void *m = mp_magazine_get(crypto_rand_int(2) ? mag : mag2);
+      memset(m, 0x0a, 241);
+      smartlist_add(allocated, m);
+    } else {
+      int idx = crypto_rand_int(smartlist_len(allocated));
+      void *m = smartlist_get(allocated, idx);
+      smartlist_del(allocated, idx);
+      switch (crypto_rand_int(3)) {
+        case 0: mp_magazine_release(mag, m); break;
+        case 1: mp_magazine_release(mag2, m); break;
+        default: mp_pool_release(m); break;
+      }
+    }
+    test_assert(mag->n_items >= 0 && mag->n_items <= MP_MAGAZINE_CAPACITY);
+    test_assert(mag2->n_items >= 0 && mag2->n_items <= MP_MAGAZINE_CAPACITY);
+    if (i % 777 == 0)
+      mp_pool_assert_ok(pool);
+  }
+  mp_magazine_clear(mag);
+  test_eq(mag->n_items, 0);
+
  done:
+  mp_magazine_free(mag);
+  mp_magazine_free(mag2);
   if (allocated) {
     SMARTLIST_FOREACH(allocated, void *, m, mp_pool_release(m));
     mp_pool_assert_ok(pool);
@@ -989,6 +1120,122 @@ test_util_datadir(void)
   tor_free(temp_dir);
 }
 
+#define N_TEST_TIMERS 1000
+/** For each timer in test_util_timers, the tick at which it last ran. */
+static uint64_t timer_ran_at[N_TEST_TIMERS];
+/** For each timer in test_util_timers, how many times it has run. */
+static int timer_n_runs[N_TEST_TIMERS];
+
+/** Helper for test_util_timers: note that the timer whose index is
+ * pointed to by <b>arg</b> ran at tick <b>now</b>. */
+static void
+test_timer_cb(wheel_timer_t *timer, void *arg, uint64_t now)
+{
+  int idx = *(int*)arg;
+  (void)timer;
+  timer_ran_at[idx] = now;
+  ++timer_n_runs[idx];
+}
+
+/** Run unit tests for the timer wheel. */
+static void
+test_util_timers(void)
+{
+  const uint64_t start = U64_LITERAL(1000000);
+  timer_wheel_t *wheel = timer_wheel_new(start);
+  wheel_timer_t *timers[N_TEST_TIMERS];
+  int idx[N_TEST_TIMERS];
+  uint64_t when[N_TEST_TIMERS];
+  uint64_t now;
+  int i, step, n_run = 0, n_cancelled = 0;
+
+  memset(timers, 0, sizeof(timers));
+  memset(timer_ran_at, 0, sizeof(timer_ran_at));
+  memset(timer_n_runs, 0, sizeof(timer_n_runs));
+
+  /* Spread timers over the first few levels of the wheel, with a few in the
+   * past. */
+  for (i = 0; i < N_TEST_TIMERS; ++i) {
+    idx[i] = i;
+    timers[i] = wheel_timer_new(test_timer_cb, &idx[i]);
+    if (i % 100 == 1)
+      when[i] = start - (i % 7);
+    else
+      when[i] = start + (i * 7919) % 300000;
+    wheel_timer_schedule(wheel, timers[i], when[i]);
+    test_assert(wheel_timer_is_scheduled(timers[i]));
+  }
+  test_eq(N_TEST_TIMERS, timer_wheel_get_n_timers(wheel));
+
+  /* Cancel every tenth timer, and reschedule every seventh. */
+  for (i = 0; i < N_TEST_TIMERS; i += 10) {
+    wheel_timer_cancel(timers[i]);
+    test_assert(!wheel_timer_is_scheduled(timers[i]));
+    ++n_cancelled;
+  }
+  for (i = 3; i < N_TEST_TIMERS; i += 7) {
+    when[i] = start + (i * 31) % 5000;
+    wheel_timer_schedule(wheel, timers[i], when[i]);
+    if (i % 10 == 0)
+      --n_cancelled;
+  }
+  test_eq(N_TEST_TIMERS - n_cancelled, timer_wheel_get_n_timers(wheel));
+
+  /* Advance in uneven steps; every timer should run exactly at its tick, or
+   * on the first advance if it was in the past. */
+  now = start;
+  for (step = 0; now < start + 300000; ++step) {
+    now += 1 + (step * 97) % 500;
+    n_run += timer_wheel_advance(wheel, now);
+    test_assert(timer_wheel_get_now(wheel) == now);
+    for (i = 0; i < N_TEST_TIMERS; ++i) {
+      if (wheel_timer_is_scheduled(timers[i])) {
+        test_assert(when[i] > now);
+      }
+    }
+  }
+  test_eq(N_TEST_TIMERS - n_cancelled, n_run);
+  test_eq(0, timer_wheel_get_n_timers(wheel));
+  for (i = 0; i < N_TEST_TIMERS; ++i) {
+    if (i % 10 == 0 && i % 7 != 3) {
+      test_eq(0, timer_n_runs[i]);
+      continue;
+    }
+    test_eq(1, timer_n_runs[i]);
+    if (when[i] <= start) {
+      /* Timers that were already due run before the wheel moves on. */
+      test_assert(timer_ran_at[i] == start);
+    } else {
+      test_assert(timer_ran_at[i] == when[i]);
+    }
+  }
+
+  /* A timer far past the end of the wheel runs at the right time too, even
+   * if we jump straight past it. */
+  now = timer_wheel_get_now(wheel);
+  when[0] = now + (U64_LITERAL(1) << 30) + 77;
+  wheel_timer_schedule(wheel, timers[0], when[0]);
+  when[1] = now + (U64_LITERAL(1) << 32);
+  wheel_timer_schedule(wheel, timers[1], when[1]);
+  test_eq(0, timer_wheel_advance(wheel, when[0] - 1));
+  test_eq(1, timer_wheel_advance(wheel, when[0]));
+  test_assert(timer_ran_at[0] == when[0]);
+  test_eq(0, timer_wheel_advance(wheel, when[1] - 1000));
+  test_eq(1, timer_wheel_advance(wheel, when[1]));
+  test_assert(timer_ran_at[1] == when[1]);
+
+  /* Going backwards does nothing. */
+  wheel_timer_schedule(wheel, timers[2], when[1] + 5);
+  test_eq(0, timer_wheel_advance(wheel, start));
+  test_assert(wheel_timer_is_scheduled(timers[2]));
+
+ done:
+  for (i = 0; i < N_TEST_TIMERS; ++i)
+    wheel_timer_free(timers[i]);
+  timer_wheel_free(wheel);
+}
+#undef N_TEST_TIMERS
+
 static void
 test_util_strtok(void)
 {
@@ -1034,9 +1281,11 @@ struct testcase_t util_tests[] = {
   UTIL_LEGACY(datadir),
   UTIL_LEGACY(mempool),
   UTIL_LEGACY(memarea),
+  UTIL_LEGACY(timers),
   UTIL_LEGACY(control_formats),
   UTIL_LEGACY(mmap),
   UTIL_LEGACY(threads),
+  UTIL_LEGACY(spsc_ring),
   UTIL_LEGACY(sscanf),
   UTIL_LEGACY(strtok),
   END_OF_TESTCASES